@@ -1,5 +1,10 @@
 # Configure FUSE using pkgconfig
 
 FIND_PACKAGE(PkgConfig)
-PKG_CHECK_MODULES(FUSE REQUIRED fuse)
+if (APPLE)
+  PKG_CHECK_MODULES(FUSE REQUIRED fuse)
+else (APPLE)
+  # readdirplus needs at least libfuse 2.9
+  PKG_CHECK_MODULES(FUSE REQUIRED fuse>=2.9)
+endif (APPLE)
 
@@ -35,6 +35,7 @@
 
 #include "Namespace.hh"
 #include "RWMutex.hh"
+#include "MemoryAccounting.hh"
 #include <memory>
 #include <vector>
 #include <string.h>
@@ -44,15 +45,18 @@ DIAMONDCOMMONNAMESPACE_BEGIN
 class Bufferll : public std::vector<char> {
 public:
 
-  Bufferll (unsigned size = 0, unsigned capacity = 0) {
+  Bufferll (unsigned size = 0, unsigned capacity = 0) : mMutex("Bufferll::mMutex"), mAccounted(0) {
     if (size)
       resize(size);
     if (capacity)
       reserve(capacity);
+    account();
   }
 
   virtual
-  ~Bufferll () { }
+  ~Bufferll () {
+    MemoryAccounting::Sub(MemoryAccounting::kData, mAccounted);
+  }
 
   //------------------------------------------------------------------------
   //! Add data
@@ -64,6 +68,7 @@ public:
     size_t currSize = size();
     resize(currSize + dataSize);
     memcpy(&operator[](currSize), ptr, dataSize);
+    account();
     return dataSize;
   }
 
@@ -77,6 +82,7 @@ public:
       if (currSize > capacity()) {
         reserve(currSize + (256 * 1024));
       }
+      account();
     }
     memcpy(&operator[](offset), ptr, dataSize);
     return currSize;
@@ -129,12 +135,29 @@ public:
 
   void
   truncateData (off_t offset) {
+    RWMutexWriteLock dLock(mMutex);
     resize(offset);
     reserve(offset);
+    account();
   }
 
 private:
+
+  //------------------------------------------------------------------------
+  //! Report capacity changes to the memory accounting
+  //------------------------------------------------------------------------
+
+  void
+  account () {
+    size_t cap = capacity();
+    if (cap != mAccounted) {
+      MemoryAccounting::Add(MemoryAccounting::kData, (int64_t) cap - (int64_t) mAccounted);
+      mAccounted = cap;
+    }
+  }
+
   RWMutex mMutex;
+  size_t mAccounted; //< capacity reported to MemoryAccounting
 };
 
 class BufferPtr {
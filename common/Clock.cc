@@ -0,0 +1,83 @@
+// ----------------------------------------------------------------------
+// File: Clock.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/Clock.hh"
+/*----------------------------------------------------------------------------*/
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+std::atomic<int> Clock::sMode(Clock::kUnknown);
+uint64_t Clock::sBaseTicks = 0;
+uint64_t Clock::sBaseNs = 0;
+double Clock::sNsPerTick = 1.0;
+
+/*----------------------------------------------------------------------------*/
+int
+Clock::Calibrate ()
+{
+  static std::mutex calibration;
+  std::lock_guard<std::mutex> lock(calibration);
+  if (sMode.load() != kUnknown)
+    return sMode.load();
+
+  int mode = kMonotonic;
+#if defined(__x86_64__) || defined(__i386__)
+  // the TSC is only usable as a clock if it ticks at a constant rate in all
+  // power states
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  bool invariant = false;
+  while (std::getline(cpuinfo, line)) {
+    if (!line.compare(0, 5, "flags")) {
+      invariant = (line.find(" constant_tsc") != std::string::npos) &&
+        (line.find(" nonstop_tsc") != std::string::npos);
+      break;
+    }
+  }
+
+  if (invariant) {
+    uint64_t ns0 = Monotonic();
+    uint64_t t0 = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    uint64_t ns1 = Monotonic();
+    uint64_t t1 = __rdtsc();
+    if (t1 > t0) {
+      sBaseTicks = t0;
+      sBaseNs = ns0;
+      sNsPerTick = (double) (ns1 - ns0) / (double) (t1 - t0);
+      mode = kTsc;
+    }
+  }
+#endif
+  sMode.store(mode, std::memory_order_release);
+  return mode;
+}
+
+DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,125 @@
+// ----------------------------------------------------------------------
+// File: Clock.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   Clock.hh
+ *
+ * @brief  Low overhead monotonic clock for latency measurements
+ *
+ * Now() returns ticks - TSC cycles when the CPU has an invariant TSC,
+ * otherwise CLOCK_MONOTONIC nanoseconds. The TSC is calibrated against
+ * CLOCK_MONOTONIC once per process on first use; Ns() and ToNs() convert
+ * tick intervals and tick stamps into nanoseconds.
+ */
+
+#ifndef __DIAMONDCOMMON_CLOCK_HH__
+#define __DIAMONDCOMMON_CLOCK_HH__
+
+#include "common/Namespace.hh"
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+class Clock {
+public:
+
+  static inline uint64_t
+  Monotonic ()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Current ticks
+  // ---------------------------------------------------------------------------
+  static inline uint64_t
+  Now ()
+  {
+    int mode = sMode.load(std::memory_order_acquire);
+    if (mode == kUnknown)
+      mode = Calibrate();
+#if defined(__x86_64__) || defined(__i386__)
+    if (mode == kTsc)
+      return __rdtsc();
+#endif
+    return Monotonic();
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Nanoseconds of an interval of ticks
+  // ---------------------------------------------------------------------------
+  static inline uint64_t
+  Ns (uint64_t ticks)
+  {
+    return IsTsc() ? (uint64_t) ((double) ticks * sNsPerTick) : ticks;
+  }
+
+  // ---------------------------------------------------------------------------
+  //! CLOCK_MONOTONIC nanoseconds of a tick stamp
+  // ---------------------------------------------------------------------------
+  static inline uint64_t
+  ToNs (uint64_t ticks)
+  {
+    return IsTsc() ? sBaseNs + (int64_t) ((double) (int64_t) (ticks - sBaseTicks) * sNsPerTick) : ticks;
+  }
+
+  static inline bool
+  IsTsc ()
+  {
+    return sMode.load(std::memory_order_relaxed) == kTsc;
+  }
+
+  static double
+  NsPerTick ()
+  {
+    return IsTsc() ? sNsPerTick : 1.0;
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Select the clock - blocks a few milliseconds the first time
+  // ---------------------------------------------------------------------------
+  static int Calibrate ();
+
+  enum Mode {
+    kUnknown = 0,
+    kTsc,
+    kMonotonic
+  };
+
+private:
+  static std::atomic<int> sMode;
+  static uint64_t sBaseTicks;   //< TSC at calibration
+  static uint64_t sBaseNs;      //< CLOCK_MONOTONIC at calibration
+  static double sNsPerTick;
+};
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
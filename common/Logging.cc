@@ -24,16 +24,24 @@
 /*----------------------------------------------------------------------------*/
 #include "common/Namespace.hh"
 #include "common/Logging.hh"
+#include "common/MemoryAccounting.hh"
+#include "common/RWMutex.hh"
 /*----------------------------------------------------------------------------*/
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 /*----------------------------------------------------------------------------*/
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
-int Logging::gLogMask = 0;
+std::atomic<int> Logging::gLogMask(0);
 int Logging::gPriorityLevel = 0;
 int Logging::gShortFormat = 0;
 
@@ -61,7 +69,7 @@ bool
 Logging::shouldlog (const char* func, int priority)
 {
   // short cut if log messages are masked
-  if (!((LOG_MASK(priority) & gLogMask)))
+  if (!IsEnabled(priority))
     return false;
 
   // apply filter to avoid message flooding for debug messages
@@ -79,6 +87,149 @@ Logging::shouldlog (const char* func, int priority)
   return true;
 }
 
+/*----------------------------------------------------------------------------*/
+//! Asynchronous output
+//!
+//! Every thread owns a single-producer ring of variable sized records. The
+//! caller formats its message text into the record and returns - time, thread
+//! id, header formatting, fan-out, the in-memory log and the writes to the
+//! streams are done by the writer thread, which drains all rings in batches
+//! sorted by time and flushes every stream once per batch. A full ring drops
+//! the message and counts it instead of blocking the caller.
+/*----------------------------------------------------------------------------*/
+
+namespace {
+
+struct LogRecord {
+  uint32_t size;      //< bytes including the header, kWrap marks the ring end
+  int32_t priority;
+  int32_t line;
+  uint16_t logidlen;
+  uint16_t cidentlen;
+  uint32_t msglen;
+  uint32_t pad;
+  struct timeval tv;
+  const char* func;   //< __FUNCTION__ and __FILE__ are literals
+  const char* file;
+
+  const char* logid () const { return (const char*) (this + 1); }
+  const char* cident () const { return logid() + logidlen; }
+  const char* msg () const { return cident() + cidentlen; }
+};
+
+const uint32_t kWrap = 0xffffffff;
+const size_t kRingSize = DIAMONDCOMMONLOGGING_RINGSIZE;
+const size_t kMaxMessage = kRingSize / 4;
+const size_t kMaxIdentity = 255;
+
+struct LogRing {
+  std::atomic<uint64_t> head;     //< written by the owning thread
+  std::atomic<uint64_t> tail;     //< written by the drainer
+  std::atomic<uint64_t> dropped;
+  std::atomic<bool> orphaned;     //< the owning thread exited
+  unsigned long tid;
+  char* data;
+  char* text;                     //< message text of the last log call
+
+  LogRing () : head(0), tail(0), dropped(0), orphaned(false), tid(0),
+  data(new char[kRingSize]), text(new char[kMaxMessage])
+  {
+    MemoryAccounting::Add(MemoryAccounting::kLogging, kRingSize + kMaxMessage);
+  }
+
+  ~LogRing ()
+  {
+    MemoryAccounting::Add(MemoryAccounting::kLogging, -(int64_t) (kRingSize + kMaxMessage));
+    delete[] data;
+    delete[] text;
+  }
+};
+
+std::mutex gRingsMutex;           //< registration of rings
+std::vector<LogRing*> gRings;
+std::mutex gDrainMutex;           //< one drainer at a time
+std::mutex gWriterMutex;
+std::condition_variable gWriterWake;
+std::thread* gWriter = 0;
+std::atomic<bool> gWriterStarted(false);
+bool gWriterStop = false;
+std::atomic<bool> gAsync(true);
+uint64_t gReportedDrops = 0;      //< protected by gDrainMutex
+uint64_t gGoneDrops = 0;          //< drops of freed rings, protected by gDrainMutex
+
+struct LogRingHolder {
+  LogRing* ring;
+
+  LogRingHolder () : ring(0) { }
+
+  ~LogRingHolder ()
+  {
+    // the writer frees the ring when it is drained
+    if (ring)
+      ring->orphaned = true;
+  }
+};
+
+thread_local LogRingHolder tRing;
+
+LogRing*
+threadRing ()
+{
+  if (!tRing.ring)
+  {
+    LogRing* ring = new LogRing();
+    ring->tid = (unsigned long) syscall(SYS_gettid);
+    std::lock_guard<std::mutex> lock(gRingsMutex);
+    gRings.push_back(ring);
+    tRing.ring = ring;
+  }
+  return tRing.ring;
+}
+
+inline size_t
+align8 (size_t len)
+{
+  return (len + 7) & ~((size_t) 7);
+}
+
+//------------------------------------------------------------------------------
+//! Reserve a record in the thread ring - returns 0 if it is full
+//------------------------------------------------------------------------------
+LogRecord*
+reserve (LogRing* ring, size_t len)
+{
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  size_t pos = head % kRingSize;
+  size_t need = len;
+
+  // records are contiguous - skip the rest of the ring if it does not fit
+  if (pos + len > kRingSize)
+    need += kRingSize - pos;
+
+  if (head + need - tail > kRingSize)
+    return 0;
+
+  if (pos + len > kRingSize)
+  {
+    ((LogRecord*) (ring->data + pos))->size = kWrap;
+    pos = 0;
+  }
+  return (LogRecord*) (ring->data + pos);
+}
+
+inline void
+commit (LogRing* ring, LogRecord* rec)
+{
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  size_t pos = head % kRingSize;
+  if ((char*) rec != ring->data + pos)
+    head += kRingSize - pos;   // wrapped
+  ring->head.store(head + rec->size, std::memory_order_release);
+}
+
+} // anonymous namespace
+
 /*----------------------------------------------------------------------------*/
 /** 
  * Logging function
@@ -91,7 +242,7 @@ Logging::shouldlog (const char* func, int priority)
  * @param cident client identifier
  * @param priority priority level of the message
  * @param msg the actual log message
- * @return pointer to the log message
+ * @return pointer to the message text, valid until the next log call of the thread
  */
 
 /*----------------------------------------------------------------------------*/
@@ -99,10 +250,8 @@ Logging::shouldlog (const char* func, int priority)
 const char*
 Logging::log (const char* func, const char* file, int line, const char* logid, const char* cident, int priority, const char *msg, ...)
 {
-  static int logmsgbuffersize = 1024 * 1024;
-
   // short cut if log messages are masked
-  if (!((LOG_MASK(priority) & gLogMask)))
+  if (!IsEnabled(priority))
     return "";
 
   // apply filter to avoid message flooding for debug messages
@@ -126,41 +275,75 @@ Logging::log (const char* func, const char* file, int line, const char* logid, c
     }
   }
 
-  static char* buffer = 0;
+  if (!gWriterStarted.load(std::memory_order_acquire))
+    StartWriter();
 
-  if (!buffer)
+  LogRing* ring = threadRing();
+
+  va_list args;
+  va_start(args, msg);
+  int n = vsnprintf(ring->text, kMaxMessage, msg, args);
+  va_end(args);
+  size_t msglen = (n < 0) ? 0 : std::min((size_t) n, kMaxMessage - 1);
+  size_t logidlen = std::min(strlen(logid), kMaxIdentity);
+  size_t cidentlen = std::min(strlen(cident), kMaxIdentity);
+
+  LogRecord* rec = reserve(ring, align8(sizeof (LogRecord) + logidlen + cidentlen + msglen));
+  if (!rec)
   {
-    // 1 M print buffer
-    buffer = (char*) malloc(logmsgbuffersize);
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return ring->text;
   }
 
-  std::string File = file;
-
-  // we show only one hierarchy directory like Acl (assuming that we have only
-  // file names like *.cc and *.hh
-  File.erase(0, File.rfind("/") + 1);
-  File.erase(File.length() - 3);
+  rec->size = align8(sizeof (LogRecord) + logidlen + cidentlen + msglen);
+  rec->priority = priority;
+  rec->line = line;
+  rec->logidlen = logidlen;
+  rec->cidentlen = cidentlen;
+  rec->msglen = msglen;
+  rec->func = func;
+  rec->file = file;
+  gettimeofday(&rec->tv, 0);
+  memcpy((char*) rec->logid(), logid, logidlen);
+  memcpy((char*) rec->cident(), cident, cidentlen);
+  memcpy((char*) rec->msg(), ring->text, msglen);
+  commit(ring, rec);
+
+  // severe messages and synchronous mode do not wait for the writer
+  if ((priority <= LOG_CRIT) || !gAsync.load(std::memory_order_relaxed))
+    Flush();
+  return ring->text;
+}
 
-  static time_t current_time;
-  static struct timeval tv;
-  static struct timezone tz;
-  static struct tm *tm;
-  pthread_mutex_lock(&gMutex);
+/*----------------------------------------------------------------------------*/
+/** 
+ * Format and write one record - called with gMutex held
+ * 
+ * @param rec the record
+ * @param tid thread id of the producer
+ * @param timestr cached 'YYMMDD HH:MM:SS' of the record time
+ * @param buffer scratch buffer for the formatted line
+ */
 
-  va_list args;
-  va_start(args, msg);
+/*----------------------------------------------------------------------------*/
 
+void
+Logging::WriteRecord (const void* record, unsigned long tid, const char* timestr, std::string& buffer)
+{
+  const LogRecord* rec = (const LogRecord*) record;
+  int priority = rec->priority;
 
-  time(&current_time);
-  gettimeofday(&tv, &tz);
+  std::string File = rec->file;
 
-  static char linen[16];
-  sprintf(linen, "%d", line);
+  // we show only one hierarchy directory like Acl (assuming that we have only
+  // file names like *.cc and *.hh
+  File.erase(0, File.rfind("/") + 1);
+  if (File.length() >= 3)
+    File.erase(File.length() - 3);
 
-  static char fcident[1024];
+  std::string logid(rec->logid(), rec->logidlen);
+  std::string truncname(rec->cident(), rec->cidentlen);
 
-  std::string truncname = cident;
-  
   // we show only the last 16 bytes of the name
   if (truncname.length() > 16)
   {
@@ -169,85 +352,318 @@ Logging::log (const char* func, const char* file, int line, const char* logid, c
   }
 
   char sourceline[64];
+  snprintf(sourceline, sizeof (sourceline) - 1, "%s:%d", File.c_str(), rec->line);
 
+  char header[2048];
   if (gShortFormat)
   {
-    tm = localtime(&current_time);
-    snprintf(sourceline, sizeof (sourceline) - 1, "%s:%s", File.c_str(), linen);
-    sprintf(buffer, "%02d%02d%02d %02d:%02d:%02d time=%lu.%06lu func=%-12s level=%s tid=%016lx source=%-30s ", tm->tm_year - 100, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, current_time, (unsigned long) tv.tv_usec, func, GetPriorityString(priority), (unsigned long) syscall(SYS_gettid), sourceline);
+    snprintf(header, sizeof (header), "%s time=%lu.%06lu func=%-12s level=%s tid=%016lx source=%-30s ", timestr, (unsigned long) rec->tv.tv_sec, (unsigned long) rec->tv.tv_usec, rec->func, GetPriorityString(priority), tid, sourceline);
   }
   else
   {
-    sprintf(fcident, "tident=%s", truncname.c_str());
-    tm = localtime(&current_time);
-    snprintf(sourceline, sizeof (sourceline) - 1, "%s:%s", File.c_str(), linen);
-    sprintf(buffer, "%02d%02d%02d %02d:%02d:%02d time=%lu.%06lu func=%-24s level=%s logid=%s unit=%s tid=%016lx source=%-30s %s ", tm->tm_year - 100, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, current_time, (unsigned long) tv.tv_usec, func, GetPriorityString(priority), logid, gUnit.c_str(), (unsigned long)syscall(SYS_gettid), sourceline, fcident);
+    snprintf(header, sizeof (header), "%s time=%lu.%06lu func=%-24s level=%s logid=%s unit=%s tid=%016lx source=%-30s tident=%s ", timestr, (unsigned long) rec->tv.tv_sec, (unsigned long) rec->tv.tv_usec, rec->func, GetPriorityString(priority), logid.c_str(), gUnit.c_str(), tid, sourceline, truncname.c_str());
   }
 
-  char* ptr = buffer + strlen(buffer);
-
-  // limit the length of the output to buffer-1 length
-  vsnprintf(ptr, logmsgbuffersize - (ptr - buffer - 1), msg, args);
+  buffer = header;
+  buffer.append(rec->msg(), rec->msglen);
 
   if (gLogFanOut.size())
   {
+    std::string msgtext(rec->msg(), rec->msglen);
+
     // we do log-message fanout
     if (gLogFanOut.count("*"))
     {
-      fprintf(gLogFanOut["*"], "%s\n", buffer);
-      fflush(gLogFanOut["*"]);
+      fprintf(gLogFanOut["*"], "%s\n", buffer.c_str());
     }
     if (gLogFanOut.count(File.c_str()))
     {
-      buffer[15] = 0;
-
       fprintf(gLogFanOut[File.c_str()], "%s %s%s%s %-30s %s \n", 
-              buffer, 
+              timestr, 
               GetLogColour(GetPriorityString(priority)), 
               GetPriorityString(priority), 
               DIAMOND_TEXTNORMAL, 
 	      sourceline,
-	      ptr);
-
-      fflush(gLogFanOut[File.c_str()]);
-      buffer[15] = ' ';
+	      msgtext.c_str());
     }
     else
     {
       if (gLogFanOut.count("#"))
       {
-	      buffer[15] = 0;
-
         fprintf(gLogFanOut["#"], "%s %s%s%s %16s %s \n",
-                buffer,
+                timestr,
 		GetLogColour(GetPriorityString(priority)),
 		GetPriorityString(priority),
                 DIAMOND_TEXTNORMAL,
 		truncname.c_str(),
-		ptr
+		msgtext.c_str()
                 );
+      }
+    }
+  }
+  fprintf(stderr, "%s\n", buffer.c_str());
+
+  // store into global log memory
+  std::string& slot = gLogMemory[priority][(gLogCircularIndex[priority]) % gCircularIndexSize];
+  size_t capacity = slot.capacity();
+  slot = buffer;
+  if (slot.capacity() != capacity)
+    MemoryAccounting::Add(MemoryAccounting::kLogging, (int64_t) slot.capacity() - (int64_t) capacity);
+  gLogCircularIndex[priority]++;
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Drain all thread rings and write the messages in time order
+ * 
+ * @return number of written messages
+ */
+
+/*----------------------------------------------------------------------------*/
+
+size_t
+Logging::Drain ()
+{
+  std::lock_guard<std::mutex> dlock(gDrainMutex);
+
+  std::vector<LogRing*> rings;
+  {
+    std::lock_guard<std::mutex> lock(gRingsMutex);
+    rings = gRings;
+  }
 
-        fflush(gLogFanOut["#"]);
-        buffer[15] = ' ';
+  // collect the pending records - they stay in place until the tails move
+  std::vector< std::pair<const LogRecord*, unsigned long> > batch;
+  std::vector<uint64_t> heads(rings.size());
+  uint64_t dropped = gGoneDrops;
+  for (size_t r = 0; r < rings.size(); r++)
+  {
+    LogRing* ring = rings[r];
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    heads[r] = ring->head.load(std::memory_order_acquire);
+    dropped += ring->dropped.load(std::memory_order_relaxed);
+    while (tail < heads[r])
+    {
+      size_t pos = tail % kRingSize;
+      const LogRecord* rec = (const LogRecord*) (ring->data + pos);
+      if (rec->size == kWrap)
+      {
+        tail += kRingSize - pos;
+        continue;
       }
+      batch.push_back(std::make_pair(rec, ring->tid));
+      tail += rec->size;
     }
-    fprintf(stderr, "%s\n", buffer);
-    fflush(stderr);
   }
-  else
+
+  std::stable_sort(batch.begin(), batch.end(),
+                   [] (const std::pair<const LogRecord*, unsigned long>& a,
+                       const std::pair<const LogRecord*, unsigned long>& b) {
+                     return timercmp(&a.first->tv, &b.first->tv, <);
+                   });
+
+  if (batch.size() || (dropped != gReportedDrops))
   {
-    fprintf(stderr, "%s\n", buffer);
+    static time_t cachedsec = -1;
+    static char timestr[80];
+    std::string buffer;
+
+    static LockStats* sLockStats = LockStats::Get("Logging::gMutex");
+    uint64_t lockstart;
+    sLockStats->Lock(&gMutex, lockstart);
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+      // the time of day string changes once per second
+      if (batch[i].first->tv.tv_sec != cachedsec)
+      {
+        struct tm tm;
+        cachedsec = batch[i].first->tv.tv_sec;
+        localtime_r(&cachedsec, &tm);
+        snprintf(timestr, sizeof (timestr), "%02d%02d%02d %02d:%02d:%02d", tm.tm_year - 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+      }
+      WriteRecord(batch[i].first, batch[i].second, timestr, buffer);
+    }
+
+    if (dropped != gReportedDrops)
+    {
+      fprintf(stderr, "%s level=%s logging dropped %llu messages - total=%llu\n", timestr,
+              GetPriorityString(LOG_WARNING),
+              (unsigned long long) (dropped - gReportedDrops),
+              (unsigned long long) dropped);
+      gReportedDrops = dropped;
+    }
+
     fflush(stderr);
+    for (auto it = gLogFanOut.begin(); it != gLogFanOut.end(); ++it)
+      fflush(it->second);
+    sLockStats->UnLock(&gMutex, lockstart);
   }
-  va_end(args);
 
-  const char* rptr;
-  // store into global log memory
-  gLogMemory[priority][(gLogCircularIndex[priority]) % gCircularIndexSize] = buffer;
-  rptr = gLogMemory[priority][(gLogCircularIndex[priority]) % gCircularIndexSize].c_str();
-  gLogCircularIndex[priority]++;
-  pthread_mutex_unlock(&gMutex);
-  return rptr;
+  // release the ring space and free rings of exited threads
+  std::vector<LogRing*> gone;
+  for (size_t r = 0; r < rings.size(); r++)
+  {
+    rings[r]->tail.store(heads[r], std::memory_order_release);
+    if (rings[r]->orphaned.load() && (rings[r]->head.load() == heads[r]))
+      gone.push_back(rings[r]);
+  }
+
+  if (gone.size())
+  {
+    std::lock_guard<std::mutex> lock(gRingsMutex);
+    for (size_t r = 0; r < gone.size(); r++)
+    {
+      gRings.erase(std::find(gRings.begin(), gRings.end(), gone[r]));
+      gGoneDrops += gone[r]->dropped.load();
+      delete gone[r];
+    }
+  }
+  return batch.size();
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Write all queued messages before returning
+ */
+
+/*----------------------------------------------------------------------------*/
+
+void
+Logging::Flush ()
+{
+  Drain();
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Select asynchronous or synchronous output
+ * 
+ * @param async if false every log call writes before it returns
+ */
+
+/*----------------------------------------------------------------------------*/
+
+void
+Logging::SetAsync (bool async)
+{
+  gAsync = async;
+  if (!async)
+    Flush();
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Number of messages dropped because a thread ring was full
+ */
+
+/*----------------------------------------------------------------------------*/
+
+uint64_t
+Logging::GetDropped ()
+{
+  std::lock_guard<std::mutex> dlock(gDrainMutex);
+  std::lock_guard<std::mutex> lock(gRingsMutex);
+  uint64_t dropped = gGoneDrops;
+  for (size_t r = 0; r < gRings.size(); r++)
+    dropped += gRings[r]->dropped.load();
+  return dropped;
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Writer thread - drains the rings with a back-off while idle
+ */
+
+/*----------------------------------------------------------------------------*/
+
+void
+Logging::RunWriter ()
+{
+  std::unique_lock<std::mutex> lock(gWriterMutex);
+  unsigned sleep_ms = 1;
+  while (!gWriterStop)
+  {
+    lock.unlock();
+    size_t n = Drain();
+    lock.lock();
+    sleep_ms = n ? 1 : std::min(sleep_ms * 2, 64u);
+    gWriterWake.wait_for(lock, std::chrono::milliseconds(sleep_ms));
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Stop the writer and write everything queued - later messages are written
+ * synchronously
+ */
+
+/*----------------------------------------------------------------------------*/
+
+void
+Logging::StopWriter ()
+{
+  {
+    std::lock_guard<std::mutex> lock(gWriterMutex);
+    gWriterStop = true;
+    gAsync = false;
+  }
+  gWriterWake.notify_all();
+  if (gWriter)
+  {
+    gWriter->join();
+    delete gWriter;
+    gWriter = 0;
+  }
+  Flush();
+}
+
+/*----------------------------------------------------------------------------*/
+/** 
+ * Start the writer thread once per process
+ */
+
+/*----------------------------------------------------------------------------*/
+
+void
+Logging::StartWriter ()
+{
+  static bool atexitregistered = false;
+  std::lock_guard<std::mutex> lock(gWriterMutex);
+  if (gWriterStarted.load())
+    return;
+
+  if (!atexitregistered)
+  {
+    atexitregistered = true;
+    atexit(StopWriter);
+    // the writer does not survive a fork - restart it in the child
+    pthread_atfork(
+      [] () {
+        gDrainMutex.lock();
+        gRingsMutex.lock();
+        pthread_mutex_lock(&gMutex);
+      },
+      [] () {
+        pthread_mutex_unlock(&gMutex);
+        gRingsMutex.unlock();
+        gDrainMutex.unlock();
+      },
+      [] () {
+        pthread_mutex_unlock(&gMutex);
+        gRingsMutex.unlock();
+        gDrainMutex.unlock();
+        // the thread object refers to a thread of the parent
+        gWriterStarted = false;
+        gWriter = 0;
+        if (tRing.ring)
+          tRing.ring->tid = (unsigned long) syscall(SYS_gettid);
+      });
+  }
+
+  gWriterStop = false;
+  if (gAsync.load() && !gWriter)
+    gWriter = new std::thread(RunWriter);
+  gWriterStarted.store(true, std::memory_order_release);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -260,6 +676,10 @@ Logging::log (const char* func, const char* file, int line, const char* logid, c
 void
 Logging::Init ()
 {
+  size_t slots = 0;
+  for (size_t i = 0; i < gLogMemory.size(); i++)
+    slots += gLogMemory[i].size();
+
   // initialize the log array and sets the log circular size
   gLogCircularIndex.resize(LOG_DEBUG + 1);
   gLogMemory.resize(LOG_DEBUG + 1);
@@ -269,6 +689,8 @@ Logging::Init ()
     gLogCircularIndex[i] = 0;
     gLogMemory[i].resize(gCircularIndexSize);
   }
+  // Init may run more than once - only account slots added now
+  MemoryAccounting::Add(MemoryAccounting::kLogging, ((int64_t) ((LOG_DEBUG + 1) * gCircularIndexSize) - (int64_t) slots) * sizeof (std::string));
 }
 
 /*----------------------------------------------------------------------------*/
@@ -41,6 +41,9 @@
  * all messages which are not in any other fan-out (besides '*') into that file.
  * The fan-out functionality assumes that
  * source filenames follow the pattern <fan-out-name>.xx !!!!
+ *
+ * Messages are queued in a ring per thread and written by a background thread.
+ * When a ring is full the message is dropped and counted - callers never block.
  */
 
 #ifndef __DIAMONDCOMMON_LOGGING_HH__
@@ -50,6 +53,7 @@
 #include "common/Namespace.hh"
 /*----------------------------------------------------------------------------*/
 /*----------------------------------------------------------------------------*/
+#include <stdint.h>
 #include <string.h>
 #include <sys/syslog.h>
 #include <sys/time.h>
@@ -58,6 +62,7 @@
 #include <set>
 #include <map>
 #include <pthread.h>
+#include <atomic>
 /*----------------------------------------------------------------------------*/
 
 DIAMONDCOMMONNAMESPACE_BEGIN
@@ -73,43 +78,60 @@ DIAMONDCOMMONNAMESPACE_BEGIN
 #define DIAMOND_TEXTUNBOLD "\033[0m"
 
 
+/*----------------------------------------------------------------------------*/
+//! Messages less important than DIAMOND_LOG_COMPILE_PRIORITY are removed at
+//! compile time, e.g. -DDIAMOND_LOG_COMPILE_PRIORITY=LOG_INFO drops all debug
+//! messages. By default everything is compiled in.
+/*----------------------------------------------------------------------------*/
+#ifndef DIAMOND_LOG_COMPILE_PRIORITY
+#define DIAMOND_LOG_COMPILE_PRIORITY LOG_DEBUG
+#endif
+
+/*----------------------------------------------------------------------------*/
+//! Inline check of a priority - a disabled message costs one branch and its
+//! arguments are not evaluated
+/*----------------------------------------------------------------------------*/
+#define DIAMOND_LOG_ENABLED(__DIAMONDCOMMON_LOG_PRIORITY__) ((((__DIAMONDCOMMON_LOG_PRIORITY__)) <= DIAMOND_LOG_COMPILE_PRIORITY) && diamond::common::Logging::IsEnabled(__DIAMONDCOMMON_LOG_PRIORITY__))
+#define DIAMOND_LOG_IF(__DIAMONDCOMMON_LOG_PRIORITY__, ...) (DIAMOND_LOG_ENABLED(__DIAMONDCOMMON_LOG_PRIORITY__) ? diamond::common::Logging::log(__VA_ARGS__) : diamond::common::Logging::Disabled())
+
 /*----------------------------------------------------------------------------*/
 //! Log Macros usable in objects inheriting from the logId Class
 /*----------------------------------------------------------------------------*/
-#define diamond_log(__DIAMONDCOMMON_LOG_PRIORITY__ , ...) diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity,  LOG_MASK(__DIAMONDCOMMON_LOG_PRIORITY__) , __VA_ARGS__
-#define diamond_debug(...)   diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_DEBUG)  , __VA_ARGS__)
-#define diamond_info(...)    diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_INFO)   , __VA_ARGS__)
-#define diamond_notice(...)  diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_NOTICE) , __VA_ARGS__)
-#define diamond_warning(...) diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_WARNING), __VA_ARGS__)
-#define diamond_err(...)     diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_ERR)    , __VA_ARGS__)
-#define diamond_crit(...)    diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_CRIT)   , __VA_ARGS__)
-#define diamond_alert(...)   diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_ALERT)  , __VA_ARGS__)
-#define diamond_emerg(...)   diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_EMERG)  , __VA_ARGS__)
+#define diamond_log(__DIAMONDCOMMON_LOG_PRIORITY__ , ...) DIAMOND_LOG_IF((__DIAMONDCOMMON_LOG_PRIORITY__), __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (__DIAMONDCOMMON_LOG_PRIORITY__), __VA_ARGS__)
+#define diamond_debug(...)   DIAMOND_LOG_IF((LOG_DEBUG)  , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_DEBUG)  , __VA_ARGS__)
+#define diamond_info(...)    DIAMOND_LOG_IF((LOG_INFO)   , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_INFO)   , __VA_ARGS__)
+#define diamond_notice(...)  DIAMOND_LOG_IF((LOG_NOTICE) , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_NOTICE) , __VA_ARGS__)
+#define diamond_warning(...) DIAMOND_LOG_IF((LOG_WARNING), __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_WARNING), __VA_ARGS__)
+#define diamond_err(...)     DIAMOND_LOG_IF((LOG_ERR)    , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_ERR)    , __VA_ARGS__)
+#define diamond_crit(...)    DIAMOND_LOG_IF((LOG_CRIT)   , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_CRIT)   , __VA_ARGS__)
+#define diamond_alert(...)   DIAMOND_LOG_IF((LOG_ALERT)  , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_ALERT)  , __VA_ARGS__)
+#define diamond_emerg(...)   DIAMOND_LOG_IF((LOG_EMERG)  , __FUNCTION__,__FILE__, __LINE__, logId, logIdentity, (LOG_EMERG)  , __VA_ARGS__)
 
 #define diamond_log_id(x,y)   char logId[1024];char logIdentity[1024];snprintf(logId,sizeof(logId)-1,"%s", (x) );snprintf(logIdentity,sizeof(logIdentity)-1,"%s", (y) );
-#define diamond_static_debug(...)   diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_DEBUG)  , __VA_ARGS__)
-#define diamond_static_info(...)    diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_INFO)   , __VA_ARGS__)
-#define diamond_static_notice(...)  diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_NOTICE) , __VA_ARGS__)
-#define diamond_static_warning(...) diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_WARNING), __VA_ARGS__)
-#define diamond_static_err(...)     diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_ERR)    , __VA_ARGS__)
-#define diamond_static_crit(...)    diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_CRIT)   , __VA_ARGS__)
-#define diamond_static_alert(...)   diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_ALERT)  , __VA_ARGS__)
-#define diamond_static_emerg(...)   diamond::common::Logging::log(__FUNCTION__,__FILE__, __LINE__, "","", (LOG_EMERG)  , __VA_ARGS__)
+#define diamond_static_debug(...)   DIAMOND_LOG_IF((LOG_DEBUG)  , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_DEBUG)  , __VA_ARGS__)
+#define diamond_static_info(...)    DIAMOND_LOG_IF((LOG_INFO)   , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_INFO)   , __VA_ARGS__)
+#define diamond_static_notice(...)  DIAMOND_LOG_IF((LOG_NOTICE) , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_NOTICE) , __VA_ARGS__)
+#define diamond_static_warning(...) DIAMOND_LOG_IF((LOG_WARNING), __FUNCTION__,__FILE__, __LINE__, "","", (LOG_WARNING), __VA_ARGS__)
+#define diamond_static_err(...)     DIAMOND_LOG_IF((LOG_ERR)    , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_ERR)    , __VA_ARGS__)
+#define diamond_static_crit(...)    DIAMOND_LOG_IF((LOG_CRIT)   , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_CRIT)   , __VA_ARGS__)
+#define diamond_static_alert(...)   DIAMOND_LOG_IF((LOG_ALERT)  , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_ALERT)  , __VA_ARGS__)
+#define diamond_static_emerg(...)   DIAMOND_LOG_IF((LOG_EMERG)  , __FUNCTION__,__FILE__, __LINE__, "","", (LOG_EMERG)  , __VA_ARGS__)
 
 /*----------------------------------------------------------------------------*/
 //! Log Macros to check if a function would log in a certain log level
 /*----------------------------------------------------------------------------*/
-#define DIAMOND_LOGS_DEBUG   diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_DEBUG)  )
-#define DIAMOND_LOGS_INFO    diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_INFO)   )
-#define DIAMOND_LOGS_NOTICE  diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_NOTICE) )
-#define DIAMOND_LOGS_WARNING diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_WARNING))
-#define DIAMOND_LOGS_ERR     diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_ERR)    )
-#define DIAMOND_LOGS_CRIT    diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_CRIT)   )
-#define DIAMOND_LOGS_ALERT   diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_ALERT)  )
-#define DIAMOND_LOGS_EMERG   diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_EMERG)  )
+#define DIAMOND_LOGS_DEBUG   (DIAMOND_LOG_ENABLED(LOG_DEBUG)   && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_DEBUG)  ))
+#define DIAMOND_LOGS_INFO    (DIAMOND_LOG_ENABLED(LOG_INFO)    && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_INFO)   ))
+#define DIAMOND_LOGS_NOTICE  (DIAMOND_LOG_ENABLED(LOG_NOTICE)  && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_NOTICE) ))
+#define DIAMOND_LOGS_WARNING (DIAMOND_LOG_ENABLED(LOG_WARNING) && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_WARNING)))
+#define DIAMOND_LOGS_ERR     (DIAMOND_LOG_ENABLED(LOG_ERR)     && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_ERR)    ))
+#define DIAMOND_LOGS_CRIT    (DIAMOND_LOG_ENABLED(LOG_CRIT)    && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_CRIT)   ))
+#define DIAMOND_LOGS_ALERT   (DIAMOND_LOG_ENABLED(LOG_ALERT)   && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_ALERT)  ))
+#define DIAMOND_LOGS_EMERG   (DIAMOND_LOG_ENABLED(LOG_EMERG)   && diamond::common::Logging::shouldlog(__FUNCTION__,(LOG_EMERG)  ))
 
 
 #define DIAMONDCOMMONLOGGING_CIRCULARINDEXSIZE 10000
+#define DIAMONDCOMMONLOGGING_RINGSIZE (256 * 1024)
 
 /*----------------------------------------------------------------------------*/
 //! Class implementing DIAMOND logging
@@ -163,7 +185,7 @@ public:
   static LogCircularIndex gLogCircularIndex; //< global circular index
   static LogArray gLogMemory; //< global logging memory
   static unsigned long gCircularIndexSize; //< global circular index size
-  static int gLogMask; //< log mask
+  static std::atomic<int> gLogMask; //< log mask - read inline by the log macros
   static int gPriorityLevel; //< log priority
   static pthread_mutex_t gMutex; //< global mutex
   static std::string gUnit; //< global unit name
@@ -179,8 +201,28 @@ public:
   static void
   SetLogPriority (int pri)
   {
-    gLogMask = LOG_UPTO(pri);
     gPriorityLevel = pri;
+    gLogMask.store(LOG_UPTO(pri), std::memory_order_release);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Check if a priority passes the log mask - inlined into every log macro
+  // ---------------------------------------------------------------------------
+
+  static inline bool
+  IsEnabled (int pri)
+  {
+    return (LOG_MASK(pri) & gLogMask.load(std::memory_order_relaxed));
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Result of a log macro for a disabled priority
+  // ---------------------------------------------------------------------------
+
+  static inline const char*
+  Disabled ()
+  {
+    return "";
   }
 
   // ---------------------------------------------------------------------------
@@ -297,10 +339,32 @@ public:
   static bool shouldlog (const char* func, int priority);
 
   // ---------------------------------------------------------------------------
-  //! Log a message into the global buffer
+  //! Queue a message for the writer thread - returns the message text
   // ---------------------------------------------------------------------------
   static const char* log (const char* func, const char* file, int line, const char* logid, const char* midentity, int priority, const char *msg, ...);
 
+  // ---------------------------------------------------------------------------
+  //! Write all queued messages before returning
+  // ---------------------------------------------------------------------------
+  static void Flush ();
+
+  // ---------------------------------------------------------------------------
+  //! Switch between the writer thread (default) and writing in every log call
+  // ---------------------------------------------------------------------------
+  static void SetAsync (bool async);
+
+  // ---------------------------------------------------------------------------
+  //! Number of messages dropped because the ring of their thread was full
+  // ---------------------------------------------------------------------------
+  static uint64_t GetDropped ();
+
+private:
+  static void StartWriter ();
+  static void StopWriter ();
+  static void RunWriter ();
+  static size_t Drain ();
+  static void WriteRecord (const void* record, unsigned long tid, const char* timestr, std::string& buffer);
+
 };
 
 /*----------------------------------------------------------------------------*/
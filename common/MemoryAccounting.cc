@@ -0,0 +1,69 @@
+// ----------------------------------------------------------------------
+// File: MemoryAccounting.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/MemoryAccounting.hh"
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+// zero initialized before any dynamic initialization
+MemoryAccounting::Counter MemoryAccounting::sCounters[MemoryAccounting::kSubsystems];
+
+/*----------------------------------------------------------------------------*/
+int64_t
+MemoryAccounting::Total ()
+{
+  int64_t total = 0;
+  for (int i = 0; i < kSubsystems; i++)
+    total += Get((Subsystem) i);
+  return total;
+}
+
+/*----------------------------------------------------------------------------*/
+const char*
+MemoryAccounting::Name (Subsystem subsystem)
+{
+  switch (subsystem) {
+  case kInodes: return "inodes";
+  case kDirents: return "dirents";
+  case kXattrs: return "xattrs";
+  case kData: return "data";
+  case kMaps: return "maps";
+  case kLogging: return "logging";
+  case kStats: return "stats";
+  case kOther: return "other";
+  default: return "unknown";
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+MemoryAccounting::Dump (std::stringstream& out)
+{
+  for (int i = 0; i < kSubsystems; i++)
+    out << "memory." << Name((Subsystem) i) << "=" << Get((Subsystem) i) << "\n";
+  out << "memory.total=" << Total() << "\n";
+}
+
+DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,96 @@
+// ----------------------------------------------------------------------
+// File: MemoryAccounting.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   MemoryAccounting.hh
+ *
+ * @brief  Live byte counters of the memory held by each subsystem
+ *
+ * Subsystems report what they allocate and free with Add/Sub. Counters are
+ * relaxed atomics on separate cache lines - callers account at the
+ * granularity they already allocate with (buffer capacity changes, slab
+ * batches, table creation), so the counters stay off the hot paths.
+ */
+
+#ifndef __DIAMONDCOMMON_MEMORYACCOUNTING_HH__
+#define __DIAMONDCOMMON_MEMORYACCOUNTING_HH__
+
+#include "common/Namespace.hh"
+#include <stdint.h>
+#include <atomic>
+#include <sstream>
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+class MemoryAccounting {
+public:
+
+  enum Subsystem {
+    kInodes = 0,   //< inode objects, cache maps and LRU nodes
+    kDirents,      //< directory entry arenas and name tables
+    kXattrs,       //< extended attributes
+    kData,         //< file contents (Bufferll)
+    kMaps,         //< lock free hash tables (map64/map128)
+    kLogging,      //< in-memory log ring
+    kStats,        //< per-thread op statistics
+    kOther,        //< untagged slab pools
+    kSubsystems
+  };
+
+  static void
+  Add (Subsystem subsystem, int64_t bytes) {
+    sCounters[subsystem].bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  static void
+  Sub (Subsystem subsystem, int64_t bytes) {
+    sCounters[subsystem].bytes.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  static int64_t
+  Get (Subsystem subsystem) {
+    return sCounters[subsystem].bytes.load(std::memory_order_relaxed);
+  }
+
+  static int64_t Total ();
+
+  static const char* Name (Subsystem subsystem);
+
+  // ---------------------------------------------------------------------------
+  //! Print one 'memory.<subsystem>=<bytes>' line per subsystem and the total
+  // ---------------------------------------------------------------------------
+  static void Dump (std::stringstream& out);
+
+private:
+
+  struct Counter {
+    std::atomic<int64_t> bytes;
+    char pad[64 - sizeof (std::atomic<int64_t>)];
+  } __attribute__ ((aligned (64)));
+
+  static Counter sCounters[kSubsystems];
+};
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
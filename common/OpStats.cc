@@ -0,0 +1,335 @@
+// ----------------------------------------------------------------------
+// File: OpStats.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/OpStats.hh"
+#include "common/Logging.hh"
+#include "common/MemoryAccounting.hh"
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <algorithm>
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+const unsigned Histogram::kSubBits;
+const uint64_t Histogram::kSub;
+const unsigned Histogram::kMaxBits;
+const size_t Histogram::kBuckets;
+const size_t OpStats::kMaxInstances;
+
+namespace {
+
+std::mutex gRegistryMutex;
+OpStats* gInstances[OpStats::kMaxInstances];
+uint64_t gIds[OpStats::kMaxInstances];
+uint64_t gNextId = 0;
+
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+//! Blocks of the calling thread indexed by instance slot - handed to their
+//! instance when the thread exits
+//------------------------------------------------------------------------------
+struct OpStatsThreadBlocks {
+  uint64_t ids[OpStats::kMaxInstances];
+  std::atomic<uint64_t>* blocks[OpStats::kMaxInstances];
+
+  ~OpStatsThreadBlocks ()
+  {
+    std::lock_guard<std::mutex> lock(gRegistryMutex);
+    for (size_t i = 0; i < OpStats::kMaxInstances; i++)
+    {
+      // the block of a destroyed instance is freed already
+      if (blocks[i] && ids[i] && (gIds[i] == ids[i]))
+        gInstances[i]->Retire(blocks[i]);
+    }
+  }
+};
+
+static thread_local OpStatsThreadBlocks tBlocks;
+
+/*----------------------------------------------------------------------------*/
+uint64_t
+Histogram::BucketMax (size_t bucket)
+{
+  if (bucket < 2 * kSub)
+    return bucket;
+  if (bucket >= kBuckets - 1)
+    return ~0ull;
+  unsigned shift = bucket / kSub - 1;
+  uint64_t sub = bucket % kSub + kSub;
+  return ((sub + 1) << shift) - 1;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+Histogram::Add (const Histogram& other)
+{
+  count += other.count;
+  sum += other.sum;
+  max = std::max(max, other.max);
+  for (size_t i = 0; i < kBuckets; i++)
+    buckets[i] += other.buckets[i];
+}
+
+/*----------------------------------------------------------------------------*/
+void
+Histogram::Sub (const Histogram& other)
+{
+  count -= other.count;
+  sum -= other.sum;
+  for (size_t i = 0; i < kBuckets; i++)
+    buckets[i] -= other.buckets[i];
+}
+
+/*----------------------------------------------------------------------------*/
+uint64_t
+Histogram::Percentile (double q) const
+{
+  uint64_t total = 0;
+  for (size_t i = 0; i < kBuckets; i++)
+    total += buckets[i];
+  if (!total)
+    return 0;
+
+  uint64_t rank = (uint64_t) (q * total + 0.5);
+  rank = std::max<uint64_t>(1, std::min(rank, total));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++)
+  {
+    seen += buckets[i];
+    if (seen >= rank)
+      return max ? std::min(BucketMax(i), max) : BucketMax(i);
+  }
+  return max;
+}
+
+/*----------------------------------------------------------------------------*/
+OpStats::OpStats (const char* const names[], bool histograms) :
+mHistograms(histograms), mIndex(kMaxInstances), mId(0), mShared(0)
+{
+  for (size_t i = 0; names[i]; i++)
+    mNames.push_back(names[i]);
+  mStride = 3 + (histograms ? Histogram::kBuckets : 0);
+  // keep the blocks of two threads off a common cache line
+  mWords = ((mNames.size() * mStride + 7) & ~7ull) + 8;
+  mRetired.resize(mWords);
+
+  std::lock_guard<std::mutex> lock(gRegistryMutex);
+  for (size_t i = 0; i < kMaxInstances; i++)
+  {
+    if (!gIds[i])
+    {
+      mIndex = i;
+      mId = ++gNextId;
+      gIds[i] = mId;
+      gInstances[i] = this;
+      break;
+    }
+  }
+
+  if (mIndex == kMaxInstances)
+  {
+    diamond_static_err("too many op statistics - counting without thread blocks");
+    mShared = NewBlock();
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+OpStats::~OpStats ()
+{
+  std::lock_guard<std::mutex> lock(gRegistryMutex);
+  if (mIndex < kMaxInstances)
+  {
+    gIds[mIndex] = 0;
+    gInstances[mIndex] = 0;
+  }
+
+  for (size_t i = 0; i < mBlocks.size(); i++)
+    delete[] mBlocks[i];
+  MemoryAccounting::Sub(MemoryAccounting::kStats, mBlocks.size() * mWords * sizeof (uint64_t));
+}
+
+/*----------------------------------------------------------------------------*/
+std::atomic<uint64_t>*
+OpStats::Block ()
+{
+  if (mShared)
+    return mShared;
+  OpStatsThreadBlocks& tb = tBlocks;
+  if ((tb.ids[mIndex] == mId) && tb.blocks[mIndex])
+    return tb.blocks[mIndex];
+
+  std::atomic<uint64_t>* block = NewBlock();
+  tb.ids[mIndex] = mId;
+  tb.blocks[mIndex] = block;
+  return block;
+}
+
+/*----------------------------------------------------------------------------*/
+std::atomic<uint64_t>*
+OpStats::NewBlock ()
+{
+  std::atomic<uint64_t>* block = new std::atomic<uint64_t>[mWords]();
+  MemoryAccounting::Add(MemoryAccounting::kStats, mWords * sizeof (uint64_t));
+  std::lock_guard<std::mutex> lock(mMutex);
+  mBlocks.push_back(block);
+  return block;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+OpStats::Retire (std::atomic<uint64_t>* block)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (size_t i = 0; i < mWords; i++)
+  {
+    // the max of an op is in word 2 of its slot
+    if ((i % mStride) == 2)
+      mRetired[i] = std::max(mRetired[i], block[i].load(std::memory_order_relaxed));
+    else
+      mRetired[i] += block[i].load(std::memory_order_relaxed);
+  }
+
+  auto it = std::find(mBlocks.begin(), mBlocks.end(), block);
+  if (it != mBlocks.end())
+    mBlocks.erase(it);
+  delete[] block;
+  MemoryAccounting::Sub(MemoryAccounting::kStats, mWords * sizeof (uint64_t));
+}
+
+/*----------------------------------------------------------------------------*/
+void
+OpStats::Fold (const std::atomic<uint64_t>* block, std::vector<Histogram>& out) const
+{
+  for (size_t op = 0; op < mNames.size(); op++)
+  {
+    const std::atomic<uint64_t>* slot = block + op * mStride;
+    Histogram& h = out[op];
+    h.count += slot[0].load(std::memory_order_relaxed);
+    h.sum += slot[1].load(std::memory_order_relaxed);
+    h.max = std::max(h.max, slot[2].load(std::memory_order_relaxed));
+    if (mHistograms)
+    {
+      for (size_t b = 0; b < Histogram::kBuckets; b++)
+        h.buckets[b] += slot[3 + b].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+OpStats::Collect (std::vector<Histogram>& out)
+{
+  out.assign(mNames.size(), Histogram());
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (size_t op = 0; op < mNames.size(); op++)
+  {
+    const uint64_t* slot = &mRetired[op * mStride];
+    Histogram& h = out[op];
+    h.count = slot[0];
+    h.sum = slot[1];
+    h.max = slot[2];
+    if (mHistograms)
+      std::copy(slot + 3, slot + 3 + Histogram::kBuckets, h.buckets.begin());
+  }
+
+  for (size_t i = 0; i < mBlocks.size(); i++)
+    Fold(mBlocks[i], out);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+OpStats::Dump (std::ostream& out, const char* prefix)
+{
+  std::vector<Histogram> h;
+  Collect(h);
+  char line[512];
+  for (size_t op = 0; op < h.size(); op++)
+  {
+    if (!mHistograms)
+    {
+      snprintf(line, sizeof (line), "%s%s=%llu\n", prefix, mNames[op], (unsigned long long) h[op].count);
+      out << line;
+      continue;
+    }
+
+    if (!h[op].count)
+      continue;
+    snprintf(line, sizeof (line),
+             "%s%s count=%llu avg_us=%.03f p50_us=%.03f p90_us=%.03f p99_us=%.03f p999_us=%.03f max_us=%.03f\n",
+             prefix, mNames[op], (unsigned long long) h[op].count,
+             h[op].sum / 1000.0 / h[op].count,
+             h[op].Percentile(0.5) / 1000.0,
+             h[op].Percentile(0.9) / 1000.0,
+             h[op].Percentile(0.99) / 1000.0,
+             h[op].Percentile(0.999) / 1000.0,
+             h[op].max / 1000.0);
+    out << line;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+std::string
+OpStats::Summary (const std::vector<Histogram>& now, const std::vector<Histogram>& before)
+{
+  std::string summary;
+  char item[256];
+  for (size_t op = 0; op < now.size(); op++)
+  {
+    Histogram delta = now[op];
+    if (op < before.size())
+      delta.Sub(before[op]);
+    if (!delta.count)
+      continue;
+
+    if (!mHistograms)
+    {
+      snprintf(item, sizeof (item), " %s=%llu", mNames[op], (unsigned long long) delta.count);
+      summary += item;
+      continue;
+    }
+
+    // the max of the interval is bounded by its highest bucket
+    uint64_t max = 0;
+    for (size_t b = Histogram::kBuckets; b-- > 0;)
+    {
+      if (delta.buckets[b])
+      {
+        max = std::min(Histogram::BucketMax(b), now[op].max);
+        break;
+      }
+    }
+    delta.max = max;
+    snprintf(item, sizeof (item), " %s=%llu/%.01f/%.01f/%.01f", mNames[op],
+             (unsigned long long) delta.count,
+             delta.Percentile(0.5) / 1000.0,
+             delta.Percentile(0.99) / 1000.0,
+             max / 1000.0);
+    summary += item;
+  }
+  return summary;
+}
+
+DIAMONDCOMMONNAMESPACE_END
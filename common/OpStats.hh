@@ -0,0 +1,180 @@
+// ----------------------------------------------------------------------
+// File: OpStats.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   OpStats.hh
+ *
+ * @brief  Per-thread operation counters and latency histograms
+ *
+ * An OpStats object holds a counter and optionally a latency histogram for
+ * each of its named operations. Every thread updates a private block with
+ * plain relaxed stores - no atomic read-modify-write and no shared cache
+ * lines. Collect merges the blocks of all threads on demand; blocks of
+ * exited threads are folded into a retired block.
+ *
+ * Histograms are log-linear like HDR histograms: 16 sub-buckets per power
+ * of two bound the relative error of a percentile to 1/16. Values are
+ * nanoseconds up to 2^36 (~69 s), larger ones land in the last bucket.
+ */
+
+#ifndef __DIAMONDCOMMON_OPSTATS_HH__
+#define __DIAMONDCOMMON_OPSTATS_HH__
+
+#include "common/Namespace.hh"
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+class Histogram {
+public:
+  static const unsigned kSubBits = 4;
+  static const uint64_t kSub = 1ull << kSubBits;
+  static const unsigned kMaxBits = 36;
+  static const size_t kBuckets = (kMaxBits - kSubBits + 2) * kSub;
+
+  static inline size_t
+  Bucket (uint64_t v)
+  {
+    if (v < 2 * kSub)
+      return v;
+    unsigned e = 63 - __builtin_clzll(v);
+    if (e > kMaxBits)
+      return kBuckets - 1;
+    unsigned shift = e - kSubBits;
+    return (shift + 1) * kSub + ((v >> shift) - kSub);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Largest value falling into a bucket
+  // ---------------------------------------------------------------------------
+  static uint64_t BucketMax (size_t bucket);
+
+  Histogram () : count(0), sum(0), max(0), buckets(kBuckets, 0) { }
+
+  void Add (const Histogram& other);
+  void Sub (const Histogram& other);
+
+  // ---------------------------------------------------------------------------
+  //! Value below which a fraction q of the samples are
+  // ---------------------------------------------------------------------------
+  uint64_t Percentile (double q) const;
+
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;   //< largest sample since the start, not per interval
+  std::vector<uint64_t> buckets;
+};
+
+class OpStats {
+public:
+  static const size_t kMaxInstances = 16;
+
+  // ---------------------------------------------------------------------------
+  //! names is a null terminated array indexed by op - without histograms only
+  //! the counters are kept
+  // ---------------------------------------------------------------------------
+  OpStats (const char* const names[], bool histograms = true);
+  virtual ~OpStats ();
+
+  // ---------------------------------------------------------------------------
+  //! Count an operation with its latency in nanoseconds
+  // ---------------------------------------------------------------------------
+  inline void
+  Add (size_t op, uint64_t ns)
+  {
+    std::atomic<uint64_t>* slot = Block() + op * mStride;
+    Inc(slot[0], 1);
+    Inc(slot[1], ns);
+    if (ns > slot[2].load(std::memory_order_relaxed))
+      slot[2].store(ns, std::memory_order_relaxed);
+    if (mHistograms)
+      Inc(slot[3 + Histogram::Bucket(ns)], 1);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Count an operation
+  // ---------------------------------------------------------------------------
+  inline void
+  Count (size_t op)
+  {
+    Inc(Block()[op * mStride], 1);
+  }
+
+  size_t Size () const { return mNames.size(); }
+  const char* Name (size_t op) const { return mNames[op]; }
+
+  // ---------------------------------------------------------------------------
+  //! Merge the counters and histograms of all threads
+  // ---------------------------------------------------------------------------
+  void Collect (std::vector<Histogram>& out);
+
+  // ---------------------------------------------------------------------------
+  //! One '<prefix><op> count=...' line per operation seen - with latencies in
+  //! microseconds for histograms, '<prefix><op>=<count>' otherwise
+  // ---------------------------------------------------------------------------
+  void Dump (std::ostream& out, const char* prefix);
+
+  // ---------------------------------------------------------------------------
+  //! Compact ' <op>=<n>/<p50>/<p99>/<max>' summary of the operations seen
+  //! between two collections, latencies in microseconds
+  // ---------------------------------------------------------------------------
+  std::string Summary (const std::vector<Histogram>& now, const std::vector<Histogram>& before);
+
+private:
+  static inline void
+  Inc (std::atomic<uint64_t>& v, uint64_t n)
+  {
+    // single writer - a plain load and store instead of a locked add
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Block of the calling thread - allocated on first use
+  // ---------------------------------------------------------------------------
+  std::atomic<uint64_t>* Block ();
+  std::atomic<uint64_t>* NewBlock ();
+  void Retire (std::atomic<uint64_t>* block);
+  void Fold (const std::atomic<uint64_t>* block, std::vector<Histogram>& out) const;
+
+  friend struct OpStatsThreadBlocks;
+
+  std::vector<const char*> mNames;
+  bool mHistograms;
+  size_t mStride;               //< counters per op: count, sum, max [, buckets]
+  size_t mWords;                //< words per block including padding
+  size_t mIndex;                //< slot in the thread block table
+  uint64_t mId;                 //< unique - slots are reused
+  std::mutex mMutex;
+  std::vector<std::atomic<uint64_t>*> mBlocks;
+  std::vector<uint64_t> mRetired;
+  std::atomic<uint64_t>* mShared; //< used by all threads if the table is full
+};
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
@@ -23,20 +23,334 @@
 
 /*----------------------------------------------------------------------------*/
 #include "common/RWMutex.hh"
+#include "common/Clock.hh"
 #include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <vector>
 
 /*----------------------------------------------------------------------------*/
 
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
+const size_t RWMutex::kReaderSlots;
+
+std::atomic<bool> LockStats::sEnabled(false);
+
+/*----------------------------------------------------------------------------*/
+// the registry is never destroyed - mutexes keep pointers into it
+/*----------------------------------------------------------------------------*/
+static std::mutex&
+lockStatsMutex ()
+{
+  static std::mutex* sMutex = new std::mutex();
+  return *sMutex;
+}
+
+static std::vector<LockStats*>&
+lockStats ()
+{
+  static std::vector<LockStats*>* sStats = new std::vector<LockStats*>();
+  return *sStats;
+}
+
+/*----------------------------------------------------------------------------*/
+LockStats*
+LockStats::Get (const char* name)
+{
+  std::lock_guard<std::mutex> lock(lockStatsMutex());
+  std::vector<LockStats*>& all = lockStats();
+  for (size_t i = 0; i < all.size(); i++)
+  {
+    if (all[i]->name == name)
+      return all[i];
+  }
+  all.push_back(new LockStats(name));
+  return all.back();
+}
+
+/*----------------------------------------------------------------------------*/
+void
+LockStats::SetEnabled (bool enabled)
+{
+  // calibrate before the first timed lock
+  if (enabled)
+    Clock::Calibrate();
+  sEnabled.store(enabled);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+LockStats::Dump (std::ostream& out)
+{
+  static const char* modes[] = {"read", "write"};
+  char line[512];
+  std::lock_guard<std::mutex> lock(lockStatsMutex());
+  std::vector<LockStats*>& all = lockStats();
+  for (size_t i = 0; i < all.size(); i++)
+  {
+    for (size_t m = 0; m < kModes; m++)
+    {
+      const Counters& c = all[i]->counters[m];
+      uint64_t acquired = c.acquired.load(std::memory_order_relaxed);
+      uint64_t contended = c.contended.load(std::memory_order_relaxed);
+      uint64_t wait = c.wait.load(std::memory_order_relaxed);
+      uint64_t hold = c.hold.load(std::memory_order_relaxed);
+      if (!acquired)
+        continue;
+      snprintf(line, sizeof (line),
+               "lock.%s mode=%s acquired=%llu contended=%llu contended_pct=%.02f wait_ms=%.03f "
+               "avg_wait_us=%.03f max_wait_us=%.03f hold_ms=%.03f avg_hold_us=%.03f\n",
+               all[i]->name.c_str(), modes[m],
+               (unsigned long long) acquired,
+               (unsigned long long) contended,
+               100.0 * contended / acquired,
+               wait / 1000000.0,
+               contended ? wait / 1000.0 / contended : 0.0,
+               c.maxwait.load(std::memory_order_relaxed) / 1000.0,
+               hold / 1000000.0,
+               hold / 1000.0 / acquired);
+      out << line;
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+LockStats::Reset ()
+{
+  std::lock_guard<std::mutex> lock(lockStatsMutex());
+  std::vector<LockStats*>& all = lockStats();
+  for (size_t i = 0; i < all.size(); i++)
+  {
+    for (size_t m = 0; m < kModes; m++)
+    {
+      Counters& c = all[i]->counters[m];
+      c.acquired = 0;
+      c.contended = 0;
+      c.wait = 0;
+      c.maxwait = 0;
+      c.hold = 0;
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+LockStats::Lock (pthread_mutex_t* mutex, uint64_t& start)
+{
+  start = 0;
+  if (!IsEnabled())
+  {
+    pthread_mutex_lock(mutex);
+    return;
+  }
+
+  uint64_t begin = Clock::Now();
+  bool contended = (pthread_mutex_trylock(mutex) != 0);
+  if (contended)
+    pthread_mutex_lock(mutex);
+  start = Clock::Now();
+  Acquired(kWrite, contended, contended ? Clock::Ns(start - begin) : 0);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+LockStats::UnLock (pthread_mutex_t* mutex, uint64_t start)
+{
+  if (start)
+    Released(kWrite, Clock::Ns(Clock::Now() - start));
+  pthread_mutex_unlock(mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+//! State of a reader biased mutex - one cache line per reader slot
 /*----------------------------------------------------------------------------*/
-RWMutex::RWMutex ()
+struct RWMutex::BigReader
+{
+  struct Slot
+  {
+    std::atomic<long> readers;
+    char pad[64 - sizeof (std::atomic<long>)];
+  } __attribute__ ((aligned (64)));
+
+  Slot slots[kReaderSlots];
+  std::atomic<bool> writer __attribute__ ((aligned (64)));
+  std::timed_mutex wmutex;   //< serializes writers, readers wait on it
+
+  BigReader () : writer(false)
+  {
+    for (size_t i = 0; i < kReaderSlots; i++)
+      slots[i].readers.store(0, std::memory_order_relaxed);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Slot of the calling thread - threads are spread round robin
+  // ---------------------------------------------------------------------------
+  static inline Slot&
+  Mine (BigReader* br)
+  {
+    // constant initialized - no guard on the thread local access
+    static std::atomic<size_t> sNext(0);
+    static thread_local size_t tSlot = 0;
+    if (!tSlot)
+      tSlot = sNext.fetch_add(1, std::memory_order_relaxed) % kReaderSlots + 1;
+    return br->slots[tSlot - 1];
+  }
+
+  void
+  LockRead ()
+  {
+    Slot& slot = Mine(this);
+    while (1)
+    {
+      // the increment and the flag check pair with the flag store and the
+      // slot scan of a writer - both are sequentially consistent
+      slot.readers.fetch_add(1);
+      if (!writer.load())
+        return;
+      slot.readers.fetch_sub(1, std::memory_order_release);
+      // sleep until the writer is done instead of spinning on the flag
+      wmutex.lock();
+      wmutex.unlock();
+    }
+  }
+
+  bool
+  TryLockRead ()
+  {
+    Slot& slot = Mine(this);
+    slot.readers.fetch_add(1);
+    if (!writer.load())
+      return true;
+    slot.readers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+
+  void
+  UnLockRead ()
+  {
+    Mine(this).readers.fetch_sub(1, std::memory_order_release);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Raise the flag and wait for the readers - false if the deadline passed
+  // ---------------------------------------------------------------------------
+  bool
+  Drain (const std::chrono::steady_clock::time_point* deadline)
+  {
+    writer.store(true);
+    for (size_t i = 0; i < kReaderSlots; i++)
+    {
+      for (size_t spin = 0; slots[i].readers.load(std::memory_order_acquire); spin++)
+      {
+        if (spin < 64)
+          continue;
+        if (deadline && (std::chrono::steady_clock::now() > *deadline))
+        {
+          writer.store(false, std::memory_order_release);
+          return false;
+        }
+        sched_yield();
+      }
+    }
+    return true;
+  }
+
+  void
+  LockWrite ()
+  {
+    wmutex.lock();
+    Drain(0);
+  }
+
+  bool
+  TryLockWrite ()
+  {
+    if (!wmutex.try_lock())
+      return false;
+    writer.store(true);
+    for (size_t i = 0; i < kReaderSlots; i++)
+    {
+      if (slots[i].readers.load(std::memory_order_acquire))
+      {
+        writer.store(false, std::memory_order_release);
+        wmutex.unlock();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int
+  TimeoutLockWrite (const struct timespec& timeout)
+  {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+      std::chrono::seconds(timeout.tv_sec) + std::chrono::nanoseconds(timeout.tv_nsec);
+    if (!wmutex.try_lock_until(deadline))
+      return ETIMEDOUT;
+    if (!Drain(&deadline))
+    {
+      wmutex.unlock();
+      return ETIMEDOUT;
+    }
+    return 0;
+  }
+
+  void
+  UnLockWrite ()
+  {
+    writer.store(false, std::memory_order_release);
+    wmutex.unlock();
+  }
+};
+
+/*----------------------------------------------------------------------------*/
+//! Absolute CLOCK_REALTIME deadline for the timed pthread calls
+/*----------------------------------------------------------------------------*/
+static struct timespec
+deadline (const struct timespec& timeout)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout.tv_sec;
+  ts.tv_nsec += timeout.tv_nsec;
+  if (ts.tv_nsec >= 1000000000)
+  {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+/*----------------------------------------------------------------------------*/
+RWMutex::RWMutex (Kind kind) : brlock(0), name(0), stats(0), wstart(0)
 {
   // ---------------------------------------------------------------------------
   //! Constructor
   // ---------------------------------------------------------------------------
 
+  Init(kind);
+}
+
+RWMutex::RWMutex (const char* i_name, Kind kind) : brlock(0), name(i_name), stats(0), wstart(0)
+{
+  // ---------------------------------------------------------------------------
+  //! Constructor of a profiled mutex
+  // ---------------------------------------------------------------------------
+
+  Init(kind);
+}
+
+void
+RWMutex::Init (Kind kind)
+{
   // by default we are not a blocking write mutex
   blocking = false;
   // try to get write lock in 5 seconds, then release quickly and retry
@@ -47,6 +361,16 @@ RWMutex::RWMutex ()
   rlocktime.tv_nsec = 1000000;
   readLockCounter = writeLockCounter = 0;
 
+  if (kind == kReaderBiased)
+  {
+    void* ptr = 0;
+    if (posix_memalign(&ptr, 64, sizeof (BigReader)))
+    {
+      throw "posix_memalign failed";
+    }
+    brlock = new (ptr) BigReader();
+  }
+
 #ifndef __APPLE__
   pthread_rwlockattr_init(&attr);
 
@@ -82,6 +406,12 @@ RWMutex::~RWMutex () {
   // ---------------------------------------------------------------------------
   //! Destructor
   // ---------------------------------------------------------------------------
+
+  if (brlock)
+  {
+    brlock->~BigReader();
+    free(brlock);
+  }
 }
 
 void
@@ -112,6 +442,21 @@ RWMutex::LockRead ()
   //! Lock for read
   // ---------------------------------------------------------------------------
 
+  if (Profiled())
+    ProfiledLock(LockStats::kRead, false);
+  else
+    DoLockRead();
+}
+
+void
+RWMutex::DoLockRead ()
+{
+  if (brlock)
+  {
+    brlock->LockRead();
+    return;
+  }
+
   if (pthread_rwlock_rdlock(&rwlock))
   {
     throw "pthread_rwlock_rdlock failed";
@@ -125,10 +470,26 @@ RWMutex::LockReadCancel ()
   //! Lock for read allowing to be canceled waiting for a lock
   // ---------------------------------------------------------------------------
 
+  if (Profiled())
+    ProfiledLock(LockStats::kRead, true);
+  else
+    DoLockReadCancel();
+}
+
+void
+RWMutex::DoLockReadCancel ()
+{
+  if (brlock)
+  {
+    brlock->LockRead();
+    return;
+  }
+
 #ifndef __APPLE__
   while (1)
   {
-    int rc = pthread_rwlock_timedrdlock(&rwlock, &rlocktime);
+    struct timespec until = deadline(rlocktime);
+    int rc = pthread_rwlock_timedrdlock(&rwlock, &until);
     if (rc)
     {
       if (rc == ETIMEDOUT)
@@ -159,7 +520,7 @@ RWMutex::LockReadCancel ()
     }
   }
 #else
-  LockRead();
+  DoLockRead();
 #endif
 }
 
@@ -170,6 +531,15 @@ RWMutex::UnLockRead ()
   //! Unlock a read lock
   // ---------------------------------------------------------------------------
 
+  if (LockStats* ls = Profiled())
+    ProfiledUnLockRead(ls);
+
+  if (brlock)
+  {
+    brlock->UnLockRead();
+    return;
+  }
+
   if (pthread_rwlock_unlock(&rwlock))
   {
     throw "pthread_rwlock_unlock failed";
@@ -183,6 +553,21 @@ RWMutex::LockWrite ()
   //! Lock for write
   // ---------------------------------------------------------------------------
 
+  if (Profiled())
+    ProfiledLock(LockStats::kWrite, false);
+  else
+    DoLockWrite();
+}
+
+void
+RWMutex::DoLockWrite ()
+{
+  if (brlock)
+  {
+    brlock->LockWrite();
+    return;
+  }
+
   if (blocking)
   {
     // a blocking mutex is just a normal lock for write
@@ -206,7 +591,8 @@ RWMutex::LockWrite ()
     // this has the side effect, that it allows dead locked readers to jump ahead the lock queue
     while (1)
     {
-      int rc = pthread_rwlock_timedwrlock(&rwlock, &wlocktime);
+      struct timespec until = deadline(wlocktime);
+      int rc = pthread_rwlock_timedwrlock(&rwlock, &until);
       if (rc)
       {
         if (rc != ETIMEDOUT)
@@ -244,6 +630,20 @@ RWMutex::UnLockWrite ()
   //! Unlock a write lock
   // ---------------------------------------------------------------------------
 
+  if (wstart)
+  {
+    // only a profiled lock sets the start - the stats are resolved already
+    uint64_t start = wstart;
+    wstart = 0;
+    stats.load(std::memory_order_relaxed)->Released(LockStats::kWrite, Clock::Ns(Clock::Now() - start));
+  }
+
+  if (brlock)
+  {
+    brlock->UnLockWrite();
+    return;
+  }
+
   if (pthread_rwlock_unlock(&rwlock))
   {
     throw "pthread_rwlock_unlock failed";
@@ -258,13 +658,130 @@ RWMutex::TimeoutLockWrite ()
   //! Lock for write but give up after wlocktime
   // ---------------------------------------------------------------------------
 
+  if (brlock)
+    return brlock->TimeoutLockWrite(wlocktime);
+
 #ifdef __APPLE__
   return pthread_rwlock_wrlock(&rwlock);
 #else
-  return pthread_rwlock_timedwrlock(&rwlock, &wlocktime);
+  struct timespec until = deadline(wlocktime);
+  return pthread_rwlock_timedwrlock(&rwlock, &until);
 #endif
 }
 
+bool
+RWMutex::TryLockRead ()
+{
+  // ---------------------------------------------------------------------------
+  //! Try to lock for read without waiting
+  // ---------------------------------------------------------------------------
+
+  if (brlock)
+    return brlock->TryLockRead();
+  return !pthread_rwlock_tryrdlock(&rwlock);
+}
+
+bool
+RWMutex::TryLockWrite ()
+{
+  // ---------------------------------------------------------------------------
+  //! Try to lock for write without waiting
+  // ---------------------------------------------------------------------------
+
+  if (brlock)
+    return brlock->TryLockWrite();
+  return !pthread_rwlock_trywrlock(&rwlock);
+}
+
+/*----------------------------------------------------------------------------*/
+//! Read locks of the calling thread with their start - readers are many, so
+//! the hold time cannot live in the mutex
+/*----------------------------------------------------------------------------*/
+namespace {
+
+const size_t kMaxReadHolds = 16;
+
+struct ReadHold
+{
+  const RWMutex* mutex;
+  uint64_t start;
+};
+
+thread_local ReadHold tReadHolds[kMaxReadHolds];
+thread_local size_t tReadHoldCount = 0;
+
+} // anonymous namespace
+
+LockStats*
+RWMutex::Profiled ()
+{
+  // ---------------------------------------------------------------------------
+  //! Stats of a named mutex while profiling is enabled, otherwise 0
+  // ---------------------------------------------------------------------------
+
+  if (!name || !LockStats::IsEnabled())
+    return 0;
+  LockStats* ls = stats.load(std::memory_order_relaxed);
+  if (!ls)
+  {
+    ls = LockStats::Get(name);
+    stats.store(ls, std::memory_order_relaxed);
+  }
+  return ls;
+}
+
+void
+RWMutex::ProfiledLock (LockStats::Mode mode, bool cancel)
+{
+  // ---------------------------------------------------------------------------
+  //! Lock counting the acquisition as contended if the lock is not free
+  // ---------------------------------------------------------------------------
+
+  LockStats* ls = stats.load(std::memory_order_relaxed);
+  uint64_t start = Clock::Now();
+  bool contended = (mode == LockStats::kRead) ? !TryLockRead() : !TryLockWrite();
+  if (contended)
+  {
+    if (mode == LockStats::kWrite)
+      DoLockWrite();
+    else if (cancel)
+      DoLockReadCancel();
+    else
+      DoLockRead();
+  }
+
+  uint64_t now = Clock::Now();
+  ls->Acquired(mode, contended, contended ? Clock::Ns(now - start) : 0);
+  if (mode == LockStats::kWrite)
+  {
+    wstart = now;
+  }
+  else if (tReadHoldCount < kMaxReadHolds)
+  {
+    tReadHolds[tReadHoldCount].mutex = this;
+    tReadHolds[tReadHoldCount].start = now;
+    tReadHoldCount++;
+  }
+}
+
+void
+RWMutex::ProfiledUnLockRead (LockStats* ls)
+{
+  // ---------------------------------------------------------------------------
+  //! Account the hold time of a read lock taken with profiling
+  // ---------------------------------------------------------------------------
+
+  for (size_t i = tReadHoldCount; i-- > 0;)
+  {
+    if (tReadHolds[i].mutex == this)
+    {
+      ls->Released(LockStats::kRead, Clock::Ns(Clock::Now() - tReadHolds[i].start));
+      tReadHolds[i] = tReadHolds[--tReadHoldCount];
+      return;
+    }
+  }
+}
+
 RWMutexWriteLock::RWMutexWriteLock (RWMutex &mutex)
 {
   // ---------------------------------------------------------------------------
@@ -25,6 +25,18 @@
  * @file   RWMutex.hh
  * 
  * @brief  Class implementing a fair read-write Mutex.
+ *
+ * By default the mutex wraps a writer preferring pthread rwlock. A mutex
+ * constructed as kReaderBiased is a big-reader lock instead: readers only
+ * touch a counter slot private to their thread, so read locks of different
+ * threads never share a cache line, while a writer raises a flag and waits
+ * for all slots to drain. Use it for read-mostly locks - a write lock has to
+ * scan kReaderSlots cache lines and the lock takes 4 kB.
+ *
+ * Named mutexes can be profiled: with LockStats enabled every acquisition
+ * tries the lock first to detect contention and records the wait and hold
+ * times into the LockStats of its name - all mutexes of a name share one.
+ * Disabled profiling costs one load per lock call.
  */
 
 #ifndef __DIAMONDCOMMON_RWMUTEX_HH__
@@ -34,6 +46,10 @@
 #include "common/Namespace.hh"
 /*----------------------------------------------------------------------------*/
 #include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <ostream>
+#include <string>
 /*----------------------------------------------------------------------------*/
 #define _MULTI_THREADED
 #include <pthread.h>
@@ -41,12 +57,111 @@
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
+/*----------------------------------------------------------------------------*/
+//! Contention counters of all mutexes sharing a name
+/*----------------------------------------------------------------------------*/
+class LockStats
+{
+public:
+
+  enum Mode {
+    kRead = 0,
+    kWrite,
+    kModes
+  };
+
+  // ---------------------------------------------------------------------------
+  //! Counters of a name - created on first use and never freed
+  // ---------------------------------------------------------------------------
+  static LockStats* Get(const char* name);
+
+  static void SetEnabled(bool enabled);
+
+  static inline bool
+  IsEnabled()
+  {
+    return sEnabled.load(std::memory_order_relaxed);
+  }
+
+  void
+  Acquired(Mode mode, bool contended, uint64_t waitns)
+  {
+    Counters& c = counters[mode];
+    c.acquired.fetch_add(1, std::memory_order_relaxed);
+    if (contended)
+    {
+      c.contended.fetch_add(1, std::memory_order_relaxed);
+      c.wait.fetch_add(waitns, std::memory_order_relaxed);
+      uint64_t max = c.maxwait.load(std::memory_order_relaxed);
+      while ((waitns > max) && !c.maxwait.compare_exchange_weak(max, waitns, std::memory_order_relaxed));
+    }
+  }
+
+  void
+  Released(Mode mode, uint64_t holdns)
+  {
+    counters[mode].hold.fetch_add(holdns, std::memory_order_relaxed);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! One 'lock.<name> mode=read|write acquired=...' line per name and mode
+  //! with acquisitions
+  // ---------------------------------------------------------------------------
+  static void Dump(std::ostream& out);
+
+  // ---------------------------------------------------------------------------
+  //! Zero all counters
+  // ---------------------------------------------------------------------------
+  static void Reset();
+
+  // ---------------------------------------------------------------------------
+  //! Lock a plain pthread mutex profiled as a writer of these stats - start
+  //! has to be handed to UnLock
+  // ---------------------------------------------------------------------------
+  void Lock(pthread_mutex_t* mutex, uint64_t& start);
+  void UnLock(pthread_mutex_t* mutex, uint64_t start);
+
+private:
+
+  LockStats(const char* i_name) : name(i_name) { }
+
+  struct Counters
+  {
+    std::atomic<uint64_t> acquired;
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> wait;      //< ns
+    std::atomic<uint64_t> maxwait;   //< ns
+    std::atomic<uint64_t> hold;      //< ns
+
+    Counters() : acquired(0), contended(0), wait(0), maxwait(0), hold(0) { }
+  };
+
+  std::string name;
+  Counters counters[kModes];
+
+  static std::atomic<bool> sEnabled;
+};
 
 //! Class implements a fair rw mutex prefering writers
 /*----------------------------------------------------------------------------*/
 class RWMutex
 {
+public:
+
+  enum Kind {
+    kPthread = 0,   //< pthread rwlock preferring writers
+    kReaderBiased   //< distributed reader counters
+  };
+
+  static const size_t kReaderSlots = 64;
+
 private:
+  struct BigReader;
+
+  BigReader* brlock;     //< set for kReaderBiased
+  const char* name;      //< profiling name or 0
+  std::atomic<LockStats*> stats;  //< resolved from name on first profiled use
+  uint64_t wstart;       //< Clock ticks when the profiled write lock was taken
   pthread_rwlock_t rwlock;
   pthread_rwlockattr_t attr;
   struct timespec wlocktime;
@@ -57,9 +172,15 @@ private:
 
 public:
   // ---------------------------------------------------------------------------
-  //! Constructor
+  //! Constructor - a reader biased mutex ignores SetBlocking and has to be
+  //! read unlocked by the thread which locked it
+  // ---------------------------------------------------------------------------
+  RWMutex(Kind kind = kPthread);
+
+  // ---------------------------------------------------------------------------
+  //! Constructor of a mutex profiled under name - name has to be a literal
   // ---------------------------------------------------------------------------
-  RWMutex();
+  RWMutex(const char* name, Kind kind = kPthread);
 
   // ---------------------------------------------------------------------------
   //! Destructor
@@ -107,6 +228,21 @@ public:
   //! Lock for write but give up after wlocktime
   // ---------------------------------------------------------------------------
   int TimeoutLockWrite();
+
+  // ---------------------------------------------------------------------------
+  //! Try to lock for read or write without waiting - true if locked
+  // ---------------------------------------------------------------------------
+  bool TryLockRead();
+  bool TryLockWrite();
+
+private:
+  void Init(Kind kind);
+  void DoLockRead();
+  void DoLockReadCancel();
+  void DoLockWrite();
+  LockStats* Profiled();
+  void ProfiledLock(LockStats::Mode mode, bool cancel);
+  void ProfiledUnLockRead(LockStats* ls);
 };
 
 /*----------------------------------------------------------------------------*/
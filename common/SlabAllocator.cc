@@ -0,0 +1,266 @@
+// ----------------------------------------------------------------------
+// File: SlabAllocator.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/SlabAllocator.hh"
+/*----------------------------------------------------------------------------*/
+#include <stdlib.h>
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+const size_t SlabPool::kSlabBytes;
+const size_t SlabPool::kBatch;
+const size_t SlabPool::kMaxCached;
+const size_t SlabPool::kMaxPools;
+
+/*----------------------------------------------------------------------------*/
+// the registry is never destroyed - thread caches flush into it at exit
+/*----------------------------------------------------------------------------*/
+static RWMutex&
+poolsMutex ()
+{
+  static RWMutex* sMutex = new RWMutex();
+  return *sMutex;
+}
+
+static std::vector<SlabPool*>&
+pools ()
+{
+  static std::vector<SlabPool*>* sPools = new std::vector<SlabPool*>();
+  return *sPools;
+}
+
+/*----------------------------------------------------------------------------*/
+SlabPool::ThreadCache::ThreadCache ()
+{
+  for (size_t i = 0; i < kMaxPools; i++)
+  {
+    head[i] = 0;
+    count[i] = 0;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+SlabPool::ThreadCache::~ThreadCache ()
+{
+  // hand all cached objects back when the thread exits
+  RWMutexReadLock lock(poolsMutex());
+  for (size_t i = 0; (i < kMaxPools) && (i < pools().size()); i++)
+  {
+    if (!head[i])
+      continue;
+    FreeObject* tail = head[i];
+    while (tail->next)
+      tail = tail->next;
+    pools()[i]->give(head[i], tail, count[i]);
+    head[i] = 0;
+    count[i] = 0;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+SlabPool::ThreadCache&
+SlabPool::threadCache ()
+{
+  static thread_local ThreadCache tc;
+  return tc;
+}
+
+/*----------------------------------------------------------------------------*/
+SlabPool*
+SlabPool::Create (const char* name, size_t objsize, MemoryAccounting::Subsystem memory)
+{
+  RWMutexWriteLock lock(poolsMutex());
+  SlabPool* pool = new SlabPool(name, objsize, pools().size(), memory);
+  pools().push_back(pool);
+  return pool;
+}
+
+/*----------------------------------------------------------------------------*/
+SlabPool::SlabPool (const char* name, size_t objsize, size_t id, MemoryAccounting::Subsystem memory) :
+mName(name), mId(id), mMemory(memory), mFree(0), mFreeCount(0), mInUse(0)
+{
+  // keep every object 16 byte aligned and large enough for the free list link
+  if (objsize < sizeof (FreeObject))
+    objsize = sizeof (FreeObject);
+  mObjSize = (objsize + 15) & ~((size_t) 15);
+  mMutex.SetBlocking(true);
+}
+
+/*----------------------------------------------------------------------------*/
+SlabPool::~SlabPool ()
+{
+  for (size_t i = 0; i < mSlabs.size(); i++)
+    free(mSlabs[i]);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+SlabPool::grow ()
+{
+  size_t nobj = (kSlabBytes >= mObjSize) ? (kSlabBytes / mObjSize) : 1;
+  char* slab = (char*) malloc(nobj * mObjSize);
+  if (!slab)
+    throw std::bad_alloc();
+  mSlabs.push_back(slab);
+
+  for (size_t i = nobj; i > 0; i--)
+  {
+    FreeObject* obj = (FreeObject*) (slab + ((i - 1) * mObjSize));
+    obj->next = mFree;
+    mFree = obj;
+  }
+  mFreeCount += nobj;
+}
+
+/*----------------------------------------------------------------------------*/
+size_t
+SlabPool::take (FreeObject*& head, size_t n)
+{
+  RWMutexWriteLock lock(mMutex);
+  while (mFreeCount < n)
+    grow();
+
+  head = mFree;
+  FreeObject* tail = mFree;
+  for (size_t i = 1; i < n; i++)
+    tail = tail->next;
+  mFree = tail->next;
+  tail->next = 0;
+  mFreeCount -= n;
+  mInUse += n;
+  // objects are accounted when they leave the shared list, not per allocation
+  MemoryAccounting::Add(mMemory, n * mObjSize);
+  return n;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+SlabPool::give (FreeObject* head, FreeObject* tail, size_t n)
+{
+  RWMutexWriteLock lock(mMutex);
+  tail->next = mFree;
+  mFree = head;
+  mFreeCount += n;
+  mInUse -= n;
+  MemoryAccounting::Sub(mMemory, n * mObjSize);
+}
+
+/*----------------------------------------------------------------------------*/
+void*
+SlabPool::allocate ()
+{
+  if (mId >= kMaxPools)
+  {
+    FreeObject* obj;
+    take(obj, 1);
+    return obj;
+  }
+
+  ThreadCache& tc = threadCache();
+  if (!tc.head[mId])
+    tc.count[mId] = take(tc.head[mId], kBatch);
+
+  FreeObject* obj = tc.head[mId];
+  tc.head[mId] = obj->next;
+  tc.count[mId]--;
+  return obj;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+SlabPool::deallocate (void* ptr)
+{
+  FreeObject* obj = (FreeObject*) ptr;
+  if (mId >= kMaxPools)
+  {
+    give(obj, obj, 1);
+    return;
+  }
+
+  ThreadCache& tc = threadCache();
+  obj->next = tc.head[mId];
+  tc.head[mId] = obj;
+  tc.count[mId]++;
+
+  if (tc.count[mId] > kMaxCached)
+  {
+    // keep kBatch objects, hand back the rest
+    FreeObject* tail = tc.head[mId];
+    for (size_t i = 1; i < kBatch; i++)
+      tail = tail->next;
+    FreeObject* head = tail->next;
+    tail->next = 0;
+
+    size_t n = tc.count[mId] - kBatch;
+    tail = head;
+    while (tail->next)
+      tail = tail->next;
+    give(head, tail, n);
+    tc.count[mId] = kBatch;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+SlabPool::GetStats (Stats& stats)
+{
+  RWMutexReadLock lock(mMutex);
+  stats.name = mName;
+  stats.objsize = mObjSize;
+  stats.slabs = mSlabs.size();
+  stats.bytes = mSlabs.size() * ((kSlabBytes >= mObjSize) ? ((kSlabBytes / mObjSize) * mObjSize) : mObjSize);
+  stats.inuse = mInUse;
+  stats.free = mFreeCount;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+SlabPool::GetAllStats (std::vector<Stats>& stats)
+{
+  RWMutexReadLock lock(poolsMutex());
+  stats.resize(pools().size());
+  for (size_t i = 0; i < pools().size(); i++)
+    pools()[i]->GetStats(stats[i]);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+SlabPool::DumpStats (std::stringstream& out)
+{
+  std::vector<Stats> stats;
+  GetAllStats(stats);
+  for (size_t i = 0; i < stats.size(); i++)
+  {
+    out << "slab=" << stats[i].name
+      << " objsize=" << stats[i].objsize
+      << " slabs=" << stats[i].slabs
+      << " bytes=" << stats[i].bytes
+      << " inuse=" << stats[i].inuse
+      << " free=" << stats[i].free
+      << "\n";
+  }
+}
+
+DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,232 @@
+// ----------------------------------------------------------------------
+// File: SlabAllocator.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   SlabAllocator.hh
+ *
+ * @brief  Fixed size object pools and an STL allocator on top of them
+ *
+ * A SlabPool carves objects of one size out of 64k slabs. Every thread keeps
+ * a private free list per pool and exchanges objects with the shared free
+ * list in batches, so allocation and release normally take no lock. Slabs
+ * are never returned to the system - pools are meant for long lived object
+ * populations like inodes and their index nodes.
+ *
+ * SlabAllocator<T, Tag> is a std allocator drawing single objects from the
+ * pool named by Tag, e.g. for std::allocate_shared, std::map or std::list.
+ * Rebinding keeps the tag, so the shared_ptr control block with the object
+ * or the container node lands in the tagged pool.
+ */
+
+#ifndef __DIAMONDCOMMON_SLABALLOCATOR_HH__
+#define __DIAMONDCOMMON_SLABALLOCATOR_HH__
+
+#include "common/Namespace.hh"
+#include "common/RWMutex.hh"
+#include "common/MemoryAccounting.hh"
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+/*----------------------------------------------------------------------------*/
+//! Declare a pool tag: DIAMOND_SLAB_TAG(diamondFileSlab, "diamondFile") - the
+//! _MEM variant accounts objects handed out to a MemoryAccounting subsystem
+/*----------------------------------------------------------------------------*/
+#define DIAMOND_SLAB_TAG_MEM(tag, str, subsystem) \
+  struct tag { \
+    static const char* name () { return str; } \
+    static diamond::common::MemoryAccounting::Subsystem memory () { return subsystem; } \
+  }
+
+#define DIAMOND_SLAB_TAG(tag, str) \
+  DIAMOND_SLAB_TAG_MEM(tag, str, diamond::common::MemoryAccounting::kOther)
+
+/*----------------------------------------------------------------------------*/
+//! Pool of fixed size objects
+/*----------------------------------------------------------------------------*/
+class SlabPool {
+public:
+
+  struct Stats {
+    std::string name;
+    size_t objsize;     //< size of one object including padding
+    size_t slabs;       //< number of slabs allocated
+    size_t bytes;       //< bytes held in slabs
+    size_t inuse;       //< objects handed out, including per-thread caches
+    size_t free;        //< objects in the shared free list
+  };
+
+  static const size_t kSlabBytes = 64 * 1024;
+  static const size_t kBatch = 32;
+  static const size_t kMaxCached = 4 * kBatch;
+  static const size_t kMaxPools = 64;
+
+  // ---------------------------------------------------------------------------
+  //! Create a pool - pools live until the process exits
+  // ---------------------------------------------------------------------------
+  static SlabPool* Create (const char* name, size_t objsize,
+                           MemoryAccounting::Subsystem memory = MemoryAccounting::kOther);
+
+  void* allocate ();
+  void deallocate (void* ptr);
+
+  void GetStats (Stats& stats);
+
+  // ---------------------------------------------------------------------------
+  //! Statistics of all pools
+  // ---------------------------------------------------------------------------
+  static void GetAllStats (std::vector<Stats>& stats);
+  static void DumpStats (std::stringstream& out);
+
+private:
+  struct FreeObject {
+    FreeObject* next;
+  };
+
+  struct ThreadCache {
+    FreeObject* head[kMaxPools];
+    size_t count[kMaxPools];
+
+    ThreadCache ();
+    ~ThreadCache ();
+  };
+
+  SlabPool (const char* name, size_t objsize, size_t id, MemoryAccounting::Subsystem memory);
+  ~SlabPool ();
+
+  static ThreadCache& threadCache ();
+
+  // move n objects from the shared free list into a chain
+  size_t take (FreeObject*& head, size_t n);
+  // return a chain of n objects to the shared free list
+  void give (FreeObject* head, FreeObject* tail, size_t n);
+  void grow ();
+
+  std::string mName;
+  size_t mObjSize;
+  size_t mId;
+  MemoryAccounting::Subsystem mMemory;
+
+  RWMutex mMutex;
+  FreeObject* mFree;
+  size_t mFreeCount;
+  size_t mInUse;
+  std::vector<void*> mSlabs;
+};
+
+/*----------------------------------------------------------------------------*/
+//! STL allocator drawing single objects from the pool named by Tag
+/*----------------------------------------------------------------------------*/
+template <typename T, typename Tag>
+class SlabAllocator {
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef SlabAllocator<U, Tag> other;
+  };
+
+  SlabAllocator () { }
+
+  template <typename U>
+  SlabAllocator (const SlabAllocator<U, Tag>&) { }
+
+  static SlabPool&
+  pool () {
+    static SlabPool* sPool = SlabPool::Create(Tag::name(), sizeof (T), Tag::memory());
+    return *sPool;
+  }
+
+  pointer
+  allocate (size_type n, const void* = 0) {
+    if (n == 1)
+      return static_cast<pointer> (pool().allocate());
+    return static_cast<pointer> (::operator new(n * sizeof (T)));
+  }
+
+  void
+  deallocate (pointer p, size_type n) {
+    if (n == 1)
+      pool().deallocate(p);
+    else
+      ::operator delete(p);
+  }
+
+  size_type
+  max_size () const {
+    return size_t(-1) / sizeof (T);
+  }
+
+  pointer
+  address (reference x) const {
+    return &x;
+  }
+
+  const_pointer
+  address (const_reference x) const {
+    return &x;
+  }
+
+  template <typename U, typename... Args>
+  void
+  construct (U* p, Args&&... args) {
+    ::new((void*) p) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U>
+  void
+  destroy (U* p) {
+    p->~U();
+  }
+};
+
+template <typename T, typename U, typename Tag>
+inline bool
+operator== (const SlabAllocator<T, Tag>&, const SlabAllocator<U, Tag>&)
+{
+  return true;
+}
+
+template <typename T, typename U, typename Tag>
+inline bool
+operator!= (const SlabAllocator<T, Tag>&, const SlabAllocator<U, Tag>&)
+{
+  return false;
+}
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
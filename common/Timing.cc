@@ -0,0 +1,86 @@
+// ----------------------------------------------------------------------
+// File: Timing.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                               *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/Timing.hh"
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+const size_t Timing::kMaxTags;
+
+std::atomic<TimingStat*> TimingStat::sHead(0);
+
+/*----------------------------------------------------------------------------*/
+TimingStat::TimingStat (const char* i_name) :
+name(i_name), next(0), count(0), sum(0), min(~0ull), max(0)
+{
+  for (size_t i = 0; i < Histogram::kBuckets; i++)
+    buckets[i].store(0, std::memory_order_relaxed);
+
+  // statistics are never unlinked - they are static objects
+  TimingStat* head = sHead.load();
+  do {
+    next = head;
+  } while (!sHead.compare_exchange_weak(head, this));
+}
+
+/*----------------------------------------------------------------------------*/
+void
+TimingStat::Collect (Histogram& h, uint64_t& minimum) const
+{
+  h.count = count.load(std::memory_order_relaxed);
+  h.sum = sum.load(std::memory_order_relaxed);
+  h.max = max.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < Histogram::kBuckets; i++)
+    h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+  minimum = min.load(std::memory_order_relaxed);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+TimingStat::Dump (std::ostream& out, const char* prefix)
+{
+  char line[512];
+  Histogram h;
+  uint64_t minimum;
+  for (TimingStat* stat = sHead.load(); stat; stat = stat->next)
+  {
+    stat->Collect(h, minimum);
+    if (!h.count)
+      continue;
+    snprintf(line, sizeof (line),
+             "%s%s count=%llu sum_ms=%.03f avg_us=%.03f min_us=%.03f p50_us=%.03f p90_us=%.03f p99_us=%.03f max_us=%.03f\n",
+             prefix, stat->name, (unsigned long long) h.count,
+             h.sum / 1000000.0,
+             h.sum / 1000.0 / h.count,
+             minimum / 1000.0,
+             h.Percentile(0.5) / 1000.0,
+             h.Percentile(0.9) / 1000.0,
+             h.Percentile(0.99) / 1000.0,
+             h.max / 1000.0);
+    out << line;
+  }
+}
+
+DIAMONDCOMMONNAMESPACE_END
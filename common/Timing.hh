@@ -25,7 +25,10 @@
  *
  * @brief  Class providing real-time code measurements.
  *
- *
+ * Timing records up to kMaxTags tagged Clock samples in place - taking a
+ * sample is one clock read and never allocates. TimingStat aggregates the
+ * latencies of a code block over the process life time; DIAMOND_TIMING_SCOPE
+ * places one with a compile-time tag.
  */
 
 
@@ -33,10 +36,15 @@
 #define __DIAMONDCOMMON__TIMING__HH
 
 #include "common/Namespace.hh"
+#include "common/Clock.hh"
+#include "common/OpStats.hh"
 #include <sys/time.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
+#include <atomic>
 #include <string>
+#include <iostream>
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
@@ -54,119 +62,87 @@ DIAMONDCOMMONNAMESPACE_BEGIN
 //! COMMONTIMING("STOP", &tm);
 //! tm.Print();
 //! fprintf(stdout,"realtime = %.02f", tm.RealTime());
+//!
+//! Tags are not copied - they have to be literals or outlive the object.
 /*----------------------------------------------------------------------------*/
 class Timing {
 public:
-  struct timeval tv;
-  std::string tag;
-  std::string maintag;
-  Timing* next;
-  Timing* ptr;
+  static const size_t kMaxTags = 32;
 
   // ---------------------------------------------------------------------------
-  //! Constructor - used only internally
+  //! Constructor - tag is used as the name for the measurement in Print
   // ---------------------------------------------------------------------------
 
-  Timing (const char* name, struct timeval &i_tv) {
-    memcpy(&tv, &i_tv, sizeof (struct timeval));
-    tag = name;
-    next = 0;
-    ptr = this;
-  }
+  Timing (const char* i_maintag) : maintag(i_maintag), ntags(0) { }
+
   // ---------------------------------------------------------------------------
-  //! Constructor - tag is used as the name for the measurement in Print
+  //! Take a sample - once all slots are used the last one is overwritten
   // ---------------------------------------------------------------------------
 
-  Timing (const char* i_maintag) {
-    tag = "BEGIN";
-    next = 0;
-    ptr = this;
-    maintag = i_maintag;
+  inline void
+  Tag (const char* tag) {
+    size_t i = (ntags < kMaxTags) ? ntags++ : kMaxTags - 1;
+    tags[i] = tag;
+    ticks[i] = Clock::Now();
   }
 
-
   // ---------------------------------------------------------------------------
   //! Get time elapsed between the two tags in miliseconds
   // ---------------------------------------------------------------------------
 
   float
-  GetTagTimelapse (const std::string& tagBegin, const std::string& tagEnd) {
-    float time_elapsed = 0;
-    Timing* ptr = this->next;
-    Timing* ptrBegin = 0;
-    Timing* ptrEnd = 0;
-
-    while (ptr) {
-      if (tagBegin.compare(ptr->tag.c_str()) == 0) {
-        ptrBegin = ptr;
-      }
-
-      if (tagEnd.compare(ptr->tag.c_str()) == 0) {
-        ptrEnd = ptr;
-      }
-
-      if (ptrBegin && ptrEnd) break;
-
-      ptr = ptr->next;
-    }
+  GetTagTimelapse (const char* tagBegin, const char* tagEnd) const {
+    int b = Find(tagBegin);
+    int e = Find(tagEnd);
+    if ((b < 0) || (e < 0))
+      return 0;
+    return (float) (Ns(b, e) / 1000000.0);
+  }
 
-    if (ptrBegin && ptrEnd) {
-      time_elapsed = static_cast<float> (((ptrEnd->tv.tv_sec - ptrBegin->tv.tv_sec) *1000000 +
-                                          (ptrEnd->tv.tv_usec - ptrBegin->tv.tv_usec)) / 1000.0);
-    }
+  // ---------------------------------------------------------------------------
+  //! Nanoseconds between sample i and j
+  // ---------------------------------------------------------------------------
 
-    return time_elapsed;
+  int64_t
+  Ns (size_t i, size_t j) const {
+    return (ticks[j] >= ticks[i]) ? (int64_t) Clock::Ns(ticks[j] - ticks[i]) :
+      -(int64_t) Clock::Ns(ticks[i] - ticks[j]);
   }
 
+  size_t
+  Tags () const {
+    return ntags;
+  }
 
   // ---------------------------------------------------------------------------
   //! Print method to display measurements on STDERR
   // ---------------------------------------------------------------------------
 
   void
-  Print () {
+  Print () const {
+    if (!ntags)
+      return;
     char msg[512];
-    Timing* p = this->next;
-    Timing* n;
     std::cerr << std::endl;
-    while ((n = p->next)) {
-
-      sprintf(msg, "                                        [ %12s ] %20s <=> %-20s : %.03f\n", maintag.c_str(), p->tag.c_str(), n->tag.c_str(), (float) ((n->tv.tv_sec - p->tv.tv_sec) *1000000 + (n->tv.tv_usec - p->tv.tv_usec)) / 1000.0);
+    for (size_t i = 1; i < ntags; i++) {
+      snprintf(msg, sizeof (msg), "                                        [ %12s ] %20s <=> %-20s : %.03f\n",
+               maintag, tags[i - 1], tags[i], Ns(i - 1, i) / 1000000.0);
       std::cerr << msg;
-      p = n;
     }
-    n = p;
-    p = this->next;
-    sprintf(msg, "                                        = %12s = %20s <=> %-20s : %.03f\n", maintag.c_str(), p->tag.c_str(), n->tag.c_str(), (float) ((n->tv.tv_sec - p->tv.tv_sec) *1000000 + (n->tv.tv_usec - p->tv.tv_usec)) / 1000.0);
+    snprintf(msg, sizeof (msg), "                                        = %12s = %20s <=> %-20s : %.03f\n",
+             maintag, tags[0], tags[ntags - 1], RealTime());
     std::cerr << msg;
   }
 
   // ---------------------------------------------------------------------------
-  //! Return total Realtime
+  //! Return total Realtime in miliseconds
   // ---------------------------------------------------------------------------
 
   double
-  RealTime () {
-    Timing* p = this->next;
-    Timing* n;
-    while ((n = p->next)) {
-      p = n;
-    }
-    n = p;
-    p = this->next;
-    return (double) ((n->tv.tv_sec - p->tv.tv_sec) *1000000 + (n->tv.tv_usec - p->tv.tv_usec)) / 1000.0;
+  RealTime () const {
+    return ntags ? Ns(0, ntags - 1) / 1000000.0 : 0;
   }
 
-  // ---------------------------------------------------------------------------
-  //! Destructor
-  // ---------------------------------------------------------------------------
-
-  virtual
-  ~Timing () {
-    Timing* n = next;
-    if (n) delete n;
-  };
-
   // ---------------------------------------------------------------------------
   //! Wrapper Function to hide difference between Apple and Linux
   // ---------------------------------------------------------------------------
@@ -238,20 +214,111 @@ public:
             utc.tm_sec);
     return std::string(result);
   }
+
+private:
+
+  int
+  Find (const char* tag) const {
+    for (size_t i = 0; i < ntags; i++) {
+      if ((tags[i] == tag) || !strcmp(tags[i], tag))
+        return i;
+    }
+    return -1;
+  }
+
+  const char* maintag;
+  size_t ntags;
+  const char* tags[kMaxTags];
+  uint64_t ticks[kMaxTags];
 };
 
 // ---------------------------------------------------------------------------
 //! Macro to place a measurement throughout the code
 // ---------------------------------------------------------------------------
-#define COMMONTIMING( __ID__,__LIST__)                                \
-  do {								\
-    struct timeval tp;						\
-    struct timezone tz;						\
-    gettimeofday(&tp, &tz);					\
-    (__LIST__)->ptr->next=new diamond::common::Timing(__ID__,tp);	\
-    (__LIST__)->ptr = (__LIST__)->ptr->next;			\
-  } while(0);
+#define COMMONTIMING( __ID__,__LIST__) (__LIST__)->Tag(__ID__)
+
+/*----------------------------------------------------------------------------*/
+//! Latency statistics of a code block over the process life time
+//!
+//! Updates are relaxed atomic adds shared by all threads - for per-thread
+//! counting of hot paths with many threads use OpStats. All statistics are
+//! registered in one list for Dump.
+//!
+//! Example
+//! void flush () {
+//!   DIAMOND_TIMING_SCOPE("writeback.flush");
+//!   ...
+//! }
+/*----------------------------------------------------------------------------*/
+class TimingStat {
+public:
+
+  TimingStat (const char* name);
+
+  inline void
+  Add (uint64_t ns) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+    buckets[Histogram::Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t v = min.load(std::memory_order_relaxed);
+    while ((ns < v) && !min.compare_exchange_weak(v, ns, std::memory_order_relaxed));
+    v = max.load(std::memory_order_relaxed);
+    while ((ns > v) && !max.compare_exchange_weak(v, ns, std::memory_order_relaxed));
+  }
 
+  // ---------------------------------------------------------------------------
+  //! Copy the statistics - min is ~0 without samples
+  // ---------------------------------------------------------------------------
+  void Collect (Histogram& h, uint64_t& minimum) const;
+
+  const char* Name () const {
+    return name;
+  }
+
+  // ---------------------------------------------------------------------------
+  //! One '<prefix><name> count=... min_us=... p50_us=...' line per statistic
+  //! with samples
+  // ---------------------------------------------------------------------------
+  static void Dump (std::ostream& out, const char* prefix);
+
+private:
+  const char* name;
+  TimingStat* next;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> min;
+  std::atomic<uint64_t> max;
+  std::atomic<uint64_t> buckets[Histogram::kBuckets];
+
+  static std::atomic<TimingStat*> sHead;
+};
+
+/*----------------------------------------------------------------------------*/
+//! Adds the time from construction to destruction to a TimingStat
+/*----------------------------------------------------------------------------*/
+class TimingScope {
+public:
+
+  TimingScope (TimingStat& i_stat) : stat(i_stat), start(Clock::Now()) { }
+
+  ~TimingScope () {
+    stat.Add(Clock::Ns(Clock::Now() - start));
+  }
+
+private:
+  TimingStat& stat;
+  uint64_t start;
+};
+
+#define DIAMOND_TIMING_CONCAT2(a, b) a ## b
+#define DIAMOND_TIMING_CONCAT(a, b) DIAMOND_TIMING_CONCAT2(a, b)
+
+// ---------------------------------------------------------------------------
+//! Time the rest of the enclosing block into the statistic named __TAG__
+// ---------------------------------------------------------------------------
+#define DIAMOND_TIMING_SCOPE(__TAG__)                                             \
+  static diamond::common::TimingStat DIAMOND_TIMING_CONCAT(diamond_timing_stat_, __LINE__)(__TAG__); \
+  diamond::common::TimingScope DIAMOND_TIMING_CONCAT(diamond_timing_scope_, __LINE__)(DIAMOND_TIMING_CONCAT(diamond_timing_stat_, __LINE__))
 
 DIAMONDCOMMONNAMESPACE_END
 
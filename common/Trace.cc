@@ -0,0 +1,203 @@
+// ----------------------------------------------------------------------
+// File: Trace.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/Trace.hh"
+#include "common/Logging.hh"
+/*----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <mutex>
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+const uint32_t Trace::kMagic;
+const uint32_t Trace::kVersion;
+const size_t Trace::kHeaderSize;
+const size_t Trace::kMaxOps;
+const size_t Trace::kOpNameSize;
+
+std::atomic<bool> Trace::sEnabled(false);
+
+static_assert(sizeof (Trace::Header) <= Trace::kHeaderSize, "trace header exceeds its page");
+static_assert(sizeof (Trace::Record) == 40, "trace record layout changed");
+
+namespace {
+
+std::mutex gTraceMutex;
+std::string gDir;
+size_t gCapacity = 0;
+const char* const* gOpNames = 0;
+std::atomic<uint64_t> gGeneration(0);   //< changes with every Enable
+
+//------------------------------------------------------------------------------
+//! Ring of the calling thread - unmapped when the thread exits
+//------------------------------------------------------------------------------
+struct TraceRing {
+  Trace::Header* header;
+  Trace::Record* records;
+  uint64_t capacity;
+  uint64_t head;
+  uint64_t generation;
+  size_t length;
+  uint32_t tid;
+
+  TraceRing () : header(0), records(0), capacity(0), head(0), generation(0), length(0), tid(0) { }
+
+  ~TraceRing ()
+  {
+    unmap();
+  }
+
+  void
+  unmap ()
+  {
+    if (header)
+      munmap(header, length);
+    header = 0;
+    records = 0;
+  }
+
+  bool
+  map ()
+  {
+    unmap();
+    std::lock_guard<std::mutex> lock(gTraceMutex);
+    generation = gGeneration.load();
+    if (!tid)
+      tid = (uint32_t) syscall(SYS_gettid);
+
+    capacity = gCapacity;
+    length = Trace::kHeaderSize + capacity * sizeof (Trace::Record);
+    std::string path = gDir + "/trace." + std::to_string(getpid()) + "." + std::to_string(tid);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+      return false;
+
+    void* ptr = MAP_FAILED;
+    if (!ftruncate(fd, length))
+      ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (ptr == MAP_FAILED)
+    {
+      diamond_static_err("cannot map trace file %s errno=%d", path.c_str(), errno);
+      unlink(path.c_str());
+      return false;
+    }
+
+    header = (Trace::Header*) ptr;
+    records = (Trace::Record*) ((char*) ptr + Trace::kHeaderSize);
+    head = 0;
+
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    header->magic = Trace::kMagic;
+    header->version = Trace::kVersion;
+    header->recordsize = sizeof (Trace::Record);
+    header->capacity = capacity;
+    header->pid = getpid();
+    header->tid = tid;
+    header->realtime = ((int64_t) rt.tv_sec * 1000000000ll + rt.tv_nsec) - (int64_t) Clock::Monotonic();
+    header->head = 0;
+    header->nops = 0;
+    for (size_t i = 0; gOpNames && gOpNames[i] && (i < Trace::kMaxOps); i++)
+    {
+      strncpy(header->opnames[i], gOpNames[i], Trace::kOpNameSize - 1);
+      header->nops++;
+    }
+    return true;
+  }
+};
+
+thread_local TraceRing tTraceRing;
+
+} // anonymous namespace
+
+/*----------------------------------------------------------------------------*/
+int
+Trace::Enable (const std::string& dir, size_t records, const char* const opnames[])
+{
+  if (!records)
+    return EINVAL;
+
+  struct stat st;
+  if (::stat(dir.c_str(), &st))
+    return errno;
+  if (!S_ISDIR(st.st_mode))
+    return ENOTDIR;
+
+  Clock::Calibrate();
+
+  {
+    std::lock_guard<std::mutex> lock(gTraceMutex);
+    gDir = dir;
+    gCapacity = records;
+    gOpNames = opnames;
+    gGeneration++;
+  }
+  sEnabled = true;
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+Trace::Disable ()
+{
+  sEnabled = false;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+Trace::Add (uint16_t op, uint64_t ino, uint64_t offset, uint64_t size, uint64_t start, uint64_t stop)
+{
+  TraceRing& ring = tTraceRing;
+  if ((ring.generation != gGeneration.load(std::memory_order_relaxed)) || !ring.header)
+  {
+    // a failed map is retried with the next Enable only
+    if ((ring.generation == gGeneration.load()) || !ring.map())
+      return;
+  }
+
+  Record& rec = ring.records[ring.head % ring.capacity];
+  uint64_t latency = Clock::Ns(stop - start);
+  rec.start = Clock::ToNs(start);
+  rec.ino = ino;
+  rec.offset = offset;
+  rec.size = (size > 0xffffffffull) ? 0xffffffffu : (uint32_t) size;
+  rec.latency = (latency > 0xffffffffull) ? 0xffffffffu : (uint32_t) latency;
+  rec.tid = ring.tid;
+  rec.op = op;
+  rec.flags = 0;
+
+  // readers of a live ring use head to find the newest record
+  __atomic_store_n(&ring.header->head, ++ring.head, __ATOMIC_RELEASE);
+}
+
+DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,134 @@
+// ----------------------------------------------------------------------
+// File: Trace.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   Trace.hh
+ *
+ * @brief  Binary trace of operations into per-thread memory mapped rings
+ *
+ * Every traced operation writes one fixed size record with its op code,
+ * inode, offset, size, thread, start time and latency. Each thread owns a
+ * ring file '<dir>/trace.<pid>.<tid>' mapped shared - recording is a plain
+ * store into the mapping and the records survive a crash of the process.
+ * The file header carries the op names so the decoder needs nothing else.
+ * Operations are timed with Clock ticks and stored as CLOCK_MONOTONIC
+ * nanoseconds. A disabled trace costs one load per operation.
+ */
+
+#ifndef __DIAMONDCOMMON_TRACE_HH__
+#define __DIAMONDCOMMON_TRACE_HH__
+
+#include "common/Namespace.hh"
+#include "common/Clock.hh"
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+class Trace {
+public:
+  static const uint32_t kMagic = 0x43525444;   //< 'DTRC'
+  static const uint32_t kVersion = 1;
+  static const size_t kHeaderSize = 4096;
+  static const size_t kMaxOps = 64;
+  static const size_t kOpNameSize = 32;
+
+  struct Record {
+    uint64_t start;     //< CLOCK_MONOTONIC nanoseconds
+    uint64_t ino;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t latency;   //< nanoseconds, saturated
+    uint32_t tid;
+    uint16_t op;
+    uint16_t flags;
+  };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordsize;
+    uint32_t nops;
+    uint64_t capacity;  //< records in the ring
+    uint64_t pid;
+    uint64_t tid;
+    int64_t realtime;   //< CLOCK_REALTIME - CLOCK_MONOTONIC in nanoseconds
+    uint64_t head;      //< records written - the ring holds the last capacity
+    char opnames[kMaxOps][kOpNameSize];
+  };
+
+  // ---------------------------------------------------------------------------
+  //! Start tracing into dir with rings of records entries per thread - the op
+  //! names are a null terminated array indexed by op code. Returns 0 or an
+  //! errno.
+  // ---------------------------------------------------------------------------
+  static int Enable (const std::string& dir, size_t records, const char* const opnames[]);
+
+  // ---------------------------------------------------------------------------
+  //! Stop tracing - the rings stay mapped until their thread exits
+  // ---------------------------------------------------------------------------
+  static void Disable ();
+
+  static inline bool
+  IsEnabled ()
+  {
+    return sEnabled.load(std::memory_order_relaxed);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Append a record to the ring of the calling thread - start and stop are
+  //! Clock ticks
+  // ---------------------------------------------------------------------------
+  static void Add (uint16_t op, uint64_t ino, uint64_t offset, uint64_t size, uint64_t start, uint64_t stop);
+
+  // ---------------------------------------------------------------------------
+  //! Records one operation from construction to destruction
+  // ---------------------------------------------------------------------------
+  class Scope {
+  public:
+
+    Scope (uint16_t op, uint64_t ino, uint64_t offset = 0, uint64_t size = 0) :
+    mStart(IsEnabled() ? Clock::Now() : 0), mIno(ino), mOffset(offset), mSize(size), mOp(op) { }
+
+    ~Scope ()
+    {
+      if (mStart)
+        Add(mOp, mIno, mOffset, mSize, mStart, Clock::Now());
+    }
+
+  private:
+    uint64_t mStart;
+    uint64_t mIno;
+    uint64_t mOffset;
+    uint64_t mSize;
+    uint16_t mOp;
+  };
+
+private:
+  static std::atomic<bool> sEnabled;
+};
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
@@ -0,0 +1,608 @@
+// ----------------------------------------------------------------------
+// File: lfmap.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                               *
+ * Copyright (C) 2015 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+/**
+ * @file   lfmap.hh
+ *
+ * @brief  Class template implementing a lock free fixed-width hash map
+ *
+ * Keys and values have to be trivially copyable types of 8 or 16 bytes.
+ * The width of the key selects the compare-and-swap instruction used to
+ * claim a slot (cmpxchg for 8 bytes, cmpxchg16b for 16 bytes). The all-zero
+ * key marks a free slot, the all-ones key marks a deleted slot - both can not
+ * be used as keys, the all-zero value can not be used as value.
+ *
+ * Lookups only stop at a free slot - an optional probe limit bounds the cost
+ * of a miss or of a failed insert in a crowded table. Items are never placed
+ * further from their home slot than the limit, so lookups stay exact.
+ */
+
+
+#ifndef __DIAMONDCOMMON_LFMAP_HH__
+#define __DIAMONDCOMMON_LFMAP_HH__
+
+#include "common/Namespace.hh"
+#include "common/MemoryAccounting.hh"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <type_traits>
+#include <vector>
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+/*----------------------------------------------------------------------------*/
+//! Atomic word operations selected by the width of the stored type
+/*----------------------------------------------------------------------------*/
+template <size_t N> struct lfmap_word;
+
+template <>
+struct lfmap_word<8> {
+  typedef uint64_t type;
+
+  static type
+  load (type* ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+  }
+
+  static void
+  store (type* ptr, type val) {
+    __atomic_store_n(ptr, val, __ATOMIC_RELAXED);
+  }
+
+  static bool
+  cas (type* ptr, type expected, type desired) {
+    return __atomic_compare_exchange_n(ptr, &expected, desired, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+
+  static uint64_t
+  hash (type h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+};
+
+template <>
+struct lfmap_word<16> {
+  typedef unsigned __int128 type;
+
+  static type
+  load (type* ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+  }
+
+  static void
+  store (type* ptr, type val) {
+    __atomic_store_n(ptr, val, __ATOMIC_RELAXED);
+  }
+
+  static bool
+  cas (type* ptr, type expected, type desired) {
+    // with -mcx16 this is inlined as a single cmpxchg16b
+    return __sync_bool_compare_and_swap(ptr, expected, desired);
+  }
+
+  static uint64_t
+  hash (type h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint64_t) (h & 0xffffffffffffffffULL);
+  }
+};
+
+/*----------------------------------------------------------------------------*/
+//! Lock free open-addressing hash map for fixed width keys and values
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+class lfmap {
+public:
+  typedef lfmap_word<sizeof (K) > key_word;
+  typedef lfmap_word<sizeof (V) > value_word;
+  typedef typename key_word::type kword_t;
+  typedef typename value_word::type vword_t;
+
+  struct Entry {
+    kword_t key;
+    vword_t value;
+  } __attribute__ ((aligned (sizeof (kword_t) > sizeof (vword_t) ? sizeof (kword_t) : sizeof (vword_t))));
+
+  kword_t _DELETED_;
+  const kword_t _ZERO_ = 0;
+
+private:
+  Entry* m_entries;
+  uint64_t m_arraySize;
+  int mapfd;
+
+  uint64_t m_item_cnt;
+  uint64_t m_item_deleted_cnt;
+  uint64_t m_probe_limit;
+  bool m_enable_cnt;
+
+  // number of slots probed by set/delete resp. get before giving up
+  uint64_t
+  setProbes () const {
+    return m_probe_limit ? m_probe_limit : (m_arraySize << 1);
+  }
+
+  uint64_t
+  getProbes () const {
+    return (m_probe_limit && (m_probe_limit < m_arraySize)) ? m_probe_limit : m_arraySize;
+  }
+
+  static kword_t
+  toKey (const K& key) {
+    kword_t w;
+    memcpy(&w, &key, sizeof (w));
+    return w;
+  }
+
+  static vword_t
+  toValueWord (const V& value) {
+    vword_t w;
+    memcpy(&w, &value, sizeof (w));
+    return w;
+  }
+
+  static V
+  fromValueWord (vword_t w) {
+    V value;
+    memcpy(&value, &w, sizeof (value));
+    return value;
+  }
+
+public:
+  lfmap (uint64_t arraySize, const char* mapfileName = 0, bool cnt = false);
+  ~lfmap ();
+
+  // Basic operations
+  bool SetItem (K key, V value, int syncflag = 0);
+
+  void DeleteItem (K key, int syncflag = 0);
+
+  V GetItem (K key);
+  uint64_t GetItemCount (bool effectively = true);
+  void Clear ();
+  bool Compact ();
+  bool Resize (uint64_t arraySize);
+  int Sync (int syncflag);
+  int Snapshot (const char* snapfileName, int syncflag = 0);
+
+  uint64_t
+  GetDeletedCount () {
+    return __atomic_load_n(&m_item_deleted_cnt, __ATOMIC_RELAXED);
+  }
+
+  uint64_t
+  GetArraySize () const {
+    return m_arraySize;
+  }
+
+  size_t
+  GetByteSize () const {
+    return sizeof (Entry) * m_arraySize;
+  }
+
+  // 0 probes the whole table - has to be set before the first item
+  void
+  SetProbeLimit (uint64_t probes) {
+    m_probe_limit = probes;
+  }
+
+  uint64_t
+  GetProbeLimit () const {
+    return m_probe_limit;
+  }
+
+  void
+  EnableCnt () {
+    m_enable_cnt = true;
+  }
+
+  void
+  DisableCnt () {
+    m_enable_cnt = false;
+  }
+};
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+lfmap<K, V>::lfmap (uint64_t arraySize, const char* mapfilename, bool cnt)
+{
+  static_assert(std::is_trivially_copyable<K>::value, "lfmap key must be trivially copyable");
+  static_assert(std::is_trivially_copyable<V>::value, "lfmap value must be trivially copyable");
+
+  // Initialize cells
+  assert((arraySize & (arraySize - 1)) == 0); // Must be a power of 2
+  m_arraySize = arraySize;
+  m_entries = 0;
+  m_enable_cnt = cnt;
+  m_probe_limit = 0;
+  mapfd = 0;
+
+  _DELETED_ = ~_ZERO_;
+
+  if (mapfilename)
+  {
+    mapfd = open(mapfilename, O_RDWR);
+    assert(mapfd > 0);
+    void *mapping;
+    mapping = mmap(0, sizeof (Entry) * arraySize,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, mapfd, 0);
+    assert(mapping != MAP_FAILED);
+    m_entries = (Entry*) mapping;
+  }
+  else
+  {
+    m_entries = new Entry[arraySize];
+  }
+  // mapped tables are accounted as well - Clear() touches every page
+  MemoryAccounting::Add(MemoryAccounting::kMaps, sizeof (Entry) * m_arraySize);
+  Clear();
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+lfmap<K, V>::~lfmap ()
+{
+  if (mapfd > 0)
+  {
+    // Unmap cells
+    if (m_entries)
+      munmap(m_entries, sizeof (Entry) * m_arraySize);
+    m_entries = 0;
+    close(mapfd);
+  }
+  else
+  {
+    // Delete cells
+    delete[] m_entries;
+  }
+  MemoryAccounting::Sub(MemoryAccounting::kMaps, sizeof (Entry) * m_arraySize);
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+bool
+lfmap<K, V>::SetItem (K ukey, V uvalue, int syncflag)
+{
+  kword_t key = toKey(ukey);
+  vword_t value = toValueWord(uvalue);
+
+  assert(key != 0);
+  assert(value != 0);
+  assert(key != _DELETED_);
+
+  // ---------------------------------------------------------------------------
+  // An existing key has to be found before a deleted slot may be reused -
+  // otherwise the key ends up in two slots and a delete revives the old one.
+  // ---------------------------------------------------------------------------
+  size_t l_stopper = setProbes();
+
+  for (uint64_t idx = key_word::hash(key); l_stopper != 0; idx++, l_stopper--)
+  {
+    idx &= m_arraySize - 1;
+    kword_t probedKey = key_word::load(&m_entries[idx].key);
+    if (probedKey == key)
+    {
+      value_word::store(&m_entries[idx].value, value);
+      if (mapfd && syncflag)
+        msync(&m_entries[idx], sizeof (Entry), syncflag);
+      return true;
+    }
+    if (probedKey == 0)
+      break;
+  }
+
+  l_stopper = setProbes();
+
+  for (uint64_t idx = key_word::hash(key); l_stopper != 0; idx++, l_stopper--)
+  {
+    bool new_key = false;
+    idx &= m_arraySize - 1;
+    // Load the key that was there.
+    kword_t probedKey = key_word::load(&m_entries[idx].key);
+
+    if (probedKey != key)
+    {
+      // -----------------------------------------------------------------------
+      // The entry was either free, or contains another key.
+      // -----------------------------------------------------------------------
+      if ((probedKey != 0) && (probedKey != _DELETED_))
+      {
+        continue; // Usually, it contains another key. Keep probing.
+      }
+      // -----------------------------------------------------------------------
+      // The entry was free. Now let's try to take it using a CAS.
+      // -----------------------------------------------------------------------
+      if (!key_word::cas(&m_entries[idx].key, probedKey, key))
+      {
+        // ---------------------------------------------------------------------
+        // it was taken, let's see if by chance with the same key
+        // ---------------------------------------------------------------------
+        if (key_word::load(&m_entries[idx].key) != key)
+        {
+          continue; // Another thread just stole it from underneath us.
+        }
+      }
+      else
+      {
+        // ---------------------------------------------------------------------
+        // a new key has been set
+        // ---------------------------------------------------------------------
+        new_key = true;
+      }
+    }
+
+    // ---------------------------------------------------------------------
+    // Store the value in this array entry.
+    // ---------------------------------------------------------------------
+    value_word::store(&m_entries[idx].value, value);
+
+    // ---------------------------------------------------------------------
+    // Count items only if they are 'new'
+    // ---------------------------------------------------------------------
+    if (new_key && m_enable_cnt)
+    {
+      if (probedKey != _DELETED_)
+        __atomic_fetch_add(&m_item_cnt, 1, __ATOMIC_SEQ_CST);
+      else
+        __atomic_fetch_sub(&m_item_deleted_cnt, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (mapfd && syncflag)
+      msync(&m_entries[idx], sizeof (Entry), syncflag);
+    return true;
+  }
+  return false;
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+void
+lfmap<K, V>::DeleteItem (K ukey, int syncflag)
+{
+  kword_t key = toKey(ukey);
+  size_t l_stopper = setProbes();
+  for (uint64_t idx = key_word::hash(key); l_stopper != 0; idx++, l_stopper--)
+  {
+    idx &= m_arraySize - 1;
+    // Load the key that was there.
+    kword_t probedKey = key_word::load(&m_entries[idx].key);
+    if (probedKey != key)
+    {
+      if (probedKey == 0)
+        return;
+      continue;
+    }
+
+    if (key_word::cas(&m_entries[idx].key, probedKey, _DELETED_))
+    {
+      if (m_enable_cnt)
+      {
+        __atomic_fetch_add(&m_item_deleted_cnt, 1, __ATOMIC_SEQ_CST);
+      }
+      if (mapfd && syncflag)
+        msync(&m_entries[idx], sizeof (Entry), syncflag);
+    }
+    // keep probing - a concurrent insert may have left a second copy
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+V
+lfmap<K, V>::GetItem (K ukey)
+{
+  kword_t key = toKey(ukey);
+  assert(key != 0);
+
+  size_t l_stopper = getProbes();
+
+  for (uint64_t idx = key_word::hash(key); l_stopper != 0; idx++, l_stopper--)
+  {
+    idx &= m_arraySize - 1;
+
+    kword_t probedKey = key_word::load(&m_entries[idx].key);
+    if (probedKey == key)
+      return fromValueWord(value_word::load(&m_entries[idx].value));
+    if (probedKey == 0)
+      break;
+  }
+  return fromValueWord(0);
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+uint64_t
+lfmap<K, V>::GetItemCount (bool effectively)
+{
+  uint64_t itemCount = 0;
+  if (effectively)
+  {
+    uint64_t itemDeletedCount = 0;
+    itemCount = __atomic_load_n(&m_item_cnt, __ATOMIC_RELAXED);
+    itemDeletedCount = __atomic_load_n(&m_item_deleted_cnt, __ATOMIC_RELAXED);
+    return itemCount - itemDeletedCount;
+  }
+  for (uint64_t idx = 0; idx < m_arraySize; idx++)
+  {
+    if ((key_word::load(&m_entries[idx].key) != 0)
+        && (value_word::load(&m_entries[idx].value) != 0))
+      itemCount++;
+  }
+  return itemCount;
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+void
+lfmap<K, V>::Clear ()
+{
+  for (uint64_t idx = 0; idx < m_arraySize; idx++)
+  {
+    key_word::store(&m_entries[idx].key, 0);
+    value_word::store(&m_entries[idx].value, 0);
+  }
+  __atomic_store_n(&m_item_cnt, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&m_item_deleted_cnt, 0, __ATOMIC_RELAXED);
+}
+
+/*----------------------------------------------------------------------------*/
+//! Re-insert all live items dropping deleted slots - the caller has to
+//! exclude concurrent writers, concurrent readers may miss items meanwhile.
+//! See Resize for the return value.
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+bool
+lfmap<K, V>::Compact ()
+{
+  return Resize(m_arraySize);
+}
+
+/*----------------------------------------------------------------------------*/
+//! Re-insert all live items into a table of arraySize slots - changing the
+//! size reallocates the table, so the caller has to exclude readers as well.
+//! A table whose items do not all fit within the probe limit keeps doubling
+//! until they do. Mapped tables can only be compacted - they return false
+//! if an item could not be placed, which is then lost.
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+bool
+lfmap<K, V>::Resize (uint64_t arraySize)
+{
+  assert((arraySize & (arraySize - 1)) == 0); // Must be a power of 2
+  assert(!mapfd || (arraySize == m_arraySize));
+
+  std::vector<Entry> live;
+  for (uint64_t idx = 0; idx < m_arraySize; idx++)
+  {
+    Entry e;
+    e.key = key_word::load(&m_entries[idx].key);
+    e.value = value_word::load(&m_entries[idx].value);
+    if ((e.key != 0) && (e.key != _DELETED_) && (e.value != 0))
+      live.push_back(e);
+  }
+
+  for (;; arraySize <<= 1)
+  {
+    if (arraySize != m_arraySize)
+    {
+      delete[] m_entries;
+      MemoryAccounting::Sub(MemoryAccounting::kMaps, sizeof (Entry) * m_arraySize);
+      m_entries = new Entry[arraySize];
+      m_arraySize = arraySize;
+      MemoryAccounting::Add(MemoryAccounting::kMaps, sizeof (Entry) * m_arraySize);
+    }
+
+    Clear();
+    bool fits = true;
+    for (auto it = live.begin(); it != live.end(); ++it)
+    {
+      K key;
+      memcpy(&key, &it->key, sizeof (key));
+      if (!SetItem(key, fromValueWord(it->value)))
+      {
+        fits = false;
+        if (!mapfd)
+          break;
+      }
+    }
+
+    if (fits || mapfd)
+      return fits;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+int
+lfmap<K, V>::Sync (int syncflag)
+{
+  return msync(m_entries, sizeof (Entry) * m_arraySize, syncflag);
+}
+
+/*----------------------------------------------------------------------------*/
+template <typename K, typename V>
+int
+lfmap<K, V>::Snapshot (const char* snapfileName, int syncflag)
+{
+  int snapfd = open(snapfileName, O_RDWR | O_CREAT, S_IRWXU);
+  if (snapfd > 0)
+  {
+    if (ftruncate(snapfd, sizeof (Entry) * m_arraySize))
+    {
+      close(snapfd);
+      return -1;
+    }
+
+    void *mapping;
+    mapping = mmap(0, sizeof (Entry) * m_arraySize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, snapfd, 0);
+    if (mapping == MAP_FAILED)
+    {
+      close(snapfd);
+      return -1;
+    }
+    Entry* snapentry = (Entry*) mapping;
+
+    for (uint64_t idx = 0; idx < m_arraySize; idx++)
+    {
+      kword_t key = key_word::load(&m_entries[idx].key);
+      vword_t val = value_word::load(&m_entries[idx].value);
+      memcpy(&snapentry->key, &key, sizeof (kword_t));
+      memcpy(&snapentry->value, &val, sizeof (vword_t));
+      snapentry++;
+    }
+    if (msync(mapping, sizeof (Entry) * m_arraySize, syncflag))
+      return -1;
+    if (munmap(mapping, sizeof (Entry) * m_arraySize))
+      return -1;
+    if (close(snapfd))
+      return -1;
+    return 0;
+  }
+  return -1;
+}
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
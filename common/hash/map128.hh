@@ -25,7 +25,7 @@
 /**
  * @file   map128.hh
  *
- * @brief  Class implementing a lock free 128bit->128bit hash map
+ * @brief  Lock free 128bit->128bit hash map (lfmap instantiation)
  *
  *
  */
@@ -35,55 +35,13 @@
 #define __DIAMONDCOMMON_MAP128_HH__
 
 #include "common/Namespace.hh"
-#include <sys/mman.h>
+#include "common/hash/lfmap.hh"
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
-class map128 {
-public:
+typedef lfmap<__int128, __int128> map128;
 
-  __int128 _DELETED_;
-  const __int128 _ZERO_ = 0;
-
-  struct Entry {
-    __int128 key;
-    __int128 value;
-  } __attribute__ ((aligned (16)));
-
-private:
-  Entry* m_entries;
-  uint64_t m_arraySize;
-  int mapfd;
-
-  uint64_t m_item_cnt;
-  uint64_t m_item_deleted_cnt;
-  bool m_enable_cnt;
-
-public:
-  map128 (uint64_t arraySize, const char* mapefileName = 0, bool cnt = false);
-  ~map128 ();
-
-  // Basic operations
-  bool SetItem (__int128 key, __int128 value, int syncflag = 0);
-
-  void DeleteItem (__int128 key, int syncflag = 0);
-
-  __int128 GetItem (__int128 key);
-  uint64_t GetItemCount (bool effectively = true);
-  void Clear ();
-  int Sync (int syncflag);
-  int Snapshot (const char* snapfileName, int syncflag = 0);
-
-  void
-  EnableCnt () {
-    m_enable_cnt = true;
-  }
-
-  void
-  DisableCnt () {
-    m_enable_cnt = false;
-  }
-};
+extern template class lfmap<__int128, __int128>;
 
 DIAMONDCOMMONNAMESPACE_END
 
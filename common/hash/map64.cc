@@ -0,0 +1,38 @@
+// ----------------------------------------------------------------------
+// File: map64.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2015 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *           A                                                           *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/*----------------------------------------------------------------------------*/
+#include "common/Namespace.hh"
+#include "common/Logging.hh"
+#include "common/hash/map64.hh"
+/*----------------------------------------------------------------------------*/
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+/*----------------------------------------------------------------------------*/
+//! Explicit instantiation of the 64bit->64bit map
+/*----------------------------------------------------------------------------*/
+template class lfmap<uint64_t, uint64_t>;
+
+/*----------------------------------------------------------------------------*/
+DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,48 @@
+// ----------------------------------------------------------------------
+// File: map64.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                               *
+ * Copyright (C) 2015 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+/**
+ * @file   map64.hh
+ *
+ * @brief  Lock free 64bit->64bit hash map (lfmap instantiation)
+ *
+ *
+ */
+
+
+#ifndef __DIAMONDCOMMON_MAP64_HH__
+#define __DIAMONDCOMMON_MAP64_HH__
+
+#include "common/Namespace.hh"
+#include "common/hash/lfmap.hh"
+
+DIAMONDCOMMONNAMESPACE_BEGIN
+
+typedef lfmap<uint64_t, uint64_t> map64;
+
+extern template class lfmap<uint64_t, uint64_t>;
+
+DIAMONDCOMMONNAMESPACE_END
+
+#endif
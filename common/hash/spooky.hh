@@ -5,7 +5,7 @@
 
 /************************************************************************
  * DIAMOND - the CERN Disk Storage System                               *
-/************************************************************************
+ ************************************************************************/
 
 //
 // SpookyHash: a 128-bit noncryptographic hash function
@@ -57,7 +57,6 @@ DIAMONDCOMMONNAMESPACE_BEGIN
   typedef  uint32_t  uint32;
   typedef  uint16_t  uint16;
   typedef  uint8_t   uint8;
-#endif
 
 
 class SpookyHash
@@ -313,4 +312,4 @@ private:
 
 DIAMONDCOMMONNAMESPACE_END
 
-
+#endif
@@ -25,9 +25,15 @@
 #include "common/Namespace.hh"
 #include "common/Logging.hh"
 #include "common/hash/map128.hh"
+#include "common/hash/spooky.hh"
 #include "common/kv/kv.hh"
 /*----------------------------------------------------------------------------*/
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -38,30 +44,628 @@
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
+const uint32_t kv::kItemMagic;
+const uint32_t kv::kTrailerMagic;
+const uint16_t kv::kFlagDeleted;
+
+static const size_t kAlign = 8;
+static const size_t kMaxRecord = 1024 * 1024 * 1024;
+static const uint64_t kSnapshotMagic = 0x6b76736e61703031ULL; // 'kvsnap01'
+static const uint64_t kCompactMinSize = 16 * 1024 * 1024;
+
+struct kv_snapshot_meta {
+  uint64_t magic;
+  uint64_t tail;
+  uint64_t used;
+  uint64_t slots;
+};
 
 /*----------------------------------------------------------------------------*/
 /**
+ * Software crc32c (Castagnoli)
  */
 /*----------------------------------------------------------------------------*/
+uint32_t
+kv::crc32c(uint32_t crc, const void* data, size_t length)
+{
+  static uint32_t table[256];
+  static bool init = [] () {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? ((c >> 1) ^ 0x82f63b78) : (c >> 1);
+      table[i] = c;
+    }
+    return true;
+  }();
+  (void) init;
+
+  const unsigned char* p = (const unsigned char*) data;
+  crc = ~crc;
+  while (length--)
+    crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
 
-kv::kv(std::string kvdevice, std::string indexdirectory, uint64_t keyspace)
+/*----------------------------------------------------------------------------*/
+/**
+ * Constructor
+ *
+ * @param kvdevice log file holding the records
+ * @param indexdirectory directory for the index snapshot - empty disables it
+ * @param keyspace expected number of keys - sizes the index
+ */
+/*----------------------------------------------------------------------------*/
+kv::kv(std::string kvdevice, std::string indexdirectory, uint64_t keyspace) :
+m_device(kvdevice), m_index_dir(indexdirectory), m_keyspace(keyspace), m_fd(-1), m_tail(0),
+m_index_mutex("kv::m_index_mutex", RWMutex::kReaderBiased)
 {
+  m_stat.n_set = m_stat.n_get = m_stat.n_del = 0;
+  m_stat.total_size = m_stat.used_size = 0;
+
+  uint64_t slots = 1024;
+  while (slots < (keyspace * 2))
+    slots <<= 1;
+  m_index.reset(new map128(slots, 0, true));
 }
 
+/*----------------------------------------------------------------------------*/
 kv::~kv()
 {
+  if (m_fd < 0)
+    return;
+
+  // a clean shutdown leaves an index snapshot matching the log
+  if (!Sync() && !m_index_dir.empty() && saveSnapshot())
+    diamond_static_err("kv failed to write index snapshot dir=%s", m_index_dir.c_str());
+  close(m_fd);
+}
+
+/*----------------------------------------------------------------------------*/
+__int128
+kv::hashKey(const std::string& key)
+{
+  uint64 h1 = 0x6b76;
+  uint64 h2 = 0x6469616d6f6e64ULL;
+  SpookyHash::Hash128(key.c_str(), key.length(), &h1, &h2);
+
+  __int128 hkey = h1;
+  hkey <<= 64;
+  hkey |= h2;
+  // the all-zero and all-one keys are reserved in the map
+  if ((hkey == 0) || (hkey == ~((__int128) 0)))
+    hkey ^= 1;
+  return hkey;
+}
+
+/*----------------------------------------------------------------------------*/
+__int128
+kv::location(uint64_t offset, uint64_t size)
+{
+  // never zero - the map reserves the zero value
+  __int128 loc = offset + 1;
+  loc <<= 64;
+  loc |= size;
+  return loc;
+}
+
+/*----------------------------------------------------------------------------*/
+size_t
+kv::encode(std::string& buffer, const std::string& key, const char* value, size_t length, uint16_t flags)
+{
+  size_t payload = key.length() + length;
+  size_t size = sizeof (kv_item_header_t) + ((payload + kAlign - 1) & ~(kAlign - 1)) + sizeof (kv_item_crc_t);
+  buffer.assign(size, 0);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  kv_item_header_t header;
+  memset(&header, 0, sizeof (header));
+  header.m_magic = kItemMagic;
+  header.m_ctime = ts.tv_sec;
+  header.m_ctime_ns = ts.tv_nsec;
+  header.m_size = size;
+  header.m_key_length = key.length();
+  header.m_flags = flags;
+  header.m_value_length = length;
+  header.m_crc32c = crc32c(crc32c(0, key.c_str(), key.length()), value, length);
+
+  char* ptr = &buffer[0];
+  memcpy(ptr, &header, sizeof (header));
+  memcpy(ptr + sizeof (header), key.c_str(), key.length());
+  if (length)
+    memcpy(ptr + sizeof (header) + key.length(), value, length);
+
+  kv_item_crc_t trailer;
+  trailer.m_crc32c = crc32c(0, &header, sizeof (header));
+  trailer.m_magic = kTrailerMagic;
+  memcpy(ptr + size - sizeof (trailer), &trailer, sizeof (trailer));
+  return size;
+}
+
+/*----------------------------------------------------------------------------*/
+bool
+kv::decode(const char* record, size_t available, kv_item_header_t& header)
+{
+  if (available < (sizeof (kv_item_header_t) + sizeof (kv_item_crc_t)))
+    return false;
+
+  memcpy(&header, record, sizeof (header));
+  if ((header.m_magic != kItemMagic) || (header.m_size > available) ||
+      (header.m_size < (sizeof (header) + header.m_key_length + header.m_value_length + sizeof (kv_item_crc_t))))
+    return false;
+
+  kv_item_crc_t trailer;
+  memcpy(&trailer, record + header.m_size - sizeof (trailer), sizeof (trailer));
+  if ((trailer.m_magic != kTrailerMagic) || (trailer.m_crc32c != crc32c(0, &header, sizeof (header))))
+    return false;
+
+  const char* payload = record + sizeof (header);
+  return (header.m_crc32c == crc32c(0, payload, header.m_key_length + header.m_value_length));
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::append(const std::string& key, const char* value, size_t length, uint16_t flags, uint64_t& offset, uint64_t& size)
+{
+  if (m_fd < 0)
+    return EBADF;
+  if ((key.length() > 0xffff) || ((key.length() + length) > kMaxRecord))
+    return EINVAL;
+
+  std::string buffer;
+  size = encode(buffer, key, value, length, flags);
+
+  // reserve the region - writers never wait for each other
+  offset = m_tail.fetch_add(size);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pwrite(m_fd, buffer.c_str() + done, size - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    done += n;
+  }
+  m_stat.total_size += size;
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Apply a log record to the index - the caller has exclusive access
+ */
+/*----------------------------------------------------------------------------*/
+void
+kv::updateIndex(const std::string& key, uint64_t offset, uint64_t size, bool deleted)
+{
+  __int128 hkey = hashKey(key);
+  uint64_t previous_size = (uint64_t) m_index->GetItem(hkey);
+
+  if (previous_size)
+    m_stat.used_size -= previous_size;
+  if (!deleted) {
+    m_stat.used_size += size;
+    m_index->SetItem(hkey, location(offset, size));
+  } else {
+    m_index->DeleteItem(hkey);
+  }
+
+  if (crowdedIndex())
+    m_index->Compact();
+}
+
+/*----------------------------------------------------------------------------*/
+bool
+kv::crowdedIndex()
+{
+  // probe sequences only end on free slots - tombstones make every miss longer
+  return m_index->GetDeletedCount() > (m_index->GetArraySize() / 4);
+}
+
+/*----------------------------------------------------------------------------*/
+void
+kv::rebuildIndex()
+{
+  RWMutexWriteLock lock(m_index_mutex);
+  if (!crowdedIndex())
+    return;
+
+  diamond_static_info("kv rebuilding index device=%s keys=%llu deleted=%llu", m_device.c_str(),
+                      (unsigned long long) m_index->GetItemCount(),
+                      (unsigned long long) m_index->GetDeletedCount());
+  m_index->Compact();
+}
+
+/*----------------------------------------------------------------------------*/
+bool
+kv::wastedLog(uint64_t ratio)
+{
+  uint64_t total = m_stat.total_size.load();
+  return (total > kCompactMinSize) && ((m_stat.used_size.load() * ratio) < total);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Compact the log while the store is in use - once three quarters of it are
+ * garbage, so the copies stay proportional to the records written
+ */
+/*----------------------------------------------------------------------------*/
+void
+kv::compactLog()
+{
+  RWMutexWriteLock lock(m_index_mutex);
+  if (!wastedLog(4))
+    return;
+
+  int rc = compact();
+  if (rc)
+    diamond_static_err("kv failed to compact device=%s errno=%d", m_device.c_str(), rc);
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::readRecord(uint64_t offset, uint64_t size, std::string& record)
+{
+  record.resize(size);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(m_fd, &record[done], size - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (!n)
+      return EIO;
+    done += n;
+  }
+  return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+int
+kv::Set(const std::string& key, const char* value, size_t length)
+{
+  __int128 hkey = hashKey(key);
+  {
+    // the shared lock keeps the log in place until the record is indexed
+    RWMutexReadLock lock(m_index_mutex);
+    uint64_t offset, size;
+    int rc = append(key, value, length, 0, offset, size);
+    if (rc)
+      return rc;
+
+    // concurrent sets of one key - the last index update wins
+    uint64_t previous_size = (uint64_t) m_index->GetItem(hkey);
+    if (!m_index->SetItem(hkey, location(offset, size)))
+      return ENOSPC;
+    if (previous_size)
+      m_stat.used_size -= previous_size;
+    m_stat.used_size += size;
+  }
+  m_stat.n_set++;
+
+  if (wastedLog(4))
+    compactLog();
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::Get(const std::string& key, std::string& value)
+{
+  m_stat.n_get++;
+  std::string record;
+  uint64_t offset;
+  {
+    // a compaction moves the records - hold it off until the read is done
+    RWMutexReadLock lock(m_index_mutex);
+    __int128 loc = m_index->GetItem(hashKey(key));
+    uint64_t size = (uint64_t) loc;
+    if (!size)
+      return ENOENT;
+    offset = (uint64_t) (loc >> 64) - 1;
+
+    int rc = readRecord(offset, size, record);
+    if (rc)
+      return rc;
+  }
+
+  kv_item_header_t header;
+  if (!decode(record.c_str(), record.size(), header)) {
+    diamond_static_err("kv corrupt record device=%s offset=%llu", m_device.c_str(), (unsigned long long) offset);
+    return EIO;
+  }
+
+  // a hash collision of two keys shows up as a key mismatch
+  if ((header.m_key_length != key.length()) ||
+      memcmp(record.c_str() + sizeof (header), key.c_str(), key.length()))
+    return ENOENT;
+
+  value.assign(record.c_str() + sizeof (header) + header.m_key_length, header.m_value_length);
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::Del(const std::string& key)
+{
+  __int128 hkey = hashKey(key);
+  bool crowded;
+  {
+    RWMutexReadLock lock(m_index_mutex);
+    uint64_t previous_size = (uint64_t) m_index->GetItem(hkey);
+    if (!previous_size)
+      return ENOENT;
+
+    uint64_t offset, size;
+    int rc = append(key, 0, 0, kFlagDeleted, offset, size);
+    if (rc)
+      return rc;
+    m_index->DeleteItem(hkey);
+    m_stat.used_size -= previous_size;
+    crowded = crowdedIndex();
+  }
+  m_stat.n_del++;
+
+  if (crowded)
+    rebuildIndex();
+  if (wastedLog(4))
+    compactLog();
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+bool
+kv::Has(const std::string& key)
+{
+  RWMutexReadLock lock(m_index_mutex);
+  return ((uint64_t) m_index->GetItem(hashKey(key))) != 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::Sync()
+{
+  RWMutexReadLock lock(m_index_mutex);
+  if (m_fd < 0)
+    return EBADF;
+  return fdatasync(m_fd) ? errno : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Rebuild the index from the log - cuts the log at the first bad record
+ */
+/*----------------------------------------------------------------------------*/
+int
+kv::scan()
+{
+  struct stat buf;
+  if (fstat(m_fd, &buf))
+    return errno;
+
+  const uint64_t kReadAhead = 4 * 1024 * 1024;
+  uint64_t end = buf.st_size;
+  uint64_t offset = 0;
+  uint64_t window_start = 0;
+  std::string window;
+
+  // make [offset, offset + n) available in the read-ahead window
+  auto fill = [&] (uint64_t n) -> const char* {
+    if ((offset + n) > end)
+      return 0;
+    if ((offset < window_start) || ((offset + n) > (window_start + window.size()))) {
+      window_start = offset;
+      if (readRecord(offset, std::min(end - offset, std::max(n, kReadAhead)), window))
+        return 0;
+    }
+    return window.c_str() + (offset - window_start);
+  };
+
+  m_stat.used_size = 0;
+  while (offset < end) {
+    kv_item_header_t header;
+    const char* record = fill(sizeof (header));
+    if (!record)
+      break;
+    memcpy(&header, record, sizeof (header));
+    if ((header.m_magic != kItemMagic) || (header.m_size > (kMaxRecord + 4096)) ||
+        !(record = fill(header.m_size)) || !decode(record, header.m_size, header))
+      break;
+
+    std::string key(record + sizeof (header), header.m_key_length);
+    updateIndex(key, offset, header.m_size, header.m_flags & kFlagDeleted);
+    offset += header.m_size;
+  }
+
+  if (offset < end) {
+    diamond_static_warning("kv cutting log device=%s at offset=%llu size=%llu", m_device.c_str(),
+                           (unsigned long long) offset, (unsigned long long) end);
+    if (ftruncate(m_fd, offset))
+      return errno;
+  }
+  m_tail = offset;
+  m_stat.total_size = offset;
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::saveSnapshot()
+{
+  std::string snapfile = m_index_dir + "/kv.index";
+  std::string metafile = snapfile + ".meta";
+
+  if (m_index->Snapshot(snapfile.c_str(), MS_SYNC))
+    return EIO;
+
+  kv_snapshot_meta meta;
+  meta.magic = kSnapshotMagic;
+  meta.tail = m_tail.load();
+  meta.used = m_stat.used_size.load();
+  meta.slots = m_index->GetArraySize();
+
+  int fd = open(metafile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+  int rc = ((write(fd, &meta, sizeof (meta)) != sizeof (meta)) || fsync(fd)) ? EIO : 0;
+  close(fd);
+  return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+kv::loadSnapshot()
+{
+  std::string snapfile = m_index_dir + "/kv.index";
+  std::string metafile = snapfile + ".meta";
+
+  kv_snapshot_meta meta;
+  int fd = open(metafile.c_str(), O_RDONLY);
+  if (fd < 0)
+    return ENOENT;
+  bool valid = (read(fd, &meta, sizeof (meta)) == sizeof (meta));
+  close(fd);
+  // the snapshot is only valid for the log it was taken of - drop it right away
+  unlink(metafile.c_str());
+
+  struct stat buf;
+  if (!valid || (meta.magic != kSnapshotMagic) || (meta.slots != m_index->GetArraySize()) ||
+      fstat(m_fd, &buf) || ((uint64_t) buf.st_size != meta.tail))
+    return EINVAL;
+
+  fd = open(snapfile.c_str(), O_RDONLY);
+  if (fd < 0)
+    return ENOENT;
+
+  typedef map128::Entry entry_t;
+  size_t length = sizeof (entry_t) * meta.slots;
+  void* mapping = (fstat(fd, &buf) || ((size_t) buf.st_size != length)) ? MAP_FAILED :
+    mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return EINVAL;
+
+  const entry_t* entries = (const entry_t*) mapping;
+  __int128 deleted = ~((__int128) 0);
+  for (uint64_t i = 0; i < meta.slots; i++) {
+    __int128 key, value;
+    memcpy(&key, &entries[i].key, sizeof (key));
+    memcpy(&value, &entries[i].value, sizeof (value));
+    if (key && (key != deleted) && value)
+      m_index->SetItem(key, value);
+  }
+  munmap(mapping, length);
+
+  m_tail = meta.tail;
+  m_stat.total_size = meta.tail;
+  m_stat.used_size = meta.used;
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Copy the live records into a new log and replace the old one - the caller
+ * has exclusive access
+ */
+/*----------------------------------------------------------------------------*/
+int
+kv::compact()
+{
+  std::string compactfile = m_device + ".compact";
+  int fd = open(compactfile.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  uint64_t offset = 0;
+  uint64_t out = 0;
+  uint64_t end = m_tail.load();
+  std::string record;
+  int rc = 0;
+
+  while (offset < end) {
+    kv_item_header_t header;
+    if ((rc = readRecord(offset, sizeof (header), record)))
+      break;
+    memcpy(&header, record.c_str(), sizeof (header));
+    if ((rc = readRecord(offset, header.m_size, record)))
+      break;
+
+    if (!(header.m_flags & kFlagDeleted)) {
+      std::string key(record.c_str() + sizeof (header), header.m_key_length);
+      __int128 loc = m_index->GetItem(hashKey(key));
+      // only the latest record of a key is live
+      if (((uint64_t) loc == header.m_size) && (((uint64_t) (loc >> 64) - 1) == offset)) {
+        if (pwrite(fd, record.c_str(), record.size(), out) != (ssize_t) record.size()) {
+          rc = errno ? errno : EIO;
+          break;
+        }
+        out += record.size();
+      }
+    }
+    offset += header.m_size;
+  }
+
+  if (!rc && fsync(fd))
+    rc = errno;
+  if (!rc && rename(compactfile.c_str(), m_device.c_str()))
+    rc = errno;
+  if (rc) {
+    close(fd);
+    unlink(compactfile.c_str());
+    return rc;
+  }
+
+  diamond_static_info("kv compacted device=%s size=%llu => %llu", m_device.c_str(),
+                      (unsigned long long) end, (unsigned long long) out);
+  close(m_fd);
+  m_fd = fd;
+  m_index->Clear();
+  return scan();
+}
+
+/*----------------------------------------------------------------------------*/
 int 
 kv::Init()
 {
-  return 0;
+  m_fd = open(m_device.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (m_fd < 0)
+    return errno;
+
+  int rc = ENOENT;
+  if (!m_index_dir.empty())
+    rc = loadSnapshot();
+  if (rc)
+    rc = scan();
+  if (rc)
+    return rc;
+
+  if (wastedLog(2))
+    rc = compact();
+
+  diamond_static_info("kv device=%s size=%llu used=%llu keys<=%llu", m_device.c_str(),
+                      (unsigned long long) m_stat.total_size.load(),
+                      (unsigned long long) m_stat.used_size.load(),
+                      (unsigned long long) m_keyspace);
+  return rc;
 }
 
-void Status(std::ostream& os)
+/*----------------------------------------------------------------------------*/
+void
+kv::Status(std::ostream& os)
 {
+  os << "kv.device=" << m_device
+    << " n_set=" << m_stat.n_set.load()
+    << " n_get=" << m_stat.n_get.load()
+    << " n_del=" << m_stat.n_del.load()
+    << " total_size=" << m_stat.total_size.load()
+    << " used_size=" << m_stat.used_size.load()
+    << "\n";
 }
 
 /*----------------------------------------------------------------------------*/
 DIAMONDCOMMONNAMESPACE_END
-
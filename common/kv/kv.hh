@@ -27,7 +27,20 @@
  *
  * @brief  Class implementing a lock free kv store
  *
+ * Items are appended to a log file - writers reserve their region with an
+ * atomic fetch-add on the log tail and write it with a single pwrite, so
+ * concurrent Set/Del calls never wait for each other. A map128 indexes the
+ * 128-bit hash of every key with the offset and size of its latest record.
+ * Deleted keys free their index slot - once the tombstones left in the probe
+ * sequences take a quarter of the index, it is rebuilt in place. Appends,
+ * reads and index accesses share a reader-biased lock which only the index
+ * rebuild and the log compaction take exclusively.
  *
+ * Init rebuilds the index from an index snapshot in the index directory when
+ * the daemon was shut down cleanly, otherwise by scanning the log - the scan
+ * stops at the first torn or corrupt record and cuts the log there. Live
+ * records are copied into a new log when more than half of it is garbage at
+ * Init, and when three quarters are garbage while the store is in use.
  */
 
 
@@ -36,19 +49,61 @@
 
 #include "common/Namespace.hh"
 #include "common/BufferPtrLockFree.hh"
+#include "common/RWMutex.hh"
+#include "common/hash/map128.hh"
 #include <sys/mman.h>
 #include <stdint.h>
 #include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
 
 DIAMONDCOMMONNAMESPACE_BEGIN
 
 class kv {
 public:
+  static const uint32_t kItemMagic = 0x6b766931;  //< 'kvi1'
+  static const uint32_t kTrailerMagic = 0x6b766965;  //< 'kvie'
+  static const uint16_t kFlagDeleted = 0x1;
+
   kv(std::string kvdevice, std::string indexdirectory, uint64_t keyspace);
   ~kv();
 
+  // ---------------------------------------------------------------------------
+  //! Open the log and build the index - returns 0 or an errno
+  // ---------------------------------------------------------------------------
   int Init();
 
+  // ---------------------------------------------------------------------------
+  //! Store a value - returns 0 or an errno (ENOSPC when the index is full)
+  // ---------------------------------------------------------------------------
+  int Set(const std::string& key, const char* value, size_t length);
+
+  int Set(const std::string& key, const std::string& value)
+  {
+    return Set(key, value.c_str(), value.length());
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Retrieve a value - returns 0, ENOENT or EIO for a corrupt record
+  // ---------------------------------------------------------------------------
+  int Get(const std::string& key, std::string& value);
+
+  // ---------------------------------------------------------------------------
+  //! Remove a key - returns 0 or ENOENT
+  // ---------------------------------------------------------------------------
+  int Del(const std::string& key);
+
+  // ---------------------------------------------------------------------------
+  //! Check a key without reading the log
+  // ---------------------------------------------------------------------------
+  bool Has(const std::string& key);
+
+  // ---------------------------------------------------------------------------
+  //! Make all records written so far durable
+  // ---------------------------------------------------------------------------
+  int Sync();
+
   void Status(std::ostream& os);
 
   typedef struct kv_stat 
@@ -56,8 +111,8 @@ public:
     std::atomic<uint64_t> n_set;
     std::atomic<uint64_t> n_get;
     std::atomic<uint64_t> n_del;
-    std::atomic<uint64_t> total_size;
-    std::atomic<uint64_t> used_size;
+    std::atomic<uint64_t> total_size;   //< bytes in the log
+    std::atomic<uint64_t> used_size;    //< bytes of live records
   } kv_stat_t;
 
   kv_stat_t m_stat;
@@ -66,8 +121,8 @@ public:
     uint32_t m_magic;
     uint32_t m_ctime;
     uint32_t m_ctime_ns;
-    uint32_t m_crc32c;
-    uint32_t m_size;
+    uint32_t m_crc32c;        //< crc32c of key and value
+    uint32_t m_size;          //< size of the whole record including padding
     uint16_t m_key_length;
     uint16_t m_flags;
     uint32_t m_value_length;
@@ -80,7 +135,7 @@ public:
   } kv_item_offsets_t;
   
   typedef struct kv_item_trailer {
-    uint32_t m_crc32c;
+    uint32_t m_crc32c;        //< crc32c of the header
     uint32_t m_magic;
   } kv_item_crc_t;
 
@@ -96,7 +151,39 @@ public:
     BufferPtrLockFree m_dec_buf;
   };
 
+  static uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
 private:
+  static __int128 hashKey(const std::string& key);
+  static __int128 location(uint64_t offset, uint64_t size);
+
+  // build a record in buffer - returns its size
+  static size_t encode(std::string& buffer, const std::string& key, const char* value, size_t length, uint16_t flags);
+  // validate a record - fills the header and returns false if it is torn or corrupt
+  static bool decode(const char* record, size_t available, kv_item_header_t& header);
+
+  int append(const std::string& key, const char* value, size_t length, uint16_t flags, uint64_t& offset, uint64_t& size);
+  int readRecord(uint64_t offset, uint64_t size, std::string& record);
+  void updateIndex(const std::string& key, uint64_t offset, uint64_t size, bool deleted);
+  // drop the tombstones once they take a quarter of the index
+  void rebuildIndex();
+  bool crowdedIndex();
+
+  int scan();
+  int loadSnapshot();
+  int saveSnapshot();
+  int compact();
+  // more than (ratio-1)/ratio of a log beyond the minimum size is garbage
+  bool wastedLog(uint64_t ratio);
+  void compactLog();
+
+  std::string m_device;
+  std::string m_index_dir;
+  uint64_t m_keyspace;
+  int m_fd;
+  std::atomic<uint64_t> m_tail;
+  std::unique_ptr<map128> m_index;
+  RWMutex m_index_mutex;
 };
 
 DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,740 @@
+// ----------------------------------------------------------------------
+// File: diamondbench.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   diamondbench.cc
+ *
+ * @brief  Benchmark of the diamondfs op handlers without a mount
+ *
+ * The handlers are called in process with replies disabled, so the numbers
+ * are the cost of the filesystem itself without the kernel round trip.
+ * Every workload runs once per configured thread count; the throughput is
+ * taken from the wall time of the timed phase and the latencies from the
+ * op statistics of the handlers. Results are written as JSON, a summary
+ * table goes to stderr.
+ */
+
+#include "diamondfs.hh"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using diamond::common::Clock;
+using diamond::common::Histogram;
+
+struct Options {
+  std::vector<unsigned> threads;
+  std::vector<std::string> workloads;
+  uint64_t ops;         //< iterations per thread of the op loops
+  uint64_t filesize;    //< file per thread of the I/O workloads
+  uint64_t blocksize;   //< sequential I/O
+  uint64_t iosize;      //< random I/O
+  uint64_t entries;     //< entries of the readdir directory
+  uint64_t bufsize;     //< readdir buffer
+  uint64_t passes;      //< readdir passes per thread
+  uint64_t xattrs;      //< attributes kept on the xattr files
+  std::string output;
+
+  Options () : ops(10000), filesize(64 * 1024 * 1024), blocksize(128 * 1024), iosize(4096),
+  entries(100000), bufsize(4096), passes(1), xattrs(16) { }
+};
+
+//------------------------------------------------------------------------------
+//! State shared by all threads of a workload - the readdir directory is built
+//! once and kept for all thread counts
+//------------------------------------------------------------------------------
+struct Context {
+  Options opt;
+  fuse_ino_t shared;
+  fuse_ino_t bigdir;
+  std::vector<off_t> pages[2];  //< readdir cursor of every buffer of a listing, [plus]
+  Context () : shared(0), bigdir(0) { }
+};
+
+struct ThreadState {
+  unsigned t;
+  unsigned threads;
+  fuse_ino_t dir;
+  fuse_ino_t file;
+  struct fuse_file_info fi;
+  std::vector<char> buffer;
+  uint64_t seed;
+  uint64_t bytes;   //< data moved in the timed phase
+};
+
+typedef void (*Setup) (Context& ctx);
+typedef void (*Step) (Context& ctx, ThreadState& s);
+
+struct Workload {
+  const char* name;
+  Setup setup;      //< main thread before the threads start
+  Step prepare;     //< every thread before the timed phase
+  Step run;         //< the timed phase
+  Step cleanup;     //< main thread after the timed phase
+};
+
+struct Result {
+  std::string workload;
+  unsigned threads;
+  double seconds;
+  uint64_t ops;
+  uint64_t bytes;
+  std::vector<Histogram> latency;  //< per op of the timed phase
+  std::vector<uint64_t> max;       //< per op, bounded by the highest bucket
+};
+
+static void
+usage ()
+{
+  fprintf(stderr, "usage: diamondbench [-t <threads>] [-w <workloads>] [-n <ops>] [-s <file size>] [-b <block size>]\n"
+          "                    [-r <io size>] [-e <entries>] [-d <readdir size>] [-p <passes>] [-x <xattrs>] [-o <json file>]\n"
+          "       -t : comma separated thread counts to run every workload with (default 1,2,4,... up to the cores)\n"
+          "       -w : comma separated workloads (default all):\n"
+          "            metadata    - mkdir/lookup/getattr/create/setattr/release/rename/unlink/rmdir in a directory per thread\n"
+          "            shared      - the metadata loop with all threads in one directory\n"
+          "            seqwrite    - write a file per thread sequentially with the block size\n"
+          "            seqread     - read a file per thread sequentially with the block size\n"
+          "            randwrite   - write random aligned io size blocks of a file per thread\n"
+          "            randread    - read random aligned io size blocks of a file per thread\n"
+          "            readdir     - list a directory of <entries> entries with readdir\n"
+          "            readdirplus - list a directory of <entries> entries with readdirplus\n"
+          "            xattr       - set/get/list/remove extended attributes of a file per thread\n"
+          "       -n : iterations per thread of the metadata, random I/O and xattr loops (default 10000)\n"
+          "       -s : file size per thread of the I/O workloads (default 64M)\n"
+          "       -b : block size of the sequential I/O (default 128K)\n"
+          "       -r : block size of the random I/O (default 4K)\n"
+          "       -e : entries of the readdir directory (default 100K)\n"
+          "       -d : readdir buffer size (default 4K)\n"
+          "       -p : readdir passes per thread (default 1)\n"
+          "       -x : attributes kept on every xattr file (default 16)\n"
+          "       -o : write the JSON results to a file instead of stdout\n");
+}
+
+static void
+fatal (const char* what, const char* name)
+{
+  fprintf(stderr, "error: %s failed for '%s'\n", what, name);
+  exit(EIO);
+}
+
+//------------------------------------------------------------------------------
+//! Inode of a name - the handlers do not reply, the name index answers
+//------------------------------------------------------------------------------
+static fuse_ino_t
+resolve (fuse_ino_t parent, const char* name)
+{
+  diamond_ino_t ino;
+  if (!diamondfs::FS->findName(DIAMOND_INODE(parent), name, ino))
+    fatal("lookup", name);
+  return DIAMOND_TO_INODE(ino);
+}
+
+static fuse_ino_t
+makeDir (fuse_ino_t parent, const char* name)
+{
+  diamondfs::mkdir(0, parent, name, S_IRWXU);
+  return resolve(parent, name);
+}
+
+static fuse_ino_t
+createFile (fuse_ino_t parent, const char* name, struct fuse_file_info& fi)
+{
+  memset(&fi, 0, sizeof (fi));
+  diamondfs::create(0, parent, name, S_IRUSR | S_IWUSR, &fi);
+  if (!fi.fh)
+    fatal("create", name);
+  return DIAMOND_TO_INODE((*(diamondCache::diamondFilePtr*) fi.fh)->getIno());
+}
+
+static inline uint64_t
+nextRandom (uint64_t& seed)
+{
+  // xorshift64*
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return seed * 2685821657736338717ull;
+}
+
+static std::string
+threadName (const char* prefix, unsigned t)
+{
+  return std::string(prefix) + "." + std::to_string(t);
+}
+
+//------------------------------------------------------------------------------
+// metadata storm
+//------------------------------------------------------------------------------
+static void
+metaLoop (Context& ctx, ThreadState& s)
+{
+  char name[64];
+  for (uint64_t i = 0; i < ctx.opt.ops; i++) {
+    snprintf(name, sizeof (name), "d.%u.%llu", s.t, (unsigned long long) i);
+    diamondfs::mkdir(0, s.dir, name, S_IRWXU);
+    diamondfs::lookup(0, s.dir, name);
+    fuse_ino_t d = resolve(s.dir, name);
+    diamondfs::getattr(0, d, 0);
+
+    struct fuse_file_info fi;
+    fuse_ino_t f = createFile(d, "f", fi);
+    struct stat attr;
+    memset(&attr, 0, sizeof (attr));
+    attr.st_mode = S_IFREG | S_IRUSR;
+    diamondfs::setattr(0, f, &attr, FUSE_SET_ATTR_MODE, &fi);
+    diamondfs::release(0, f, &fi);
+    diamondfs::rename(0, d, "f", d, "g");
+    diamondfs::unlink(0, d, "g");
+    diamondfs::rmdir(0, s.dir, name);
+  }
+}
+
+static void
+metaPrepare (Context& ctx, ThreadState& s)
+{
+  s.dir = makeDir(FUSE_ROOT_ID, threadName("metadata", s.t).c_str());
+}
+
+static void
+metaCleanup (Context& ctx, ThreadState& s)
+{
+  diamondfs::rmdir(0, FUSE_ROOT_ID, threadName("metadata", s.t).c_str());
+}
+
+static void
+sharedSetup (Context& ctx)
+{
+  if (!ctx.shared)
+    ctx.shared = makeDir(FUSE_ROOT_ID, "shared");
+}
+
+static void
+sharedPrepare (Context& ctx, ThreadState& s)
+{
+  s.dir = ctx.shared;
+}
+
+//------------------------------------------------------------------------------
+// file I/O
+//------------------------------------------------------------------------------
+static void
+fileFill (Context& ctx, ThreadState& s)
+{
+  for (uint64_t off = 0; off < ctx.opt.filesize; off += s.buffer.size())
+    diamondfs::write(0, s.file, &s.buffer[0], std::min<uint64_t>(s.buffer.size(), ctx.opt.filesize - off), off, &s.fi);
+}
+
+static void
+fileOpen (Context& ctx, ThreadState& s, size_t block, bool fill)
+{
+  s.file = createFile(FUSE_ROOT_ID, threadName("io", s.t).c_str(), s.fi);
+  s.buffer.assign(block, (char) ('a' + s.t % 26));
+  s.seed = 0x9e3779b97f4a7c15ull * (s.t + 1);
+  if (fill)
+    fileFill(ctx, s);
+}
+
+static void
+seqWritePrepare (Context& ctx, ThreadState& s)
+{
+  fileOpen(ctx, s, ctx.opt.blocksize, false);
+}
+
+static void
+seqReadPrepare (Context& ctx, ThreadState& s)
+{
+  fileOpen(ctx, s, ctx.opt.blocksize, true);
+}
+
+static void
+randPrepare (Context& ctx, ThreadState& s)
+{
+  fileOpen(ctx, s, ctx.opt.iosize, true);
+}
+
+static void
+seqWrite (Context& ctx, ThreadState& s)
+{
+  fileFill(ctx, s);
+  s.bytes = ctx.opt.filesize;
+}
+
+static void
+seqRead (Context& ctx, ThreadState& s)
+{
+  for (uint64_t off = 0; off < ctx.opt.filesize; off += ctx.opt.blocksize)
+    diamondfs::read(0, s.file, ctx.opt.blocksize, off, &s.fi);
+  s.bytes = ctx.opt.filesize;
+}
+
+static void
+randWrite (Context& ctx, ThreadState& s)
+{
+  uint64_t blocks = std::max<uint64_t>(1, ctx.opt.filesize / ctx.opt.iosize);
+  for (uint64_t i = 0; i < ctx.opt.ops; i++)
+    diamondfs::write(0, s.file, &s.buffer[0], ctx.opt.iosize, (nextRandom(s.seed) % blocks) * ctx.opt.iosize, &s.fi);
+  s.bytes = ctx.opt.ops * ctx.opt.iosize;
+}
+
+static void
+randRead (Context& ctx, ThreadState& s)
+{
+  uint64_t blocks = std::max<uint64_t>(1, ctx.opt.filesize / ctx.opt.iosize);
+  for (uint64_t i = 0; i < ctx.opt.ops; i++)
+    diamondfs::read(0, s.file, ctx.opt.iosize, (nextRandom(s.seed) % blocks) * ctx.opt.iosize, &s.fi);
+  s.bytes = ctx.opt.ops * ctx.opt.iosize;
+}
+
+static void
+fileCleanup (Context& ctx, ThreadState& s)
+{
+  diamondfs::release(0, s.file, &s.fi);
+  diamondfs::unlink(0, FUSE_ROOT_ID, threadName("io", s.t).c_str());
+}
+
+//------------------------------------------------------------------------------
+// readdir on a huge directory
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+//! Cursor of every buffer a full listing returns - the sizes are computed the
+//! way dir_fill packs the entries
+//------------------------------------------------------------------------------
+static void
+dirPages (Context& ctx, bool plus)
+{
+  diamondCache::diamondDirPtr dir = diamondfs::FS->getDir(DIAMOND_INODE(ctx.bigdir), false, false);
+  std::vector<off_t>& pages = ctx.pages[plus];
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof (e));
+
+  size_t size = ctx.opt.bufsize;
+  size_t used = diamondfs::dir_add(0, NULL, 0, ".", e, 1, plus) +
+    diamondfs::dir_add(0, NULL, 0, "..", e, diamondfs::kDirCursorOffset, plus);
+  uint64_t next = 0;
+  std::string name;
+  diamond_ino_t child;
+
+  pages.assign(1, 0);
+  diamond::common::RWMutexReadLock dLock(dir->Locker());
+  while (dir->nextEntry(next, name, child)) {
+    off_t off = next + diamondfs::kDirCursorOffset;
+    size_t len = diamondfs::dir_add(0, NULL, 0, name.c_str(), e, off, plus);
+    if (used + len > size) {
+      // the entry starts the next buffer - resume at its own sequence
+      pages.push_back(off - 1);
+      used = 0;
+    }
+    used += len;
+  }
+  // the final call returns the empty buffer
+  pages.push_back(next + diamondfs::kDirCursorOffset);
+}
+
+static void
+dirSetup (Context& ctx)
+{
+  if (ctx.bigdir)
+    return;
+
+  ctx.bigdir = makeDir(FUSE_ROOT_ID, "readdir");
+  char name[64];
+  for (uint64_t i = 0; i < ctx.opt.entries; i++) {
+    struct fuse_file_info fi;
+    snprintf(name, sizeof (name), "entry.%llu", (unsigned long long) i);
+    fuse_ino_t f = createFile(ctx.bigdir, name, fi);
+    diamondfs::release(0, f, &fi);
+  }
+  dirPages(ctx, false);
+  dirPages(ctx, true);
+}
+
+static void
+dirList (Context& ctx, ThreadState& s, bool plus)
+{
+  std::vector<off_t>& pages = ctx.pages[plus];
+  for (uint64_t p = 0; p < ctx.opt.passes; p++) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof (fi));
+    diamondfs::opendir(0, ctx.bigdir, &fi);
+    for (size_t i = 0; i < pages.size(); i++) {
+      if (plus)
+	diamondfs::readdirplus(0, ctx.bigdir, ctx.opt.bufsize, pages[i], &fi);
+      else
+	diamondfs::readdir(0, ctx.bigdir, ctx.opt.bufsize, pages[i], &fi);
+    }
+    diamondfs::releasedir(0, ctx.bigdir, &fi);
+  }
+}
+
+static void
+dirRead (Context& ctx, ThreadState& s)
+{
+  dirList(ctx, s, false);
+}
+
+static void
+dirReadPlus (Context& ctx, ThreadState& s)
+{
+  dirList(ctx, s, true);
+}
+
+//------------------------------------------------------------------------------
+// xattr churn
+//------------------------------------------------------------------------------
+static void
+xattrPrepare (Context& ctx, ThreadState& s)
+{
+  s.file = createFile(FUSE_ROOT_ID, threadName("xattr", s.t).c_str(), s.fi);
+  s.buffer.assign(64, 'v');
+  for (uint64_t i = 0; i < ctx.opt.xattrs; i++) {
+    std::string key = "user.key." + std::to_string(i);
+#ifdef __APPLE__
+    diamondfs::setxattr(0, s.file, key.c_str(), &s.buffer[0], s.buffer.size(), 0, 0);
+#else
+    diamondfs::setxattr(0, s.file, key.c_str(), &s.buffer[0], s.buffer.size(), 0);
+#endif
+  }
+}
+
+static void
+xattrLoop (Context& ctx, ThreadState& s)
+{
+  char key[64];
+  char churn[64];
+  uint64_t keys = std::max<uint64_t>(1, ctx.opt.xattrs);
+  for (uint64_t i = 0; i < ctx.opt.ops; i++) {
+    snprintf(key, sizeof (key), "user.key.%llu", (unsigned long long) (i % keys));
+    snprintf(churn, sizeof (churn), "user.churn.%llu", (unsigned long long) (i % keys));
+#ifdef __APPLE__
+    diamondfs::setxattr(0, s.file, churn, &s.buffer[0], s.buffer.size(), 0, 0);
+    diamondfs::getxattr(0, s.file, key, 4096, 0);
+#else
+    diamondfs::setxattr(0, s.file, churn, &s.buffer[0], s.buffer.size(), 0);
+    diamondfs::getxattr(0, s.file, key, 4096);
+#endif
+    diamondfs::listxattr(0, s.file, 4096);
+    diamondfs::removexattr(0, s.file, churn);
+  }
+}
+
+static void
+xattrCleanup (Context& ctx, ThreadState& s)
+{
+  diamondfs::release(0, s.file, &s.fi);
+  diamondfs::unlink(0, FUSE_ROOT_ID, threadName("xattr", s.t).c_str());
+}
+
+static const Workload kWorkloads[] = {
+  {"metadata", 0, metaPrepare, metaLoop, metaCleanup},
+  {"shared", sharedSetup, sharedPrepare, metaLoop, 0},
+  {"seqwrite", 0, seqWritePrepare, seqWrite, fileCleanup},
+  {"seqread", 0, seqReadPrepare, seqRead, fileCleanup},
+  {"randwrite", 0, randPrepare, randWrite, fileCleanup},
+  {"randread", 0, randPrepare, randRead, fileCleanup},
+  {"readdir", dirSetup, 0, dirRead, 0},
+  {"readdirplus", dirSetup, 0, dirReadPlus, 0},
+  {"xattr", 0, xattrPrepare, xattrLoop, xattrCleanup},
+  {0, 0, 0, 0, 0}
+};
+
+//------------------------------------------------------------------------------
+//! Run one workload - the op statistics before and after the timed phase
+//! give its latencies
+//------------------------------------------------------------------------------
+static Result
+runWorkload (Context& ctx, const Workload& w, unsigned threads)
+{
+  std::vector<ThreadState> state(threads);
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned ready = 0;
+  bool go = false;
+
+  if (w.setup)
+    w.setup(ctx);
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    ThreadState& s = state[t];
+    memset(&s.fi, 0, sizeof (s.fi));
+    s.t = t;
+    s.threads = threads;
+    s.dir = s.file = 0;
+    s.seed = 0;
+    s.bytes = 0;
+    workers.push_back(std::thread([&, t] () {
+      if (w.prepare)
+	w.prepare(ctx, state[t]);
+      std::unique_lock<std::mutex> lock(mutex);
+      ready++;
+      cv.notify_all();
+      cv.wait(lock, [&] () { return go; });
+      lock.unlock();
+      w.run(ctx, state[t]);
+    }));
+  }
+
+  std::vector<Histogram> before, after;
+  uint64_t start;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] () { return ready == threads; });
+    diamondfs::op_stats().Collect(before);
+    start = Clock::Monotonic();
+    go = true;
+  }
+  cv.notify_all();
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+  uint64_t stop = Clock::Monotonic();
+
+  // exited threads are folded into the totals
+  diamondfs::op_stats().Collect(after);
+
+  Result r;
+  r.workload = w.name;
+  r.threads = threads;
+  r.seconds = (stop - start) / 1000000000.0;
+  r.ops = 0;
+  r.bytes = 0;
+  r.latency = after;
+  r.max.assign(after.size(), 0);
+  for (size_t op = 0; op < after.size(); op++) {
+    if (op < before.size())
+      r.latency[op].Sub(before[op]);
+    r.ops += r.latency[op].count;
+    for (size_t b = Histogram::kBuckets; b-- > 0;) {
+      if (r.latency[op].buckets[b]) {
+	r.max[op] = std::min(Histogram::BucketMax(b), after[op].max);
+	break;
+      }
+    }
+  }
+  for (unsigned t = 0; t < threads; t++)
+    r.bytes += state[t].bytes;
+
+  if (w.cleanup) {
+    for (unsigned t = 0; t < threads; t++)
+      w.cleanup(ctx, state[t]);
+  }
+  return r;
+}
+
+static void
+teardown (Context& ctx)
+{
+  if (ctx.shared)
+    diamondfs::rmdir(0, FUSE_ROOT_ID, "shared");
+
+  if (ctx.bigdir) {
+    char name[64];
+    for (uint64_t i = 0; i < ctx.opt.entries; i++) {
+      snprintf(name, sizeof (name), "entry.%llu", (unsigned long long) i);
+      diamondfs::unlink(0, ctx.bigdir, name);
+    }
+    diamondfs::rmdir(0, FUSE_ROOT_ID, "readdir");
+  }
+}
+
+static void
+writeJson (FILE* out, const Context& ctx, const std::vector<Result>& results)
+{
+  char host[256] = "";
+  gethostname(host, sizeof (host) - 1);
+  const Options& o = ctx.opt;
+
+  fprintf(out, "{\n  \"benchmark\": \"diamondbench\",\n  \"host\": \"%s\",\n  \"cores\": %u,\n"
+          "  \"clock\": \"%s\",\n", host, std::thread::hardware_concurrency(), Clock::IsTsc() ? "tsc" : "monotonic");
+  fprintf(out, "  \"config\": {\"ops\": %llu, \"filesize\": %llu, \"blocksize\": %llu, \"iosize\": %llu, "
+          "\"entries\": %llu, \"bufsize\": %llu, \"passes\": %llu, \"xattrs\": %llu},\n",
+          (unsigned long long) o.ops, (unsigned long long) o.filesize, (unsigned long long) o.blocksize,
+          (unsigned long long) o.iosize, (unsigned long long) o.entries, (unsigned long long) o.bufsize,
+          (unsigned long long) o.passes, (unsigned long long) o.xattrs);
+  fprintf(out, "  \"results\": [");
+
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& r = results[i];
+    double secs = (r.seconds > 0) ? r.seconds : 1e-9;
+    fprintf(out, "%s\n    {\"workload\": \"%s\", \"threads\": %u, \"seconds\": %.6f, \"ops\": %llu, "
+            "\"ops_per_s\": %.1f, \"bytes\": %llu, \"mb_per_s\": %.1f,\n     \"latency_us\": {",
+            i ? "," : "", r.workload.c_str(), r.threads, r.seconds, (unsigned long long) r.ops,
+            r.ops / secs, (unsigned long long) r.bytes, r.bytes / secs / (1024 * 1024));
+
+    bool first = true;
+    for (size_t op = 0; op < r.latency.size(); op++) {
+      const Histogram& h = r.latency[op];
+      if (!h.count)
+	continue;
+      fprintf(out, "%s\n       \"%s\": {\"count\": %llu, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+              "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+              first ? "" : ",", diamondfs::op_names[op], (unsigned long long) h.count,
+              h.sum / 1000.0 / h.count, h.Percentile(0.5) / 1000.0, h.Percentile(0.9) / 1000.0,
+              h.Percentile(0.99) / 1000.0, h.Percentile(0.999) / 1000.0, r.max[op] / 1000.0);
+      first = false;
+    }
+    fprintf(out, "%s}}", first ? "" : "\n     ");
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+template <typename T, typename P>
+static bool
+parseList (const char* arg, std::vector<T>& out, P parse)
+{
+  out.clear();
+  std::string list = arg;
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    if (end > pos) {
+      T v;
+      if (!parse(list.substr(pos, end - pos), v))
+	return false;
+      out.push_back(v);
+    }
+    pos = end + 1;
+  }
+  return !out.empty();
+}
+
+int
+main (int argc, char* argv[])
+{
+  Context ctx;
+  Options& o = ctx.opt;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:w:n:s:b:r:e:d:p:x:o:h")) != -1) {
+    bool ok = true;
+    switch (opt) {
+    case 't':
+      ok = parseList(optarg, o.threads, [] (const std::string& s, unsigned& v) {
+	v = atoi(s.c_str());
+	return v > 0;
+      });
+      break;
+    case 'w':
+      ok = parseList(optarg, o.workloads, [] (const std::string& s, std::string& v) {
+	v = s;
+	for (const Workload* w = kWorkloads; w->name; w++)
+	  if (s == w->name)
+	    return true;
+	return false;
+      });
+      break;
+    case 'n':
+      ok = (o.ops = diamondCapacity::parseSize(optarg));
+      break;
+    case 's':
+      ok = (o.filesize = diamondCapacity::parseSize(optarg));
+      break;
+    case 'b':
+      ok = (o.blocksize = diamondCapacity::parseSize(optarg));
+      break;
+    case 'r':
+      ok = (o.iosize = diamondCapacity::parseSize(optarg));
+      break;
+    case 'e':
+      ok = (o.entries = diamondCapacity::parseSize(optarg));
+      break;
+    case 'd':
+      ok = (o.bufsize = diamondCapacity::parseSize(optarg));
+      break;
+    case 'p':
+      ok = (o.passes = diamondCapacity::parseSize(optarg));
+      break;
+    case 'x':
+      ok = (o.xattrs = diamondCapacity::parseSize(optarg));
+      break;
+    case 'o':
+      o.output = optarg;
+      break;
+    default:
+      ok = false;
+    }
+    if (!ok) {
+      usage();
+      return EINVAL;
+    }
+  }
+
+  if (optind < argc) {
+    usage();
+    return EINVAL;
+  }
+
+  if (o.threads.empty()) {
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned t = 1; t < cores; t *= 2)
+      o.threads.push_back(t);
+    o.threads.push_back(cores);
+  }
+
+  if (o.workloads.empty()) {
+    for (const Workload* w = kWorkloads; w->name; w++)
+      o.workloads.push_back(w->name);
+  }
+
+  FILE* out = stdout;
+  if (!o.output.empty() && !(out = fopen(o.output.c_str(), "w"))) {
+    fprintf(stderr, "error: cannot open %s errno=%d\n", o.output.c_str(), errno);
+    return errno;
+  }
+
+  diamond::common::Logging::Init();
+  diamond::common::Logging::SetUnit("FUSE/DiamondBench");
+  diamond::common::Logging::gShortFormat = true;
+  diamond::common::Logging::SetLogPriority(LOG_WARNING);
+  diamondCapacity::setLimits(0, 0);
+  Clock::Calibrate();
+
+  diamondfs fs;
+  fs.makeRoot();
+  diamondfs::fuse_do_reply = 0;
+
+  std::vector<Result> results;
+  fprintf(stderr, "%-12s %7s %10s %12s %10s %10s\n", "workload", "threads", "seconds", "ops/s", "MB/s", "us/op");
+  for (size_t i = 0; i < o.workloads.size(); i++) {
+    const Workload* w = kWorkloads;
+    while (o.workloads[i] != w->name)
+      w++;
+
+    for (size_t t = 0; t < o.threads.size(); t++) {
+      results.push_back(runWorkload(ctx, *w, o.threads[t]));
+      const Result& r = results.back();
+      double secs = (r.seconds > 0) ? r.seconds : 1e-9;
+      fprintf(stderr, "%-12s %7u %10.3f %12.0f %10.1f %10.3f\n", r.workload.c_str(), r.threads, r.seconds,
+              r.ops / secs, r.bytes / secs / (1024 * 1024), r.ops ? secs * 1000000.0 * r.threads / r.ops : 0.0);
+    }
+  }
+
+  teardown(ctx);
+  writeJson(out, ctx, results);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
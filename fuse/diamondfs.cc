@@ -1,1124 +1,295 @@
-#include "llfusexx.h"
-#include <iostream>
-#include <cstring>
-#include <cerrno>
-#include <cassert>
-#include <cstdio>
+#include "diamondfs.hh"
 
-#include "common/Logging.hh"
-#include "common/Timing.hh"
-#include "rio/diamondCache.hh"
-#include <sys/statvfs.h>
-
-struct statvfs stat_fs;
-
-//------------------------------------------------------------------------------
-//! Curiously recurring templates....
-//!
-//!   g++ -Wall `pkg-config fuse --cflags --libs` os.cpp -o os
-//------------------------------------------------------------------------------
-
-using namespace diamond::rio;
-
-class diamondfs : public llfusexx::fs<diamondfs> , public diamond::rio::diamondCache
+int
+main (int argc, char *argv[])
 {
-private:
+  //----------------------------------------------------------------------------
+  //! Runs the daemon at the mountpoint specified in argv and with other
+  //! options if specified
+  //----------------------------------------------------------------------------
 
-public:
+  diamond::common::Timing startup("startup");
+  COMMONTIMING("start", &startup);
 
-  static double entrycachetime; 
-  static double attrcachetime;
-  static bool fuse_do_reply;
+  diamondfs fs;
 
-  static void
-  dump_stat(struct stat* st) 
+  //----------------------------------------------------------------------------
+  // Configure the Logging
+  // Two Env vars define the log leve:
+  // export DIAMONDFS_FUSE_DEBUG=1 to run in debug mode (lists the cached directories after startup)
+  // export DIAMONDFS_FUSE_LOGLEVEL=<n> to set the log leve different from LOG_INFO
+  //----------------------------------------------------------------------------
+  diamond::common::Logging::Init();
+  diamond::common::Logging::SetUnit("FUSE/DiamondFS");
+  diamond::common::Logging::gShortFormat = true;
+  std::string fusedebug = getenv("DIAMONDFS_FUSE_DEBUG")?getenv("DIAMONDFS_FUSE_DEBUG"):"0";
+  
+  if ((getenv("DIAMONDFS_FUSE_DEBUG")) && (fusedebug != "0"))
   {
-    diamond_static_debug("dev=%llx ino=%llx mode=%llx link=%llx uid=%llx gid=%llx rdev=%llx size=%llx blksize=%llx blocks=%llx atime=%llu mtime=%llu, ctime=%llu",
-			 (unsigned long long) st->st_dev,
-			 (unsigned long long) st->st_ino,
-			 (unsigned long long) st->st_mode,
-			 (unsigned long long) st->st_nlink,
-			 (unsigned long long) st->st_uid,
-			 (unsigned long long) st->st_gid, 
-			 (unsigned long long) st->st_rdev,
-			 (unsigned long long) st->st_size,
-			 (unsigned long long) st->st_blksize,
-			 (unsigned long long) st->st_blocks,
-			 (unsigned long long) st->st_atime,
-			 (unsigned long long) st->st_mtime,
-			 (unsigned long long) st->st_ctime);
+    diamond::common::Logging::SetLogPriority(LOG_DEBUG);
+    if (DIAMOND_LOG_COMPILE_PRIORITY < LOG_DEBUG)
+      std::cerr << "warning: debug messages are compiled out of this build" << std::endl;
   }
-  //--------------------------------------------------------------------------
-  //! Constructor
-  //--------------------------------------------------------------------------
-
-  diamondfs () 
-  { 
-    diamond_static_debug("");
-    FS = this;
-  };
-
-  //--------------------------------------------------------------------------
-  //! Destructor
-  //--------------------------------------------------------------------------
-
-  virtual
-  ~diamondfs () 
+  else
   { 
-    diamond_static_debug("");
-  };
-
-  //--------------------------------------------------------------------------
-  //! Initialize filesystem
-  //--------------------------------------------------------------------------
-
-  static void
-  init (void *userdata, struct fuse_conn_info *conn)
-  {
-    diamond_static_debug("");
-  }
-
-  //--------------------------------------------------------------------------
-  //! Clean up filesystem
-  //--------------------------------------------------------------------------
-
-  static void
-  destroy (void *userdata)
-  {
-    diamond_static_debug("userdata=%llu",(unsigned long long)userdata);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Get file attributes
-  //--------------------------------------------------------------------------
-
-  static void
-  getattr (fuse_req_t req,
-           fuse_ino_t ino,
-           struct fuse_file_info *fi)
-  {
-    diamond_static_debug("ino=%llx", ino);
-    
-    (void) fi;
-
-
-    diamondCache::diamondFilePtr inode = FS->getFile(DIAMOND_INODE(ino), false, false);
-
-    struct stat* st = 0;
-
-    if (inode) {
-      st = inode->getStat();
-    } else {
-      diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(ino), false, false);
-      if (inode) {
-	st = inode->getStat();
-      } else {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      }
-    }
-
-    diamond_static_debug("size=%d mode=%x ino=%llx inode=%llu (%d/%d) (%d/%d)", st->st_size, st->st_mode, ino, st->st_ino, sizeof(fuse_ino_t), sizeof(st->st_ino), sizeof(struct stat), sizeof(st));
-    int rc = 0;
-    rc = (!fuse_do_reply)?0:fuse_reply_attr(req, st, attrcachetime);
-    diamond_static_debug("rc=%d", rc);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Change attributes of a file
-  //--------------------------------------------------------------------------
-
-  static void
-  setattr (fuse_req_t req,
-           fuse_ino_t ino,
-           struct stat *attr,
-           int to_set,
-           struct fuse_file_info *fi)
-  {
-    diamond_static_debug("");
-
-    diamondCache::diamondDirPtr dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
-    diamondFilePtr finode;
-
-    struct stat* st = 0;
-
-    if (!dinode) {
-      finode = FS->getFile(DIAMOND_INODE(ino),false,false);
-      if (!finode) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      } else {
-	st = finode->getStat();
-      }
-    } else {
-      st = dinode->getStat();
-    }
-
-    if (to_set & FUSE_SET_ATTR_MODE) {
-      st->st_mode = attr->st_mode;
-    }
-    if (to_set & FUSE_SET_ATTR_UID) {
-      st->st_uid = attr->st_uid;
-    }
-    if (to_set & FUSE_SET_ATTR_GID) {
-      st->st_gid = attr->st_gid;
-    }
-
-    if (to_set & FUSE_SET_ATTR_SIZE) {
-      if (attr->st_size < (1024ll*1024*1024*1024*16)) {
-	st->st_size = attr->st_size;
-	if (finode) {
-	  finode->truncate(attr->st_size);
-	}
-      } else {
-	(!fuse_do_reply)?0:fuse_reply_err(req, EFBIG);
-      }
-    }
-    
-    if (to_set & FUSE_SET_ATTR_ATIME) {
-      st->st_atime = attr->st_atime;
-      st->st_atim.tv_sec = attr->st_atim.tv_sec;
-      st->st_atim.tv_nsec = attr->st_atim.tv_nsec;
-    }
-
-    if (to_set & FUSE_SET_ATTR_MTIME) {
-      st->st_mtime = attr->st_mtime;
-      st->st_mtim.tv_sec = attr->st_mtim.tv_sec;
-      st->st_mtim.tv_nsec = attr->st_mtim.tv_nsec;
-    }
-    (!fuse_do_reply)?0:fuse_reply_attr (req, st, attrcachetime);
-    return ;
-  }
-
-  //--------------------------------------------------------------------------
-  //! Lookup an entry
-  //--------------------------------------------------------------------------
-
-  static void
-  lookup (fuse_req_t req,
-          fuse_ino_t parent,
-          const char *name)
-  {
-    struct fuse_entry_param e;
-    diamond_static_debug("name=%s", name);
-
-    memset(&e, 0, sizeof ( e));
-
-    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
-
-    if (!inode) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return;
-    }
-    
-    if (!inode->getNamesInode().count(name)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return;
-    }
-      
-    e.ino = DIAMOND_TO_INODE(inode->getNamesInode()[name]);
-    e.attr_timeout = attrcachetime;
-    e.entry_timeout = entrycachetime;
-    struct stat* st=0;
-    inode = FS->getDir(DIAMOND_INODE(e.ino), false, false);
-    if (!inode) {
-      diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(e.ino), false, false);
-      if (!finode) {
-	// very unlikely if not impossible
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      }
-      st = finode->getStat();
-    } else {
-      st = inode->getStat();
-    }
-    memcpy(&e.attr, st, sizeof(struct stat));
-    dump_stat(&e.attr);
-    (!fuse_do_reply)?0:fuse_reply_entry(req,&e);
-  }
-
-  struct dirbuf
-  {
-    char *p;
-    size_t size;
-    size_t alloc_size;
-  };
-
-  static void
-  dirbuf_add (fuse_req_t req, struct dirbuf *b, const char *name,
-              fuse_ino_t ino)
-  {
-    diamond_static_debug("name=%s ino=%llx", name, ino);
-
-    struct stat stbuf;
-    size_t oldsize = b->size;
-    b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-    if (b->size > b->alloc_size) {
-      // avoid reallocation for every single entry
-      char *newp = (char*) realloc(b->p, b->size+(256*1024));
-      if (!newp) {
-	fprintf(stderr, "*** fatal error: cannot allocate memory\n");
-	abort();
-      }
-      b->p = newp;
-      b->alloc_size = b->size+(256*1024);
-    }
-
-    memset(&stbuf, 0, sizeof ( stbuf));
-    stbuf.st_ino = ino;
-    fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, &stbuf,
-                      b->size);
-  }
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-  static int
-  reply_buf_limited (fuse_req_t req, const char *buf,
-                     size_t bufsize, off_t off, size_t maxsize)
-  {
-    if (off < (off_t)bufsize)
-      return (!fuse_do_reply)?0:fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-    else
-      return (!fuse_do_reply)?0:fuse_reply_buf(req, NULL, 0);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Produce cached directory contents
-  //--------------------------------------------------------------------------
-  static void 
-  opendir (fuse_req_t req, 
-	   fuse_ino_t ino,
-	   struct fuse_file_info *fi)
-  {
-    (void) fi;
-    diamond_static_debug("ino=%llx", ino);
-
-    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(ino), false, false);
-
-    if (!inode) {
-      diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
-      if (!finode) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      } else {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOTDIR);
-	return;
-      }
-    }
-    
-    fi->fh = (uint64_t) new struct dirbuf;
-    struct dirbuf* b = (struct dirbuf*) fi->fh;
-
-    memset(b, 0, sizeof ( struct dirbuf));
-
-    dirbuf_add(req, b, ".", ino);
-    dirbuf_add(req, b, "..", ino);
-    
-    for (std::set<diamond_ino_t>::const_iterator it = (*inode).std::set<diamond_ino_t>::begin(); it != (*inode).std::set<diamond_ino_t>::end(); ++it) {
-      // get each inode to add the name
-      diamondCache::diamondDirPtr dinode = FS->getDir(*it,false,false);
-      if (!dinode) {
-	diamondCache::diamondFilePtr finode = FS->getFile(*it,false,false);
-	if (finode) {
-	  dirbuf_add(req, b, finode->getName().c_str(), DIAMOND_TO_INODE(*it));
-	}
-      } else {
-	dirbuf_add(req, b, dinode->getName().c_str(), DIAMOND_TO_INODE(*it));
-      }
-    }
-    (!fuse_do_reply)?0:fuse_reply_open(req, fi);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Read the entries from a directory
-  //--------------------------------------------------------------------------
-
-  static void
-  readdir (fuse_req_t req,
-           fuse_ino_t ino,
-           size_t size,
-           off_t off,
-           struct fuse_file_info *fi)
-  {
-    if (fi && fi->fh) {
-      struct dirbuf* b = (struct dirbuf*) fi->fh;
-      reply_buf_limited(req, b->p, b->size, off, size);
-    }
-  }
-
-  //--------------------------------------------------------------------------
-  //! Release cached directory contents
-  //--------------------------------------------------------------------------
-
-  static void
-  releasedir (fuse_req_t req, 
-	      fuse_ino_t ino,
-	      struct fuse_file_info *fi)
-  {
-    if (fi->fh) {
-      struct dirbuf* b = (struct dirbuf*) fi->fh;
-
-      free(b->p);
-      delete b;
-      fi->fh = 0;
+    if ((getenv("DIAMONDFS_FUSE_LOGLEVEL"))) 
+    {
+      diamond::common::Logging::SetLogPriority(atoi(getenv("DIAMONDFS_FUSE_LOGLEVEL")));
+    } 
+    else 
+    {
+      diamond::common::Logging::SetLogPriority(LOG_INFO);
     }
-    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Return statistics about the filesystem
-  //--------------------------------------------------------------------------
-
-  static void
-  statfs (fuse_req_t req, fuse_ino_t ino)
-  {
-    diamond_static_debug("");
-    memset(&stat_fs, 0, sizeof (stat_fs));
-
-    stat_fs.f_bsize = 4096;
-    stat_fs.f_frsize = 4096;
-    stat_fs.f_blocks = 1000000ll;
-    stat_fs.f_bfree = 1000000ll;
-    stat_fs.f_bavail = 1000000ll;
-    stat_fs.f_files = 1000000ll;
-    stat_fs.f_ffree = 1000000ll;
-    stat_fs.f_fsid = 99;
-    stat_fs.f_flag = 1;
-    stat_fs.f_namemax = 512;
-
-    (!fuse_do_reply)?0:fuse_reply_statfs(req, &stat_fs);
   }
 
-  //--------------------------------------------------------------------------
-  //! Make a special (device) file, FIFO, or socket
-  //--------------------------------------------------------------------------
-
-  static void
-  mknod (fuse_req_t req,
-         fuse_ino_t parent,
-         const char *name,
-         mode_t mode,
-         dev_t rdev)
-  {
-    diamond_static_debug("");
-  }
-
-  //--------------------------------------------------------------------------
-  //! Create a directory with a given name
-  //--------------------------------------------------------------------------
-
-  static void
-  mkdir (fuse_req_t req,
-         fuse_ino_t parent,
-         const char *name,
-         mode_t mode)
+  //----------------------------------------------------------------------------
+  // Configure the binary op trace
+  // export DIAMONDFS_TRACE=<dir> to record every FUSE op into <dir>/trace.<pid>.<tid>
+  // export DIAMONDFS_TRACE_RECORDS=<n>[K|M] to size the ring per thread (default 256K)
+  // decode the rings with 'diamondtrace [-c] <files>'
+  //----------------------------------------------------------------------------
+  static_assert(diamondfs::kOps <= diamond::common::Trace::kMaxOps, "too many traced ops");
+  if (getenv("DIAMONDFS_TRACE"))
   {
-    diamond_static_debug("");
-
-    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
-
-    if (!inode) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
+    uint64_t records = 256 * 1024;
+    if (getenv("DIAMONDFS_TRACE_RECORDS") && !(records = diamondCapacity::parseSize(getenv("DIAMONDFS_TRACE_RECORDS"))))
+    {
+      std::cerr << "error: invalid DIAMONDFS_TRACE_RECORDS " << getenv("DIAMONDFS_TRACE_RECORDS") << std::endl;
+      return EINVAL;
     }
-
-    if (inode->getNamesInode().count(name)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, EEXIST);
-      return ;
+    int rc = diamond::common::Trace::Enable(getenv("DIAMONDFS_TRACE"), records, diamondfs::op_names);
+    if (rc)
+    {
+      std::cerr << "error: cannot trace into " << getenv("DIAMONDFS_TRACE") << " errno=" << rc << std::endl;
+      return rc;
     }
-
-    // create a new entry
-    diamond_ino_t new_ino = FS->newInode();
-    diamondCache::diamondDirPtr new_inode = FS->getDir(new_ino, true, true, name );
-    if (new_inode)
-      new_inode->makeStat(req?(fuse_req_ctx(req)->uid):0, req?(fuse_req_ctx(req)->gid):0, DIAMOND_TO_INODE(new_ino), S_IFDIR | mode, 0);
-
-    
-    struct fuse_entry_param e;
-    memcpy(&e.attr, new_inode->getStat(), sizeof(struct stat));
-
-    e.ino = e.attr.st_ino;
-    e.attr_timeout  = attrcachetime;
-    e.entry_timeout = entrycachetime;
-
-    // attach to the parent
-    inode->getNamesInode()[name]=new_ino;
-    inode->std::set<diamond_ino_t>::insert(new_ino);
-    dump_stat(&e.attr);
-    diamond_static_debug("ino=%s name=%s\n", new_inode->getIno().c_str(), new_inode->getName().c_str());
-    (!fuse_do_reply)?0:fuse_reply_entry(req, &e);
   }
 
-  //--------------------------------------------------------------------------
-  //! Remove (delete) the given file, symbolic link, hard link,or special node
-  //--------------------------------------------------------------------------
+  //----------------------------------------------------------------------------
+  // Configure the op statistics
+  // the counters and latency percentiles are readable any time with
+  // 'getfattr -n diamond.ops <mountpoint>'
+  // export DIAMONDFS_STATS_LOG_S=<s> to change the interval of the op summary log line (default 60, 0 disables)
+  //----------------------------------------------------------------------------
+  unsigned statsinterval = getenv("DIAMONDFS_STATS_LOG_S") ? atoi(getenv("DIAMONDFS_STATS_LOG_S")) : 60;
 
-  static void
-  unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
+  //----------------------------------------------------------------------------
+  // Configure the lock profiling
+  // export DIAMONDFS_LOCK_PROFILE=1 to count acquisitions, contention, wait and hold
+  // times of the named mutexes - read them with 'getfattr -n diamond.locks <mountpoint>'
+  //----------------------------------------------------------------------------
+  if ((getenv("DIAMONDFS_LOCK_PROFILE")) && (std::string(getenv("DIAMONDFS_LOCK_PROFILE")) != "0"))
   {
-    diamond_static_debug("");
-
-    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
-
-    if (!inode) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    if (!inode->getNamesInode().count(name)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    diamond_ino_t ino = inode->getNamesInode()[name];
-    diamondCache::diamondFilePtr child = FS->getFile(ino, false, false);
-
-    if (!child) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    // remove 'name' directory
-    if ( FS->rmFile(ino) ) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    // update parent
-    inode->getNamesInode().erase(name);
-    inode->std::set<diamond_ino_t>::erase(ino);
-    (!fuse_do_reply)?0:fuse_reply_err(req,0);
-    return;
+    diamond::common::LockStats::SetEnabled(true);
   }
 
-  //--------------------------------------------------------------------------
-  //! Remove the given directory
-  //--------------------------------------------------------------------------
-
-  static void
-  rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
+  //----------------------------------------------------------------------------
+  // Configure the session loop
+  // export DIAMONDFS_THREADS=<n> to serve the mount with a fixed pool of n workers (default: libfuse loop)
+  // export DIAMONDFS_CPUS=<list> to pin the workers round robin to the cpus in list, e.g. 0-3,8
+  // export DIAMONDFS_CLONE_FD=1 to give every worker its own clone of the fuse device
+  //----------------------------------------------------------------------------
   {
-    diamond_static_debug("");
-
-    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
-
-    if (!inode) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    if (!inode->getNamesInode().count(name)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    diamond_ino_t ino = inode->getNamesInode()[name];
-    diamondCache::diamondDirPtr child = FS->getDir(ino, false, false);
-
-    if (!child) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    if (child->getNamesInode().size()) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOTEMPTY);
-      return ;
-    }
-
-    // remove 'name' directory
-    if ( FS->rmDir(ino) ) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
+    llfusexx::loop_config loop;
+    loop.threads = getenv("DIAMONDFS_THREADS") ? atoi(getenv("DIAMONDFS_THREADS")) : 0;
+    loop.clone_fd = (getenv("DIAMONDFS_CLONE_FD")) && (std::string(getenv("DIAMONDFS_CLONE_FD")) != "0");
+    if (getenv("DIAMONDFS_CPUS") && !llfusexx::loop_config::parse_cpus(getenv("DIAMONDFS_CPUS"), loop.cpus))
+    {
+      std::cerr << "error: invalid DIAMONDFS_CPUS " << getenv("DIAMONDFS_CPUS") << std::endl;
+      return EINVAL;
     }
-
-    // update parent
-    inode->getNamesInode().erase(name);
-    inode->std::set<diamond_ino_t>::erase(ino);
-
-    (!fuse_do_reply)?0:fuse_reply_err(req,0);    
-    return;
+    if (loop.threads)
+      diamond_static_info("session workers=%u cpus=%s clone_fd=%d", loop.threads,
+			  getenv("DIAMONDFS_CPUS") ? getenv("DIAMONDFS_CPUS") : "all", loop.clone_fd);
+    fs.set_loop(loop);
   }
 
-  //--------------------------------------------------------------------------
-  //! Rename the file, directory, or other object
-  //--------------------------------------------------------------------------
-
-  static void
-  rename (fuse_req_t req,
-          fuse_ino_t parent,
-          const char *name,
-          fuse_ino_t newparent,
-          const char *newname)
+  //----------------------------------------------------------------------------
+  // Configure the inode allocator
+  // export DIAMONDFS_STATE_DIR=<dir> to keep inode numbers monotonic across restarts
+  // export DIAMONDFS_INODE_REUSE=1 to recycle freed inode numbers with a new generation
+  //----------------------------------------------------------------------------
+  if (getenv("DIAMONDFS_STATE_DIR"))
   {
-    diamond_static_debug("parent=%llx newparent=%llx name=%s newname=%s", parent, newparent, name, newname);
-
-    diamondCache::diamondDirPtr dinode;
-    diamondCache::diamondDirPtr tinode;
-
-    dinode = FS->getDir(DIAMOND_INODE(parent), false, false);
-    tinode = FS->getDir(DIAMOND_INODE(newparent), false, false);
-    
-    if ( (!dinode) || (!tinode)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    if (!dinode->getNamesInode().count(name)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return ;
-    }
-
-    diamond_ino_t ino = dinode->getNamesInode()[name];
-
-    if (tinode->getNamesInode().count(newname)) {
-      diamond_ino_t tino = tinode->getNamesInode()[newname];
-    
-      //the target exists
-      if (FS->rmFile(tino))
-	FS->rmDir(tino);
-      tinode->getNamesInode().erase(newname);
-      tinode->std::set<diamond_ino_t>::erase(tino);
-    }
-      
-    // update source
-    dinode->getNamesInode().erase(name);
-    dinode->std::set<diamond_ino_t>::erase(ino);
-
-    // update target
-    tinode->getNamesInode()[newname]=ino;
-    tinode->std::set<diamond_ino_t>::insert(ino);
-    
-    // rename the object itself
-
-    diamondCache::diamondFilePtr finode = FS->getFile(ino,false,false);
-    if (!finode) {
-      diamondCache::diamondDirPtr dinode = FS->getDir(ino, false, false);
-      if (!dinode) {    
-	// uups
-      } else {
-	dinode->setName(newname);
-      }
-    } else {
-      finode->setName(newname);
+    std::string statefile = std::string(getenv("DIAMONDFS_STATE_DIR")) + "/inode.counter";
+    int rc = fs.getInodeAllocator().setStateFile(statefile.c_str());
+    if (rc)
+    {
+      std::cerr << "error: cannot open inode counter file " << statefile << " errno=" << rc << std::endl;
+      return rc;
     }
-
-    (!fuse_do_reply)?0:fuse_reply_err(req,0);
-    return;
-  }
-
-  //--------------------------------------------------------------------------
-  //
-  //--------------------------------------------------------------------------
-
-  static void
-  access (fuse_req_t req, fuse_ino_t ino, int mask)
-  {
-    diamond_static_debug("");
   }
-
-  //--------------------------------------------------------------------------
-  //! Open a file
-  //--------------------------------------------------------------------------
-
-  static void
-  open (fuse_req_t req,
-        fuse_ino_t ino,
-        struct fuse_file_info * fi)
+  
+  if ((getenv("DIAMONDFS_INODE_REUSE")) && (std::string(getenv("DIAMONDFS_INODE_REUSE")) != "0"))
   {
-    diamond_static_debug("ino=%llx", ino);
-    
-    diamondCache::diamondFilePtr* fptr = new diamondCache::diamondFilePtr;
-    *fptr = FS->getFile(DIAMOND_INODE(ino), true, false);
-    
-    if (!fptr) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return;
-    }
-    // store the shared pointer the file as file handle
-    fi->fh = (uint64_t) fptr;
-    //    fi->direct_io = 1;
-    (!fuse_do_reply)?0:fuse_reply_open(req, fi);
-    return;
+    fs.getInodeAllocator().setReuse(true);
   }
 
-  //--------------------------------------------------------------------------
-  //! Create a file
-  //--------------------------------------------------------------------------
-  static void 
-  create (fuse_req_t req, 
-	  fuse_ino_t parent, 
-	  const char *name,
-	  mode_t mode, 
-	  struct fuse_file_info *fi)
+  //----------------------------------------------------------------------------
+  // Configure the capacity
+  // export DIAMONDFS_CAPACITY=<bytes>[K|M|G|T] to limit file data (default: physical memory)
+  // export DIAMONDFS_MAX_INODES=<n> to limit the number of inodes
+  // export DIAMONDFS_NAME_INDEX=<slots>[K|M|G] to size the name index (default 1M, grows up to 2 slots per inode)
+  //----------------------------------------------------------------------------
   {
-    diamondCache::diamondFilePtr* fptr = new diamondCache::diamondFilePtr;
-
-    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
-
-    if (!inode) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return;
-    }
-    
-    if (inode->getNamesInode().count(name)) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, EEXIST);
-      return;
+    uint64_t capacity = 0;
+    uint64_t maxinodes = 0;
+    if (getenv("DIAMONDFS_CAPACITY") && !(capacity = diamondCapacity::parseSize(getenv("DIAMONDFS_CAPACITY"))))
+    {
+      std::cerr << "error: invalid DIAMONDFS_CAPACITY " << getenv("DIAMONDFS_CAPACITY") << std::endl;
+      return EINVAL;
     }
-
-    diamond_ino_t ino = FS->newInode();
-    *fptr = FS->getFile(ino, true, true, name);
-    
-    if (!fptr) {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-      return;
+    if (getenv("DIAMONDFS_MAX_INODES") && !(maxinodes = diamondCapacity::parseSize(getenv("DIAMONDFS_MAX_INODES"))))
+    {
+      std::cerr << "error: invalid DIAMONDFS_MAX_INODES " << getenv("DIAMONDFS_MAX_INODES") << std::endl;
+      return EINVAL;
     }
-    // store the shared pointer the file as file handle
-    fi->fh = (uint64_t) fptr;
-
-    if (*fptr)
-      (*fptr)->makeStat(req?(fuse_req_ctx(req)->uid):0, req?(fuse_req_ctx(req)->gid):0, DIAMOND_TO_INODE(ino) , S_IFREG | mode, 0);
-    
-    struct fuse_entry_param e;
-    memcpy(&e.attr, (*fptr)->getStat(), sizeof(struct stat));
-
-    e.ino = e.attr.st_ino;
-    e.attr_timeout  = attrcachetime;
-    e.entry_timeout = entrycachetime;
+    diamondCapacity::setLimits(capacity, maxinodes);
 
-    // attach to the parent
-    inode->getNamesInode()[name]=ino;
-    inode->std::set<diamond_ino_t>::insert(ino);
-    dump_stat(&e.attr);
-    diamond_static_debug("ino=%s name=%s\n", (*fptr)->getIno().c_str(), (*fptr)->getName().c_str());
-    (!fuse_do_reply)?0:fuse_reply_create(req, &e, fi);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Read from file. Returns the number of bytes transferred, or 0 if offset
-  //! was at or beyond the end of the file.
-  //--------------------------------------------------------------------------
-  
-  static void
-  read (fuse_req_t req,
-        fuse_ino_t ino,
-        size_t size,
-        off_t off,
-        struct fuse_file_info * fi)
-  {
-    diamondCache::diamondFilePtr* file = ((diamondCache::diamondFilePtr*)fi->fh);
-    
-    char* buffer=0;
-    size_t s = (*file)->peek(buffer, off, size);
-    diamond_static_debug("ino=%llx off=%llx size=%llu avail=%u", (unsigned long long)ino, (unsigned long long)off, (unsigned long long)size, s);
-    
-    (!fuse_do_reply)?0:fuse_reply_buf(req, buffer, s);
-    (*file)->release();
-    return;
-  }
-
-  //--------------------------------------------------------------------------
-  //! Write function
-  //--------------------------------------------------------------------------
-
-  static void
-  write (fuse_req_t req,
-         fuse_ino_t ino,
-         const char *buf,
-         size_t size,
-         off_t off,
-         struct fuse_file_info * fi)
-  {
-    diamond_static_debug("");
-    diamondCache::diamondFilePtr* file = ((diamondCache::diamondFilePtr*)fi->fh);
-    diamond_static_debug("ino=%llx off=%llx size=%llu", (unsigned long long)ino, (unsigned long long)off, (unsigned long long)size);
-    off_t s = (*file)->write(buf, off, size);
-    diamond_static_debug("size=%u offset=%llu", size, s);
-    (!fuse_do_reply)?0:fuse_reply_write(req, size);
-    return;
-  }
-
-  //--------------------------------------------------------------------------
-  //! Release is called when FUSE is completely done with a file; at that point,
-  //! you can free up any temporarily allocated data structures.
-  //--------------------------------------------------------------------------
-
-  static void
-  release (fuse_req_t req,
-           fuse_ino_t ino,
-           struct fuse_file_info * fi)
-  {
-    diamond_static_debug("");
-    if (fi && fi->fh) {
-      if (fi->fh) delete ((diamondCache::diamondFilePtr*)fi->fh);
+    uint64_t nameindex = diamondCache::kNameIndexSize;
+    if (getenv("DIAMONDFS_NAME_INDEX") && !(nameindex = diamondCapacity::parseSize(getenv("DIAMONDFS_NAME_INDEX"))))
+    {
+      std::cerr << "error: invalid DIAMONDFS_NAME_INDEX " << getenv("DIAMONDFS_NAME_INDEX") << std::endl;
+      return EINVAL;
     }
-    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
-  }
-
-  //--------------------------------------------------------------------------
-  //! Flush any dirty information about the file to disk
-  //--------------------------------------------------------------------------
-
-  static void
-  fsync (fuse_req_t req,
-         fuse_ino_t ino,
-         int datasync,
-         struct fuse_file_info * fi)
-  {
-   diamond_static_debug("");
-  }
-
-  //--------------------------------------------------------------------------
-  //! Forget inode <-> path mapping
-  //--------------------------------------------------------------------------
-
-  static void
-  forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
-  {
-    diamond_static_debug("");
-    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
-    return;
+    fs.sizeNameIndex(nameindex);
+    diamond_static_info("capacity bytes=%llu inodes=%llu name-index=%llu/%llu",
+			(unsigned long long) diamondCapacity::byteLimit(),
+			(unsigned long long) diamondCapacity::inodeLimit(),
+			(unsigned long long) fs.nameIndexSize(),
+			(unsigned long long) fs.nameIndexLimit());
   }
 
-  //--------------------------------------------------------------------------
-  //! Called on each close so that the filesystem has a chance to report delayed errors
-  //! Important: there may be more than one flush call for each open.
-  //! Note: There is no guarantee that flush will ever be called at all!
-  //--------------------------------------------------------------------------
-
-  static void
-  flush (fuse_req_t req,
-         fuse_ino_t ino,
-         struct fuse_file_info * fi)
+  //----------------------------------------------------------------------------
+  // Configure the namespace persistency
+  // with DIAMONDFS_STATE_DIR the namespace is written back to <dir>/namespace.kv
+  // export DIAMONDFS_WRITEBACK_MS=<ms> to change the flush interval (default 1000)
+  // export DIAMONDFS_WRITEBACK_KEYS=<n>[K|M|G] to size the store index (default 1M)
+  // export DIAMONDFS_NAMESPACE=journal to keep a metadata journal with checkpoints instead
+  // export DIAMONDFS_JOURNAL_SYNC_MS=<ms> to change the journal sync interval (default 100)
+  // export DIAMONDFS_CHECKPOINT_S=<s> to change the checkpoint interval (default 300)
+  // export DIAMONDFS_NAMESPACE=snapshot to load <dir>/namespace.snapshot at start and dump it at exit
+  // export DIAMONDFS_LOAD_THREADS=<n> to limit the snapshot/checkpoint loader threads (default all cores)
+  //----------------------------------------------------------------------------
+  std::string nsmode = getenv("DIAMONDFS_NAMESPACE") ? getenv("DIAMONDFS_NAMESPACE") : "kv";
+  unsigned loadthreads = getenv("DIAMONDFS_LOAD_THREADS") ? atoi(getenv("DIAMONDFS_LOAD_THREADS")) : 0;
+  if ((nsmode != "kv") && (nsmode != "journal") && (nsmode != "snapshot"))
   {
-    diamond_static_debug("");
-    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
-    return;
+    std::cerr << "error: invalid DIAMONDFS_NAMESPACE " << nsmode << std::endl;
+    return EINVAL;
   }
 
-  //--------------------------------------------------------------------------
-  //! Get an extended attribute
-  //--------------------------------------------------------------------------
-#ifdef __APPLE__
-  static void getxattr (fuse_req_t req,
-                        fuse_ino_t ino,
-                        const char *name,
-                        size_t size,
-                        uint32_t position)
-#else
-
-  static void
-  getxattr (fuse_req_t req,
-            fuse_ino_t ino,
-            const char *name,
-            size_t size)
-#endif
+  if (getenv("DIAMONDFS_STATE_DIR") && (nsmode == "kv"))
   {
-    diamond_static_debug("name=%s size=%u", name, size);
-
-    // ignore capability requests
-    if (std::string(name) == "security.capability") {
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENODATA);
-      return;
-    }
-
-    diamond::common::BufferPtr attr;
-
-    // try to get a file or a directory with that inode
-    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
-    if (!finode) {
-      diamondCache::diamondDirPtr dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
-      if (!dinode) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      }
-      attr = dinode->std::map<std::string, diamond::common::BufferPtr>::operator [] (name);
-    } else {
-      attr = finode->std::map<std::string, diamond::common::BufferPtr>::operator [] (name);
-    }
-
-    if (size == 0) {
-      (!fuse_do_reply)?0:fuse_reply_xattr(req, (*attr)->size());
-      return ;
+    std::string statedir = getenv("DIAMONDFS_STATE_DIR");
+    unsigned interval = getenv("DIAMONDFS_WRITEBACK_MS") ? atoi(getenv("DIAMONDFS_WRITEBACK_MS")) : 1000;
+    uint64_t keys = 1024 * 1024;
+    if (getenv("DIAMONDFS_WRITEBACK_KEYS") && !(keys = diamondCapacity::parseSize(getenv("DIAMONDFS_WRITEBACK_KEYS"))))
+    {
+      std::cerr << "error: invalid DIAMONDFS_WRITEBACK_KEYS " << getenv("DIAMONDFS_WRITEBACK_KEYS") << std::endl;
+      return EINVAL;
     }
-
-
-    if ((*attr)->size() > size)
-      	(!fuse_do_reply)?0:fuse_reply_err(req, ERANGE);
-    else
-      (!fuse_do_reply)?0:fuse_reply_buf(req, &(**attr)[0], (*attr)->size());
-    return;
-  }
-
-  //--------------------------------------------------------------------------
-  //! Set extended attribute
-  //--------------------------------------------------------------------------
-#ifdef __APPLE__
-  static void setxattr (fuse_req_t req,
-                        fuse_ino_t ino,
-                        const char *name,
-                        const char *value,
-                        size_t size,
-                        int flags,
-                        uint32_t position)
-#else
-
-  static void
-  setxattr (fuse_req_t req,
-            fuse_ino_t ino,
-            const char *name,
-            const char *value,
-            size_t size,
-            int flags)
-#endif
-  {
-    diamond_static_debug("name=%s size=%d", name, size);
-    diamond::common::BufferPtr buffer;
-
-    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
-    if (!finode) {
-      diamondCache::diamondDirPtr dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
-      if (!dinode) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      }
-      if (flags && dinode->std::map<std::string, diamond::common::BufferPtr>::count(name)) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, EEXIST);
-	return;
-      }
-      buffer = dinode->std::map<std::string, diamond::common::BufferPtr>::operator [] (name);
-    } else {
-      if (flags && finode->std::map<std::string, diamond::common::BufferPtr>::count(name)) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, EEXIST);
-	return;
-      }
-      buffer = finode->std::map<std::string, diamond::common::BufferPtr>::operator [] (name);     
+    int rc = fs.enableWriteBack(statedir + "/namespace.kv", statedir, keys, interval ? interval : 1000);
+    if (rc)
+    {
+      std::cerr << "error: cannot open namespace store " << statedir << "/namespace.kv errno=" << rc << std::endl;
+      return rc;
     }
-    (**buffer).putData(value,size);
-    (!fuse_do_reply)?0:fuse_reply_err(req,0);
-    return;
   }
 
-  //--------------------------------------------------------------------------
-  //! List extended attributes
-  //--------------------------------------------------------------------------
+  fs.makeRoot();
 
-  static void
-  listxattr (fuse_req_t req, fuse_ino_t ino, size_t size)
+  // the journal recovers the namespace on top of the empty root
+  if (getenv("DIAMONDFS_STATE_DIR") && (nsmode == "journal"))
   {
-    diamond_static_debug("");
-
-    std::map<std::string, diamond::common::BufferPtr>::const_iterator it;
-    std::map<std::string, diamond::common::BufferPtr>::const_iterator it_end;
-
-    // try to get a file or a directory with that inode
-    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
-    if (!finode) {
-      diamondCache::diamondDirPtr dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
-      if (!dinode) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
-      }
-      it = dinode->std::map<std::string, diamond::common::BufferPtr>::begin();
-      it_end = dinode->std::map<std::string, diamond::common::BufferPtr>::end();
-    } else {
-      it = finode->std::map<std::string, diamond::common::BufferPtr>::begin();
-      it_end = finode->std::map<std::string, diamond::common::BufferPtr>::end();
-    }
-    
-    diamond::common::BufferPtr buffer;
-    for ( ; it != it_end; ++it) {
-      (**buffer).putData(it->first.c_str(), it->first.length()+1);
-    }
-
-    if (size == 0) {
-      (!fuse_do_reply)?0:fuse_reply_xattr(req, (**buffer).size());
-      return ;
+    std::string statedir = getenv("DIAMONDFS_STATE_DIR");
+    unsigned syncms = getenv("DIAMONDFS_JOURNAL_SYNC_MS") ? atoi(getenv("DIAMONDFS_JOURNAL_SYNC_MS")) : 100;
+    unsigned checkpoint = getenv("DIAMONDFS_CHECKPOINT_S") ? atoi(getenv("DIAMONDFS_CHECKPOINT_S")) : 300;
+    int rc = fs.enableJournal(statedir, syncms, checkpoint, loadthreads);
+    if (rc)
+    {
+      std::cerr << "error: cannot recover the namespace journal in " << statedir << " errno=" << rc << std::endl;
+      return rc;
     }
-
-    if ((**buffer).size() > size)
-      	(!fuse_do_reply)?0:fuse_reply_err(req, ERANGE);
-    else
-      (!fuse_do_reply)?0:fuse_reply_buf(req, &(**buffer)[0], (**buffer).size());
-    return ;
   }
 
-  //--------------------------------------------------------------------------
-  //! Remove extended attribute
-  //--------------------------------------------------------------------------
-
-  static void
-  removexattr (fuse_req_t req,
-               fuse_ino_t ino,
-               const char *name)
+  // the snapshot is published completely before the mount becomes visible
+  std::string snapshot;
+  if (getenv("DIAMONDFS_STATE_DIR") && (nsmode == "snapshot"))
   {
-    diamond_static_debug("");
-    diamond::common::BufferPtr attr;
-
-    int items_removed=0;
-
-    // try to get a file or a directory with that inode
-    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
-    if (!finode) {
-      diamondCache::diamondDirPtr dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
-      if (!dinode) {
-	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
-	return;
+    snapshot = std::string(getenv("DIAMONDFS_STATE_DIR")) + "/namespace.snapshot";
+    uint64_t epoch;
+    int rc = diamondSnapshot::load(fs, snapshot, epoch, loadthreads);
+    if (rc && (rc != ENOENT))
+    {
+      std::cerr << "error: cannot load the namespace snapshot " << snapshot << " errno=" << rc << std::endl;
+      return rc;
+    }
+  }
+
+  COMMONTIMING("stop", &startup);
+  diamond_static_notice("startup time=%.03f ms files=%llu dirs=%llu",
+			startup.RealTime(),
+			(unsigned long long) fs.fsize(),
+			(unsigned long long) fs.dsize());
+
+  // the cached directories are only listed for debugging - outside the startup time
+  if (fusedebug != "0")
+  {
+    std::stringstream s;
+    fs.DumpCachedDirs(s);
+    std::cerr << s.str();
+  }
+
+  // log the ops of every interval as <op>=<count>/<p50>/<p99>/<max> in us
+  std::mutex statsmutex;
+  std::condition_variable statscv;
+  bool statsstop = false;
+  std::thread statslog;
+  if (statsinterval)
+  {
+    statslog = std::thread([&] () {
+      std::vector<diamond::common::Histogram> ops, lastops, hits, lasthits;
+      std::unique_lock<std::mutex> lock(statsmutex);
+      while (!statscv.wait_for(lock, std::chrono::seconds(statsinterval), [&] () { return statsstop; }))
+      {
+	diamondfs::op_stats().Collect(ops);
+	diamondCache::stats().Collect(hits);
+	std::string opsummary = diamondfs::op_stats().Summary(ops, lastops);
+	std::string hitsummary = diamondCache::stats().Summary(hits, lasthits);
+	if (!opsummary.empty() || !hitsummary.empty())
+	  diamond_static_notice("ops interval=%us%s cache%s", statsinterval, opsummary.c_str(), hitsummary.c_str());
+	lastops.swap(ops);
+	lasthits.swap(hits);
       }
-      items_removed = dinode->std::map<std::string, diamond::common::BufferPtr>::erase(name);
-    } else {
-      items_removed = finode->std::map<std::string, diamond::common::BufferPtr>::erase(name);
-    }
-
-    if (!items_removed)
-      (!fuse_do_reply)?0:fuse_reply_err(req, ENODATA);
-    else
-      (!fuse_do_reply)?0:fuse_reply_err(req, 0);
-    return;
+    });
   }
 
-  //--------------------------------------------------------------------------
-  //! Singleton
-  //--------------------------------------------------------------------------
-  static diamondfs* FS;
-
-};
-
-diamondfs* diamondfs::FS = 0;
-double diamondfs::entrycachetime = 1.0;
-double diamondfs::attrcachetime  = 1.0;
-bool diamondfs::fuse_do_reply=1;
-
-int
-main (int argc, char *argv[])
-{
   //----------------------------------------------------------------------------
-  //! Runs the daemon at the mountpoint specified in argv and with other
-  //! options if specified
+  // start the FUSE daemon
   //----------------------------------------------------------------------------
+  int rc = fs.daemonize(argc, argv, &fs, NULL);
 
-  diamondfs fs;
-  bool selftest = false;
-
-  //----------------------------------------------------------------------------
-  // Configure the Logging
-  // Two Env vars define the log leve:
-  // export DIAMONDFS_FUSE_DEBUG=1 to run in debug mode
-  // export DIAMONDFS_FUSE_LOGLEVEL=<n> to set the log leve different from LOG_INFO
-  //----------------------------------------------------------------------------
-  diamond::common::Logging::Init();
-  diamond::common::Logging::SetUnit("FUSE/DiamondFS");
-  diamond::common::Logging::gShortFormat = true;
-  std::string fusedebug = getenv("DIAMONDFS_FUSE_DEBUG")?getenv("DIAMONDFS_FUSE_DEBUG"):"0";
-  
-  if ((getenv("DIAMONDFS_FUSE_DEBUG")) && (fusedebug != "0"))
+  if (statslog.joinable())
   {
-    diamond::common::Logging::SetLogPriority(LOG_DEBUG);
-  }
-  else
-  { 
-    if ((getenv("DIAMONDFS_FUSE_LOGLEVEL"))) 
     {
-      diamond::common::Logging::SetLogPriority(atoi(getenv("DIAMONDFS_FUSE_LOGLEVEL")));
-    } 
-    else 
-    {
-      diamond::common::Logging::SetLogPriority(LOG_INFO);
+      std::lock_guard<std::mutex> lock(statsmutex);
+      statsstop = true;
     }
+    statscv.notify_all();
+    statslog.join();
   }
 
-  // create root node
-  diamond_ino_t root_ino = fs.newInode();
-  diamondCache::diamondDirPtr root = fs.getDir(root_ino, true, true, "/");
-  if (root)
-    root->makeStat(0,0,0, S_IFDIR | 0777, 1);
-
-  std::stringstream s;
-  fs.DumpCachedDirs(s);
-  std::cerr << s.str();
-
-  diamond::common::Timing tm1("mkdir");
-  diamond::common::Timing tm2("stat");
-  diamond::common::Timing tm3("rmdir");
-  diamond::common::Timing tm4("create");
-
-  // disable fuse replying
-  diamondfs::fuse_do_reply=0;
-  if (selftest) {
-    diamond_ino_t selftest_ino;
-    diamondCache::diamondDirPtr selftest_inode;
-
-    {
-      COMMONTIMING("t0",&tm1);
-      //----------------------------------------------------------------------------
-      // self test
-      //----------------------------------------------------------------------------
-      selftest_ino = fs.newInode();
-      selftest_inode = fs.getDir(selftest_ino, true, true, ".selftest" );
-      if (selftest_inode)
-	selftest_inode->makeStat(0,0,DIAMOND_TO_INODE(selftest_ino), S_IFDIR | 0777, 0);
-      
-      root->getNamesInode()[".selftest"]=selftest_ino;
-      root->std::set<diamond_ino_t>::insert(selftest_ino);
-
-      for (size_t i = 0; i < 100000; ++i) {
-	fs.mkdir ((fuse_req_t)0, DIAMOND_TO_INODE(selftest_ino), std::to_string(i).c_str(), S_IRWXU);
-      }
-      COMMONTIMING("t1",&tm1);
-    }
-
-    {
-      COMMONTIMING("t0",&tm2);
-      for (size_t i=0; i < 100000; ++i) {
-	fs.lookup((fuse_req_t) 0, DIAMOND_TO_INODE(selftest_ino), std::to_string(i).c_str());
-      }
-      /*      for (auto it = selftest_inode->std::set<diamond_ino_t>::begin(); it != selftest_inode->std::set<diamond_ino_t>::end(); ++it) {
-	diamondCache::diamondDirPtr inode = fs.getDir(*it, false, false);
-	}*/
-      COMMONTIMING("t1",&tm2);
-    }
-
-    {
-      COMMONTIMING("t0",&tm3);
-      for (size_t i=0; i< 100000; ++i) {
-	fs.rmdir ((fuse_req_t) 0, DIAMOND_TO_INODE(selftest_ino), std::to_string(i).c_str());
-      }
-      COMMONTIMING("t1",&tm3);
-    }
-    {
-      COMMONTIMING("t0",&tm4);
-      for (size_t i=0 ; i< 1000; ++i) {
-	struct fuse_file_info fi;
-	fs.create ((fuse_req_t)0, DIAMOND_TO_INODE(selftest_ino), (std::string("f") + std::to_string(i)).c_str(), S_IRWXU, &fi);
-	if (fi.fh) delete ((diamondCache::diamondFilePtr*)fi.fh);
-      }
-      COMMONTIMING("t1",&tm4);
-    }
-    {
-      for (size_t i = 0; i < 10000; ++i) {
-	// create a new entry
-	diamond_ino_t new_ino = fs.newInode();
-	diamondCache::diamondDirPtr new_inode = fs.getDir(new_ino, true, true, std::to_string(i).c_str() );
-	if (new_inode)
-	  new_inode->makeStat( i%10, i%10 , DIAMOND_TO_INODE(new_ino), S_IFDIR | S_IRWXU, 0);
-	
-	// attach to the parent
-	selftest_inode->getNamesInode()[std::to_string(i)]=new_ino;
-	selftest_inode->std::set<diamond_ino_t>::insert(new_ino);
-      }
-    }
-  }
-
-  // enable fuse replying
-  diamondfs::fuse_do_reply=1;
-  if (selftest) {
-    diamond_static_notice("unit=self-test create=%.02f kHz", 100000/tm1.RealTime());
-    diamond_static_notice("unit=self-test lookup=%.02f kHz", 100000/tm2.RealTime());
-    diamond_static_notice("unit=self-test remove=%.02f kHz", 100000/tm3.RealTime());
-    diamond_static_notice("unit=self-test create=%.02f kHz", 10000/tm4.RealTime());
+  if (!snapshot.empty())
+  {
+    int src = diamondSnapshot::dump(fs, snapshot);
+    if (src)
+      diamond_static_crit("cannot dump the namespace snapshot %s errno=%d", snapshot.c_str(), src);
+    else
+      diamond_static_notice("snapshot dumped path=%s files=%llu dirs=%llu",
+			    snapshot.c_str(),
+			    (unsigned long long) fs.fsize(),
+			    (unsigned long long) fs.dsize());
   }
-
-  //----------------------------------------------------------------------------
-  // start the FUSE daemon
-  //----------------------------------------------------------------------------
-  return fs.daemonize(argc, argv, &fs, NULL);
+  return rc;
 }
@@ -0,0 +1,1410 @@
+/*
+ * File:   diamondfs.hh
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#ifndef DIAMONDFS_HH
+#define	DIAMONDFS_HH
+
+#include "llfusexx.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <cstdio>
+
+#include "common/Logging.hh"
+#include "common/Clock.hh"
+#include "common/MemoryAccounting.hh"
+#include "common/OpStats.hh"
+#include "common/SlabAllocator.hh"
+#include "common/Timing.hh"
+#include "common/Trace.hh"
+#include "rio/diamondCache.hh"
+#include "rio/diamondCapacity.hh"
+#include "rio/diamondSnapshot.hh"
+#include <sys/statvfs.h>
+#include <condition_variable>
+#include <thread>
+
+//------------------------------------------------------------------------------
+//! Curiously recurring templates....
+//!
+//!   g++ -Wall `pkg-config fuse --cflags --libs` os.cpp -o os
+//------------------------------------------------------------------------------
+
+using namespace diamond::rio;
+
+class diamondfs : public llfusexx::fs<diamondfs> , public diamond::rio::diamondCache
+{
+private:
+
+public:
+
+  static double entrycachetime; 
+  static double attrcachetime;
+  static bool fuse_do_reply;
+
+  //--------------------------------------------------------------------------
+  //! Op codes of the timed and traced operations - op_names is indexed by them
+  //--------------------------------------------------------------------------
+
+  enum Op {
+    kOpGetattr = 0,
+    kOpSetattr,
+    kOpLookup,
+    kOpOpendir,
+    kOpReaddir,
+    kOpReaddirplus,
+    kOpReleasedir,
+    kOpStatfs,
+    kOpMkdir,
+    kOpUnlink,
+    kOpRmdir,
+    kOpRename,
+    kOpOpen,
+    kOpCreate,
+    kOpRead,
+    kOpWrite,
+    kOpRelease,
+    kOpForget,
+    kOpGetxattr,
+    kOpSetxattr,
+    kOpListxattr,
+    kOpRemovexattr,
+    kOps
+  };
+
+  static const char* op_names[];
+
+  //--------------------------------------------------------------------------
+  //! Count and latency histogram per op, merged over all threads on demand
+  //--------------------------------------------------------------------------
+
+  static diamond::common::OpStats&
+  op_stats()
+  {
+    static diamond::common::OpStats stats(op_names);
+    return stats;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Times one op from construction to destruction into op_stats and the
+  //! trace if enabled
+  //--------------------------------------------------------------------------
+
+  class OpTimer {
+  public:
+
+    OpTimer(Op op, uint64_t ino, uint64_t offset = 0, uint64_t size = 0) :
+    mStart(diamond::common::Clock::Now()), mIno(ino), mOffset(offset), mSize(size), mOp(op) { }
+
+    ~OpTimer()
+    {
+      uint64_t stop = diamond::common::Clock::Now();
+      op_stats().Add(mOp, diamond::common::Clock::Ns(stop - mStart));
+      if (diamond::common::Trace::IsEnabled())
+	diamond::common::Trace::Add(mOp, mIno, mOffset, mSize, mStart, stop);
+    }
+
+  private:
+    uint64_t mStart;
+    uint64_t mIno;
+    uint64_t mOffset;
+    uint64_t mSize;
+    Op mOp;
+  };
+
+  //--------------------------------------------------------------------------
+  //! Virtual attributes on the mountpoint - 'diamond.memory' reports the
+  //! memory held per subsystem and per slab pool, 'diamond.writeback' and
+  //! 'diamond.journal' the state of the namespace persistency, 'diamond.ops'
+  //! the op latencies, the cache hit counters and the timed code blocks,
+  //! 'diamond.locks' the lock contention profile
+  //--------------------------------------------------------------------------
+
+  static const char* virtual_xattrs[]; //< names listed on the mountpoint
+
+  static bool
+  virtual_xattr(fuse_ino_t ino, const std::string& name, std::string* value = 0)
+  {
+    if (ino != FUSE_ROOT_ID)
+      return false;
+
+    std::stringstream out;
+    if (name == "diamond.memory") {
+      if (value) {
+	diamond::common::MemoryAccounting::Dump(out);
+	diamond::common::SlabPool::DumpStats(out);
+      }
+    } else if (name == "diamond.journal") {
+      if (value) {
+	if (FS && FS->getJournal())
+	  FS->getJournal()->Status(out);
+	else
+	  out << "journal=off" << std::endl;
+      }
+    } else if (name == "diamond.ops") {
+      if (value) {
+	op_stats().Dump(out, "ops.");
+	diamondCache::stats().Dump(out, "cache.");
+	diamond::common::TimingStat::Dump(out, "timing.");
+      }
+    } else if (name == "diamond.locks") {
+      if (value) {
+	if (diamond::common::LockStats::IsEnabled())
+	  diamond::common::LockStats::Dump(out);
+	else
+	  out << "locks=off" << std::endl;
+      }
+    } else if (name == "diamond.writeback") {
+      if (value) {
+	if (FS && FS->getWriteBack())
+	  FS->getWriteBack()->Status(out);
+	else
+	  out << "writeback=off" << std::endl;
+      }
+    } else {
+      return false;
+    }
+
+    if (value)
+      *value = out.str();
+    return true;
+  }
+
+  static void
+  dump_stat(struct stat* st) 
+  {
+    diamond_static_debug("dev=%llx ino=%llx mode=%llx link=%llx uid=%llx gid=%llx rdev=%llx size=%llx blksize=%llx blocks=%llx atime=%llu mtime=%llu, ctime=%llu",
+			 (unsigned long long) st->st_dev,
+			 (unsigned long long) st->st_ino,
+			 (unsigned long long) st->st_mode,
+			 (unsigned long long) st->st_nlink,
+			 (unsigned long long) st->st_uid,
+			 (unsigned long long) st->st_gid, 
+			 (unsigned long long) st->st_rdev,
+			 (unsigned long long) st->st_size,
+			 (unsigned long long) st->st_blksize,
+			 (unsigned long long) st->st_blocks,
+			 (unsigned long long) st->st_atime,
+			 (unsigned long long) st->st_mtime,
+			 (unsigned long long) st->st_ctime);
+  }
+  //--------------------------------------------------------------------------
+  //! Constructor
+  //--------------------------------------------------------------------------
+
+  diamondfs () 
+  { 
+    diamond_static_debug("");
+    FS = this;
+  };
+
+  //--------------------------------------------------------------------------
+  //! Destructor
+  //--------------------------------------------------------------------------
+
+  virtual
+  ~diamondfs () 
+  { 
+    diamond_static_debug("");
+  };
+
+  //--------------------------------------------------------------------------
+  //! Create the root directory unless it was loaded already - the allocator
+  //! never hands out the root inode number
+  //--------------------------------------------------------------------------
+
+  diamondCache::diamondDirPtr
+  makeRoot ()
+  {
+    diamond_ino_t root_ino = DIAMOND_INODE(FUSE_ROOT_ID);
+    diamondCache::diamondDirPtr root = getDir(root_ino, true, false);
+    if (!root)
+    {
+      root = getDir(root_ino, true, true, "/");
+      if (root)
+      {
+	root->makeStat(0,0, S_IFDIR | 0777, 1);
+	dirtyDir(root_ino, diamondWriteBack::kInode);
+      }
+    }
+    return root;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Initialize filesystem
+  //--------------------------------------------------------------------------
+
+  static void
+  init (void *userdata, struct fuse_conn_info *conn)
+  {
+    diamond_static_debug("");
+#ifdef FUSE_CAP_READDIRPLUS
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+      conn->want |= FUSE_CAP_READDIRPLUS;
+#endif
+  }
+
+  //--------------------------------------------------------------------------
+  //! Clean up filesystem
+  //--------------------------------------------------------------------------
+
+  static void
+  destroy (void *userdata)
+  {
+    diamond_static_debug("userdata=%llu",(unsigned long long)userdata);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Get file attributes
+  //--------------------------------------------------------------------------
+
+  static void
+  getattr (fuse_req_t req,
+           fuse_ino_t ino,
+           struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpGetattr, ino);
+    diamond_static_debug("ino=%llx", ino);
+    
+    (void) fi;
+
+
+    diamondCache::diamondFilePtr inode = FS->getFile(DIAMOND_INODE(ino), false, false);
+
+    // consistent snapshot of the stat without taking any lock
+    struct stat st;
+
+    if (inode) {
+      inode->copyStat(st);
+    } else {
+      diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(ino), false, false);
+      if (inode) {
+	inode->copyStat(st);
+      } else {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+    }
+
+    diamond_static_debug("size=%d mode=%x ino=%llx inode=%llu (%d/%d) (%d/%d)", st.st_size, st.st_mode, ino, st.st_ino, sizeof(fuse_ino_t), sizeof(st.st_ino), sizeof(struct stat), sizeof(st));
+    int rc = 0;
+    rc = (!fuse_do_reply)?0:fuse_reply_attr(req, &st, attrcachetime);
+    diamond_static_debug("rc=%d", rc);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Change attributes of a file
+  //--------------------------------------------------------------------------
+
+  static void
+  setattr (fuse_req_t req,
+           fuse_ino_t ino,
+           struct stat *attr,
+           int to_set,
+           struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpSetattr, ino);
+    diamond_static_debug("");
+
+    diamondCache::diamondDirPtr dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
+    diamondFilePtr finode;
+    diamondMeta* meta = 0;
+
+    if (!dinode) {
+      finode = FS->getFile(DIAMOND_INODE(ino),false,false);
+      if (!finode) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      } else {
+	meta = finode.get();
+      }
+    } else {
+      meta = dinode.get();
+    }
+
+    if ((to_set & FUSE_SET_ATTR_SIZE) && (attr->st_size >= (1024ll*1024*1024*1024*16))) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EFBIG);
+      return;
+    }
+
+    if ((to_set & FUSE_SET_ATTR_SIZE) && finode) {
+      int rc = finode->truncate(attr->st_size);
+      if (rc) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, rc);
+	return;
+      }
+    }
+
+    // the stripe lock keeps the journal records of this inode in order -
+    // the seqlock is released before the record is written
+    meta->xattrLocker().LockWrite();
+    struct stat rstat;
+    {
+      diamondMeta::StatWriter st(*meta);
+
+      if (to_set & FUSE_SET_ATTR_MODE) {
+        st->st_mode = attr->st_mode;
+      }
+      if (to_set & FUSE_SET_ATTR_UID) {
+        st->st_uid = attr->st_uid;
+      }
+      if (to_set & FUSE_SET_ATTR_GID) {
+        st->st_gid = attr->st_gid;
+      }
+
+      if (to_set & FUSE_SET_ATTR_SIZE) {
+        st->st_size = attr->st_size;
+      }
+    
+      if (to_set & FUSE_SET_ATTR_ATIME) {
+        st->st_atime = attr->st_atime;
+        st->st_atim.tv_sec = attr->st_atim.tv_sec;
+        st->st_atim.tv_nsec = attr->st_atim.tv_nsec;
+      }
+
+      if (to_set & FUSE_SET_ATTR_MTIME) {
+        st->st_mtime = attr->st_mtime;
+        st->st_mtim.tv_sec = attr->st_mtim.tv_sec;
+        st->st_mtim.tv_nsec = attr->st_mtim.tv_nsec;
+      }
+
+      rstat = *st;
+    }
+
+    if (FS->getJournal())
+	FS->getJournal()->logSetattr(meta->getIno(), rstat);
+    meta->xattrLocker().UnLockWrite();
+
+    if (finode)
+      FS->dirtyFile(finode->getIno(), diamondWriteBack::kInode | ((to_set & FUSE_SET_ATTR_SIZE) ? diamondWriteBack::kData : 0));
+    else
+      FS->dirtyDir(dinode->getIno(), diamondWriteBack::kInode);
+    (!fuse_do_reply)?0:fuse_reply_attr (req, &rstat, attrcachetime);
+    return ;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Lookup an entry
+  //--------------------------------------------------------------------------
+
+  static void
+  lookup (fuse_req_t req,
+          fuse_ino_t parent,
+          const char *name)
+  {
+    OpTimer timer(kOpLookup, parent);
+    struct fuse_entry_param e;
+    diamond_static_debug("name=%s", name);
+
+    memset(&e, 0, sizeof ( e));
+
+    diamond_ino_t ino;
+
+    // fast path: a single probe in the name index, verified by the link key of the inode
+    if (!FS->findName(DIAMOND_INODE(parent), name, ino) ||
+        !stat_inode(ino, diamondCache::linkKey(DIAMOND_INODE(parent), name), e.attr, &e.generation)) {
+      diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
+
+      if (!inode) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+
+      bool found;
+      {
+	diamond::common::RWMutexReadLock dLock(inode->Locker());
+	found = inode->findName(name, ino);
+      }
+
+      if (!found) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+
+      if (!stat_inode(ino, 0, e.attr, &e.generation)) {
+	// very unlikely if not impossible
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+    }
+      
+    e.ino = DIAMOND_TO_INODE(ino);
+    e.attr_timeout = attrcachetime;
+    e.entry_timeout = entrycachetime;
+    dump_stat(&e.attr);
+    (!fuse_do_reply)?0:fuse_reply_entry(req,&e);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Copy the stat and generation of a file or directory inode, optionally
+  //! verifying the link key of its (parent, name)
+  //--------------------------------------------------------------------------
+
+  static bool
+  stat_inode (const diamond_ino_t& ino, uint64_t linkkey, struct stat& st, uint64_t* generation = 0)
+  {
+    diamondMeta* meta = 0;
+    diamondCache::diamondDirPtr dinode = FS->getDir(ino, false, false);
+    diamondCache::diamondFilePtr finode;
+
+    if (dinode) {
+      meta = dinode.get();
+    } else {
+      finode = FS->getFile(ino, false, false);
+      if (!finode)
+	return false;
+      meta = finode.get();
+    }
+
+    if (linkkey && (meta->getLinkKey() != linkkey))
+      return false;
+
+    meta->copyStat(st);
+    if (generation)
+      *generation = meta->getGeneration();
+    return true;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Readdir offsets: 0 -> '.', 1 -> '..', n+2 -> directory cursor n
+  //!
+  //! The directory cursor is the sequence number of an entry, which stays
+  //! valid while entries are created and unlinked concurrently. With 'plus'
+  //! set the entries carry full attributes (readdirplus).
+  //--------------------------------------------------------------------------
+
+  static const off_t kDirCursorOffset = 2;
+
+  static size_t
+  dir_add (fuse_req_t req,
+           char* buf,
+           size_t size,
+           const char* name,
+           struct fuse_entry_param& e,
+           off_t off,
+           bool plus)
+  {
+#if FUSE_VERSION >= 29
+    if (plus)
+      return fuse_add_direntry_plus(req, buf, size, name, &e, off);
+#endif
+    return fuse_add_direntry(req, buf, size, name, &e.attr, off);
+  }
+
+  static size_t
+  dir_fill (fuse_req_t req,
+            fuse_ino_t ino,
+            diamondCache::diamondDirPtr& dir,
+            char* buf,
+            size_t size,
+            off_t off,
+            bool plus)
+  {
+    struct fuse_entry_param e;
+    size_t used = 0;
+    size_t len;
+
+    memset(&e, 0, sizeof ( e));
+
+    // '.' and '..' are never looked up by the kernel - inode and type only
+    e.attr.st_ino = ino;
+    e.attr.st_mode = S_IFDIR;
+
+    if (off < 1) {
+      len = dir_add(req, buf + used, size - used, ".", e, 1, plus);
+      if (len > (size - used))
+	return used;
+      used += len;
+    }
+
+    if (off < kDirCursorOffset) {
+      len = dir_add(req, buf + used, size - used, "..", e, kDirCursorOffset, plus);
+      if (len > (size - used))
+	return used;
+      used += len;
+      off = kDirCursorOffset;
+    }
+
+    uint64_t next = off - kDirCursorOffset;
+    std::string name;
+    diamond_ino_t child;
+
+    diamond::common::RWMutexReadLock dLock(dir->Locker());
+    while (dir->nextEntry(next, name, child)) {
+      memset(&e, 0, sizeof ( e));
+      if (plus) {
+	if (!stat_inode(child, 0, e.attr, &e.generation))
+	  continue;
+	e.ino = DIAMOND_TO_INODE(child);
+	e.attr_timeout = attrcachetime;
+	e.entry_timeout = entrycachetime;
+      } else {
+	e.attr.st_ino = DIAMOND_TO_INODE(child);
+      }
+      len = dir_add(req, buf + used, size - used, name.c_str(), e, next + kDirCursorOffset, plus);
+      if (len > (size - used))
+	break;
+      used += len;
+    }
+    return used;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Open a directory
+  //--------------------------------------------------------------------------
+  static void 
+  opendir (fuse_req_t req, 
+	   fuse_ino_t ino,
+	   struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpOpendir, ino);
+    diamond_static_debug("ino=%llx", ino);
+
+    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(ino), false, false);
+
+    if (!inode) {
+      diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
+      if (!finode) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      } else {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOTDIR);
+	return;
+      }
+    }
+    
+    // store the shared pointer to the directory as directory handle
+    fi->fh = (uint64_t) new diamondCache::diamondDirPtr(inode);
+    (!fuse_do_reply)?0:fuse_reply_open(req, fi);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Read the entries from a directory starting at the cursor in off
+  //--------------------------------------------------------------------------
+
+  static void
+  readdir (fuse_req_t req,
+           fuse_ino_t ino,
+           size_t size,
+           off_t off,
+           struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpReaddir, ino, off, size);
+    diamond_static_debug("ino=%llx size=%llu off=%llu", ino, (unsigned long long) size, (unsigned long long) off);
+
+    if (!fi || !fi->fh) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EBADF);
+      return;
+    }
+
+    diamondCache::diamondDirPtr* dir = (diamondCache::diamondDirPtr*) fi->fh;
+    std::vector<char> buf(size);
+    size_t used = dir_fill(req, ino, *dir, &buf[0], size, off, false);
+    (!fuse_do_reply)?0:fuse_reply_buf(req, used ? &buf[0] : NULL, used);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Read the entries of a directory including their attributes
+  //--------------------------------------------------------------------------
+
+  static void
+  readdirplus (fuse_req_t req,
+               fuse_ino_t ino,
+               size_t size,
+               off_t off,
+               struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpReaddirplus, ino, off, size);
+    diamond_static_debug("ino=%llx size=%llu off=%llu", ino, (unsigned long long) size, (unsigned long long) off);
+
+    if (!fi || !fi->fh) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EBADF);
+      return;
+    }
+
+    diamondCache::diamondDirPtr* dir = (diamondCache::diamondDirPtr*) fi->fh;
+    std::vector<char> buf(size);
+    size_t used = dir_fill(req, ino, *dir, &buf[0], size, off, true);
+    (!fuse_do_reply)?0:fuse_reply_buf(req, used ? &buf[0] : NULL, used);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Release a directory handle
+  //--------------------------------------------------------------------------
+
+  static void
+  releasedir (fuse_req_t req, 
+	      fuse_ino_t ino,
+	      struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpReleasedir, ino);
+    if (fi->fh) {
+      delete ((diamondCache::diamondDirPtr*) fi->fh);
+      fi->fh = 0;
+    }
+    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Return statistics about the filesystem
+  //--------------------------------------------------------------------------
+
+  static void
+  statfs (fuse_req_t req, fuse_ino_t ino)
+  {
+    OpTimer timer(kOpStatfs, ino);
+    diamond_static_debug("");
+    struct statvfs stat_fs;
+    memset(&stat_fs, 0, sizeof (stat_fs));
+
+    // file data and inodes against the configured capacity
+    diamondCapacity::fillStatfs(stat_fs);
+    stat_fs.f_fsid = 99;
+    stat_fs.f_flag = 1;
+    stat_fs.f_namemax = 512;
+
+    (!fuse_do_reply)?0:fuse_reply_statfs(req, &stat_fs);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Make a special (device) file, FIFO, or socket
+  //--------------------------------------------------------------------------
+
+  static void
+  mknod (fuse_req_t req,
+         fuse_ino_t parent,
+         const char *name,
+         mode_t mode,
+         dev_t rdev)
+  {
+    diamond_static_debug("");
+  }
+
+  //--------------------------------------------------------------------------
+  //! Create a directory with a given name
+  //--------------------------------------------------------------------------
+
+  static void
+  mkdir (fuse_req_t req,
+         fuse_ino_t parent,
+         const char *name,
+         mode_t mode)
+  {
+    OpTimer timer(kOpMkdir, parent);
+    diamond_static_debug("");
+
+    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
+
+    if (!inode) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+      return ;
+    }
+
+    if (!diamondCapacity::haveInode()) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOSPC);
+      return ;
+    }
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof ( e));
+    diamondCache::diamondDirPtr new_inode;
+
+    {
+      diamond::common::RWMutexWriteLock dLock(inode->Locker());
+
+      if (inode->isRemoved()) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return ;
+      }
+
+      diamond_ino_t ino;
+      if (!inode->findName(name, ino)) {
+	// create a new entry
+	uint64_t generation;
+	diamond_ino_t new_ino = FS->newInode(&generation);
+	new_inode = FS->getDir(new_ino, true, true, name );
+	new_inode->makeStat(req?(fuse_req_ctx(req)->uid):0, req?(fuse_req_ctx(req)->gid):0, S_IFDIR | mode, 0);
+	new_inode->setGeneration(generation);
+	new_inode->setLinkKey(diamondCache::linkKey(inode->getIno(), name));
+	new_inode->copyStat(e.attr);
+	e.generation = generation;
+
+	// attach to the parent
+	inode->addName(name, new_ino);
+	FS->addName(inode->getIno(), name, new_ino);
+	FS->dirtyDir(new_ino, diamondWriteBack::kInode);
+	FS->dirtyDir(inode->getIno(), diamondWriteBack::kEntries);
+	if (FS->getJournal())
+	  FS->getJournal()->logMkdir(inode->getIno(), name, new_ino, generation, e.attr);
+      }
+    }
+
+    if (!new_inode) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EEXIST);
+      return ;
+    }
+
+    e.ino = e.attr.st_ino;
+    e.attr_timeout  = attrcachetime;
+    e.entry_timeout = entrycachetime;
+
+    dump_stat(&e.attr);
+    diamond_static_debug("ino=%s name=%s\n", new_inode->getIno().c_str(), name);
+    (!fuse_do_reply)?0:fuse_reply_entry(req, &e);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Remove (delete) the given file, symbolic link, hard link,or special node
+  //--------------------------------------------------------------------------
+
+  static void
+  unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
+  {
+    OpTimer timer(kOpUnlink, parent);
+    diamond_static_debug("");
+
+    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
+
+    if (!inode) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+      return ;
+    }
+
+    int rc = 0;
+    {
+      diamond::common::RWMutexWriteLock dLock(inode->Locker());
+
+      diamond_ino_t ino;
+      // remove the file and update the parent
+      if (!inode->findName(name, ino) || FS->rmFile(ino)) {
+	rc = ENOENT;
+      } else {
+	inode->rmName(name);
+	FS->rmName(inode->getIno(), name);
+	FS->dirtyDir(inode->getIno(), diamondWriteBack::kEntries);
+	if (FS->getJournal())
+	  FS->getJournal()->logUnlink(inode->getIno(), name, ino);
+      }
+    }
+
+    (!fuse_do_reply)?0:fuse_reply_err(req, rc);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Remove the given directory
+  //--------------------------------------------------------------------------
+
+  static void
+  rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
+  {
+    OpTimer timer(kOpRmdir, parent);
+    diamond_static_debug("");
+
+    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
+
+    if (!inode) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+      return ;
+    }
+
+    int rc = 0;
+    for (;;) {
+      diamond_ino_t ino;
+      diamondCache::diamondDirPtr child;
+      {
+	diamond::common::RWMutexReadLock dLock(inode->Locker());
+	if (inode->findName(name, ino))
+	  child = FS->getDir(ino, false, false);
+      }
+
+      if (!child) {
+	rc = ENOENT;
+	break;
+      }
+
+      // the parent and the child are locked in inode order
+      diamondDirWriteLock dLock(inode.get(), child.get());
+
+      diamond_ino_t cino;
+      if (!inode->findName(name, cino) || (cino != ino)) {
+	// the entry changed while unlocked - resolve it again
+	continue;
+      }
+
+      if (child->nEntries()) {
+	rc = ENOTEMPTY;
+	break;
+      }
+
+      // remove 'name' directory
+      if ( FS->rmDir(ino) ) {
+	rc = ENOENT;
+	break;
+      }
+      child->setRemoved();
+
+      // update parent
+      inode->rmName(name);
+      FS->rmName(inode->getIno(), name);
+      FS->dirtyDir(inode->getIno(), diamondWriteBack::kEntries);
+      if (FS->getJournal())
+	FS->getJournal()->logRmdir(inode->getIno(), name, ino);
+      break;
+    }
+
+    (!fuse_do_reply)?0:fuse_reply_err(req, rc);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Rename the file, directory, or other object
+  //--------------------------------------------------------------------------
+
+  static void
+  rename (fuse_req_t req,
+          fuse_ino_t parent,
+          const char *name,
+          fuse_ino_t newparent,
+          const char *newname)
+  {
+    OpTimer timer(kOpRename, parent);
+    diamond_static_debug("parent=%llx newparent=%llx name=%s newname=%s", parent, newparent, name, newname);
+
+    diamondCache::diamondDirPtr dinode;
+    diamondCache::diamondDirPtr tinode;
+
+    dinode = FS->getDir(DIAMOND_INODE(parent), false, false);
+    tinode = FS->getDir(DIAMOND_INODE(newparent), false, false);
+    
+    if ( (!dinode) || (!tinode)) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+      return ;
+    }
+
+    int rc = 0;
+    for (;;) {
+      diamond_ino_t ino;
+      diamond_ino_t tino;
+      diamondCache::diamondDirPtr target;
+      {
+	diamond::common::RWMutexReadLock tLock(tinode->Locker());
+	if (tinode->findName(newname, tino))
+	  target = FS->getDir(tino, false, false);
+      }
+
+      // source and target directory and a replaced directory are locked in
+      // inode order
+      diamondDirWriteLock dLock(dinode.get(), tinode.get(), target.get());
+
+      bool exists = tinode->findName(newname, tino);
+      if (target ? (!exists || (tino != target->getIno())) : (exists && FS->getDir(tino, false, false))) {
+	// the target changed while unlocked - resolve it again
+	continue;
+      }
+
+      if (dinode->isRemoved() || tinode->isRemoved() || !dinode->findName(name, ino)) {
+	rc = ENOENT;
+      } else if (exists && (tino != ino) && target && target->nEntries()) {
+	rc = ENOTEMPTY;
+      } else if (!exists || (tino != ino)) {
+	if (exists) {
+	  // the target exists - a directory is removed like by rmdir
+	  if (target) {
+	    FS->rmDir(tino);
+	    target->setRemoved();
+	  } else {
+	    FS->rmFile(tino);
+	  }
+	  tinode->rmName(newname);
+	  FS->rmName(tinode->getIno(), newname);
+	}
+
+	// update source
+	dinode->rmName(name);
+	FS->rmName(dinode->getIno(), name);
+
+	// update target
+	tinode->addName(newname, ino);
+	FS->addName(tinode->getIno(), newname, ino);
+
+	// rename the object itself
+	diamondMeta* meta = 0;
+	diamondCache::diamondFilePtr finode = FS->getFile(ino,false,false);
+	diamondCache::diamondDirPtr cinode;
+	if (finode) {
+	  meta = finode.get();
+	} else {
+	  cinode = FS->getDir(ino, false, false);
+	  meta = cinode.get();
+	}
+
+	if (meta) {
+	  meta->setName(newname);
+	  meta->setLinkKey(diamondCache::linkKey(tinode->getIno(), newname));
+	  if (finode)
+	    FS->dirtyFile(ino, diamondWriteBack::kInode);
+	  else
+	    FS->dirtyDir(ino, diamondWriteBack::kInode);
+	}
+
+	FS->dirtyDir(dinode->getIno(), diamondWriteBack::kEntries);
+	FS->dirtyDir(tinode->getIno(), diamondWriteBack::kEntries);
+	if (FS->getJournal())
+	  FS->getJournal()->logRename(dinode->getIno(), name, tinode->getIno(), newname, ino);
+      }
+      break;
+    }
+
+    (!fuse_do_reply)?0:fuse_reply_err(req, rc);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //
+  //--------------------------------------------------------------------------
+
+  static void
+  access (fuse_req_t req, fuse_ino_t ino, int mask)
+  {
+    diamond_static_debug("");
+  }
+
+  //--------------------------------------------------------------------------
+  //! Open a file
+  //--------------------------------------------------------------------------
+
+  static void
+  open (fuse_req_t req,
+        fuse_ino_t ino,
+        struct fuse_file_info * fi)
+  {
+    OpTimer timer(kOpOpen, ino);
+    diamond_static_debug("ino=%llx", ino);
+    
+    diamondCache::diamondFilePtr* fptr = new diamondCache::diamondFilePtr;
+    *fptr = FS->getFile(DIAMOND_INODE(ino), true, false);
+    
+    if (!fptr) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+      return;
+    }
+    // store the shared pointer the file as file handle
+    fi->fh = (uint64_t) fptr;
+    //    fi->direct_io = 1;
+    (!fuse_do_reply)?0:fuse_reply_open(req, fi);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Create a file
+  //--------------------------------------------------------------------------
+  static void 
+  create (fuse_req_t req, 
+	  fuse_ino_t parent, 
+	  const char *name,
+	  mode_t mode, 
+	  struct fuse_file_info *fi)
+  {
+    OpTimer timer(kOpCreate, parent);
+    diamondCache::diamondDirPtr inode = FS->getDir(DIAMOND_INODE(parent), false, false);
+
+    if (!inode) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+      return;
+    }
+
+    if (!diamondCapacity::haveInode()) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENOSPC);
+      return;
+    }
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof ( e));
+    diamondCache::diamondFilePtr* fptr = 0;
+
+    {
+      diamond::common::RWMutexWriteLock dLock(inode->Locker());
+
+      if (inode->isRemoved()) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+
+      diamond_ino_t ino;
+      if (!inode->findName(name, ino)) {
+	uint64_t generation;
+	ino = FS->newInode(&generation);
+	fptr = new diamondCache::diamondFilePtr(FS->getFile(ino, true, true, name));
+	(*fptr)->makeStat(req?(fuse_req_ctx(req)->uid):0, req?(fuse_req_ctx(req)->gid):0, S_IFREG | mode, 0);
+	(*fptr)->setGeneration(generation);
+	(*fptr)->setLinkKey(diamondCache::linkKey(inode->getIno(), name));
+	(*fptr)->copyStat(e.attr);
+	e.generation = generation;
+
+	// attach to the parent
+	inode->addName(name, ino);
+	FS->addName(inode->getIno(), name, ino);
+	FS->dirtyFile(ino, diamondWriteBack::kInode);
+	FS->dirtyDir(inode->getIno(), diamondWriteBack::kEntries);
+	if (FS->getJournal())
+	  FS->getJournal()->logCreate(inode->getIno(), name, ino, generation, e.attr);
+      }
+    }
+
+    if (!fptr) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EEXIST);
+      return;
+    }
+
+    // store the shared pointer the file as file handle
+    fi->fh = (uint64_t) fptr;
+
+    e.ino = e.attr.st_ino;
+    e.attr_timeout  = attrcachetime;
+    e.entry_timeout = entrycachetime;
+
+    dump_stat(&e.attr);
+    diamond_static_debug("ino=%s name=%s\n", (*fptr)->getIno().c_str(), name);
+    (!fuse_do_reply)?0:fuse_reply_create(req, &e, fi);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Read from file. Returns the number of bytes transferred, or 0 if offset
+  //! was at or beyond the end of the file.
+  //--------------------------------------------------------------------------
+  
+  static void
+  read (fuse_req_t req,
+        fuse_ino_t ino,
+        size_t size,
+        off_t off,
+        struct fuse_file_info * fi)
+  {
+    OpTimer timer(kOpRead, ino, off, size);
+    diamondCache::diamondFilePtr* file = ((diamondCache::diamondFilePtr*)fi->fh);
+    
+    char* buffer=0;
+    size_t s = (*file)->peek(buffer, off, size);
+    diamond_static_debug("ino=%llx off=%llx size=%llu avail=%u", (unsigned long long)ino, (unsigned long long)off, (unsigned long long)size, s);
+    
+    (!fuse_do_reply)?0:fuse_reply_buf(req, buffer, s);
+    (*file)->release();
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Write function
+  //--------------------------------------------------------------------------
+
+  static void
+  write (fuse_req_t req,
+         fuse_ino_t ino,
+         const char *buf,
+         size_t size,
+         off_t off,
+         struct fuse_file_info * fi)
+  {
+    OpTimer timer(kOpWrite, ino, off, size);
+    diamond_static_debug("");
+    diamondCache::diamondFilePtr* file = ((diamondCache::diamondFilePtr*)fi->fh);
+    diamond_static_debug("ino=%llx off=%llx size=%llu", (unsigned long long)ino, (unsigned long long)off, (unsigned long long)size);
+    off_t s = (*file)->write(buf, off, size);
+    diamond_static_debug("size=%u offset=%llu", size, s);
+    if (s < 0) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, -s);
+      return;
+    }
+    FS->dirtyFile((*file)->getIno(), diamondWriteBack::kData | diamondWriteBack::kInode, off, size);
+    (!fuse_do_reply)?0:fuse_reply_write(req, size);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Release is called when FUSE is completely done with a file; at that point,
+  //! you can free up any temporarily allocated data structures.
+  //--------------------------------------------------------------------------
+
+  static void
+  release (fuse_req_t req,
+           fuse_ino_t ino,
+           struct fuse_file_info * fi)
+  {
+    OpTimer timer(kOpRelease, ino);
+    diamond_static_debug("");
+    if (fi && fi->fh) {
+      if (fi->fh) delete ((diamondCache::diamondFilePtr*)fi->fh);
+    }
+    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
+  }
+
+  //--------------------------------------------------------------------------
+  //! Flush any dirty information about the file to disk
+  //--------------------------------------------------------------------------
+
+  static void
+  fsync (fuse_req_t req,
+         fuse_ino_t ino,
+         int datasync,
+         struct fuse_file_info * fi)
+  {
+   diamond_static_debug("");
+  }
+
+  //--------------------------------------------------------------------------
+  //! Forget inode <-> path mapping
+  //--------------------------------------------------------------------------
+
+  static void
+  forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+  {
+    OpTimer timer(kOpForget, ino);
+    diamond_static_debug("");
+    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Called on each close so that the filesystem has a chance to report delayed errors
+  //! Important: there may be more than one flush call for each open.
+  //! Note: There is no guarantee that flush will ever be called at all!
+  //--------------------------------------------------------------------------
+
+  static void
+  flush (fuse_req_t req,
+         fuse_ino_t ino,
+         struct fuse_file_info * fi)
+  {
+    diamond_static_debug("");
+    (!fuse_do_reply)?0:fuse_reply_err(req, 0);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Get an extended attribute
+  //--------------------------------------------------------------------------
+#ifdef __APPLE__
+  static void getxattr (fuse_req_t req,
+                        fuse_ino_t ino,
+                        const char *name,
+                        size_t size,
+                        uint32_t position)
+#else
+
+  static void
+  getxattr (fuse_req_t req,
+            fuse_ino_t ino,
+            const char *name,
+            size_t size)
+#endif
+  {
+    OpTimer timer(kOpGetxattr, ino);
+    diamond_static_debug("name=%s size=%u", name, size);
+
+    // ignore capability requests
+    if (std::string(name) == "security.capability") {
+      (!fuse_do_reply)?0:fuse_reply_err(req, ENODATA);
+      return;
+    }
+
+    std::string value;
+    if (!virtual_xattr(ino, name, &value)) {
+      diamondMeta* meta = 0;
+
+      // try to get a file or a directory with that inode
+      diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
+      diamondCache::diamondDirPtr dinode;
+      if (!finode) {
+        dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
+        if (!dinode) {
+	  (!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	  return;
+        }
+        meta = dinode.get();
+      } else {
+        meta = finode.get();
+      }
+
+      int rc = meta->getXattr(name, value);
+      if (rc) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, rc);
+	return;
+      }
+    }
+
+    if (size == 0) {
+      (!fuse_do_reply)?0:fuse_reply_xattr(req, value.size());
+      return ;
+    }
+
+
+    if (value.size() > size)
+      	(!fuse_do_reply)?0:fuse_reply_err(req, ERANGE);
+    else
+      (!fuse_do_reply)?0:fuse_reply_buf(req, value.c_str(), value.size());
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Set extended attribute
+  //--------------------------------------------------------------------------
+#ifdef __APPLE__
+  static void setxattr (fuse_req_t req,
+                        fuse_ino_t ino,
+                        const char *name,
+                        const char *value,
+                        size_t size,
+                        int flags,
+                        uint32_t position)
+#else
+
+  static void
+  setxattr (fuse_req_t req,
+            fuse_ino_t ino,
+            const char *name,
+            const char *value,
+            size_t size,
+            int flags)
+#endif
+  {
+    OpTimer timer(kOpSetxattr, ino, 0, size);
+    diamond_static_debug("name=%s size=%d", name, size);
+    if (virtual_xattr(ino, name)) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EPERM);
+      return;
+    }
+
+    diamondMeta* meta = 0;
+
+    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
+    diamondCache::diamondDirPtr dinode;
+    if (!finode) {
+      dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
+      if (!dinode) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+      meta = dinode.get();
+    } else {
+      meta = finode.get();
+    }
+
+    int rc = meta->setXattr(name, value, size, flags);
+    if (!rc) {
+      if (finode)
+	FS->dirtyFile(finode->getIno(), diamondWriteBack::kInode);
+      else
+	FS->dirtyDir(dinode->getIno(), diamondWriteBack::kInode);
+      if (FS->getJournal())
+	FS->getJournal()->logSetxattr(meta->getIno(), name, value, size);
+    }
+    (!fuse_do_reply)?0:fuse_reply_err(req, rc);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! List extended attributes
+  //--------------------------------------------------------------------------
+
+  static void
+  listxattr (fuse_req_t req, fuse_ino_t ino, size_t size)
+  {
+    OpTimer timer(kOpListxattr, ino);
+    diamond_static_debug("");
+
+    diamondMeta* meta = 0;
+
+    // try to get a file or a directory with that inode
+    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
+    diamondCache::diamondDirPtr dinode;
+    if (!finode) {
+      dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
+      if (!dinode) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+      meta = dinode.get();
+    } else {
+      meta = finode.get();
+    }
+
+    std::string names;
+    meta->listXattr(names);
+
+    if (ino == FUSE_ROOT_ID) {
+      for (size_t i = 0; virtual_xattrs[i]; i++) {
+	names.append(virtual_xattrs[i]);
+	names.push_back('\0');
+      }
+    }
+
+    if (size == 0) {
+      (!fuse_do_reply)?0:fuse_reply_xattr(req, names.size());
+      return ;
+    }
+
+    if (names.size() > size)
+      	(!fuse_do_reply)?0:fuse_reply_err(req, ERANGE);
+    else
+      (!fuse_do_reply)?0:fuse_reply_buf(req, names.c_str(), names.size());
+    return ;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Remove extended attribute
+  //--------------------------------------------------------------------------
+
+  static void
+  removexattr (fuse_req_t req,
+               fuse_ino_t ino,
+               const char *name)
+  {
+    OpTimer timer(kOpRemovexattr, ino);
+    diamond_static_debug("");
+    if (virtual_xattr(ino, name)) {
+      (!fuse_do_reply)?0:fuse_reply_err(req, EPERM);
+      return;
+    }
+
+    diamondMeta* meta = 0;
+
+    // try to get a file or a directory with that inode
+    diamondCache::diamondFilePtr finode = FS->getFile(DIAMOND_INODE(ino),false,false);
+    diamondCache::diamondDirPtr dinode;
+    if (!finode) {
+      dinode = FS->getDir(DIAMOND_INODE(ino), false, false);
+      if (!dinode) {
+	(!fuse_do_reply)?0:fuse_reply_err(req, ENOENT);
+	return;
+      }
+      meta = dinode.get();
+    } else {
+      meta = finode.get();
+    }
+
+    int rc = meta->rmXattr(name);
+    if (!rc) {
+      if (finode)
+	FS->dirtyFile(finode->getIno(), diamondWriteBack::kInode);
+      else
+	FS->dirtyDir(dinode->getIno(), diamondWriteBack::kInode);
+      if (FS->getJournal())
+	FS->getJournal()->logRemovexattr(meta->getIno(), name);
+    }
+    (!fuse_do_reply)?0:fuse_reply_err(req, rc);
+    return;
+  }
+
+  //--------------------------------------------------------------------------
+  //! Singleton
+  //--------------------------------------------------------------------------
+  static diamondfs* FS;
+
+};
+
+#endif	/* DIAMONDFS_HH */
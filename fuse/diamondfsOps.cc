@@ -0,0 +1,18 @@
+/*
+ * File:   diamondfsOps.cc
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#include "diamondfs.hh"
+
+diamondfs* diamondfs::FS = 0;
+double diamondfs::entrycachetime = 1.0;
+double diamondfs::attrcachetime  = 1.0;
+bool diamondfs::fuse_do_reply=1;
+const char* diamondfs::op_names[] = {"getattr", "setattr", "lookup", "opendir", "readdir", "readdirplus",
+				     "releasedir", "statfs", "mkdir", "unlink", "rmdir", "rename", "open",
+				     "create", "read", "write", "release", "forget", "getxattr", "setxattr",
+				     "listxattr", "removexattr", 0};
+const char* diamondfs::virtual_xattrs[] = {"diamond.memory", "diamond.writeback", "diamond.journal", "diamond.ops", "diamond.locks", 0};
@@ -0,0 +1,175 @@
+// ----------------------------------------------------------------------
+// File: diamondtrace.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   diamondtrace.cc
+ *
+ * @brief  Offline decoder of the binary op trace rings written by diamondfs
+ *
+ * Reads any number of ring files, merges their records by start time and
+ * prints them as text or CSV.
+ */
+
+#include "common/Trace.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using diamond::common::Trace;
+
+struct TraceFile {
+  std::string path;
+  const Trace::Header* header;
+  size_t length;
+};
+
+struct Entry {
+  const Trace::Record* record;
+  const TraceFile* file;
+};
+
+static void
+usage ()
+{
+  fprintf(stderr, "usage: diamondtrace [-c] <trace file> ...\n"
+          "       -c : print CSV instead of text\n");
+}
+
+static bool
+mapFile (const char* path, TraceFile& file)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "error: cannot open %s errno=%d\n", path, errno);
+    return false;
+  }
+
+  struct stat st;
+  void* ptr = MAP_FAILED;
+  if (!fstat(fd, &st) && ((size_t) st.st_size >= Trace::kHeaderSize))
+    ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (ptr == MAP_FAILED) {
+    fprintf(stderr, "error: cannot map %s\n", path);
+    return false;
+  }
+
+  const Trace::Header* header = (const Trace::Header*) ptr;
+  if ((header->magic != Trace::kMagic) || (header->version != Trace::kVersion) ||
+      (header->recordsize != sizeof (Trace::Record)) ||
+      (Trace::kHeaderSize + header->capacity * sizeof (Trace::Record) > (size_t) st.st_size)) {
+    fprintf(stderr, "error: %s is not a trace file\n", path);
+    munmap(ptr, st.st_size);
+    return false;
+  }
+
+  file.path = path;
+  file.header = header;
+  file.length = st.st_size;
+  return true;
+}
+
+int
+main (int argc, char* argv[])
+{
+  bool csv = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "ch")) != -1) {
+    switch (opt) {
+    case 'c':
+      csv = true;
+      break;
+    default:
+      usage();
+      return EINVAL;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return EINVAL;
+  }
+
+  std::vector<TraceFile> files(argc - optind);
+  for (int i = optind; i < argc; i++) {
+    if (!mapFile(argv[i], files[i - optind]))
+      return EIO;
+  }
+
+  // the ring holds the last capacity records - with a wrapped ring the oldest
+  // slot may be the one overwritten when the writer stopped
+  std::vector<Entry> entries;
+  for (size_t f = 0; f < files.size(); f++) {
+    const Trace::Header* header = files[f].header;
+    const Trace::Record* records = (const Trace::Record*) ((const char*) header + Trace::kHeaderSize);
+    uint64_t head = header->head;
+    uint64_t first = (head > header->capacity) ? head - header->capacity + 1 : 0;
+    for (uint64_t i = first; i < head; i++) {
+      Entry e = {&records[i % header->capacity], &files[f]};
+      entries.push_back(e);
+    }
+  }
+
+  std::stable_sort(entries.begin(), entries.end(), [] (const Entry& a, const Entry& b) {
+    return a.record->start < b.record->start;
+  });
+
+  if (csv)
+    printf("start_ns,realtime_ns,pid,tid,op,ino,offset,size,latency_ns\n");
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    const Trace::Record* r = entries[i].record;
+    const Trace::Header* h = entries[i].file->header;
+    const char* op = (r->op < h->nops) ? h->opnames[r->op] : "unknown";
+    int64_t realtime = (int64_t) r->start + h->realtime;
+
+    if (csv) {
+      printf("%llu,%lld,%llu,%u,%s,%llu,%llu,%u,%u\n",
+             (unsigned long long) r->start, (long long) realtime,
+             (unsigned long long) h->pid, r->tid, op,
+             (unsigned long long) r->ino, (unsigned long long) r->offset,
+             r->size, r->latency);
+    } else {
+      time_t sec = realtime / 1000000000ll;
+      struct tm tm;
+      char date[32];
+      localtime_r(&sec, &tm);
+      strftime(date, sizeof (date), "%y%m%d %H:%M:%S", &tm);
+      printf("%s.%06lld tid=%u op=%-12s ino=%llx off=%llu size=%u latency=%.03f us\n",
+             date, (long long) ((realtime % 1000000000ll) / 1000), r->tid, op,
+             (unsigned long long) r->ino, (unsigned long long) r->offset,
+             r->size, r->latency / 1000.0);
+    }
+  }
+  return 0;
+}
@@ -26,8 +26,8 @@
 #ifdef __APPLE__
 #define FUSE_USE_VERSION 27
 #else
-#define FUSE_USE_VERSION 26
-//#pragma message("FUSE VERSION 26")
+// 2.9 is the first API version offering readdirplus
+#define FUSE_USE_VERSION 29
 #endif
 #endif
 
@@ -35,10 +35,334 @@ extern "C" {
 #include <fuse_lowlevel.h>
 }
 
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
 
 namespace llfusexx
 {
+  //----------------------------------------------------------------------------
+  //! Settings of the session loop - without threads the libfuse
+  //! multi-threaded loop is used
+  //----------------------------------------------------------------------------
+  struct loop_config
+  {
+    unsigned threads;       //!< fixed number of workers
+    std::vector<int> cpus;  //!< worker i runs on cpus[i % size], empty: no pinning
+    bool clone_fd;          //!< one /dev/fuse clone per worker if the kernel has it
+
+    loop_config() : threads(0), clone_fd(false) {}
+
+    //--------------------------------------------------------------------------
+    //! Parse a cpu list like '0-3,8'
+    //!
+    //! @return false if the list is malformed
+    //--------------------------------------------------------------------------
+    static bool parse_cpus( const char *list, std::vector<int> &cpus )
+    {
+      cpus.clear();
+      while( *list )
+      {
+        char *end;
+        long first = strtol( list, &end, 10 );
+        long last = first;
+        if( end == list || first < 0 )
+          return false;
+        if( *end == '-' )
+        {
+          list = end + 1;
+          last = strtol( list, &end, 10 );
+          if( end == list || last < first )
+            return false;
+        }
+        for( long cpu = first; cpu <= last; cpu++ )
+          cpus.push_back( cpu );
+        if( *end == ',' )
+          end++;
+        else if( *end )
+          return false;
+        list = end;
+      }
+      return !cpus.empty();
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Fixed pool of workers serving one session
+  //!
+  //! Every worker owns its receive buffer and optionally its own clone of the
+  //! /dev/fuse descriptor, so requests are read and answered without sharing
+  //! a channel between the workers. The workers block all signals - the
+  //! signal handlers of the session run on the thread calling loop(), which
+  //! stops the workers once the session has exited.
+  //----------------------------------------------------------------------------
+  class session_pool
+  {
+    public:
+      session_pool( struct fuse_session *session, struct fuse_chan *channel,
+                    const loop_config &config ) :
+        session( session ), channel( channel ), config( config ), error( 0 ),
+        finished( 0 )
+      {
+      }
+
+      //------------------------------------------------------------------------
+      //! Run the workers until the session exits
+      //!
+      //! @return 0 on success, -1 on error
+      //------------------------------------------------------------------------
+      int loop()
+      {
+        std::vector<worker> workers( config.threads );
+        size_t bufsize = fuse_chan_bufsize( channel );
+        bool clone = config.clone_fd;
+        sigset_t all, old;
+
+        // the workers inherit the blocked signals
+        sigfillset( &all );
+        pthread_sigmask( SIG_BLOCK, &all, &old );
+
+        size_t started = 0;
+        for( size_t i = 0; i < workers.size(); i++ )
+        {
+          worker &w = workers[i];
+          w.pool = this;
+          w.chan = clone ? clone_chan( session, channel ) : 0;
+          if( clone && !w.chan )
+          {
+            fprintf( stderr, "fuse: cannot clone the device errno=%d - the workers share it\n", errno );
+            clone = false;
+          }
+          w.owned = ( w.chan != 0 );
+          if( !w.chan )
+            w.chan = channel;
+          w.cpu = config.cpus.empty() ? -1 : config.cpus[i % config.cpus.size()];
+          w.bufsize = bufsize;
+          w.buf = (char*) malloc( bufsize );
+          if( !w.buf || pthread_create( &w.thread, NULL, &session_pool::run, &w ) )
+          {
+            fprintf( stderr, "fuse: cannot start worker %u\n", (unsigned) i );
+            fuse_session_exit( session );
+            error = -1;
+            break;
+          }
+          started++;
+        }
+        pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+        // a signal only sets the exit flag of the session - poll for it
+        {
+          std::unique_lock<std::mutex> lock( mutex );
+          while( !fuse_session_exited( session ) && finished < started )
+            cond.wait_for( lock, std::chrono::milliseconds( 200 ) );
+        }
+        fuse_session_exit( session );
+
+        // workers in a handler finish it, cancellation is enabled in receive only
+        for( size_t i = 0; i < started; i++ )
+          pthread_cancel( workers[i].thread );
+        for( size_t i = 0; i < started; i++ )
+          pthread_join( workers[i].thread, NULL );
+
+        for( size_t i = 0; i < workers.size(); i++ )
+        {
+          if( workers[i].owned )
+            fuse_chan_destroy( workers[i].chan );
+          free( workers[i].buf );
+        }
+        return error;
+      }
+
+    private:
+      struct worker
+      {
+        session_pool      *pool;
+        pthread_t          thread;
+        struct fuse_chan  *chan;
+        bool               owned;    //!< a clone destroyed with the pool
+        int                cpu;
+        char              *buf;
+        size_t             bufsize;
+
+        worker() : pool( 0 ), chan( 0 ), owned( false ), cpu( -1 ), buf( 0 ),
+          bufsize( 0 ) {}
+      };
+
+      //------------------------------------------------------------------------
+      //! Receive and process requests until the session exits
+      //------------------------------------------------------------------------
+      static void *run( void *arg )
+      {
+        worker *w = (worker*) arg;
+        session_pool *pool = w->pool;
+        struct fuse_session *se = pool->session;
+
+        pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, NULL );
+#ifdef __linux__
+        if( w->cpu >= 0 )
+        {
+          cpu_set_t set;
+          CPU_ZERO( &set );
+          CPU_SET( w->cpu, &set );
+          if( pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) )
+            fprintf( stderr, "fuse: cannot pin worker to cpu %d\n", w->cpu );
+        }
+#endif
+
+        while( !fuse_session_exited( se ) )
+        {
+          struct fuse_chan *ch = w->chan;
+          struct fuse_buf fbuf;
+          memset( &fbuf, 0, sizeof( fbuf ) );
+          fbuf.mem = w->buf;
+          fbuf.size = w->bufsize;
+
+          pthread_setcancelstate( PTHREAD_CANCEL_ENABLE, NULL );
+          int res = fuse_session_receive_buf( se, &fbuf, &ch );
+          pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, NULL );
+
+          if( res == -EINTR || res == -EAGAIN )
+            continue;
+          if( res <= 0 )
+          {
+            if( res < 0 )
+            {
+              fuse_session_exit( se );
+              pool->error = -1;
+            }
+            break;
+          }
+          if( fuse_session_exited( se ) )
+            break;
+
+          fuse_session_process_buf( se, &fbuf, ch );
+        }
+
+        {
+          std::lock_guard<std::mutex> lock( pool->mutex );
+          pool->finished++;
+        }
+        pool->cond.notify_all();
+        return NULL;
+      }
+
+      //------------------------------------------------------------------------
+      //! Channel on a clone of the device of channel - requests read from it
+      //! are answered on it
+      //------------------------------------------------------------------------
+      static struct fuse_chan *clone_chan( struct fuse_session *se,
+                                           struct fuse_chan *channel )
+      {
+        static struct fuse_chan_ops ops = { &chan_receive, &chan_send,
+                                            &chan_destroy };
+
+        int fd = ::open( "/dev/fuse", O_RDWR );
+        if( fd < 0 )
+          return 0;
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+
+        uint32_t master = fuse_chan_fd( channel );
+        struct fuse_chan *clone = 0;
+        if( !ioctl( fd, FUSE_DEV_IOC_CLONE, &master ) )
+          clone = fuse_chan_new( &ops, fd, fuse_chan_bufsize( channel ), se );
+        if( !clone )
+        {
+          int err = errno;
+          ::close( fd );
+          errno = err;
+        }
+        return clone;
+      }
+
+      //------------------------------------------------------------------------
+      //! Channel operations of a clone - the error handling of the libfuse
+      //! kernel channel
+      //------------------------------------------------------------------------
+      static int chan_receive( struct fuse_chan **chp, char *buf, size_t size )
+      {
+        // sizeof(struct fuse_in_header)
+        static const size_t in_header_size = 40;
+        struct fuse_chan *ch = *chp;
+        struct fuse_session *se = (struct fuse_session*) fuse_chan_data( ch );
+        ssize_t res;
+
+        do
+        {
+          res = ::read( fuse_chan_fd( ch ), buf, size );
+          // ENOENT: the request was interrupted and answered already
+        } while( res == -1 && errno == ENOENT && !fuse_session_exited( se ) );
+
+        int err = errno;
+        if( fuse_session_exited( se ) )
+          return 0;
+        if( res == -1 )
+        {
+          // ENODEV: the filesystem was unmounted
+          if( err == ENODEV )
+          {
+            fuse_session_exit( se );
+            return 0;
+          }
+          if( err != EINTR && err != EAGAIN )
+            perror( "fuse: reading device" );
+          return -err;
+        }
+        if( (size_t) res < in_header_size )
+        {
+          fprintf( stderr, "fuse: short read on fuse device\n" );
+          return -EIO;
+        }
+        return res;
+      }
+
+      static int chan_send( struct fuse_chan *ch, const struct iovec iov[],
+                            size_t count )
+      {
+        if( !iov )
+          return 0;
+
+        ssize_t res = ::writev( fuse_chan_fd( ch ), iov, count );
+        int err = errno;
+        if( res == -1 )
+        {
+          struct fuse_session *se = (struct fuse_session*) fuse_chan_data( ch );
+          // ENOENT: the request was interrupted meanwhile
+          if( !fuse_session_exited( se ) && err != ENOENT )
+            perror( "fuse: writing device" );
+          return -err;
+        }
+        return 0;
+      }
+
+      static void chan_destroy( struct fuse_chan *ch )
+      {
+        ::close( fuse_chan_fd( ch ) );
+      }
+
+      struct fuse_session     *session;
+      struct fuse_chan        *channel;
+      loop_config              config;
+      int                      error;
+      size_t                   finished;  //!< workers returned
+      std::mutex               mutex;
+      std::condition_variable  cond;
+  };
+
   //----------------------------------------------------------------------------
   //! Interface to the low-level FUSE API
   //----------------------------------------------------------------------------
@@ -66,6 +390,11 @@ namespace llfusexx
         return operations;
       }
 
+      //------------------------------------------------------------------------
+      //! Session loop settings
+      //------------------------------------------------------------------------
+      loop_config loop_settings;
+
     public:
       //------------------------------------------------------------------------
       //! Constructor
@@ -82,6 +411,9 @@ namespace llfusexx
 	operations.setattr      = &T::setattr;
 	//        operations.access       = &T::access;
         operations.readdir      = &T::readdir;
+#if FUSE_VERSION >= 29
+        operations.readdirplus  = &T::readdirplus;
+#endif
 	//        operations.mknod        = &T::mknod;
 	operations.mkdir        = &T::mkdir;
 	operations.unlink       = &T::unlink;
@@ -104,6 +436,14 @@ namespace llfusexx
 	operations.removexattr  = &T::removexattr;
       }
 
+      //------------------------------------------------------------------------
+      //! Configure the session loop used by daemonize
+      //------------------------------------------------------------------------
+      void set_loop( const loop_config &config )
+      {
+        loop_settings = config;
+      }
+
       //------------------------------------------------------------------------
       //! Mount the filesystem with the supplied arguments and run the daemon
       //!
@@ -158,9 +498,16 @@ namespace llfusexx
               fuse_session_add_chan( session, channel );
 
               //----------------------------------------------------------------
-              // Start the multithreaded session loop
+              // Start the multithreaded session loop - our worker pool if
+              // configured
               //----------------------------------------------------------------
-              error = fuse_session_loop_mt( session );
+              if( loop_settings.threads )
+              {
+                session_pool pool( session, channel, loop_settings );
+                error = pool.loop();
+              }
+              else
+                error = fuse_session_loop_mt( session );
 
               //----------------------------------------------------------------
               // Clean up
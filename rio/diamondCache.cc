@@ -6,70 +6,404 @@
  */
 
 #include "diamondCache.hh"
+#include "diamondCapacity.hh"
+#include "common/hash/spooky.hh"
+
+#include <algorithm>
 
 DIAMONDRIONAMESPACE_BEGIN
 
-diamondCache::diamondCache (std::string mountpoint) { }
+// every name lookup and update read locks the name index - only a rebuild write locks it
+diamondCache::diamondCache (std::string mountpoint, uint64_t nameindexsize) :
+mFilesMutex("diamondCache::mFilesMutex"), mDirsMutex("diamondCache::mDirsMutex"), mNameIndex(nameindexsize, 0, true),
+mNameIndexMutex("diamondCache::mNameIndexMutex", diamond::common::RWMutex::kReaderBiased), mNameIndexMax(0)
+{
+  mNameIndex.SetProbeLimit(kNameIndexProbes);
+}
+
+diamondCache::diamondCache (const diamondCache& orig) :
+mFilesMutex("diamondCache::mFilesMutex"), mDirsMutex("diamondCache::mDirsMutex"), mNameIndex(kNameIndexSize, 0, true),
+mNameIndexMutex("diamondCache::mNameIndexMutex", diamond::common::RWMutex::kReaderBiased), mNameIndexMax(0)
+{
+  mNameIndex.SetProbeLimit(kNameIndexProbes);
+}
+
+diamondCache::~diamondCache ()
+{
+  disableJournal();
+  disableWriteBack();
+}
+
+int
+diamondCache::enableWriteBack (const std::string& path, const std::string& indexdir, uint64_t keyspace, unsigned interval_ms)
+{
+  disableWriteBack();
+  std::unique_ptr<diamondWriteBack> writeback(new diamondWriteBack(*this));
+  int rc = writeback->open(path, indexdir, keyspace, interval_ms);
+  if (!rc)
+    mWriteBack = std::move(writeback);
+  return rc;
+}
 
-diamondCache::diamondCache (const diamondCache& orig) { }
+void
+diamondCache::disableWriteBack ()
+{
+  if (mWriteBack) {
+    mWriteBack->close();
+    mWriteBack.reset();
+  }
+}
+
+int
+diamondCache::enableJournal (const std::string& dir, unsigned sync_ms, unsigned checkpoint_s, unsigned load_threads)
+{
+  disableJournal();
+  std::unique_ptr<diamondJournal> journal(new diamondJournal(*this));
+  int rc = journal->open(dir, sync_ms, checkpoint_s, load_threads);
+  if (!rc)
+    mJournal = std::move(journal);
+  return rc;
+}
 
-diamondCache::~diamondCache () { }
+void
+diamondCache::disableJournal ()
+{
+  if (mJournal) {
+    mJournal->close();
+    mJournal.reset();
+  }
+}
 
+diamond::common::OpStats&
+diamondCache::stats ()
+{
+  static const char* const names[] = {
+    "file.hit", "file.miss", "file.load", "dir.hit", "dir.miss", "dir.load", "name.hit", "name.miss", 0
+  };
+  static diamond::common::OpStats counters(names, false);
+  return counters;
+}
 
 diamondCache::diamondFilePtr 
 diamondCache::getFile(diamond_ino_t ino, bool update_lru, bool create, std::string name)
 {
-  diamond::common::RWMutexWriteLock flock(mFilesMutex);
+  if (!update_lru) {
+    // a hit without an LRU touch only reads the map
+    diamond::common::RWMutexReadLock flock(mFilesMutex);
+    lru_file_map_t::iterator it = mFiles.find(ino);
+    if (it != mFiles.end()) {
+      stats().Count(kFileHit);
+      return it->second.second;
+    }
+  }
 
-  if (mFiles.count(ino)) {
-    // return an existing ino
-    if (update_lru)
-      mFilesLRU.splice( mFiles[ino].first, mFilesLRU, mFilesLRU.end());
+  if (!update_lru && !create) {
+    stats().Count(kFileMiss);
   } else {
-    if (!create)
-      return 0;
+    diamond::common::RWMutexWriteLock flock(mFilesMutex);
+
+    lru_file_map_t::iterator it = mFiles.find(ino);
+    if (it != mFiles.end()) {
+      // return an existing ino
+      if (update_lru)
+        mFilesLRU.splice( mFilesLRU.begin(), mFilesLRU, it->second.first);
+      stats().Count(kFileHit);
+      return it->second.second;
+    }
+    stats().Count(kFileMiss);
 
-    // create a new one
-    diamondFilePtr f = std::make_shared<diamondFile>(new diamondFile(ino,name));
-    mFilesLRU.push_front(ino);
-    mFiles[ino] = std::make_pair( mFilesLRU.begin(), f );
+    if (create) {
+      // create a new one - object and control block share one slab object
+      diamondFilePtr f = std::allocate_shared<diamondFile>(SlabAllocator<diamondFile, diamondFileSlab>(), ino, name);
+      mFilesLRU.push_front(ino);
+      mFiles.insert(std::make_pair(ino, std::make_pair( mFilesLRU.begin(), f )));
+      diamondCapacity::addInode();
 
-    // evt. shrink here
+      // evt. shrink here
+      return f;
+    }
   }
-  return mFiles[ino].second;
+
+  if (!mWriteBack)
+    return 0;
+
+  // load on miss - an index probe filters inodes not stored as files
+  uint64_t inode = DIAMOND_TO_INODE(ino);
+  if (!mWriteBack->hasFile(inode) || mWriteBack->isRemoved(inode))
+    return 0;
+
+  diamondFilePtr f = mWriteBack->loadFile(inode);
+  if (!f)
+    return 0;
+  stats().Count(kFileLoad);
+  return publishFile(f);
 }
 
 diamondCache::diamondDirPtr 
 diamondCache::getDir(diamond_ino_t ino, bool update_lru, bool create, std::string name)
 {
-  diamond::common::RWMutexWriteLock flock(mDirsMutex);
+  if (!update_lru) {
+    // a hit without an LRU touch only reads the map
+    diamond::common::RWMutexReadLock flock(mDirsMutex);
+    lru_dir_map_t::iterator it = mDirs.find(ino);
+    if (it != mDirs.end()) {
+      stats().Count(kDirHit);
+      return it->second.second;
+    }
+  }
 
-  if (mDirs.count(ino)) {
-    // return an existing ino
-    if (update_lru)
-      mDirsLRU.splice( mDirs[ino].first, mDirsLRU, mDirsLRU.end());
+  if (!update_lru && !create) {
+    stats().Count(kDirMiss);
   } else {
-    if (!create)
-      return 0;
-    // create a new one
-    diamondDirPtr d = std::make_shared<diamondDir>(new diamondDir(ino,name));
-    mDirsLRU.push_front(ino);
-    mDirs[ino] = std::make_pair( mDirsLRU.begin(), d );
+    diamond::common::RWMutexWriteLock flock(mDirsMutex);
+
+    lru_dir_map_t::iterator it = mDirs.find(ino);
+    if (it != mDirs.end()) {
+      // return an existing ino
+      if (update_lru)
+        mDirsLRU.splice( mDirsLRU.begin(), mDirsLRU, it->second.first);
+      stats().Count(kDirHit);
+      return it->second.second;
+    }
+    stats().Count(kDirMiss);
+
+    if (create) {
+      // create a new one - object and control block share one slab object
+      diamondDirPtr d = std::allocate_shared<diamondDir>(SlabAllocator<diamondDir, diamondDirSlab>(), ino, name);
+      mDirsLRU.push_front(ino);
+      mDirs.insert(std::make_pair(ino, std::make_pair( mDirsLRU.begin(), d )));
+      diamondCapacity::addInode();
+
+      // evt. shrink here
+      return d;
+    }
+  }
+
+  if (!mWriteBack)
+    return 0;
+
+  // load on miss - an index probe filters inodes not stored as directories
+  uint64_t inode = DIAMOND_TO_INODE(ino);
+  if (!mWriteBack->hasDir(inode) || mWriteBack->isRemoved(inode))
+    return 0;
+
+  diamondDirPtr d = mWriteBack->loadDir(inode);
+  if (!d)
+    return 0;
+  stats().Count(kDirLoad);
+  return publishDir(d);
+}
+
+diamondCache::diamondFilePtr
+diamondCache::publishFile (const diamondFilePtr& file)
+{
+  diamond_ino_t ino = file->getIno();
+  diamond::common::RWMutexWriteLock flock(mFilesMutex);
+  lru_file_map_t::iterator it = mFiles.find(ino);
+  if (it != mFiles.end())
+    return it->second.second;   // another thread loaded it meanwhile
+  if (mWriteBack && mWriteBack->isRemoved(file->getInode()))
+    return 0;
+
+  mFilesLRU.push_front(ino);
+  mFiles.insert(std::make_pair(ino, std::make_pair( mFilesLRU.begin(), file )));
+  diamondCapacity::addInode();
+  return file;
+}
+
+diamondCache::diamondDirPtr
+diamondCache::publishDir (const diamondDirPtr& dir)
+{
+  diamond_ino_t ino = dir->getIno();
+  addNames(dir);
+
+  diamond::common::RWMutexWriteLock flock(mDirsMutex);
+  lru_dir_map_t::iterator it = mDirs.find(ino);
+  if (it != mDirs.end())
+    return it->second.second;   // another thread loaded it meanwhile
+  if (mWriteBack && mWriteBack->isRemoved(dir->getInode()))
+    return 0;
+
+  mDirsLRU.push_front(ino);
+  mDirs.insert(std::make_pair(ino, std::make_pair( mDirsLRU.begin(), dir )));
+  diamondCapacity::addInode();
+  return dir;
+}
+
+void
+diamondCache::addNames (const diamondDirPtr& dir)
+{
+  // the entries are not published yet - no directory lock needed
+  diamond_ino_t ino = dir->getIno();
+  std::string entry;
+  diamond_ino_t child;
+
+  // a second pass retries the names which did not fit before the rebuild
+  for (size_t pass = 0; pass < 2; pass++) {
+    uint64_t cursor = 0;
+    size_t failed = 0;
+    bool crowded;
+    {
+      diamond::common::RWMutexReadLock ilock(mNameIndexMutex);
+      while (dir->nextEntry(cursor, entry, child)) {
+        __int128 key = nameKey(ino, entry.c_str());
+        if (mNameIndex.GetItem(key))
+          continue;
+        if (!mNameIndex.SetItem(key, (__int128) DIAMOND_TO_INODE(child)))
+          failed++;
+      }
+      crowded = failed || nameIndexCrowded();
+    }
+
+    if (crowded)
+      rebuildNameIndex();
+    if (!failed)
+      return;
+    if (pass)
+      diamond_static_debug("name index full - parent=%s names=%lu", ino.c_str(), (unsigned long) failed);
+  }
+}
+
+//------------------------------------------------------------------------------
+//! Merge sorted partitions into a table with end hints - linear in the number
+//! of inodes apart from the heap over the partitions
+//------------------------------------------------------------------------------
+template <typename Ptr, typename Map, typename List>
+static size_t
+mergePartitions (std::vector< std::vector< std::pair<diamond_ino_t, Ptr> > >& parts, Map& map, List& lru)
+{
+  typedef std::pair<size_t, size_t> cursor_t;   // partition, position
+  auto greater = [&parts] (const cursor_t& a, const cursor_t& b) {
+    return parts[b.first][b.second].first < parts[a.first][a.second].first;
+  };
+
+  std::vector<cursor_t> heap;
+  for (size_t p = 0; p < parts.size(); p++)
+    if (!parts[p].empty())
+      heap.push_back(cursor_t(p, 0));
+  std::make_heap(heap.begin(), heap.end(), greater);
+
+  size_t inserted = 0;
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    cursor_t& c = heap.back();
+    std::pair<diamond_ino_t, Ptr>& item = parts[c.first][c.second];
 
-    // evt. shrink here
+    lru.push_front(item.first);
+    size_t before = map.size();
+    map.insert(map.end(), std::make_pair(std::move(item.first), std::make_pair(lru.begin(), std::move(item.second))));
+    if (map.size() == before)
+      lru.pop_front();    // duplicate inode
+    else
+      inserted++;
+
+    if (++c.second < parts[c.first].size())
+      std::push_heap(heap.begin(), heap.end(), greater);
+    else
+      heap.pop_back();
+  }
+
+  for (size_t p = 0; p < parts.size(); p++)
+    std::vector< std::pair<diamond_ino_t, Ptr> >().swap(parts[p]);
+  return inserted;
+}
+
+void
+diamondCache::publish (std::vector<file_vector_t>& files, std::vector<dir_vector_t>& dirs)
+{
+  lru_file_map_t fmap;
+  lru_dir_map_t dmap;
+  lru_list_t flru;
+  lru_list_t dlru;
+  size_t inodes = mergePartitions(files, fmap, flru) + mergePartitions(dirs, dmap, dlru);
+
+  {
+    diamond::common::RWMutexWriteLock flock(mFilesMutex);
+    for (lru_file_map_t::iterator it = mFiles.begin(); it != mFiles.end(); ++it) {
+      if (fmap.count(it->first))
+        inodes--;   // decoded in place
+      else {
+        flru.push_front(it->first);
+        fmap.insert(std::make_pair(it->first, std::make_pair(flru.begin(), it->second.second)));
+      }
+    }
+    mFiles.swap(fmap);
+    mFilesLRU.swap(flru);
+  }
+
+  {
+    diamond::common::RWMutexWriteLock dlock(mDirsMutex);
+    for (lru_dir_map_t::iterator it = mDirs.begin(); it != mDirs.end(); ++it) {
+      if (dmap.count(it->first))
+        inodes--;
+      else {
+        dlru.push_front(it->first);
+        dmap.insert(std::make_pair(it->first, std::make_pair(dlru.begin(), it->second.second)));
+      }
+    }
+    mDirs.swap(dmap);
+    mDirsLRU.swap(dlru);
   }
-  return mDirs[ino].second;
+
+  for (size_t i = 0; i < inodes; i++)
+    diamondCapacity::addInode();
+}
+
+void
+diamondCache::getInodes (std::vector<diamondFilePtr>& files, std::vector<diamondDirPtr>& dirs)
+{
+  {
+    diamond::common::RWMutexReadLock flock(mFilesMutex);
+    files.reserve(mFiles.size());
+    for (lru_file_map_t::iterator it = mFiles.begin(); it != mFiles.end(); ++it)
+      files.push_back(it->second.second);
+  }
+  {
+    diamond::common::RWMutexReadLock flock(mDirsMutex);
+    dirs.reserve(mDirs.size());
+    for (lru_dir_map_t::iterator it = mDirs.begin(); it != mDirs.end(); ++it)
+      dirs.push_back(it->second.second);
+  }
+}
+
+diamondCache::diamondFilePtr
+diamondCache::cachedFile (const diamond_ino_t& ino)
+{
+  diamond::common::RWMutexReadLock flock(mFilesMutex);
+  lru_file_map_t::iterator it = mFiles.find(ino);
+  return (it != mFiles.end()) ? it->second.second : 0;
+}
+
+diamondCache::diamondDirPtr
+diamondCache::cachedDir (const diamond_ino_t& ino)
+{
+  diamond::common::RWMutexReadLock flock(mDirsMutex);
+  lru_dir_map_t::iterator it = mDirs.find(ino);
+  return (it != mDirs.end()) ? it->second.second : 0;
 }
 
 int
 diamondCache::rmFile (diamond_ino_t ino)
 {
-  diamond::common::RWMutexWriteLock flock(mFilesMutex);
+  uint64_t inode = DIAMOND_TO_INODE(ino);
+  {
+    diamond::common::RWMutexWriteLock flock(mFilesMutex);
 
-  if (mFiles.count(ino)) {
-    mFilesLRU.erase(mFiles[ino].first);
-    mFiles.erase(ino);
+    lru_file_map_t::iterator it = mFiles.find(ino);
+    if (it != mFiles.end()) {
+      mInodes.release(inode, it->second.second->getGeneration());
+      mFilesLRU.erase(it->second.first);
+      mFiles.erase(it);
+      diamondCapacity::removeInode();
+      if (mWriteBack)
+        mWriteBack->markRemoved(inode, false);
+      return 0;
+    }
+  }
 
+  // stored but never loaded
+  if (mWriteBack && mWriteBack->hasFile(inode) && !mWriteBack->isRemoved(inode)) {
+    mWriteBack->markRemoved(inode, false);
     return 0;
   }
   return ENOENT;
@@ -78,17 +412,177 @@ diamondCache::rmFile (diamond_ino_t ino)
 int
 diamondCache::rmDir (diamond_ino_t ino)
 {
-  diamond::common::RWMutexWriteLock flock(mDirsMutex);
+  uint64_t inode = DIAMOND_TO_INODE(ino);
+  {
+    diamond::common::RWMutexWriteLock flock(mDirsMutex);
 
-  if (mDirs.count(ino)) {
-    mDirsLRU.erase(mDirs[ino].first);
-    mDirs.erase(ino);
+    lru_dir_map_t::iterator it = mDirs.find(ino);
+    if (it != mDirs.end()) {
+      mInodes.release(inode, it->second.second->getGeneration());
+      mDirsLRU.erase(it->second.first);
+      mDirs.erase(it);
+      diamondCapacity::removeInode();
+      if (mWriteBack)
+        mWriteBack->markRemoved(inode, true);
+      return 0;
+    }
+  }
 
+  // stored but never loaded
+  if (mWriteBack && mWriteBack->hasDir(inode) && !mWriteBack->isRemoved(inode)) {
+    mWriteBack->markRemoved(inode, true);
     return 0;
   }
   return ENOENT;
 }
 
+__int128
+diamondCache::nameKey (const diamond_ino_t& parent, const char* name)
+{
+  diamond::common::uint64 h1 = DIAMOND_TO_INODE(parent);
+  diamond::common::uint64 h2 = 0x6469616d6f6e64ULL;
+  diamond::common::SpookyHash::Hash128(name, strlen(name), &h1, &h2);
+
+  __int128 key = h1;
+  key <<= 64;
+  key |= h2;
+
+  // 0 and all-ones are reserved by the map for free and deleted slots
+  if ((!key) || (!~key))
+    key = 1;
+  return key;
+}
+
+bool
+diamondCache::findName (const diamond_ino_t& parent, const char* name, diamond_ino_t& ino)
+{
+  __int128 key = nameKey(parent, name);
+  __int128 val;
+  {
+    diamond::common::RWMutexReadLock ilock(mNameIndexMutex);
+    val = mNameIndex.GetItem(key);
+  }
+
+  if (!val) {
+    stats().Count(kNameMiss);
+    return false;
+  }
+  stats().Count(kNameHit);
+  ino = DIAMOND_INODE((unsigned long long) val);
+  return true;
+}
+
+void
+diamondCache::addName (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino)
+{
+  __int128 key = nameKey(parent, name);
+  __int128 val = DIAMOND_TO_INODE(ino);
+
+  // a name which did not fit is retried once after the rebuild
+  for (size_t pass = 0; pass < 2; pass++) {
+    bool added;
+    bool crowded;
+    {
+      diamond::common::RWMutexReadLock ilock(mNameIndexMutex);
+      // never overwrite a colliding entry, such a name is resolved via the directory
+      if (mNameIndex.GetItem(key))
+        return;
+      added = mNameIndex.SetItem(key, val);
+      crowded = !added || nameIndexCrowded();
+    }
+
+    if (crowded)
+      rebuildNameIndex();
+    if (added)
+      return;
+  }
+  diamond_static_debug("name index full - parent=%s name=%s", parent.c_str(), name);
+}
+
+void
+diamondCache::rmName (const diamond_ino_t& parent, const char* name)
+{
+  bool crowded;
+  {
+    diamond::common::RWMutexReadLock ilock(mNameIndexMutex);
+    mNameIndex.DeleteItem(nameKey(parent, name));
+    crowded = nameIndexCrowded();
+  }
+
+  if (crowded)
+    rebuildNameIndex();
+}
+
+bool
+diamondCache::nameIndexCrowded ()
+{
+  // probe sequences only end on free slots - tombstones and a high load both
+  // make misses expensive
+  uint64_t size = mNameIndex.GetArraySize();
+  uint64_t deleted = mNameIndex.GetDeletedCount();
+  uint64_t used = mNameIndex.GetItemCount() + deleted;
+  return (deleted > (size / 4)) ||
+    ((used > ((size / 4) * 3)) && (size < nameIndexLimit()));
+}
+
+void
+diamondCache::rebuildNameIndex ()
+{
+  // callers may hold directory locks - the rebuild must not need any
+  diamond::common::RWMutexWriteLock ilock(mNameIndexMutex);
+  if (!nameIndexCrowded())
+    return;
+
+  // keep the load of the rebuilt index at or below one half
+  uint64_t size = mNameIndex.GetArraySize();
+  uint64_t live = mNameIndex.GetItemCount();
+  while (((live * 2) > size) && (size < nameIndexLimit()))
+    size <<= 1;
+
+  diamond_static_info("rebuilding name index items=%llu deleted=%llu slots=%llu->%llu",
+                      (unsigned long long) live,
+                      (unsigned long long) mNameIndex.GetDeletedCount(),
+                      (unsigned long long) mNameIndex.GetArraySize(),
+                      (unsigned long long) size);
+
+  mNameIndex.Resize(size);
+}
+
+static uint64_t
+roundSlots (uint64_t slots)
+{
+  uint64_t size = 1;
+  while (size < slots)
+    size <<= 1;
+  return size;
+}
+
+void
+diamondCache::sizeNameIndex (uint64_t slots, uint64_t maxslots)
+{
+  diamond::common::RWMutexWriteLock ilock(mNameIndexMutex);
+  mNameIndexMax = maxslots ? roundSlots(maxslots) : 0;
+  uint64_t size = roundSlots(slots);
+  if (mNameIndexMax && (size > mNameIndexMax))
+    size = mNameIndexMax;
+  if (size != mNameIndex.GetArraySize())
+    mNameIndex.Resize(size);
+}
+
+uint64_t
+diamondCache::nameIndexSize ()
+{
+  diamond::common::RWMutexReadLock ilock(mNameIndexMutex);
+  return mNameIndex.GetArraySize();
+}
+
+uint64_t
+diamondCache::nameIndexLimit ()
+{
+  // by default room for every inode at a load of one half
+  return mNameIndexMax ? mNameIndexMax : roundSlots(2 * diamondCapacity::inodeLimit());
+}
+
 void 
 diamondCache::DumpCachedFiles(std::stringstream& out)
 {
@@ -12,14 +12,21 @@
 #include <map>
 #include <list>
 #include <sstream>
+#include <vector>
 
 #include "rio/Namespace.hh"
 #include "rio/diamondFile.hh"
 #include "rio/diamondDir.hh"
+#include "rio/diamondInodeAllocator.hh"
+#include "rio/diamondWriteBack.hh"
+#include "rio/diamondJournal.hh"
 #include "rio/diamond_types.hh"
 
 #include "common/RWMutex.hh"
 #include "common/Logging.hh"
+#include "common/hash/map128.hh"
+#include "common/SlabAllocator.hh"
+#include "common/OpStats.hh"
 
 
 DIAMONDRIONAMESPACE_BEGIN
@@ -31,6 +38,13 @@ public:
   typedef std::shared_ptr<diamondFile> diamondFilePtr;
   typedef std::shared_ptr<diamondDir> diamondDirPtr;
 
+  // inodes and their index nodes are allocated from dedicated slab pools
+  DIAMOND_SLAB_TAG_MEM(diamondFileSlab, "diamondFile", diamond::common::MemoryAccounting::kInodes);
+  DIAMOND_SLAB_TAG_MEM(diamondDirSlab, "diamondDir", diamond::common::MemoryAccounting::kInodes);
+  DIAMOND_SLAB_TAG_MEM(lruSlab, "diamondCache::lru", diamond::common::MemoryAccounting::kInodes);
+  DIAMOND_SLAB_TAG_MEM(fileMapSlab, "diamondCache::files", diamond::common::MemoryAccounting::kInodes);
+  DIAMOND_SLAB_TAG_MEM(dirMapSlab, "diamondCache::dirs", diamond::common::MemoryAccounting::kInodes);
+
   diamondFilePtr
   getFile (diamond_ino_t ino, bool update_lru=true, bool create=true, std::string name="");
 
@@ -43,8 +57,54 @@ public:
   int 
   rmDir (diamond_ino_t ino);
 
+  // ---------------------------------------------------------------------------
+  //! Name index: (parent, name) -> inode in a single flat table probe
+  //!
+  //! The index is an accelerator only - a miss or a link key mismatch has to
+  //! be resolved by the parent directory, which stays authoritative. Lookups
+  //! and updates share a reader-biased lock which only a rebuild takes
+  //! exclusively. Probes are capped at kNameIndexProbes slots. The index is
+  //! rebuilt when tombstones pile up and doubles when it is 3/4 full, up to
+  //! nameIndexLimit() slots - names which do not fit are left to the directory.
+  // ---------------------------------------------------------------------------
+  bool
+  findName (const diamond_ino_t& parent, const char* name, diamond_ino_t& ino);
+
+  void
+  addName (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino);
+
+  void
+  rmName (const diamond_ino_t& parent, const char* name);
+
+  void
+  rebuildNameIndex ();
+
+  // resize the name index to slots and cap its growth at maxslots - both are
+  // rounded up to a power of 2, a maxslots of 0 follows the inode limit
+  void
+  sizeNameIndex (uint64_t slots, uint64_t maxslots = 0);
+
+  uint64_t
+  nameIndexSize ();
+
+  uint64_t
+  nameIndexLimit ();
+
+  static __int128
+  nameKey (const diamond_ino_t& parent, const char* name);
+
+  // ---------------------------------------------------------------------------
+  //! Key stored in an inode to verify a name index hit without locking
+  // ---------------------------------------------------------------------------
+  static uint64_t
+  linkKey (const diamond_ino_t& parent, const char* name) {
+    return (uint64_t) nameKey(parent, name);
+  }
+
+  static const uint64_t kNameIndexSize = 1024 * 1024;
+  static const uint64_t kNameIndexProbes = 256;
 
-  diamondCache (std::string mount_point = "/");
+  diamondCache (std::string mount_point = "/", uint64_t nameindexsize = kNameIndexSize);
   diamondCache (const diamondCache& orig);
   virtual ~diamondCache ();
 
@@ -61,20 +121,107 @@ public:
   void DumpCachedFiles(std::stringstream& out);
   void DumpCachedDirs(std::stringstream& out);
 
-  diamond_ino_t newInode() {
-    static diamond::common::RWMutex sMutex;
-    static unsigned long long last_inode=0;
-    diamond::common::RWMutexWriteLock sLock(sMutex);
-    return std::to_string(++last_inode);
+  // ---------------------------------------------------------------------------
+  //! Hit and miss counters of getFile, getDir and findName - a load counts an
+  //! inode read back from the write-back store after a miss
+  // ---------------------------------------------------------------------------
+  enum Counter {
+    kFileHit = 0,
+    kFileMiss,
+    kFileLoad,
+    kDirHit,
+    kDirMiss,
+    kDirLoad,
+    kNameHit,
+    kNameMiss,
+    kCounters
+  };
+
+  static diamond::common::OpStats& stats();
+
+  diamond_ino_t newInode(uint64_t* generation = 0) {
+    uint64_t gen;
+    uint64_t ino = mInodes.allocate(gen);
+    if (generation)
+      *generation = gen;
+    return DIAMOND_INODE(ino);
+  }
+
+  diamondInodeAllocator& getInodeAllocator() { return mInodes; }
+
+  // ---------------------------------------------------------------------------
+  //! Write-back persistence into a kv store
+  //!
+  //! Once enabled, namespace operations report their changes with dirtyFile/
+  //! dirtyDir, getFile/getDir load missing inodes from the store and
+  //! rmFile/rmDir remove them there. Without write-back all hooks are no-ops.
+  // ---------------------------------------------------------------------------
+  int enableWriteBack(const std::string& path, const std::string& indexdir,
+                      uint64_t keyspace, unsigned interval_ms = 1000);
+  void disableWriteBack();
+  diamondWriteBack* getWriteBack() { return mWriteBack.get(); }
+
+  void dirtyFile(const diamond_ino_t& ino, int what, off_t offset = 0, size_t size = 0) {
+    if (mWriteBack)
+      mWriteBack->markFile(DIAMOND_TO_INODE(ino), what, offset, size);
   }
 
+  void dirtyDir(const diamond_ino_t& ino, int what) {
+    if (mWriteBack)
+      mWriteBack->markDir(DIAMOND_TO_INODE(ino), what);
+  }
+
+  // ---------------------------------------------------------------------------
+  //! Metadata journal with periodic checkpoints
+  //!
+  //! Enabling recovers the namespace from the last checkpoint and the journal
+  //! tail into a cache holding at most the root. Namespace operations append
+  //! their records through getJournal(). The checkpoint is loaded by
+  //! load_threads threads, 0 uses all cores.
+  // ---------------------------------------------------------------------------
+  int enableJournal(const std::string& dir, unsigned sync_ms = 100, unsigned checkpoint_s = 300,
+                    unsigned load_threads = 0);
+  void disableJournal();
+  diamondJournal* getJournal() { return mJournal.get(); }
+
 private:
-  typedef std::pair<std::list<diamond_ino_t>::iterator, diamondFilePtr> lru_file_t;
-  typedef std::pair<std::list<diamond_ino_t>::iterator, diamondDirPtr> lru_dir_t;
+  friend class diamondWriteBack;
+  friend class diamondJournal;
+  friend class diamondSnapshot;
+
+  // lookups which never load from the write-back store
+  diamondFilePtr cachedFile(const diamond_ino_t& ino);
+  diamondDirPtr cachedDir(const diamond_ino_t& ino);
 
-  typedef std::map< diamond_ino_t, lru_file_t > lru_file_map_t;
-  typedef std::map< diamond_ino_t, lru_dir_t > lru_dir_map_t;
-  typedef std::list< diamond_ino_t > lru_list_t;
+  // insert a loaded inode unless it is cached already - returns the cached one
+  diamondFilePtr publishFile(const diamondFilePtr& file);
+  diamondDirPtr publishDir(const diamondDirPtr& dir);
+
+  // references to all cached inodes
+  void getInodes(std::vector<diamondFilePtr>& files, std::vector<diamondDirPtr>& dirs);
+
+  typedef std::vector< std::pair<diamond_ino_t, diamondFilePtr> > file_vector_t;
+  typedef std::vector< std::pair<diamond_ino_t, diamondDirPtr> > dir_vector_t;
+
+  // merge partitions of loaded inodes sorted by key and replace the inode
+  // tables in one step - cached inodes missing in the partitions are kept
+  void publish(std::vector<file_vector_t>& files, std::vector<dir_vector_t>& dirs);
+
+  // add the entries of an unpublished directory to the name index
+  void addNames(const diamondDirPtr& dir);
+
+  // true if tombstones or the load call for a rebuild - the caller holds
+  // mNameIndexMutex
+  bool nameIndexCrowded();
+
+  typedef std::list< diamond_ino_t, SlabAllocator<diamond_ino_t, lruSlab> > lru_list_t;
+  typedef std::pair<lru_list_t::iterator, diamondFilePtr> lru_file_t;
+  typedef std::pair<lru_list_t::iterator, diamondDirPtr> lru_dir_t;
+
+  typedef std::map< diamond_ino_t, lru_file_t, std::less<diamond_ino_t>,
+                    SlabAllocator<std::pair<const diamond_ino_t, lru_file_t>, fileMapSlab> > lru_file_map_t;
+  typedef std::map< diamond_ino_t, lru_dir_t, std::less<diamond_ino_t>,
+                    SlabAllocator<std::pair<const diamond_ino_t, lru_dir_t>, dirMapSlab> > lru_dir_map_t;
   lru_file_map_t mFiles;
   lru_list_t mFilesLRU;
   diamond::common::RWMutex mFilesMutex;
@@ -84,7 +231,14 @@ private:
 
   diamond::common::RWMutex mDirsMutex;
 
+  diamond::common::map128 mNameIndex;
+  diamond::common::RWMutex mNameIndexMutex;
+  uint64_t mNameIndexMax;     //< growth limit in slots, 0 follows the inode limit
+
+  diamondInodeAllocator mInodes;
 
+  std::unique_ptr<diamondWriteBack> mWriteBack;
+  std::unique_ptr<diamondJournal> mJournal;
 };
 
 DIAMONDCOMMONNAMESPACE_END
@@ -0,0 +1,118 @@
+/*
+ * File:   diamondCapacity.cc
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#include "diamondCapacity.hh"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+DIAMONDRIONAMESPACE_BEGIN
+
+const uint64_t diamondCapacity::kBlockSize;
+const uint64_t diamondCapacity::kBytesPerInode;
+
+std::atomic<uint64_t> diamondCapacity::sBytes(0);
+std::atomic<uint64_t> diamondCapacity::sInodes(0);
+std::atomic<uint64_t> diamondCapacity::sByteLimit(0);
+std::atomic<uint64_t> diamondCapacity::sInodeLimit(0);
+
+int
+diamondCapacity::reserveBytes (uint64_t bytes)
+{
+  uint64_t limit = byteLimit();
+  uint64_t used = sBytes.load(std::memory_order_relaxed);
+  do {
+    if ((used + bytes) > limit)
+      return ENOSPC;
+  } while (!sBytes.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+  return 0;
+}
+
+void
+diamondCapacity::releaseBytes (uint64_t bytes)
+{
+  sBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void
+diamondCapacity::setLimits (uint64_t bytes, uint64_t inodes)
+{
+  sByteLimit = bytes;
+  sInodeLimit = inodes;
+}
+
+uint64_t
+diamondCapacity::byteLimit ()
+{
+  uint64_t limit = sByteLimit.load(std::memory_order_relaxed);
+  if (!limit) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    limit = ((pages > 0) && (pagesize > 0)) ? ((uint64_t) pages * pagesize) : (1ull << 32);
+    sByteLimit = limit;
+  }
+  return limit;
+}
+
+uint64_t
+diamondCapacity::inodeLimit ()
+{
+  uint64_t limit = sInodeLimit.load(std::memory_order_relaxed);
+  if (!limit) {
+    limit = byteLimit() / kBytesPerInode;
+    sInodeLimit = limit;
+  }
+  return limit;
+}
+
+void
+diamondCapacity::fillStatfs (struct statvfs& sfs)
+{
+  uint64_t used = (bytes() + kBlockSize - 1) / kBlockSize;
+  uint64_t blocks = byteLimit() / kBlockSize;
+  uint64_t files = inodes();
+
+  sfs.f_bsize = kBlockSize;
+  sfs.f_frsize = kBlockSize;
+  sfs.f_blocks = blocks;
+  sfs.f_bfree = (blocks > used) ? (blocks - used) : 0;
+  sfs.f_bavail = sfs.f_bfree;
+  sfs.f_files = inodeLimit();
+  sfs.f_ffree = (sfs.f_files > files) ? (sfs.f_files - files) : 0;
+  sfs.f_favail = sfs.f_ffree;
+}
+
+uint64_t
+diamondCapacity::parseSize (const char* size)
+{
+  char* end = 0;
+  errno = 0;
+  uint64_t value = strtoull(size, &end, 10);
+  if (errno || (end == size))
+    return 0;
+
+  switch (*end) {
+  case 'T': case 't': value <<= 10;
+    // fall through
+  case 'G': case 'g': value <<= 10;
+    // fall through
+  case 'M': case 'm': value <<= 10;
+    // fall through
+  case 'K': case 'k': value <<= 10;
+    end++;
+    // fall through
+  case 0:
+    break;
+  default:
+    return 0;
+  }
+  return (*end) ? 0 : value;
+}
+
+DIAMONDRIONAMESPACE_END
@@ -0,0 +1,65 @@
+/*
+ * File:   diamondCapacity.hh
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#ifndef DIAMONDCAPACITY_HH
+#define	DIAMONDCAPACITY_HH
+
+#include <stdint.h>
+#include <atomic>
+
+#include <sys/statvfs.h>
+
+#include "rio/Namespace.hh"
+
+DIAMONDRIONAMESPACE_BEGIN
+
+//------------------------------------------------------------------------------
+//! Capacity accounting of the file system
+//!
+//! File data is reserved before it is written and released when files shrink
+//! or go away, inodes are counted when they enter and leave the cache. Both
+//! are plain atomics - statfs reads them without touching the namespace.
+//! The byte limit defaults to the physical memory of the machine, the inode
+//! limit to one inode per kBytesPerInode bytes of capacity.
+//------------------------------------------------------------------------------
+class diamondCapacity {
+public:
+  static const uint64_t kBlockSize = 4096;
+  static const uint64_t kBytesPerInode = 512;
+
+  // reserve bytes of file data - returns 0 or ENOSPC
+  static int reserveBytes (uint64_t bytes);
+  static void releaseBytes (uint64_t bytes);
+
+  // inodes are counted without a limit check - see haveInode
+  static void addInode () { sInodes.fetch_add(1, std::memory_order_relaxed); }
+  static void removeInode () { sInodes.fetch_sub(1, std::memory_order_relaxed); }
+  static bool haveInode () { return sInodes.load(std::memory_order_relaxed) < inodeLimit(); }
+
+  // a limit of 0 selects the default
+  static void setLimits (uint64_t bytes, uint64_t inodes);
+
+  static uint64_t bytes () { return sBytes.load(std::memory_order_relaxed); }
+  static uint64_t inodes () { return sInodes.load(std::memory_order_relaxed); }
+  static uint64_t byteLimit ();
+  static uint64_t inodeLimit ();
+
+  static void fillStatfs (struct statvfs& sfs);
+
+  // parse a size with an optional K/M/G/T suffix - returns 0 on error
+  static uint64_t parseSize (const char* size);
+
+private:
+  static std::atomic<uint64_t> sBytes;
+  static std::atomic<uint64_t> sInodes;
+  static std::atomic<uint64_t> sByteLimit;
+  static std::atomic<uint64_t> sInodeLimit;
+};
+
+DIAMONDRIONAMESPACE_END
+
+#endif	/* DIAMONDCAPACITY_HH */
@@ -1,20 +1,279 @@
-/* 
+/*
  * File:   diamondDir.cc
  * Author: apeters
- * 
+ *
  * Created on October 15, 2014, 4:09 PM
  */
 
 #include "diamondDir.hh"
+#include "common/hash/spooky.hh"
+#include "common/MemoryAccounting.hh"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
 
 DIAMONDRIONAMESPACE_BEGIN
 
-diamondDir::diamondDir (const diamond_ino_t ino, const std::string name) : diamondMeta::diamondMeta(ino, name) { }
+const uint32_t diamondDir::kFree;
+const uint32_t diamondDir::kDeleted;
+
+const char* const diamondDir::kLockName = "diamondDir::mMutex";
+
+diamondDir::diamondDir () : diamondMeta(), mNextSeq(0), mLive(0), mDeletedSlots(0), mAccounted(0), mRemoved(false), mMutex(kLockName) { }
+
+diamondDir::diamondDir (const diamond_ino_t ino, const std::string name) : diamondMeta::diamondMeta(ino, name), mNextSeq(0), mLive(0), mDeletedSlots(0), mAccounted(0), mRemoved(false), mMutex(kLockName) { }
+
+diamondDir::diamondDir (const diamondDir& orig) : diamondMeta::diamondMeta(orig), mEntries(orig.mEntries), mNames(orig.mNames), mSlots(orig.mSlots), mNextSeq(orig.mNextSeq), mLive(orig.mLive), mDeletedSlots(orig.mDeletedSlots), mAccounted(0), mRemoved(false), mMutex(kLockName)
+{
+  account();
+}
+
+diamondDir::diamondDir (diamondDir* orig) : diamondMeta::diamondMeta(orig), mEntries(orig->mEntries), mNames(orig->mNames), mSlots(orig->mSlots), mNextSeq(orig->mNextSeq), mLive(orig->mLive), mDeletedSlots(orig->mDeletedSlots), mAccounted(0), mRemoved(false), mMutex(kLockName)
+{
+  account();
+}
+
+diamondDir::~diamondDir ()
+{
+  diamond::common::MemoryAccounting::Sub(diamond::common::MemoryAccounting::kDirents, mAccounted);
+}
+
+void
+diamondDir::account ()
+{
+  // the arenas only change capacity when they reallocate - report the delta
+  size_t bytes = (mEntries.capacity() * sizeof (Entry)) + mNames.capacity() +
+    (mSlots.capacity() * sizeof (uint32_t));
+  if (bytes != mAccounted) {
+    diamond::common::MemoryAccounting::Add(diamond::common::MemoryAccounting::kDirents, (int64_t) bytes - (int64_t) mAccounted);
+    mAccounted = bytes;
+  }
+}
+
+uint32_t
+diamondDir::hashName (const char* name, size_t len)
+{
+  return diamond::common::SpookyHash::Hash32(name, len, 0);
+}
+
+bool
+diamondDir::match (const Entry& e, uint32_t hash, const char* name, size_t len) const
+{
+  return (e.ino && (e.hash == hash) && (e.name_len == len) &&
+          !memcmp(&mNames[e.name_off], name, len));
+}
+
+size_t
+diamondDir::findSlot (uint32_t hash, const char* name, size_t len) const
+{
+  size_t nslots = mSlots.size();
+  size_t mask = nslots - 1;
+
+  for (size_t i = hash & mask, n = 0; n < nslots; i = (i + 1) & mask, n++) {
+    uint32_t slot = mSlots[i];
+    if (slot == kFree)
+      break;
+    if ((slot != kDeleted) && match(mEntries[slot - 1], hash, name, len))
+      return i;
+  }
+  return (size_t) - 1;
+}
+
+void
+diamondDir::rehash (size_t nslots)
+{
+  mSlots.assign(nslots, kFree);
+  mDeletedSlots = 0;
+  size_t mask = nslots - 1;
+
+  for (size_t idx = 0; idx < mEntries.size(); idx++) {
+    if (!mEntries[idx].ino)
+      continue;
+    size_t i = mEntries[idx].hash & mask;
+    while (mSlots[i] != kFree)
+      i = (i + 1) & mask;
+    mSlots[i] = idx + 1;
+  }
+}
+
+void
+diamondDir::compact ()
+{
+  std::vector<Entry> entries;
+  std::vector<char> names;
+  entries.reserve(mLive);
+
+  // keep the order and the sequence numbers - they are readdir positions
+  for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
+    if (!it->ino)
+      continue;
+    Entry e = *it;
+    e.name_off = names.size();
+    names.insert(names.end(), &mNames[it->name_off], &mNames[it->name_off] + it->name_len);
+    entries.push_back(e);
+  }
+  mEntries.swap(entries);
+  mNames.swap(names);
+
+  size_t nslots = 16;
+  while (nslots < (mLive * 2))
+    nslots <<= 1;
+  rehash(nslots);
+}
+
+bool
+diamondDir::findName (const char* name, diamond_ino_t& ino) const
+{
+  if (!mLive)
+    return false;
+
+  size_t len = strlen(name);
+  size_t slot = findSlot(hashName(name, len), name, len);
+  if (slot == (size_t) - 1)
+    return false;
+
+  ino = DIAMOND_INODE(mEntries[mSlots[slot] - 1].ino);
+  return true;
+}
+
+bool
+diamondDir::addName (const char* name, const diamond_ino_t& ino)
+{
+  size_t len = strlen(name);
+  uint32_t hash = hashName(name, len);
+
+  if (mLive && (findSlot(hash, name, len) != (size_t) - 1))
+    return false;
+
+  // keep the load including deleted slots below 3/4
+  if (((mLive + mDeletedSlots + 1) * 4) > (mSlots.size() * 3)) {
+    size_t nslots = 16;
+    while (nslots < ((mLive + 1) * 2))
+      nslots <<= 1;
+    rehash(nslots);
+  }
+
+  Entry e;
+  e.ino = DIAMOND_TO_INODE(ino);
+  e.seq = mNextSeq++;
+  e.hash = hash;
+  e.name_off = mNames.size();
+  e.name_len = len;
+  mNames.insert(mNames.end(), name, name + len);
+  mEntries.push_back(e);
+
+  size_t mask = mSlots.size() - 1;
+  size_t i = hash & mask;
+  while ((mSlots[i] != kFree) && (mSlots[i] != kDeleted))
+    i = (i + 1) & mask;
+  if (mSlots[i] == kDeleted)
+    mDeletedSlots--;
+  mSlots[i] = mEntries.size();
+  mLive++;
+  account();
+  return true;
+}
+
+bool
+diamondDir::rmName (const char* name, diamond_ino_t* ino)
+{
+  if (!mLive)
+    return false;
+
+  size_t len = strlen(name);
+  size_t slot = findSlot(hashName(name, len), name, len);
+  if (slot == (size_t) - 1)
+    return false;
+
+  Entry& e = mEntries[mSlots[slot] - 1];
+  if (ino)
+    *ino = DIAMOND_INODE(e.ino);
+  e.ino = 0;
+  mSlots[slot] = kDeleted;
+  mDeletedSlots++;
+  mLive--;
+
+  size_t dead = mEntries.size() - mLive;
+  if ((dead > 64) && (dead > mLive)) {
+    compact();
+    account();
+  }
+  return true;
+}
+
+bool
+diamondDir::nextEntry (uint64_t& cursor, std::string& name, diamond_ino_t& ino) const
+{
+  struct seq_less {
+    bool operator() (const Entry& e, uint64_t seq) const { return e.seq < seq; }
+  };
+
+  auto it = std::lower_bound(mEntries.begin(), mEntries.end(), cursor, seq_less());
+  while ((it != mEntries.end()) && (!it->ino))
+    ++it;
+
+  if (it == mEntries.end())
+    return false;
+
+  name.assign(&mNames[it->name_off], it->name_len);
+  ino = DIAMOND_INODE(it->ino);
+  cursor = it->seq + 1;
+  return true;
+}
+
+void
+diamondDir::encodeEntries (std::string& record) const
+{
+  record.clear();
+  for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
+    if (!it->ino)
+      continue;
+    record.append((const char*) &it->ino, sizeof (it->ino));
+    record.append((const char*) &it->name_len, sizeof (it->name_len));
+    record.append(&mNames[it->name_off], it->name_len);
+  }
+}
+
+int
+diamondDir::decodeEntries (const std::string& record)
+{
+  size_t pos = 0;
+  while (pos < record.size()) {
+    uint64_t ino;
+    uint32_t len;
+    if ((record.size() - pos) < (sizeof (ino) + sizeof (len)))
+      return EINVAL;
+    memcpy(&ino, record.c_str() + pos, sizeof (ino));
+    memcpy(&len, record.c_str() + pos + sizeof (ino), sizeof (len));
+    pos += sizeof (ino) + sizeof (len);
+    if ((record.size() - pos) < len)
+      return EINVAL;
+    addName(record.substr(pos, len).c_str(), DIAMOND_INODE(ino));
+    pos += len;
+  }
+  return 0;
+}
 
-diamondDir::diamondDir (const diamondDir& orig) : diamondMeta::diamondMeta(orig) { }
+diamondDirWriteLock::diamondDirWriteLock (diamondDir* dir, diamondDir* other, diamondDir* third) : mCount(0)
+{
+  diamondDir* dirs[3] = {dir, other, third};
+  for (size_t i = 0; i < 3; i++) {
+    if (dirs[i] && (std::find(mDirs, mDirs + mCount, dirs[i]) == (mDirs + mCount)))
+      mDirs[mCount++] = dirs[i];
+  }
 
-diamondDir::diamondDir (diamondDir* orig) : diamondMeta::diamondMeta(orig) { mNamesInode = orig->getNamesInode(); }
+  std::sort(mDirs, mDirs + mCount, [] (diamondDir* a, diamondDir* b) {
+    return a->getInode() < b->getInode();
+  });
+  for (size_t i = 0; i < mCount; i++)
+    mDirs[i]->Locker().LockWrite();
+}
 
-diamondDir::~diamondDir () { }
+diamondDirWriteLock::~diamondDirWriteLock ()
+{
+  while (mCount)
+    mDirs[--mCount]->Locker().UnLockWrite();
+}
 
 DIAMONDRIONAMESPACE_END
@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   diamondDir.hh
  * Author: apeters
  *
@@ -8,24 +8,107 @@
 #ifndef DIAMONDDIR_HH
 #define	DIAMONDDIR_HH
 
+#include <stdint.h>
+#include <vector>
+
 #include "rio/Namespace.hh"
 #include "rio/diamond_types.hh"
 #include "rio/diamondMeta.hh"
+#include "common/RWMutex.hh"
 
 DIAMONDRIONAMESPACE_BEGIN
 
-class diamondDir : public diamondMeta, public std::set<diamond_ino_t> {
+//------------------------------------------------------------------------------
+//! Directory with O(1) name lookup
+//!
+//! Entries live in a contiguous arena ordered by a per-directory sequence
+//! number, names are packed into a single character arena and an open
+//! addressing table of entry indices hashes the names. Unlinked entries are
+//! marked dead and compacted away once they dominate the arena - the sequence
+//! numbers survive compaction and serve as stable readdir positions.
+//------------------------------------------------------------------------------
+class diamondDir : public diamondMeta {
 public:
-  diamondDir () : diamondMeta() { }
+  struct Entry {
+    uint64_t ino;      //< 0 marks an unlinked entry
+    uint64_t seq;      //< stable position inside the directory
+    uint32_t hash;
+    uint32_t name_off;
+    uint32_t name_len;
+  };
+
+  diamondDir ();
   diamondDir (const diamond_ino_t ino, const std::string name);
   diamondDir (const diamondDir& orig);
   diamondDir (diamondDir* orig);
   virtual ~diamondDir ();
-  
-  std::map<std::string, diamond_ino_t>& getNamesInode() { return mNamesInode; }
+
+  // find the inode of an entry
+  bool findName (const char* name, diamond_ino_t& ino) const;
+
+  // add an entry - fails if the name exists
+  bool addName (const char* name, const diamond_ino_t& ino);
+
+  // remove an entry - fails if the name does not exist
+  bool rmName (const char* name, diamond_ino_t* ino = 0);
+
+  // return the first entry at or after cursor and advance the cursor behind it
+  bool nextEntry (uint64_t& cursor, std::string& name, diamond_ino_t& ino) const;
+
+  size_t nEntries () const { return mLive; }
+
+  // rmdir marks the directory removed under its write lock - mutations that
+  // resolved it before must not attach entries to it anymore
+  bool isRemoved () const { return mRemoved; }
+  void setRemoved () { mRemoved = true; }
+
+  // serialized entries for the write-back store - the caller holds the lock
+  void encodeEntries (std::string& record) const;
+  int decodeEntries (const std::string& record);
+
+  // only directories carry a lock - see diamondDirWriteLock
+  diamond::common::RWMutex& Locker () { return mMutex; }
+
+private:
+  static const char* const kLockName;   //< all directory locks are profiled as one
+  static const uint32_t kFree = 0;
+  static const uint32_t kDeleted = 0xffffffff;
+
+  static uint32_t hashName (const char* name, size_t len);
+
+  bool match (const Entry& e, uint32_t hash, const char* name, size_t len) const;
+  size_t findSlot (uint32_t hash, const char* name, size_t len) const;
+  void rehash (size_t slots);
+  void compact ();
+  void account ();
+
+  std::vector<Entry> mEntries;   //< entry arena sorted by seq
+  std::vector<char> mNames;      //< packed names of all entries in the arena
+  std::vector<uint32_t> mSlots;  //< entry index + 1 or kFree/kDeleted
+  uint64_t mNextSeq;
+  size_t mLive;
+  size_t mDeletedSlots;
+  size_t mAccounted;             //< arena bytes reported to MemoryAccounting
+  bool mRemoved;                 //< set by rmdir under the write lock
+  diamond::common::RWMutex mMutex;
+};
+
+//------------------------------------------------------------------------------
+//! Write lock on up to three directories
+//!
+//! Namespace mutations hold the write lock of every directory they modify -
+//! a rename also locks the directory it replaces. Directories are always
+//! locked in ascending inode order, so concurrent renames and removals
+//! cannot deadlock.
+//------------------------------------------------------------------------------
+class diamondDirWriteLock {
+public:
+  diamondDirWriteLock (diamondDir* dir, diamondDir* other = 0, diamondDir* third = 0);
+  ~diamondDirWriteLock ();
 
 private:
-  std::map<std::string, diamond_ino_t> mNamesInode;
+  diamondDir* mDirs[3];
+  size_t mCount;
 };
 
 DIAMONDRIONAMESPACE_END
@@ -6,47 +6,102 @@
  */
 
 #include "diamondFile.hh"
+#include "diamondCapacity.hh"
+
+#include <errno.h>
 
 DIAMONDRIONAMESPACE_BEGIN
 
-diamondFile::diamondFile (const diamond_ino_t ino, const std::string name) : diamondMeta::diamondMeta(ino, name) { }
+diamondFile::diamondFile (const diamond_ino_t ino, const std::string name) : diamondMeta::diamondMeta(ino, name), mContents(0), mReserved(0) { }
+
+diamondFile::diamondFile (const diamondFile& orig) : diamondMeta::diamondMeta(orig), mContents(0), mReserved(0) { }
+
+diamondFile::diamondFile (diamondFile* orig) : diamondMeta::diamondMeta(orig), mContents(0), mReserved(0) { }
+
+diamondFile::~diamondFile ()
+{
+  delete mContents.load();
+  diamondCapacity::releaseBytes(mReserved.load());
+}
 
-diamondFile::diamondFile (const diamondFile& orig) : diamondMeta::diamondMeta(orig) { }
+int
+diamondFile::reserve(uint64_t end)
+{
+  uint64_t reserved = mReserved.load();
+  while (end > reserved) {
+    uint64_t previous = reserved;
+    if (diamondCapacity::reserveBytes(end - previous))
+      return ENOSPC;
+    if (mReserved.compare_exchange_weak(reserved, end))
+      return 0;
+    // lost against a concurrent write - retry with its reservation
+    diamondCapacity::releaseBytes(end - previous);
+  }
+  return 0;
+}
 
-diamondFile::diamondFile (diamondFile* orig) : diamondMeta::diamondMeta(orig) { }
+diamond::common::Bufferll&
+diamondFile::contents ()
+{
+  diamond::common::Bufferll* current = mContents.load();
+  if (current)
+    return *current;
 
-diamondFile::~diamondFile () { }
+  diamond::common::Bufferll* fresh = new diamond::common::Bufferll();
+  if (!mContents.compare_exchange_strong(current, fresh)) {
+    // another thread was faster
+    delete fresh;
+    return *current;
+  }
+  return *fresh;
+}
 
 int 
 diamondFile::read(char* buffer, off_t offset, size_t size)
 {
-  return mContents.readData(buffer, offset, size);
+  return contents().readData(buffer, offset, size);
 }
 
 off_t
 diamondFile::write(const char* buffer, off_t offset, size_t size)
 {
-  mStat.st_size = mContents.writeData(buffer, offset, size);
-  mStat.st_blocks = (mStat.st_size+mStat.st_blksize-1) / mStat.st_blksize;
-  return mStat.st_size;
+  if (reserve(offset + size))
+    return -ENOSPC;
+
+  off_t size_after = contents().writeData(buffer, offset, size);
+
+  StatWriter st(*this);
+  // writes only extend a file - a racing smaller write must not shrink it
+  if (size_after > st->st_size)
+    st->st_size = size_after;
+  return st->st_size;
 }
 
 int 
 diamondFile::peek(char* &buffer, off_t offset, size_t size)
 {
-  return mContents.peekData(buffer, offset, size);
+  return contents().peekData(buffer, offset, size);
 }
 
 void
 diamondFile::release()
 {
-  return mContents.releasePeek();
+  return contents().releasePeek();
 }
 
 int
 diamondFile::truncate(off_t offset)
 {
-  mContents.truncateData(offset);
+  if (reserve(offset))
+    return ENOSPC;
+
+  // shrinking hands back the tail of the reservation
+  uint64_t reserved = mReserved.load();
+  while ((reserved > (uint64_t) offset) && !mReserved.compare_exchange_weak(reserved, offset)) { }
+  if (reserved > (uint64_t) offset)
+    diamondCapacity::releaseBytes(reserved - offset);
+
+  contents().truncateData(offset);
   return 0;
 }
 DIAMONDRIONAMESPACE_END
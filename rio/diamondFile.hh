@@ -9,26 +9,37 @@
 #define	DIAMONDFILE_HH
 
 #include <string>
+#include <atomic>
 #include "rio/Namespace.hh"
 #include "rio/diamond_types.hh"
 #include "rio/diamondMeta.hh"
+#include "common/BufferPtr.hh"
 
 DIAMONDRIONAMESPACE_BEGIN
 class diamondFile : public diamondMeta {
 public:
-  diamondFile () : diamondMeta() {}
+  diamondFile () : diamondMeta(), mContents(0), mReserved(0) {}
   diamondFile (const diamond_ino_t ino, const std::string name);
   diamondFile (const diamondFile& orig);
   diamondFile (diamondFile* orig);
   virtual ~diamondFile ();
+  // returns the file size after the write or -ENOSPC
   off_t write(const char* buffer, off_t offset, size_t size);
   int read(char* buffer, off_t offset, size_t size);
   int peek(char* &buffer, off_t offset, size_t size);
+  // returns 0 or ENOSPC
   int truncate(off_t offset);
   void release();
 
 private:
-  diamond::common::Bufferll mContents;
+  // contents are allocated with the first access - most inodes never have data
+  diamond::common::Bufferll& contents();
+
+  // capacity reservation for the contents - see diamondCapacity
+  int reserve(uint64_t end);
+
+  std::atomic<diamond::common::Bufferll*> mContents;
+  std::atomic<uint64_t> mReserved;
 };
 
 DIAMONDRIONAMESPACE_END
@@ -0,0 +1,131 @@
+/*
+ * File:   diamondInodeAllocator.cc
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#include "diamondInodeAllocator.hh"
+#include "common/Logging.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+DIAMONDRIONAMESPACE_BEGIN
+
+const uint64_t diamondInodeAllocator::kFirstInode;
+const uint64_t diamondInodeAllocator::kRange;
+const uint64_t diamondInodeAllocator::kPersistAhead;
+const size_t diamondInodeAllocator::kMaxFree;
+
+std::atomic<uint64_t> diamondInodeAllocator::sInstances(0);
+
+diamondInodeAllocator::diamondInodeAllocator () : mNext(kFirstInode), mFloor(0), mPersisted(0), mReuse(false), mStateFd(-1)
+{
+  // thread caches are tagged with the instance id, never with an address
+  mId = ++sInstances;
+}
+
+diamondInodeAllocator::~diamondInodeAllocator ()
+{
+  if (mStateFd >= 0)
+    close(mStateFd);
+}
+
+diamondInodeAllocator::ThreadCache&
+diamondInodeAllocator::threadCache ()
+{
+  static thread_local ThreadCache tc = {0, 0, 0, std::vector< std::pair<uint64_t, uint64_t> >()};
+  if (tc.owner != mId) {
+    tc.owner = mId;
+    tc.next = tc.end = 0;
+    tc.freed.clear();
+  }
+  return tc;
+}
+
+uint64_t
+diamondInodeAllocator::allocate (uint64_t& generation)
+{
+  ThreadCache& tc = threadCache();
+
+  if (mReuse && !tc.freed.empty()) {
+    std::pair<uint64_t, uint64_t> ino = tc.freed.back();
+    tc.freed.pop_back();
+    generation = ino.second + 1;
+    return ino.first;
+  }
+
+  // a range reserved before a loader raised the floor is dropped
+  if ((tc.next == tc.end) || (tc.next < mFloor.load(std::memory_order_relaxed))) {
+    tc.next = mNext.fetch_add(kRange);
+    tc.end = tc.next + kRange;
+    if ((mStateFd >= 0) && (tc.end > mPersisted.load()))
+      persist(tc.end);
+  }
+  generation = 0;
+  return tc.next++;
+}
+
+void
+diamondInodeAllocator::release (uint64_t ino, uint64_t generation)
+{
+  if (!mReuse)
+    return;
+
+  ThreadCache& tc = threadCache();
+  if (tc.freed.size() < kMaxFree)
+    tc.freed.push_back(std::make_pair(ino, generation));
+}
+
+int
+diamondInodeAllocator::setStateFile (const char* path)
+{
+  diamond::common::RWMutexWriteLock sLock(mStateMutex);
+  int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  uint64_t stored = 0;
+  if (pread(fd, &stored, sizeof (stored), 0) != sizeof (stored))
+    stored = 0;
+
+  uint64_t next = mNext.load();
+  while ((stored > next) && !mNext.compare_exchange_weak(next, stored)) { }
+
+  if (mStateFd >= 0)
+    close(mStateFd);
+  mStateFd = fd;
+  mPersisted = 0;
+  diamond_static_info("inode counter state=%s next=%llu", path, (unsigned long long) mNext.load());
+  return 0;
+}
+
+void
+diamondInodeAllocator::raiseFloor (uint64_t floor)
+{
+  uint64_t next = mNext.load();
+  while ((floor > next) && !mNext.compare_exchange_weak(next, floor)) { }
+
+  uint64_t current = mFloor.load();
+  while ((floor > current) && !mFloor.compare_exchange_weak(current, floor)) { }
+}
+
+void
+diamondInodeAllocator::persist (uint64_t end)
+{
+  diamond::common::RWMutexWriteLock sLock(mStateMutex);
+  if (end <= mPersisted.load())
+    return;
+
+  uint64_t watermark = end + kPersistAhead;
+  if ((pwrite(mStateFd, &watermark, sizeof (watermark), 0) != sizeof (watermark)) ||
+      fdatasync(mStateFd)) {
+    diamond_static_err("failed to persist inode counter errno=%d", errno);
+    return;
+  }
+  mPersisted = watermark;
+}
+
+DIAMONDRIONAMESPACE_END
@@ -0,0 +1,82 @@
+/*
+ * File:   diamondInodeAllocator.hh
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#ifndef DIAMONDINODEALLOCATOR_HH
+#define	DIAMONDINODEALLOCATOR_HH
+
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "rio/Namespace.hh"
+#include "common/RWMutex.hh"
+
+DIAMONDRIONAMESPACE_BEGIN
+
+//------------------------------------------------------------------------------
+//! Lock-free inode number allocator
+//!
+//! Every thread reserves a range of kRange numbers from a shared atomic
+//! counter and hands them out without further synchronization. Released
+//! numbers can be recycled by the releasing thread with an incremented
+//! generation. With a state file the counter is persisted kPersistAhead
+//! numbers ahead of the reservations, so numbers stay monotonic across
+//! restarts without touching the disk for every range.
+//------------------------------------------------------------------------------
+class diamondInodeAllocator {
+public:
+  static const uint64_t kFirstInode = 2; //< 1 is the FUSE root inode
+  static const uint64_t kRange = 1024;
+  static const uint64_t kPersistAhead = 64 * kRange;
+  static const size_t kMaxFree = 4096;
+
+  diamondInodeAllocator ();
+  virtual ~diamondInodeAllocator ();
+
+  // return a new inode number and its generation
+  uint64_t allocate (uint64_t& generation);
+
+  // hand back an inode number for reuse
+  void release (uint64_t ino, uint64_t generation);
+
+  // persist the counter in path and continue from the stored value
+  int setStateFile (const char* path);
+
+  // never hand out numbers below floor again - loaders call this with the
+  // highest inode number they restored plus one
+  void raiseFloor (uint64_t floor);
+
+  void setReuse (bool reuse) { mReuse = reuse; }
+
+  uint64_t reserved () const { return mNext.load(); }
+
+private:
+  struct ThreadCache {
+    uint64_t owner;
+    uint64_t next;
+    uint64_t end;
+    std::vector< std::pair<uint64_t, uint64_t> > freed;
+  };
+
+  ThreadCache& threadCache ();
+  void persist (uint64_t end);
+
+  uint64_t mId;
+  std::atomic<uint64_t> mNext;
+  std::atomic<uint64_t> mFloor;
+  std::atomic<uint64_t> mPersisted;
+  std::atomic<bool> mReuse;
+  int mStateFd;
+  diamond::common::RWMutex mStateMutex;
+
+  static std::atomic<uint64_t> sInstances;
+};
+
+DIAMONDRIONAMESPACE_END
+
+#endif	/* DIAMONDINODEALLOCATOR_HH */
@@ -0,0 +1,715 @@
+/*
+ * File:   diamondJournal.cc
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#include "diamondJournal.hh"
+#include "diamondCache.hh"
+#include "diamondSnapshot.hh"
+#include "common/Clock.hh"
+#include "common/Logging.hh"
+#include "common/SlabAllocator.hh"
+#include "common/Timing.hh"
+#include "common/kv/kv.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <sstream>
+#include <vector>
+
+DIAMONDRIONAMESPACE_BEGIN
+
+const uint32_t diamondJournal::kJournalMagic;
+const uint32_t diamondJournal::kRecordMagic;
+const uint64_t diamondJournal::kFileBit;
+const uint64_t diamondJournal::kMaxJournal;
+
+static const uint32_t kVersion = 1;
+
+static inline void
+putIno (std::string& out, const diamond_ino_t& ino)
+{
+  diamondMeta::put64(out, DIAMOND_TO_INODE(ino));
+}
+
+//------------------------------------------------------------------------------
+//! Record payload decoding on top of the diamondMeta field encoding
+//------------------------------------------------------------------------------
+class payloadReader {
+public:
+  payloadReader (const char* data, size_t length) : mData(data), mEnd(data + length) { }
+
+  bool
+  get (void* out, size_t len) {
+    return diamondMeta::get(mData, mEnd, out, len);
+  }
+
+  bool
+  getIno (diamond_ino_t& ino) {
+    uint64_t v;
+    if (!get(&v, sizeof (v)))
+      return false;
+    ino = DIAMOND_INODE(v);
+    return true;
+  }
+
+  bool
+  getString (std::string& str) {
+    return diamondMeta::getString(mData, mEnd, str);
+  }
+
+private:
+  const char* mData;
+  const char* mEnd;
+};
+
+static std::string&
+scratch ()
+{
+  static thread_local std::string payload;
+  payload.clear();
+  return payload;
+}
+
+diamondJournal::diamondJournal (diamondCache& cache) : mCache(cache), mTail(0), mDirty(false), mEpoch(0), mDurable(0),
+mRecords(0), mBytes(0), mErrors(0), mSyncs(0), mCheckpoints(0), mReplayed(0), mSkipped(0),
+mStop(false), mSyncInterval(100), mCheckpointInterval(300)
+{
+  mFd[0] = mFd[1] = -1;
+  mActive[0] = mActive[1] = 0;
+}
+
+diamondJournal::~diamondJournal ()
+{
+  close();
+}
+
+int
+diamondJournal::open (const std::string& dir, unsigned sync_ms, unsigned checkpoint_s, unsigned load_threads)
+{
+  diamond::common::Timing tm("journal");
+  COMMONTIMING("start", &tm);
+
+  mDir = dir;
+  mSyncInterval = sync_ms ? sync_ms : 1;
+  mCheckpointInterval = checkpoint_s ? checkpoint_s : 1;
+
+  // a damaged checkpoint refuses the start instead of losing the namespace
+  uint64_t epoch = 0;
+  int rc = diamondSnapshot::load(mCache, checkpointPath(), epoch, load_threads);
+  if (rc && (rc != ENOENT))
+    return rc;
+  COMMONTIMING("checkpoint", &tm);
+
+  FileHeader header[2];
+  bool valid[2];
+  for (unsigned i = 0; i < 2; i++) {
+    mFd[i] = ::open(journalPath(i).c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (mFd[i] < 0) {
+      rc = errno;
+      close();
+      return rc;
+    }
+    valid[i] = (pread(mFd[i], &header[i], sizeof (header[i]), 0) == sizeof (header[i])) &&
+      (header[i].magic == kJournalMagic) && (header[i].version == kVersion) && (header[i].epoch >= epoch);
+  }
+
+  // replay the journals written after the checkpoint in epoch order
+  unsigned order[2] = {0, 1};
+  if (valid[0] && valid[1] && (header[1].epoch < header[0].epoch)) {
+    order[0] = 1;
+    order[1] = 0;
+  }
+
+  int active = -1;
+  uint64_t end = 0;
+  for (unsigned i = 0; i < 2; i++) {
+    unsigned idx = order[i];
+    if (!valid[idx])
+      continue;
+    if ((rc = replay(idx, end))) {
+      close();
+      return rc;
+    }
+    active = idx;
+  }
+  COMMONTIMING("replay", &tm);
+
+  if (active < 0) {
+    // start a fresh journal - an empty one covers nothing to lose
+    active = 0;
+    FileHeader fresh = {kJournalMagic, kVersion, epoch ? epoch : 1};
+    if (ftruncate(mFd[0], 0) || ftruncate(mFd[1], 0) ||
+        (pwrite(mFd[0], &fresh, sizeof (fresh), 0) != sizeof (fresh)) || fdatasync(mFd[0])) {
+      rc = errno ? errno : EIO;
+      close();
+      return rc;
+    }
+    mEpoch = fresh.epoch;
+    mDurable = fresh.epoch;
+    end = sizeof (fresh);
+  } else {
+    // cut a torn tail
+    if (ftruncate(mFd[active], end)) {
+      rc = errno;
+      close();
+      return rc;
+    }
+    mEpoch = header[active].epoch;
+    mDurable = epoch;
+  }
+
+  mTail = (active ? kFileBit : 0) | end;
+  mDirty = false;
+
+  diamond_static_notice("journal recovered dir=%s files=%llu dirs=%llu replayed=%llu skipped=%llu epoch=%llu time=%.03f ms",
+                        dir.c_str(),
+                        (unsigned long long) mCache.fsize(),
+                        (unsigned long long) mCache.dsize(),
+                        (unsigned long long) mReplayed.load(),
+                        (unsigned long long) mSkipped.load(),
+                        (unsigned long long) mEpoch.load(),
+                        tm.RealTime());
+
+  mStop = false;
+  mSyncer = std::thread(&diamondJournal::run, this);
+  return 0;
+}
+
+void
+diamondJournal::close ()
+{
+  if (mSyncer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mWakeMutex);
+      mStop = true;
+    }
+    mWake.notify_one();
+    mSyncer.join();
+
+    // a clean shutdown leaves a short journal to replay
+    if (checkpoint())
+      sync();
+    std::stringstream out;
+    Status(out);
+    diamond_static_info("journal closed %s", out.str().c_str());
+  }
+
+  for (unsigned i = 0; i < 2; i++) {
+    if (mFd[i] >= 0) {
+      ::close(mFd[i]);
+      mFd[i] = -1;
+    }
+  }
+}
+
+void
+diamondJournal::run ()
+{
+  std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mWakeMutex);
+      mWake.wait_for(lock, std::chrono::milliseconds(mSyncInterval), [this] () {
+        return mStop || ((mTail.load() & ~kFileBit) > kMaxJournal);
+      });
+      if (mStop)
+        return;
+    }
+
+    if (mDirty.load())
+      sync();
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (((mTail.load() & ~kFileBit) > kMaxJournal) ||
+        (now - last >= std::chrono::seconds(mCheckpointInterval))) {
+      checkpoint();
+      last = now;
+    }
+  }
+}
+
+int
+diamondJournal::append (uint8_t op, const std::string& payload)
+{
+  uint64_t start = diamond::common::Clock::Now();
+  static thread_local std::string record;
+
+  RecordHeader header;
+  memset(&header, 0, sizeof (header));
+  header.magic = kRecordMagic;
+  header.length = payload.size();
+  header.op = op;
+
+  size_t len = (sizeof (header) + payload.size() + 7) & ~((size_t) 7);
+  record.assign((const char*) &header, sizeof (header));
+  record.append(payload);
+  record.resize(len, 0);
+  uint32_t crc = diamond::common::kv::crc32c(0, record.data(), len);
+  memcpy(&record[offsetof(RecordHeader, crc)], &crc, sizeof (crc));
+
+  // register with the file the tail points to - a journal switch between
+  // the load and the reservation moves the registration along
+  unsigned idx = (mTail.load() & kFileBit) ? 1 : 0;
+  mActive[idx]++;
+  uint64_t pos = mTail.fetch_add(len);
+  unsigned widx = (pos & kFileBit) ? 1 : 0;
+  if (widx != idx) {
+    mActive[widx]++;
+    mActive[idx]--;
+  }
+
+  ssize_t n = pwrite(mFd[widx], record.data(), len, pos & ~kFileBit);
+  int rc = (n == (ssize_t) len) ? 0 : ((n < 0) ? errno : EIO);
+  mActive[widx]--;
+
+  if (rc) {
+    mErrors++;
+    diamond_static_err("journal append failed op=%u errno=%d", (unsigned) op, rc);
+    return rc;
+  }
+
+  mRecords++;
+  mBytes += len;
+  mDirty = true;
+
+  uint64_t offset = pos & ~kFileBit;
+  if ((offset <= kMaxJournal) && ((offset + len) > kMaxJournal))
+    mWake.notify_one();
+  stats().Add(kStatAppend, diamond::common::Clock::Ns(diamond::common::Clock::Now() - start));
+  return 0;
+}
+
+int
+diamondJournal::logMkdir (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino,
+                          uint64_t generation, const struct stat& st)
+{
+  diamondMeta::Attr attrs;
+  diamondMeta::packStat(st, attrs);
+  std::string& payload = scratch();
+  putIno(payload, parent);
+  putIno(payload, ino);
+  diamondMeta::put64(payload, generation);
+  payload.append((const char*) &attrs, sizeof (attrs));
+  diamondMeta::putString(payload, name, strlen(name));
+  return append(kMkdir, payload);
+}
+
+int
+diamondJournal::logCreate (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino,
+                           uint64_t generation, const struct stat& st)
+{
+  diamondMeta::Attr attrs;
+  diamondMeta::packStat(st, attrs);
+  std::string& payload = scratch();
+  putIno(payload, parent);
+  putIno(payload, ino);
+  diamondMeta::put64(payload, generation);
+  payload.append((const char*) &attrs, sizeof (attrs));
+  diamondMeta::putString(payload, name, strlen(name));
+  return append(kCreate, payload);
+}
+
+int
+diamondJournal::logUnlink (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino)
+{
+  std::string& payload = scratch();
+  putIno(payload, parent);
+  putIno(payload, ino);
+  diamondMeta::putString(payload, name, strlen(name));
+  return append(kUnlink, payload);
+}
+
+int
+diamondJournal::logRmdir (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino)
+{
+  std::string& payload = scratch();
+  putIno(payload, parent);
+  putIno(payload, ino);
+  diamondMeta::putString(payload, name, strlen(name));
+  return append(kRmdir, payload);
+}
+
+int
+diamondJournal::logRename (const diamond_ino_t& parent, const char* name,
+                           const diamond_ino_t& newparent, const char* newname, const diamond_ino_t& ino)
+{
+  std::string& payload = scratch();
+  putIno(payload, parent);
+  putIno(payload, newparent);
+  putIno(payload, ino);
+  diamondMeta::putString(payload, name, strlen(name));
+  diamondMeta::putString(payload, newname, strlen(newname));
+  return append(kRename, payload);
+}
+
+int
+diamondJournal::logSetattr (const diamond_ino_t& ino, const struct stat& st)
+{
+  diamondMeta::Attr attrs;
+  diamondMeta::packStat(st, attrs);
+  std::string& payload = scratch();
+  putIno(payload, ino);
+  payload.append((const char*) &attrs, sizeof (attrs));
+  return append(kSetattr, payload);
+}
+
+int
+diamondJournal::logSetxattr (const diamond_ino_t& ino, const char* name, const char* value, size_t size)
+{
+  std::string& payload = scratch();
+  putIno(payload, ino);
+  diamondMeta::putString(payload, name, strlen(name));
+  diamondMeta::putString(payload, value, size);
+  return append(kSetxattr, payload);
+}
+
+int
+diamondJournal::logRemovexattr (const diamond_ino_t& ino, const char* name)
+{
+  std::string& payload = scratch();
+  putIno(payload, ino);
+  diamondMeta::putString(payload, name, strlen(name));
+  return append(kRemovexattr, payload);
+}
+
+int
+diamondJournal::sync ()
+{
+  DIAMOND_TIMING_SCOPE("journal.sync");
+  mDirty = false;
+  int rc = 0;
+  for (unsigned i = 0; i < 2; i++) {
+    if ((mFd[i] >= 0) && fdatasync(mFd[i]) && !rc)
+      rc = errno;
+  }
+
+  if (rc) {
+    mErrors++;
+    mDirty = true;
+    diamond_static_err("journal sync failed errno=%d", rc);
+  } else {
+    mSyncs++;
+  }
+  return rc;
+}
+
+void
+diamondJournal::waitIdle (unsigned idx)
+{
+  while (mActive[idx].load())
+    std::this_thread::yield();
+}
+
+int
+diamondJournal::switchJournal ()
+{
+  unsigned cur = (mTail.load() & kFileBit) ? 1 : 0;
+  unsigned next = 1 - cur;
+
+  // the other journal is obsolete, wait for stragglers of its last epoch
+  waitIdle(next);
+
+  FileHeader header = {kJournalMagic, kVersion, mEpoch.load() + 1};
+  if (ftruncate(mFd[next], 0) ||
+      (pwrite(mFd[next], &header, sizeof (header), 0) != sizeof (header)) ||
+      fdatasync(mFd[next]))
+    return errno ? errno : EIO;
+
+  mTail.exchange((next ? kFileBit : 0) | sizeof (header));
+  mEpoch = header.epoch;
+  return 0;
+}
+
+int
+diamondJournal::checkpoint ()
+{
+  std::lock_guard<std::mutex> lock(mCheckpointMutex);
+  if ((mFd[0] < 0) || (mFd[1] < 0))
+    return EBADF;
+
+  diamond::common::Timing tm("checkpoint");
+  COMMONTIMING("start", &tm);
+
+  // only switch when the active journal is covered by a checkpoint - after a
+  // failed checkpoint the next one retries on the current journal
+  int rc;
+  if ((mDurable.load() == mEpoch.load()) && (rc = switchJournal())) {
+    mErrors++;
+    diamond_static_err("journal switch failed errno=%d", rc);
+    return rc;
+  }
+
+  uint64_t epoch = mEpoch.load();
+  if ((rc = diamondSnapshot::dump(mCache, checkpointPath(), epoch))) {
+    mErrors++;
+    diamond_static_err("checkpoint failed dir=%s errno=%d", mDir.c_str(), rc);
+    return rc;
+  }
+  mDurable = epoch;
+  mCheckpoints++;
+
+  // truncate the previous journal
+  unsigned old = (mTail.load() & kFileBit) ? 0 : 1;
+  waitIdle(old);
+  if (ftruncate(mFd[old], 0))
+    diamond_static_warning("failed to truncate journal %s errno=%d", journalPath(old).c_str(), errno);
+
+  COMMONTIMING("stop", &tm);
+  diamond_static_info("checkpoint epoch=%llu files=%llu dirs=%llu time=%.03f ms",
+                      (unsigned long long) epoch,
+                      (unsigned long long) mCache.fsize(),
+                      (unsigned long long) mCache.dsize(),
+                      tm.RealTime());
+  return 0;
+}
+
+int
+diamondJournal::replay (unsigned idx, uint64_t& end)
+{
+  struct stat st;
+  if (fstat(mFd[idx], &st))
+    return errno;
+
+  end = sizeof (FileHeader);
+  size_t size = st.st_size;
+  if (size <= end)
+    return 0;
+
+  void* map = mmap(0, size, PROT_READ, MAP_PRIVATE, mFd[idx], 0);
+  if (map == MAP_FAILED)
+    return errno;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  const char* data = (const char*) map;
+  uint64_t pos = end;
+  while ((size - pos) >= sizeof (RecordHeader)) {
+    RecordHeader header;
+    memcpy(&header, data + pos, sizeof (header));
+    if (header.magic != kRecordMagic)
+      break;
+    size_t len = (sizeof (header) + (size_t) header.length + 7) & ~((size_t) 7);
+    if ((size - pos) < len)
+      break;
+
+    // the checksum covers the padded record with a zero crc field
+    uint32_t crc = header.crc;
+    header.crc = 0;
+    uint32_t check = diamond::common::kv::crc32c(0, &header, sizeof (header));
+    check = diamond::common::kv::crc32c(check, data + pos + sizeof (header), len - sizeof (header));
+    if (check != crc)
+      break;
+
+    if (apply(header.op, data + pos + sizeof (header), header.length))
+      mSkipped++;
+    else
+      mReplayed++;
+    pos += len;
+  }
+
+  munmap(map, size);
+  if (pos != size)
+    diamond_static_warning("journal %s ends with a torn record at offset=%llu size=%llu",
+                           journalPath(idx).c_str(), (unsigned long long) pos, (unsigned long long) size);
+  end = pos;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+//! Apply a record to the cache - returns 0 or an errno if it was skipped
+//!
+//! A checkpoint may already contain the effect of a record and of records
+//! after it. Every operation therefore checks the inode it acted on and
+//! leaves entries alone which by now belong to another inode.
+//------------------------------------------------------------------------------
+int
+diamondJournal::apply (uint8_t op, const char* data, size_t length)
+{
+  payloadReader reader(data, length);
+  diamond_ino_t parent, newparent, ino, existing;
+  std::string name, newname, value;
+  uint64_t generation;
+  diamondMeta::Attr attrs;
+  struct stat st;
+
+  switch (op) {
+  case kMkdir:
+  case kCreate:
+  {
+    if (!reader.getIno(parent) || !reader.getIno(ino) || !reader.get(&generation, sizeof (generation)) ||
+        !reader.get(&attrs, sizeof (attrs)) || !reader.getString(name))
+      return EINVAL;
+
+    diamondCache::diamondDirPtr dir = mCache.getDir(parent, false, false);
+    if (!dir)
+      return ENOENT;
+
+    // a checkpoint taken during the create may hold the entry but not the inode
+    bool linked = dir->findName(name.c_str(), existing);
+    if (linked && ((existing != ino) ||
+                   ((op == kMkdir) ? (bool) mCache.getDir(ino, false, false) :
+                    (bool) mCache.getFile(ino, false, false))))
+      return EEXIST;
+
+    diamondMeta* meta;
+    diamondCache::diamondDirPtr newdir;
+    diamondCache::diamondFilePtr newfile;
+    if (op == kMkdir) {
+      newdir = mCache.getDir(ino, false, true, name);
+      meta = newdir.get();
+    } else {
+      newfile = mCache.getFile(ino, false, true, name);
+      meta = newfile.get();
+    }
+
+    diamondMeta::unpackAttr(attrs, st);
+    meta->setStat(st);
+    meta->setName(name);
+    meta->setGeneration(generation);
+    meta->setLinkKey(diamondCache::linkKey(parent, name.c_str()));
+    mCache.getInodeAllocator().raiseFloor(DIAMOND_TO_INODE(ino) + 1);
+    if (!linked) {
+      dir->addName(name.c_str(), ino);
+      mCache.addName(parent, name.c_str(), ino);
+    }
+    return 0;
+  }
+
+  case kUnlink:
+  case kRmdir:
+  {
+    if (!reader.getIno(parent) || !reader.getIno(ino) || !reader.getString(name))
+      return EINVAL;
+
+    diamondCache::diamondDirPtr dir = mCache.getDir(parent, false, false);
+    if (dir && dir->findName(name.c_str(), existing) && (existing == ino)) {
+      dir->rmName(name.c_str());
+      mCache.rmName(parent, name.c_str());
+    }
+    return (op == kUnlink) ? mCache.rmFile(ino) : mCache.rmDir(ino);
+  }
+
+  case kRename:
+  {
+    if (!reader.getIno(parent) || !reader.getIno(newparent) || !reader.getIno(ino) ||
+        !reader.getString(name) || !reader.getString(newname))
+      return EINVAL;
+
+    diamondCache::diamondDirPtr dir = mCache.getDir(parent, false, false);
+    if (dir && dir->findName(name.c_str(), existing) && (existing == ino)) {
+      dir->rmName(name.c_str());
+      mCache.rmName(parent, name.c_str());
+    }
+
+    diamondCache::diamondFilePtr file = mCache.getFile(ino, false, false);
+    diamondCache::diamondDirPtr cdir;
+    diamondMeta* meta = file.get();
+    if (!meta) {
+      cdir = mCache.getDir(ino, false, false);
+      meta = cdir.get();
+    }
+
+    diamondCache::diamondDirPtr target = mCache.getDir(newparent, false, false);
+    if (!meta || !target)
+      return ENOENT;
+
+    if (target->findName(newname.c_str(), existing)) {
+      if (existing == ino)
+        return EEXIST;
+      // the target was replaced
+      if (mCache.rmFile(existing))
+        mCache.rmDir(existing);
+      target->rmName(newname.c_str());
+      mCache.rmName(newparent, newname.c_str());
+    }
+
+    target->addName(newname.c_str(), ino);
+    mCache.addName(newparent, newname.c_str(), ino);
+    meta->setName(newname);
+    meta->setLinkKey(diamondCache::linkKey(newparent, newname.c_str()));
+    return 0;
+  }
+
+  case kSetattr:
+  case kSetxattr:
+  case kRemovexattr:
+  {
+    if (!reader.getIno(ino))
+      return EINVAL;
+
+    diamondCache::diamondFilePtr file = mCache.getFile(ino, false, false);
+    diamondCache::diamondDirPtr dir;
+    diamondMeta* meta = file.get();
+    if (!meta) {
+      dir = mCache.getDir(ino, false, false);
+      meta = dir.get();
+    }
+
+    if (op == kSetattr) {
+      if (!reader.get(&attrs, sizeof (attrs)))
+        return EINVAL;
+      if (!meta)
+        return ENOENT;
+
+      struct stat cur;
+      meta->copyStat(cur);
+      diamondMeta::unpackAttr(attrs, st);
+      if (file && (cur.st_size != st.st_size)) {
+        int rc = file->truncate(st.st_size);
+        if (rc)
+          return rc;
+      }
+      meta->setStat(st);
+      return 0;
+    }
+
+    if (!reader.getString(name))
+      return EINVAL;
+    if (!meta)
+      return ENOENT;
+
+    if (op == kSetxattr) {
+      if (!reader.getString(value))
+        return EINVAL;
+      return meta->setXattr(name, value.data(), value.size());
+    }
+    return meta->rmXattr(name);
+  }
+
+  default:
+    return EINVAL;
+  }
+}
+
+diamond::common::OpStats&
+diamondJournal::stats ()
+{
+  static const char* const names[] = {"append", 0};
+  static diamond::common::OpStats ops(names);
+  return ops;
+}
+
+void
+diamondJournal::Status (std::ostream& os)
+{
+  os << "journal.epoch=" << mEpoch.load()
+    << " journal.checkpoint=" << mDurable.load()
+    << " journal.size=" << (mTail.load() & ~kFileBit)
+    << " journal.records=" << mRecords.load()
+    << " journal.bytes=" << mBytes.load()
+    << " journal.syncs=" << mSyncs.load()
+    << " journal.checkpoints=" << mCheckpoints.load()
+    << " journal.replayed=" << mReplayed.load()
+    << " journal.skipped=" << mSkipped.load()
+    << " journal.errors=" << mErrors.load() << std::endl;
+  stats().Dump(os, "journal.");
+}
+
+DIAMONDRIONAMESPACE_END
@@ -0,0 +1,176 @@
+/*
+ * File:   diamondJournal.hh
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#ifndef DIAMONDJOURNAL_HH
+#define	DIAMONDJOURNAL_HH
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rio/Namespace.hh"
+#include "rio/diamond_types.hh"
+#include "common/OpStats.hh"
+
+DIAMONDRIONAMESPACE_BEGIN
+
+class diamondCache;
+
+//------------------------------------------------------------------------------
+//! Binary metadata journal with periodic checkpoints
+//!
+//! Namespace operations append one compact record after they changed the
+//! cache, still holding their directory locks, so records of one directory
+//! are in operation order. Appending reserves space with a single fetch_add on
+//! the journal tail and writes with pwrite - worker threads never lock. A
+//! syncer thread batches fdatasync every sync interval.
+//!
+//! There are two journal files used alternately. A checkpoint switches the
+//! tail to the other file, serializes the cache while operations continue and
+//! replaces the checkpoint file atomically - the previous journal is then
+//! obsolete and truncated. Records appended during the checkpoint may or may
+//! not be part of it, so replay is idempotent: records carry the inode they
+//! act on and are skipped when the namespace already moved past them.
+//!
+//! Files: <dir>/journal.0, <dir>/journal.1, <dir>/namespace.checkpoint - the
+//! checkpoint is a diamondSnapshot dump.
+//! File contents are not journaled.
+//------------------------------------------------------------------------------
+class diamondJournal {
+public:
+  enum Op {
+    kMkdir = 1,
+    kCreate,
+    kUnlink,
+    kRmdir,
+    kRename,
+    kSetattr,
+    kSetxattr,
+    kRemovexattr
+  };
+
+  static const uint32_t kJournalMagic = 0x4a4e5244;     //< 'DRNJ'
+  static const uint32_t kRecordMagic = 0x43455244;      //< 'DREC'
+  static const uint64_t kFileBit = 1ull << 63;
+  static const uint64_t kMaxJournal = 256ull * 1024 * 1024;
+
+  diamondJournal (diamondCache& cache);
+  virtual ~diamondJournal ();
+
+  // ---------------------------------------------------------------------------
+  //! Recover the namespace into the cache and start the syncer - returns 0 or
+  //! an errno. The cache has to be empty apart from the root directory. The
+  //! checkpoint is loaded with load_threads threads, 0 uses all cores.
+  // ---------------------------------------------------------------------------
+  int open (const std::string& dir, unsigned sync_ms, unsigned checkpoint_s, unsigned load_threads = 0);
+
+  // ---------------------------------------------------------------------------
+  //! Stop the syncer, sync the journal and close it
+  // ---------------------------------------------------------------------------
+  void close ();
+
+  // ---------------------------------------------------------------------------
+  //! Record appenders - return 0 or an errno
+  // ---------------------------------------------------------------------------
+  int logMkdir (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino,
+                uint64_t generation, const struct stat& st);
+  int logCreate (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino,
+                 uint64_t generation, const struct stat& st);
+  int logUnlink (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino);
+  int logRmdir (const diamond_ino_t& parent, const char* name, const diamond_ino_t& ino);
+  int logRename (const diamond_ino_t& parent, const char* name,
+                 const diamond_ino_t& newparent, const char* newname, const diamond_ino_t& ino);
+  int logSetattr (const diamond_ino_t& ino, const struct stat& st);
+  int logSetxattr (const diamond_ino_t& ino, const char* name, const char* value, size_t size);
+  int logRemovexattr (const diamond_ino_t& ino, const char* name);
+
+  // ---------------------------------------------------------------------------
+  //! Make all appended records durable - returns 0 or an errno
+  // ---------------------------------------------------------------------------
+  int sync ();
+
+  // ---------------------------------------------------------------------------
+  //! Write a checkpoint and truncate the journal - returns 0 or an errno
+  // ---------------------------------------------------------------------------
+  int checkpoint ();
+
+  void Status (std::ostream& os);
+
+  // ---------------------------------------------------------------------------
+  //! Per-thread append latencies - append runs on every namespace mutation
+  // ---------------------------------------------------------------------------
+  enum Stat {
+    kStatAppend = 0,
+    kStats
+  };
+
+  static diamond::common::OpStats& stats ();
+
+private:
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t epoch;   //< incremented with every journal switch
+  };
+
+  struct RecordHeader {
+    uint32_t magic;
+    uint32_t length;  //< payload bytes
+    uint32_t crc;     //< crc32c of the padded record with crc = 0
+    uint8_t op;
+    uint8_t pad[3];
+  };
+
+  std::string path (const char* name) const { return mDir + "/" + name; }
+  std::string journalPath (unsigned idx) const { return path(idx ? "journal.1" : "journal.0"); }
+  std::string checkpointPath () const { return path("namespace.checkpoint"); }
+
+  int append (uint8_t op, const std::string& payload);
+  int switchJournal ();
+  void waitIdle (unsigned idx);
+
+  int replay (unsigned idx, uint64_t& end);
+  int apply (uint8_t op, const char* data, size_t length);
+
+  void run ();
+
+  diamondCache& mCache;
+  std::string mDir;
+  int mFd[2];
+  std::atomic<uint64_t> mTail;      //< kFileBit selects the file, the rest is the offset
+  std::atomic<uint64_t> mActive[2]; //< appenders writing into a file
+  std::atomic<bool> mDirty;
+  std::atomic<uint64_t> mEpoch;     //< epoch of the active journal
+  std::atomic<uint64_t> mDurable;   //< epoch of the last checkpoint
+
+  std::atomic<uint64_t> mRecords;
+  std::atomic<uint64_t> mBytes;
+  std::atomic<uint64_t> mErrors;
+  std::atomic<uint64_t> mSyncs;
+  std::atomic<uint64_t> mCheckpoints;
+  std::atomic<uint64_t> mReplayed;
+  std::atomic<uint64_t> mSkipped;
+
+  std::mutex mCheckpointMutex;      //< one checkpoint at a time
+  std::mutex mWakeMutex;
+  std::condition_variable mWake;
+  bool mStop;
+  unsigned mSyncInterval;
+  unsigned mCheckpointInterval;
+  std::thread mSyncer;
+};
+
+DIAMONDRIONAMESPACE_END
+
+#endif	/* DIAMONDJOURNAL_HH */
@@ -1,60 +1,424 @@
-/* 
+/*
  * File:   diamondMeta.cc
  * Author: apeters
- * 
+ *
  * Created on October 15, 2014, 4:09 PM
  */
 
 #include "diamondMeta.hh"
+#include "common/MemoryAccounting.hh"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/xattr.h>
 
 DIAMONDRIONAMESPACE_BEGIN
 
-diamondMeta::diamondMeta (const diamond_ino_t ino, std::string name) { mIno = ino; mName = name; }
+const size_t diamondMeta::kInlineName;
+const size_t diamondMeta::kXattrStripes;
+
+diamond::common::RWMutex diamondMeta::sXattrMutex[diamondMeta::kXattrStripes];
+
+static const int64_t kNsec = 1000000000ll;
+
+using diamond::common::MemoryAccounting;
+
+// approximate footprint of one xattr - tree node with the two strings
+static inline int64_t
+xattrEntryBytes (size_t namelen, size_t valuelen)
+{
+  return 32 + sizeof (diamondMeta::xattr_map_t::value_type) + namelen + valuelen;
+}
+
+static inline int64_t
+toNsec (const struct timespec& ts)
+{
+  return ((int64_t) ts.tv_sec * kNsec) + ts.tv_nsec;
+}
 
-diamondMeta::diamondMeta (const diamondMeta& orig) { }
+static inline void
+fromNsec (int64_t ns, struct timespec& ts)
+{
+  ts.tv_sec = ns / kNsec;
+  ts.tv_nsec = ns % kNsec;
+  if (ts.tv_nsec < 0) {
+    ts.tv_sec--;
+    ts.tv_nsec += kNsec;
+  }
+}
 
-diamondMeta::diamondMeta (diamondMeta* orig) { mName = orig->getName(); mIno = orig->getIno(); memcpy(&mStat, orig->getStat(), sizeof (struct stat) ); }
+diamondMeta::diamondMeta () : mStatSeq(0), mNameLen(0), mIno(0), mGeneration(0), mLinkKey(0)
+{
+  memset(&mAttr, 0, sizeof (mAttr));
+}
 
-diamondMeta::~diamondMeta () { }
+diamondMeta::diamondMeta (const diamond_ino_t ino, std::string name) : mStatSeq(0), mNameLen(0), mIno(DIAMOND_TO_INODE(ino)), mGeneration(0), mLinkKey(0)
+{
+  memset(&mAttr, 0, sizeof (mAttr));
+  setNameData(name.c_str(), name.length());
+}
 
-void 
-diamondMeta::setStat(struct stat& sbuf) 
+diamondMeta::diamondMeta (const diamondMeta& orig) : mStatSeq(0), mNameLen(0), mIno(0), mGeneration(0), mLinkKey(0)
 {
-  memcpy(&mStat, &sbuf, sizeof(struct stat));
+  memset(&mAttr, 0, sizeof (mAttr));
+}
+
+diamondMeta::diamondMeta (diamondMeta* orig) : mStatSeq(0), mNameLen(0), mIno(orig->mIno), mGeneration(orig->mGeneration), mLinkKey(orig->getLinkKey())
+{
+  struct stat st;
+  orig->copyStat(st);
+  packStat(st, mAttr);
+  std::string name = orig->getName();
+  setNameData(name.c_str(), name.length());
+
+  diamond::common::RWMutexReadLock xLock(orig->xattrLocker());
+  if (orig->mXattrs) {
+    mXattrs.reset(new xattr_map_t(*orig->mXattrs));
+    MemoryAccounting::Add(MemoryAccounting::kXattrs, xattrBytes(*mXattrs));
+  }
+}
+
+diamondMeta::~diamondMeta ()
+{
+  if (mNameLen > kInlineName) {
+    delete[] mNameHeap;
+    MemoryAccounting::Sub(MemoryAccounting::kInodes, mNameLen);
+  }
+  if (mXattrs)
+    MemoryAccounting::Sub(MemoryAccounting::kXattrs, xattrBytes(*mXattrs));
+}
+
+int64_t
+diamondMeta::xattrBytes (const xattr_map_t& xattrs)
+{
+  int64_t bytes = sizeof (xattr_map_t);
+  for (xattr_map_t::const_iterator it = xattrs.begin(); it != xattrs.end(); ++it)
+    bytes += xattrEntryBytes(it->first.size(), it->second.size());
+  return bytes;
 }
 
 void
-diamondMeta::makeStat(uid_t uid, 
-		      gid_t gid, 
-		      ino_t ino,
-		      mode_t mode,
-		      off_t size)
+diamondMeta::setNameData (const char* name, size_t len)
+{
+  if (mNameLen > kInlineName) {
+    delete[] mNameHeap;
+    MemoryAccounting::Sub(MemoryAccounting::kInodes, mNameLen);
+  }
+
+  if (len > kInlineName) {
+    mNameHeap = new char[len];
+    memcpy(mNameHeap, name, len);
+    MemoryAccounting::Add(MemoryAccounting::kInodes, len);
+  } else {
+    memcpy(mNameInline, name, len);
+  }
+  mNameLen = len;
+}
+
+const char*
+diamondMeta::nameData () const
+{
+  return (mNameLen > kInlineName) ? mNameHeap : mNameInline;
+}
+
+std::string
+diamondMeta::getName () const
+{
+  // rename frees a heap name - readers hold the stripe lock while copying
+  diamond::common::RWMutexReadLock xLock(xattrLocker());
+  return std::string(nameData(), mNameLen);
+}
+
+void
+diamondMeta::setName (const std::string& name)
+{
+  diamond::common::RWMutexWriteLock xLock(xattrLocker());
+  setNameData(name.c_str(), name.length());
+}
+
+void
+diamondMeta::packStat (const struct stat& st, Attr& attr)
+{
+  attr.mode = st.st_mode;
+  attr.uid = st.st_uid;
+  attr.gid = st.st_gid;
+  attr.nlink = st.st_nlink;
+  attr.size = st.st_size;
+  attr.atime = toNsec(st.st_atim);
+  attr.mtime = toNsec(st.st_mtim);
+  attr.ctime = toNsec(st.st_ctim);
+}
+
+void
+diamondMeta::unpackAttr (const Attr& attr, struct stat& st)
+{
+  memset(&st, 0, sizeof (st));
+  st.st_mode = attr.mode;
+  st.st_nlink = attr.nlink;
+  st.st_uid = attr.uid;
+  st.st_gid = attr.gid;
+  st.st_size = attr.size;
+  fromNsec(attr.atime, st.st_atim);
+  fromNsec(attr.mtime, st.st_mtim);
+  fromNsec(attr.ctime, st.st_ctim);
+}
+
+void
+diamondMeta::unpackStat (const Attr& attr, struct stat& st) const
+{
+  unpackAttr(attr, st);
+  st.st_dev = 0xcafe;
+  st.st_ino = mIno;
+  st.st_rdev = 0;
+  st.st_blksize = 4096;
+  st.st_blocks = (attr.size + 511) / 512;
+}
+
+static const size_t kAttrWords = 6;
+
+static inline void
+statRelax ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+diamondMeta::StatWriter::StatWriter (diamondMeta& meta) : mMeta(meta)
+{
+  // take the odd bit - at most one writer at a time
+  mSeq = mMeta.mStatSeq.load(std::memory_order_relaxed);
+  for (;;) {
+    if (!(mSeq & 1) &&
+        mMeta.mStatSeq.compare_exchange_weak(mSeq, mSeq + 1, std::memory_order_acquire))
+      break;
+    statRelax();
+    mSeq = mMeta.mStatSeq.load(std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  mMeta.unpackStat(mMeta.mAttr, mStat);
+}
+
+diamondMeta::StatWriter::~StatWriter ()
+{
+  Attr attr;
+  packStat(mStat, attr);
+
+  uint64_t* src = (uint64_t*) & attr;
+  uint64_t* dst = (uint64_t*) & mMeta.mAttr;
+  for (size_t i = 0; i < kAttrWords; i++)
+    __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+  mMeta.mStatSeq.store(mSeq + 2, std::memory_order_release);
+}
+
+void
+diamondMeta::copyStat (struct stat& sbuf) const
+{
+  static_assert(sizeof (Attr) == (kAttrWords * sizeof (uint64_t)), "attributes are copied in 64-bit words");
+
+  Attr attr;
+  uint64_t* dst = (uint64_t*) & attr;
+  uint64_t* src = (uint64_t*) & mAttr;
+
+  for (;;) {
+    uint32_t seq = mStatSeq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      statRelax();
+      continue;
+    }
+    for (size_t i = 0; i < kAttrWords; i++)
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (mStatSeq.load(std::memory_order_relaxed) == seq)
+      break;
+  }
+  unpackStat(attr, sbuf);
+}
+
+void
+diamondMeta::setStat (const struct stat& sbuf)
+{
+  StatWriter st(*this);
+  memcpy(&*st, &sbuf, sizeof(struct stat));
+}
+
+void
+diamondMeta::makeStat (uid_t uid,
+		       gid_t gid,
+		       mode_t mode,
+		       off_t size)
 {
   struct timespec ts;
   GetTimeSpecNow(ts);
+
+  StatWriter st(*this);
+  st->st_mode = mode;
+  st->st_nlink= 1;
+  st->st_uid  = uid;
+  st->st_gid  = gid;
+  st->st_size = size;
+  st->st_atim = ts;
+  st->st_mtim = ts;
+  st->st_ctim = ts;
+}
+
+diamond::common::RWMutex&
+diamondMeta::xattrLocker () const
+{
+  return sXattrMutex[mIno % kXattrStripes];
+}
+
+int
+diamondMeta::getXattr (const std::string& name, std::string& value)
+{
+  diamond::common::RWMutexReadLock xLock(xattrLocker());
+  if (!mXattrs)
+    return ENODATA;
+
+  xattr_map_t::const_iterator it = mXattrs->find(name);
+  if (it == mXattrs->end())
+    return ENODATA;
+  value = it->second;
+  return 0;
+}
+
+int
+diamondMeta::setXattr (const std::string& name, const char* value, size_t size, int flags)
+{
+  diamond::common::RWMutexWriteLock xLock(xattrLocker());
+  bool exists = mXattrs && mXattrs->count(name);
+
+  if ((flags & XATTR_CREATE) && exists)
+    return EEXIST;
+  if ((flags & XATTR_REPLACE) && !exists)
+    return ENODATA;
+
+  if (!mXattrs) {
+    mXattrs.reset(new xattr_map_t);
+    MemoryAccounting::Add(MemoryAccounting::kXattrs, sizeof (xattr_map_t));
+  }
+
+  std::string& stored = (*mXattrs)[name];
+  if (exists)
+    MemoryAccounting::Add(MemoryAccounting::kXattrs, (int64_t) size - (int64_t) stored.size());
+  else
+    MemoryAccounting::Add(MemoryAccounting::kXattrs, xattrEntryBytes(name.size(), size));
+  stored.assign(value, size);
+  return 0;
+}
+
+int
+diamondMeta::rmXattr (const std::string& name)
+{
+  diamond::common::RWMutexWriteLock xLock(xattrLocker());
+  xattr_map_t::iterator it;
+  if (!mXattrs || ((it = mXattrs->find(name)) == mXattrs->end()))
+    return ENODATA;
+
+  MemoryAccounting::Sub(MemoryAccounting::kXattrs, xattrEntryBytes(it->first.size(), it->second.size()));
+  mXattrs->erase(it);
+
+  if (mXattrs->empty()) {
+    mXattrs.reset();
+    MemoryAccounting::Sub(MemoryAccounting::kXattrs, sizeof (xattr_map_t));
+  }
+  return 0;
+}
+
+void
+diamondMeta::listXattr (std::string& names)
+{
+  diamond::common::RWMutexReadLock xLock(xattrLocker());
+  names.clear();
+  if (!mXattrs)
+    return;
+
+  for (xattr_map_t::const_iterator it = mXattrs->begin(); it != mXattrs->end(); ++it) {
+    names.append(it->first);
+    names.push_back('\0');
+  }
+}
+
+struct diamondMetaRecord {
+  uint32_t version;
+  uint32_t namelen;
+  uint64_t generation;
+  uint64_t linkkey;
+  uint32_t nxattr;
+  uint32_t reserved;
+};
+
+static const uint32_t kRecordVersion = 1;
+
+void
+diamondMeta::encode (std::string& record)
+{
   struct stat st;
-  memset(&st, sizeof(st),0);
-  st.st_dev  = 0xcafe;
-  st.st_ino  = ino;
-  st.st_mode = mode;
-  st.st_nlink= 1;  
-  st.st_uid  = uid;
-  st.st_gid  = gid;
-  st.st_rdev = 0;
-  st.st_size = size;
-  st.st_blksize = 4096;
-  st.st_blocks  = 0;
-  st.st_atime   = ts.tv_sec;
-  st.st_mtime   = ts.tv_sec;
-  st.st_ctime   = ts.tv_sec;
-  st.st_atim.tv_sec = ts.tv_sec;
-  st.st_mtim.tv_sec = ts.tv_sec;
-  st.st_ctim.tv_sec = ts.tv_sec;
-  st.st_atim.tv_nsec = ts.tv_nsec;
-  st.st_mtim.tv_nsec = ts.tv_nsec;
-  st.st_ctim.tv_nsec = ts.tv_nsec;
-
-  setStat(st);
+  copyStat(st);
+  Attr attr;
+  packStat(st, attr);
+
+  diamondMetaRecord header;
+  memset(&header, 0, sizeof (header));
+  header.version = kRecordVersion;
+  header.generation = getGeneration();
+  header.linkkey = getLinkKey();
+
+  // the stripe lock covers the name as well as the xattrs
+  diamond::common::RWMutexReadLock xLock(xattrLocker());
+  header.namelen = mNameLen;
+  header.nxattr = mXattrs ? mXattrs->size() : 0;
+
+  record.assign((const char*) &header, sizeof (header));
+  record.append((const char*) &attr, sizeof (attr));
+  record.append(nameData(), mNameLen);
+
+  if (!mXattrs)
+    return;
+
+  for (xattr_map_t::const_iterator it = mXattrs->begin(); it != mXattrs->end(); ++it) {
+    uint32_t len[2] = {(uint32_t) it->first.length(), (uint32_t) it->second.length()};
+    record.append((const char*) len, sizeof (len));
+    record.append(it->first);
+    record.append(it->second);
+  }
+}
+
+int
+diamondMeta::decode (const std::string& record)
+{
+  diamondMetaRecord header;
+  Attr attr;
+  size_t pos = sizeof (header) + sizeof (attr);
+
+  if (record.size() < pos)
+    return EINVAL;
+  memcpy(&header, record.c_str(), sizeof (header));
+  memcpy(&attr, record.c_str() + sizeof (header), sizeof (attr));
+  if ((header.version != kRecordVersion) || ((record.size() - pos) < header.namelen))
+    return EINVAL;
+
+  setNameData(record.c_str() + pos, header.namelen);
+  pos += header.namelen;
+
+  for (uint32_t i = 0; i < header.nxattr; i++) {
+    uint32_t len[2];
+    if ((record.size() - pos) < sizeof (len))
+      return EINVAL;
+    memcpy(len, record.c_str() + pos, sizeof (len));
+    pos += sizeof (len);
+    if ((record.size() - pos) < ((size_t) len[0] + len[1]))
+      return EINVAL;
+    int rc = setXattr(record.substr(pos, len[0]), record.c_str() + pos + len[0], len[1]);
+    if (rc)
+      return rc;
+    pos += len[0] + len[1];
+  }
+
+  mAttr = attr;
+  mGeneration = header.generation;
+  mLinkKey = header.linkkey;
+  return 0;
 }
 
 DIAMONDRIONAMESPACE_END
@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   diamondMeta.hh
  * Author: apeters
  *
@@ -8,9 +8,12 @@
 #ifndef DIAMONDMETA_HH
 #define	DIAMONDMETA_HH
 
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include <map>
-#include <set> 
+#include <memory>
+#include <atomic>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,30 +24,134 @@
 #include "rio/Namespace.hh"
 #include "rio/diamond_types.hh"
 
-#include "common/BufferPtr.hh"
 #include "common/RWMutex.hh"
 
 
 DIAMONDRIONAMESPACE_BEGIN
 
-class diamondMeta : public std::map<std::string, diamond::common::BufferPtr>  {
-  friend class diamondFile;
-
+//------------------------------------------------------------------------------
+//! Compact inode record
+//!
+//! Attributes are packed into 48 bytes with nanosecond times and a
+//! struct stat is only built on demand. Names up to kInlineName bytes are
+//! stored inline, extended attributes are allocated with the first one set.
+//! The name and the extended attributes are protected by a striped lock
+//! shared between all inodes.
+//------------------------------------------------------------------------------
+class diamondMeta {
 public:
-  diamondMeta () {}
+  typedef std::map<std::string, std::string> xattr_map_t;
+
+  static const size_t kInlineName = 16;
+  static const size_t kXattrStripes = 64;
+
+  diamondMeta ();
   diamondMeta (diamond_ino_t ino, std::string name);
   diamondMeta (const diamondMeta& orig);
   diamondMeta (diamondMeta* orig);
   virtual ~diamondMeta ();
 
-  struct stat* getStat() {return &mStat;}
-  void setStat(struct stat& sbuf);
-  void makeStat(uid_t uid, gid_t gid, ino_t ino, mode_t mode, off_t size);
-  diamond::common::RWMutex& Locker() { return mMutex; }
+  // ---------------------------------------------------------------------------
+  //! Stat seqlock: writers serialize on the odd bit of the sequence number and
+  //! publish a private copy, readers copy optimistically and retry if the
+  //! sequence moved - getattr neither blocks nor writes shared cache lines.
+  // ---------------------------------------------------------------------------
+  class StatWriter {
+  public:
+    StatWriter (diamondMeta& meta);
+    ~StatWriter ();
+
+    struct stat* operator-> () { return &mStat; }
+    struct stat& operator* () { return mStat; }
+
+  private:
+    diamondMeta& mMeta;
+    uint32_t mSeq;
+    struct stat mStat;
+  };
+
+  void copyStat(struct stat& sbuf) const;
+  void setStat(const struct stat& sbuf);
+  void makeStat(uid_t uid, gid_t gid, mode_t mode, off_t size);
+
+  diamond_ino_t getIno() const {return DIAMOND_INODE(mIno);}
+  uint64_t getInode() const {return mIno;}
+  std::string getName() const;
+  void setName(const std::string& name);
+
+  uint64_t getGeneration() const {return mGeneration;}
+  void setGeneration(uint64_t generation) {mGeneration = generation;}
+
+  // key of the (parent, name) link - verifies name index hits without locking
+  uint64_t getLinkKey() const {return mLinkKey.load();}
+  void setLinkKey(uint64_t key) {mLinkKey = key;}
+
+  // ---------------------------------------------------------------------------
+  //! Serialized record of attributes, name, generation, link key and xattrs
+  //! for the write-back store - decode only runs on unpublished objects
+  // ---------------------------------------------------------------------------
+  void encode(std::string& record);
+  int decode(const std::string& record);
+
+  // ---------------------------------------------------------------------------
+  //! Packed attributes - also the attribute layout of the journal records
+  // ---------------------------------------------------------------------------
+  struct Attr {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint64_t size;
+    int64_t atime;   //< nanoseconds since the epoch
+    int64_t mtime;
+    int64_t ctime;
+  };
+
+  static void packStat(const struct stat& st, Attr& attr);
+  // fills the packed fields only - unpackStat adds the inode specific ones
+  static void unpackAttr(const Attr& attr, struct stat& st);
+
+  // ---------------------------------------------------------------------------
+  //! Field encoding of the journal and snapshot records - native 64-bit words
+  //! and strings with a 32-bit length prefix. The getters advance data and
+  //! return false when the record ends early.
+  // ---------------------------------------------------------------------------
+  static void put64 (std::string& out, uint64_t v) {
+    out.append((const char*) &v, sizeof (v));
+  }
+
+  static void putString (std::string& out, const char* str, size_t len) {
+    uint32_t l = len;
+    out.append((const char*) &l, sizeof (l));
+    out.append(str, len);
+  }
+
+  static bool get (const char*& data, const char* end, void* out, size_t len) {
+    if ((size_t) (end - data) < len)
+      return false;
+    memcpy(out, data, len);
+    data += len;
+    return true;
+  }
+
+  static bool getString (const char*& data, const char* end, std::string& str) {
+    uint32_t len;
+    if (!get(data, end, &len, sizeof (len)) || ((size_t) (end - data) < len))
+      return false;
+    str.assign(data, len);
+    data += len;
+    return true;
+  }
+
+  // stripe lock guarding the xattrs and the name - setattr also holds it to
+  // keep the journal records of an inode in order
+  diamond::common::RWMutex& xattrLocker() const;
 
-  diamond_ino_t& getIno() {return mIno;}
-  std::string& getName() {return mName;}
-  void setName(std::string name) {mName = name;}
+  // extended attributes - return 0 or an errno
+  int getXattr(const std::string& name, std::string& value);
+  int setXattr(const std::string& name, const char* value, size_t size, int flags = 0);
+  int rmXattr(const std::string& name);
+  void listXattr(std::string& names);
 
   void GetTimeSpecNow (struct timespec &ts) {
 #ifdef __APPLE__
@@ -57,14 +164,27 @@ public:
 #endif
   }
 
-
 protected:
-  diamond_ino_t mIno;
-  std::string mName;
-
-  struct stat mStat;
-  diamond::common::RWMutex mMutex;
-
+  void unpackStat(const Attr& attr, struct stat& st) const;
+  static int64_t xattrBytes(const xattr_map_t& xattrs);
+  void setNameData(const char* name, size_t len);
+  const char* nameData() const;
+
+  Attr mAttr;
+  std::atomic<uint32_t> mStatSeq;
+  uint32_t mNameLen;
+  uint64_t mIno;
+  uint64_t mGeneration;
+  std::atomic<uint64_t> mLinkKey;
+
+  union {
+    char mNameInline[kInlineName];
+    char* mNameHeap;
+  };
+
+  std::unique_ptr<xattr_map_t> mXattrs;
+
+  static diamond::common::RWMutex sXattrMutex[kXattrStripes];
 };
 
 DIAMONDRIONAMESPACE_END
@@ -0,0 +1,320 @@
+/*
+ * File:   diamondSnapshot.cc
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#include "diamondSnapshot.hh"
+#include "diamondCache.hh"
+#include "common/Logging.hh"
+#include "common/SlabAllocator.hh"
+#include "common/Timing.hh"
+#include "common/kv/kv.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+DIAMONDRIONAMESPACE_BEGIN
+
+const uint32_t diamondSnapshot::kMagic;
+const uint32_t diamondSnapshot::kBlockMagic;
+const size_t diamondSnapshot::kBlockSize;
+
+static const uint32_t kVersion = 1;
+
+static bool
+writeAll (int fd, const void* data, size_t len)
+{
+  const char* p = (const char*) data;
+  while (len) {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+int
+diamondSnapshot::dump (diamondCache& cache, const std::string& path, uint64_t epoch)
+{
+  std::vector<diamondCache::diamondFilePtr> files;
+  std::vector<diamondCache::diamondDirPtr> dirs;
+  cache.getInodes(files, dirs);
+
+  std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  Header header;
+  memset(&header, 0, sizeof (header));
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.epoch = epoch;
+  header.files = files.size();
+  header.dirs = dirs.size();
+
+  bool ok = writeAll(fd, &header, sizeof (header));
+  std::string block;
+  std::string record;
+  uint32_t records = 0;
+  block.reserve(kBlockSize + 4096);
+
+  auto flushBlock = [&] () {
+    if (!records)
+      return;
+    BlockHeader bh = {kBlockMagic, records, (uint32_t) block.size(),
+      diamond::common::kv::crc32c(0, block.data(), block.size())};
+    ok = ok && writeAll(fd, &bh, sizeof (bh)) && writeAll(fd, block.data(), block.size());
+    header.blocks++;
+    block.clear();
+    records = 0;
+  };
+
+  // record: type, ino, meta record [, directory entries]
+  for (size_t i = 0; ok && (i < files.size()); i++) {
+    files[i]->encode(record);
+    block.push_back('F');
+    diamondMeta::put64(block, files[i]->getInode());
+    diamondMeta::putString(block, record.data(), record.size());
+    records++;
+    if (block.size() >= kBlockSize)
+      flushBlock();
+  }
+
+  for (size_t i = 0; ok && (i < dirs.size()); i++) {
+    dirs[i]->encode(record);
+    block.push_back('D');
+    diamondMeta::put64(block, dirs[i]->getInode());
+    diamondMeta::putString(block, record.data(), record.size());
+    {
+      diamond::common::RWMutexReadLock dLock(dirs[i]->Locker());
+      dirs[i]->encodeEntries(record);
+    }
+    diamondMeta::putString(block, record.data(), record.size());
+    records++;
+    if (block.size() >= kBlockSize)
+      flushBlock();
+  }
+  flushBlock();
+
+  ok = ok && (pwrite(fd, &header, sizeof (header), 0) == sizeof (header)) && !fdatasync(fd);
+  int rc = ok ? 0 : (errno ? errno : EIO);
+  ::close(fd);
+
+  if (!rc && ::rename(tmp.c_str(), path.c_str()))
+    rc = errno;
+
+  if (rc) {
+    unlink(tmp.c_str());
+    return rc;
+  }
+
+  // make the rename durable
+  std::string dir = path.substr(0, path.rfind('/') + 1);
+  int dfd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    ::close(dfd);
+  }
+  return 0;
+}
+
+int
+diamondSnapshot::load (diamondCache& cache, const std::string& path, uint64_t& epoch, unsigned threads)
+{
+  diamond::common::Timing tm("snapshot");
+  COMMONTIMING("start", &tm);
+  epoch = 0;
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int rc = errno;
+    ::close(fd);
+    return rc;
+  }
+
+  size_t size = st.st_size;
+  void* map = (size >= sizeof (Header)) ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    diamond_static_crit("cannot map snapshot %s size=%llu", path.c_str(), (unsigned long long) size);
+    return EIO;
+  }
+  madvise(map, size, MADV_WILLNEED);
+
+  const char* data = (const char*) map;
+  const char* end = data + size;
+  Header header;
+  memcpy(&header, data, sizeof (header));
+
+  // locate the blocks - the headers chain through the file
+  std::vector<const char*> blocks;
+  const char* pos = data + sizeof (header);
+  bool valid = (header.magic == kMagic) && (header.version == kVersion);
+  while (valid && (blocks.size() < header.blocks)) {
+    BlockHeader bh;
+    if (!diamondMeta::get(pos, end, &bh, sizeof (bh)) || (bh.magic != kBlockMagic) || ((size_t) (end - pos) < bh.length)) {
+      valid = false;
+      break;
+    }
+    blocks.push_back(pos - sizeof (bh));
+    pos += bh.length;
+  }
+
+  if (!valid) {
+    munmap(map, size);
+    diamond_static_crit("corrupt snapshot %s", path.c_str());
+    return EIO;
+  }
+  COMMONTIMING("index", &tm);
+
+  // inodes cached already, e.g. the root, are decoded in place
+  std::map<diamond_ino_t, diamondCache::diamondFilePtr> cachedFiles;
+  std::map<diamond_ino_t, diamondCache::diamondDirPtr> cachedDirs;
+  {
+    std::vector<diamondCache::diamondFilePtr> files;
+    std::vector<diamondCache::diamondDirPtr> dirs;
+    cache.getInodes(files, dirs);
+    for (size_t i = 0; i < files.size(); i++)
+      cachedFiles[files[i]->getIno()] = files[i];
+    for (size_t i = 0; i < dirs.size(); i++)
+      cachedDirs[dirs[i]->getIno()] = dirs[i];
+  }
+
+  if (!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::max<size_t>(1, std::min<size_t>(threads, blocks.size()));
+
+  std::vector<diamondCache::file_vector_t> files(threads);
+  std::vector<diamondCache::dir_vector_t> dirs(threads);
+  std::vector<uint64_t> highest(threads, 0);
+  std::atomic<size_t> next(0);
+  std::atomic<int> error(0);
+
+  auto worker = [&] (unsigned t) {
+    std::string meta;
+    std::string entries;
+    size_t b;
+
+    while (!error.load() && ((b = next.fetch_add(1)) < blocks.size())) {
+      BlockHeader bh;
+      memcpy(&bh, blocks[b], sizeof (bh));
+      const char* rec = blocks[b] + sizeof (bh);
+      const char* recend = rec + bh.length;
+      if (diamond::common::kv::crc32c(0, rec, bh.length) != bh.crc) {
+        error = EIO;
+        return;
+      }
+
+      for (uint32_t r = 0; r < bh.records; r++) {
+        char type;
+        uint64_t inode;
+        if (!diamondMeta::get(rec, recend, &type, sizeof (type)) || !diamondMeta::get(rec, recend, &inode, sizeof (inode)) ||
+            !diamondMeta::getString(rec, recend, meta)) {
+          error = EIO;
+          return;
+        }
+        diamond_ino_t ino = DIAMOND_INODE(inode);
+        highest[t] = std::max(highest[t], inode);
+
+        if (type == 'F') {
+          auto it = cachedFiles.find(ino);
+          diamondCache::diamondFilePtr file = (it != cachedFiles.end()) ? it->second :
+            std::allocate_shared<diamondFile>(
+              diamond::common::SlabAllocator<diamondFile, diamondCache::diamondFileSlab>(), ino, "");
+          if (file->decode(meta)) {
+            error = EIO;
+            return;
+          }
+
+          // contents are not part of the snapshot - keep the size consistent
+          struct stat fst;
+          file->copyStat(fst);
+          if (fst.st_size && file->truncate(fst.st_size))
+            diamond_static_err("no space to load file ino=%s size=%llu", ino.c_str(), (unsigned long long) fst.st_size);
+          files[t].push_back(std::make_pair(ino, file));
+        } else if (type == 'D') {
+          if (!diamondMeta::getString(rec, recend, entries)) {
+            error = EIO;
+            return;
+          }
+          auto it = cachedDirs.find(ino);
+          diamondCache::diamondDirPtr dir = (it != cachedDirs.end()) ? it->second :
+            std::allocate_shared<diamondDir>(
+              diamond::common::SlabAllocator<diamondDir, diamondCache::diamondDirSlab>(), ino, "");
+          if (dir->decode(meta) || dir->decodeEntries(entries)) {
+            error = EIO;
+            return;
+          }
+          cache.addNames(dir);
+          dirs[t].push_back(std::make_pair(ino, dir));
+        } else {
+          error = EIO;
+          return;
+        }
+      }
+    }
+
+    // the partitions are merged in key order
+    std::sort(files[t].begin(), files[t].end(),
+              [] (const diamondCache::file_vector_t::value_type& a, const diamondCache::file_vector_t::value_type& b) {
+                return a.first < b.first;
+              });
+    std::sort(dirs[t].begin(), dirs[t].end(),
+              [] (const diamondCache::dir_vector_t::value_type& a, const diamondCache::dir_vector_t::value_type& b) {
+                return a.first < b.first;
+              });
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++)
+    workers.push_back(std::thread(worker, t));
+  worker(0);
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+  munmap(map, size);
+  COMMONTIMING("decode", &tm);
+
+  if (error.load()) {
+    diamond_static_crit("corrupt snapshot %s", path.c_str());
+    return error.load();
+  }
+
+  cache.publish(files, dirs);
+  cache.getInodeAllocator().raiseFloor(*std::max_element(highest.begin(), highest.end()) + 1);
+  COMMONTIMING("publish", &tm);
+
+  epoch = header.epoch;
+  diamond_static_notice("snapshot loaded path=%s files=%llu dirs=%llu blocks=%llu threads=%u "
+                        "decode=%.03f ms publish=%.03f ms time=%.03f ms",
+                        path.c_str(),
+                        (unsigned long long) header.files,
+                        (unsigned long long) header.dirs,
+                        (unsigned long long) header.blocks,
+                        threads,
+                        tm.GetTagTimelapse("index", "decode"),
+                        tm.GetTagTimelapse("decode", "publish"),
+                        tm.RealTime());
+  return 0;
+}
+
+DIAMONDRIONAMESPACE_END
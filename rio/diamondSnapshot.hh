@@ -0,0 +1,72 @@
+/*
+ * File:   diamondSnapshot.hh
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#ifndef DIAMONDSNAPSHOT_HH
+#define	DIAMONDSNAPSHOT_HH
+
+#include <stdint.h>
+#include <string>
+
+#include "rio/Namespace.hh"
+#include "rio/diamond_types.hh"
+
+DIAMONDRIONAMESPACE_BEGIN
+
+class diamondCache;
+
+//------------------------------------------------------------------------------
+//! Snapshot dump of all inodes in a cache and a parallel loader
+//!
+//! A dump is a header followed by independent blocks of up to kBlockSize
+//! bytes, each with its own checksum. A record holds the type, the inode,
+//! its serialized meta data and for directories the entry list.
+//!
+//! The loader maps the file, hands the blocks to all cores and every thread
+//! decodes into private partitions - inode objects, directory entries and
+//! name index slots are built without any lock. The sorted partitions are
+//! merged into new inode tables which replace the cache tables in one step.
+//------------------------------------------------------------------------------
+class diamondSnapshot {
+public:
+  static const uint32_t kMagic = 0x504b4344;       //< 'DCKP'
+  static const uint32_t kBlockMagic = 0x4b4c4244;  //< 'DBLK'
+  static const size_t kBlockSize = 1024 * 1024;
+
+  // ---------------------------------------------------------------------------
+  //! Dump all inodes of the cache atomically into path - the epoch is kept
+  //! for the journal. Returns 0 or an errno.
+  // ---------------------------------------------------------------------------
+  static int dump (diamondCache& cache, const std::string& path, uint64_t epoch = 0);
+
+  // ---------------------------------------------------------------------------
+  //! Load a dump with the given number of threads (0 uses all cores) and
+  //! publish it - inodes cached already are decoded in place. Returns 0,
+  //! ENOENT if there is no dump or another errno.
+  // ---------------------------------------------------------------------------
+  static int load (diamondCache& cache, const std::string& path, uint64_t& epoch, unsigned threads = 0);
+
+private:
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t epoch;
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t blocks;
+  };
+
+  struct BlockHeader {
+    uint32_t magic;
+    uint32_t records;
+    uint32_t length;  //< payload bytes
+    uint32_t crc;     //< crc32c of the payload
+  };
+};
+
+DIAMONDRIONAMESPACE_END
+
+#endif	/* DIAMONDSNAPSHOT_HH */
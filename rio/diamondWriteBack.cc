@@ -0,0 +1,447 @@
+/*
+ * File:   diamondWriteBack.cc
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#include "diamondWriteBack.hh"
+#include "diamondCache.hh"
+#include "common/Logging.hh"
+#include "common/SlabAllocator.hh"
+#include "common/Timing.hh"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+DIAMONDRIONAMESPACE_BEGIN
+
+const uint64_t diamondWriteBack::kChunkSize;
+const size_t diamondWriteBack::kStripes;
+const size_t diamondWriteBack::kMaxPending;
+
+diamondWriteBack::diamondWriteBack (diamondCache& cache) : mCache(cache), mPending(0), mSeq(0), mFlushed(0), mHighest(0), mStop(false), mInterval(1000)
+{
+  for (size_t i = 0; i < kStripes; i++)
+    mStripes[i].mutex.SetBlocking(true);
+}
+
+diamondWriteBack::~diamondWriteBack ()
+{
+  close();
+}
+
+int
+diamondWriteBack::open (const std::string& path, const std::string& indexdir, uint64_t keyspace, unsigned interval_ms)
+{
+  mStore.reset(new diamond::common::kv(path, indexdir, keyspace));
+  int rc = mStore->Init();
+  if (rc) {
+    mStore.reset();
+    return rc;
+  }
+
+  // inodes are loaded on demand - new ones must not reuse a stored number
+  std::string highest;
+  if (!mStore->Get(highestKey(), highest)) {
+    mHighest = strtoull(highest.c_str(), 0, 10);
+    mCache.getInodeAllocator().raiseFloor(mHighest + 1);
+  }
+
+  mInterval = interval_ms ? interval_ms : 1;
+  mStop = false;
+  mFlusher = std::thread(&diamondWriteBack::run, this);
+  return 0;
+}
+
+void
+diamondWriteBack::close ()
+{
+  if (mFlusher.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mWakeMutex);
+      mStop = true;
+    }
+    mWake.notify_one();
+    mFlusher.join();
+  }
+
+  if (mStore) {
+    flush();
+    std::stringstream out;
+    Status(out);
+    diamond_static_info("write-back closed %s", out.str().c_str());
+    mStore.reset();
+  }
+}
+
+void
+diamondWriteBack::run ()
+{
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mWakeMutex);
+      mWake.wait_for(lock, std::chrono::milliseconds(mInterval), [this] () {
+        return mStop || (mPending.load() >= kMaxPending);
+      });
+      if (mStop)
+        return;
+    }
+    flush();
+  }
+}
+
+void
+diamondWriteBack::mark (uint64_t ino, int what, off_t offset, size_t size)
+{
+  Stripe& s = stripe(ino);
+  bool wake = false;
+  {
+    diamond::common::RWMutexWriteLock lock(s.mutex);
+    auto it = s.inodes.find(ino);
+    if (it == s.inodes.end()) {
+      it = s.inodes.insert(std::make_pair(ino, Dirty())).first;
+      it->second.flags = 0;
+      wake = (++mPending == kMaxPending);
+    }
+
+    Dirty& dirty = it->second;
+    if (what & kRemoved) {
+      // a removal supersedes all pending changes
+      dirty.flags = what;
+      dirty.chunks.clear();
+    } else {
+      // a re-used inode number is alive again
+      dirty.flags = (dirty.flags & ~kRemoved) | what;
+      if ((what & kData) && size) {
+        for (uint64_t c = offset / kChunkSize; c <= ((offset + size - 1) / kChunkSize); c++)
+          dirty.chunks.insert(c);
+      }
+    }
+    dirty.seq = ++mSeq;
+  }
+
+  if (wake)
+    mWake.notify_one();
+}
+
+void
+diamondWriteBack::markFile (uint64_t ino, int what, off_t offset, size_t size)
+{
+  mark(ino, what & ~kDir, offset, size);
+}
+
+void
+diamondWriteBack::markDir (uint64_t ino, int what)
+{
+  mark(ino, what | kDir, 0, 0);
+}
+
+void
+diamondWriteBack::markRemoved (uint64_t ino, bool dir)
+{
+  mark(ino, kRemoved | (dir ? kDir : 0), 0, 0);
+}
+
+bool
+diamondWriteBack::isRemoved (uint64_t ino)
+{
+  Stripe& s = stripe(ino);
+  diamond::common::RWMutexReadLock lock(s.mutex);
+  auto it = s.inodes.find(ino);
+  return (it != s.inodes.end()) && (it->second.flags & kRemoved);
+}
+
+uint64_t
+diamondWriteBack::storedSize (uint64_t ino)
+{
+  std::string record;
+  diamondFile stored(DIAMOND_INODE(ino), "");
+  if (mStore->Get(fileKey(ino), record) || stored.decode(record))
+    return 0;
+
+  struct stat st;
+  stored.copyStat(st);
+  return st.st_size;
+}
+
+int
+diamondWriteBack::persistFile (uint64_t ino, const Dirty& dirty)
+{
+  diamondCache::diamondFilePtr file = mCache.cachedFile(DIAMOND_INODE(ino));
+  if (!file)
+    return 0;
+
+  struct stat st;
+  file->copyStat(st);
+  uint64_t size = st.st_size;
+  std::set<uint64_t> chunks = dirty.chunks;
+  int rc = 0;
+
+  if (dirty.flags & kInode) {
+    // a shrunk file drops its tail chunks and rewrites the cut one
+    uint64_t stored = storedSize(ino);
+    for (uint64_t c = (size + kChunkSize - 1) / kChunkSize; c < ((stored + kChunkSize - 1) / kChunkSize); c++)
+      chunks.insert(c);
+    if ((stored > size) && (size % kChunkSize))
+      chunks.insert(size / kChunkSize);
+  }
+
+  for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+    uint64_t offset = *it * kChunkSize;
+    if (offset >= size) {
+      mStore->Del(chunkKey(ino, *it));
+      continue;
+    }
+
+    char* ptr = 0;
+    size_t length = ((size - offset) < kChunkSize) ? (size - offset) : kChunkSize;
+    int n = file->peek(ptr, offset, length);
+    std::string data(ptr, (n > 0) ? n : 0);
+    file->release();
+
+    if ((rc = mStore->Set(chunkKey(ino, *it), data)))
+      return rc;
+  }
+
+  std::string record;
+  file->encode(record);
+  return mStore->Set(fileKey(ino), record);
+}
+
+int
+diamondWriteBack::persistDir (uint64_t ino, const Dirty& dirty)
+{
+  diamondCache::diamondDirPtr dir = mCache.cachedDir(DIAMOND_INODE(ino));
+  if (!dir)
+    return 0;
+
+  std::string record;
+  if (dirty.flags & kInode) {
+    dir->encode(record);
+    return mStore->Set(dirKey(ino), record);
+  }
+
+  std::vector<uint64_t> children;
+  {
+    diamond::common::RWMutexReadLock dLock(dir->Locker());
+    dir->encodeEntries(record);
+
+    uint64_t cursor = 0;
+    std::string name;
+    diamond_ino_t child;
+    while (dir->nextEntry(cursor, name, child))
+      children.push_back(DIAMOND_TO_INODE(child));
+  }
+
+  int rc = persistChildren(children);
+  return rc ? rc : mStore->Set(entriesKey(ino), record);
+}
+
+int
+diamondWriteBack::persistChildren (const std::vector<uint64_t>& children)
+{
+  // children created after the batch was taken are still dirty and unwritten
+  for (auto it = children.begin(); it != children.end(); ++it) {
+    if (mWritten.count(*it))
+      continue;
+
+    Dirty dirty;
+    {
+      Stripe& s = stripe(*it);
+      diamond::common::RWMutexReadLock lock(s.mutex);
+      auto pending = s.inodes.find(*it);
+      if ((pending == s.inodes.end()) || !(pending->second.flags & kInode) ||
+          (pending->second.flags & kRemoved))
+        continue;
+      dirty = pending->second;
+    }
+
+    int rc = (dirty.flags & kDir) ? persistDir(*it, dirty) : persistFile(*it, dirty);
+    if (rc)
+      return rc;
+    mWritten.insert(*it);
+  }
+  return 0;
+}
+
+int
+diamondWriteBack::removeFile (uint64_t ino)
+{
+  uint64_t stored = storedSize(ino);
+  for (uint64_t c = 0; c < ((stored + kChunkSize - 1) / kChunkSize); c++)
+    mStore->Del(chunkKey(ino, c));
+  int rc = mStore->Del(fileKey(ino));
+  return (rc == ENOENT) ? 0 : rc;
+}
+
+int
+diamondWriteBack::removeDir (uint64_t ino)
+{
+  mStore->Del(entriesKey(ino));
+  int rc = mStore->Del(dirKey(ino));
+  return (rc == ENOENT) ? 0 : rc;
+}
+
+int
+diamondWriteBack::flush ()
+{
+  std::lock_guard<std::mutex> flushLock(mFlushMutex);
+  if (!mStore)
+    return EBADF;
+
+  std::vector<Batch> batch;
+  for (size_t i = 0; i < kStripes; i++) {
+    diamond::common::RWMutexReadLock lock(mStripes[i].mutex);
+    for (auto it = mStripes[i].inodes.begin(); it != mStripes[i].inodes.end(); ++it) {
+      Batch b;
+      b.ino = it->first;
+      b.dirty = it->second;
+      batch.push_back(b);
+    }
+  }
+
+  if (batch.empty())
+    return 0;
+  DIAMOND_TIMING_SCOPE("writeback.flush");
+
+  int rc = 0;
+  int retc;
+
+  // inode records and data first, entries next, removals last
+  mWritten.clear();
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    if (it->dirty.flags & kRemoved)
+      continue;
+    if (it->dirty.flags & kDir) {
+      if (it->dirty.flags & kInode) {
+        if ((retc = persistDir(it->ino, it->dirty)) && !rc)
+          rc = retc;
+        mWritten.insert(it->ino);
+      }
+    } else {
+      if ((retc = persistFile(it->ino, it->dirty)) && !rc)
+        rc = retc;
+      mWritten.insert(it->ino);
+    }
+  }
+
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    if ((it->dirty.flags & (kRemoved | kDir | kEntries)) != (kDir | kEntries))
+      continue;
+    Dirty entries = it->dirty;
+    entries.flags = kDir | kEntries;
+    if ((retc = persistDir(it->ino, entries)) && !rc)
+      rc = retc;
+  }
+
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    if (!(it->dirty.flags & kRemoved))
+      continue;
+    retc = (it->dirty.flags & kDir) ? removeDir(it->ino) : removeFile(it->ino);
+    if (retc && !rc)
+      rc = retc;
+  }
+
+  uint64_t highest = mHighest;
+  for (auto it = mWritten.begin(); it != mWritten.end(); ++it)
+    highest = std::max(highest, *it);
+  if ((highest > mHighest) && !rc) {
+    if ((retc = mStore->Set(highestKey(), std::to_string(highest))))
+      rc = retc;
+    else
+      mHighest = highest;
+  }
+
+  if ((retc = mStore->Sync()) && !rc)
+    rc = retc;
+
+  if (rc) {
+    // keep everything pending and retry with the next round
+    diamond_static_err("write-back flush failed errno=%d pending=%llu", rc, (unsigned long long) mPending.load());
+    return rc;
+  }
+
+  // drop what did not change meanwhile - the rest goes with the next round
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    Stripe& s = stripe(it->ino);
+    diamond::common::RWMutexWriteLock lock(s.mutex);
+    auto dirty = s.inodes.find(it->ino);
+    if ((dirty != s.inodes.end()) && (dirty->second.seq == it->dirty.seq)) {
+      s.inodes.erase(dirty);
+      mPending--;
+    }
+  }
+  mFlushed += batch.size();
+  return 0;
+}
+
+std::shared_ptr<diamondFile>
+diamondWriteBack::loadFile (uint64_t ino)
+{
+  std::string record;
+  if (!mStore || mStore->Get(fileKey(ino), record))
+    return 0;
+
+  std::shared_ptr<diamondFile> file = std::allocate_shared<diamondFile>(
+    diamond::common::SlabAllocator<diamondFile, diamondCache::diamondFileSlab>(), DIAMOND_INODE(ino), "");
+  if (file->decode(record)) {
+    diamond_static_err("corrupt file record ino=%llu", (unsigned long long) ino);
+    return 0;
+  }
+
+  struct stat st;
+  file->copyStat(st);
+  uint64_t size = st.st_size;
+  for (uint64_t c = 0; c < ((size + kChunkSize - 1) / kChunkSize); c++) {
+    // missing chunks are holes
+    std::string data;
+    if (mStore->Get(chunkKey(ino, c), data) || data.empty())
+      continue;
+    if (file->write(data.c_str(), c * kChunkSize, data.size()) < 0) {
+      diamond_static_err("no space to load file ino=%llu size=%llu", (unsigned long long) ino, (unsigned long long) size);
+      return 0;
+    }
+  }
+
+  if (size && file->truncate(size)) {
+    diamond_static_err("no space to load file ino=%llu size=%llu", (unsigned long long) ino, (unsigned long long) size);
+    return 0;
+  }
+  return file;
+}
+
+std::shared_ptr<diamondDir>
+diamondWriteBack::loadDir (uint64_t ino)
+{
+  std::string record;
+  if (!mStore || mStore->Get(dirKey(ino), record))
+    return 0;
+
+  std::shared_ptr<diamondDir> dir = std::allocate_shared<diamondDir>(
+    diamond::common::SlabAllocator<diamondDir, diamondCache::diamondDirSlab>(), DIAMOND_INODE(ino), "");
+  if (dir->decode(record)) {
+    diamond_static_err("corrupt directory record ino=%llu", (unsigned long long) ino);
+    return 0;
+  }
+
+  std::string entries;
+  if (!mStore->Get(entriesKey(ino), entries) && dir->decodeEntries(entries)) {
+    diamond_static_err("corrupt directory entries ino=%llu", (unsigned long long) ino);
+    return 0;
+  }
+  return dir;
+}
+
+void
+diamondWriteBack::Status (std::ostream& os)
+{
+  os << "writeback.pending=" << mPending.load()
+    << " writeback.flushed=" << mFlushed.load() << " ";
+  if (mStore)
+    mStore->Status(os);
+}
+
+DIAMONDRIONAMESPACE_END
@@ -0,0 +1,154 @@
+/*
+ * File:   diamondWriteBack.hh
+ * Author: apeters
+ *
+ * Created on October 15, 2014, 4:09 PM
+ */
+
+#ifndef DIAMONDWRITEBACK_HH
+#define	DIAMONDWRITEBACK_HH
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "rio/Namespace.hh"
+#include "rio/diamond_types.hh"
+#include "rio/diamondFile.hh"
+#include "rio/diamondDir.hh"
+#include "common/RWMutex.hh"
+#include "common/kv/kv.hh"
+
+DIAMONDRIONAMESPACE_BEGIN
+
+class diamondCache;
+
+//------------------------------------------------------------------------------
+//! Asynchronous write-back of the namespace into a kv store
+//!
+//! Namespace operations only mark inodes dirty in a striped in-memory table,
+//! repeated changes of one inode coalesce into a single entry. A flusher
+//! thread persists the current state of all dirty inodes every flush interval
+//! or once enough inodes are pending, then syncs the store once per batch.
+//! Inode records are written before directory entries and deletions come
+//! last, so a crash loses at most the last interval and never leaves an entry
+//! pointing to an inode that was not written. Entries are encoded from the
+//! live directory - children created after the batch was taken are written
+//! right before the entries referring to them.
+//!
+//! Keys: F<ino>/D<ino> file and directory records, E<ino> directory entries,
+//! C<ino>.<n> file data in chunks of kChunkSize, N the highest inode number
+//! written - open raises the inode allocator above it.
+//------------------------------------------------------------------------------
+class diamondWriteBack {
+public:
+  enum {
+    kInode = 0x1,     //< attributes, name, xattrs
+    kEntries = 0x2,   //< directory entries
+    kData = 0x4,      //< file contents
+    kRemoved = 0x8,   //< inode was removed from the namespace
+    kDir = 0x10       //< inode is a directory
+  };
+
+  static const uint64_t kChunkSize = 1024 * 1024;
+  static const size_t kStripes = 64;
+  static const size_t kMaxPending = 4096;
+
+  diamondWriteBack (diamondCache& cache);
+  virtual ~diamondWriteBack ();
+
+  // ---------------------------------------------------------------------------
+  //! Open the store and start the flusher - returns 0 or an errno
+  // ---------------------------------------------------------------------------
+  int open (const std::string& path, const std::string& indexdir, uint64_t keyspace, unsigned interval_ms);
+
+  // ---------------------------------------------------------------------------
+  //! Flush everything and stop the flusher
+  // ---------------------------------------------------------------------------
+  void close ();
+
+  // ---------------------------------------------------------------------------
+  //! Persist all pending changes now - returns 0 or the first errno
+  // ---------------------------------------------------------------------------
+  int flush ();
+
+  void markFile (uint64_t ino, int what, off_t offset = 0, size_t size = 0);
+  void markDir (uint64_t ino, int what);
+  void markRemoved (uint64_t ino, bool dir);
+
+  bool isRemoved (uint64_t ino);
+  bool hasFile (uint64_t ino) { return mStore->Has(fileKey(ino)); }
+  bool hasDir (uint64_t ino) { return mStore->Has(dirKey(ino)); }
+
+  // ---------------------------------------------------------------------------
+  //! Load an inode from the store - returns 0 if it is not stored
+  // ---------------------------------------------------------------------------
+  std::shared_ptr<diamondFile> loadFile (uint64_t ino);
+  std::shared_ptr<diamondDir> loadDir (uint64_t ino);
+
+  size_t pending () const { return mPending.load(); }
+  void Status (std::ostream& os);
+
+private:
+  struct Dirty {
+    int flags;
+    uint64_t seq;
+    std::set<uint64_t> chunks;
+  };
+
+  struct Stripe {
+    diamond::common::RWMutex mutex;
+    std::unordered_map<uint64_t, Dirty> inodes;
+  };
+
+  struct Batch {
+    uint64_t ino;
+    Dirty dirty;
+  };
+
+  static std::string fileKey (uint64_t ino) { return "F" + std::to_string(ino); }
+  static std::string dirKey (uint64_t ino) { return "D" + std::to_string(ino); }
+  static std::string entriesKey (uint64_t ino) { return "E" + std::to_string(ino); }
+  static std::string chunkKey (uint64_t ino, uint64_t chunk) { return "C" + std::to_string(ino) + "." + std::to_string(chunk); }
+  static std::string highestKey () { return "N"; }
+
+  Stripe& stripe (uint64_t ino) { return mStripes[ino % kStripes]; }
+  void mark (uint64_t ino, int what, off_t offset, size_t size);
+
+  int persistFile (uint64_t ino, const Dirty& dirty);
+  int persistDir (uint64_t ino, const Dirty& dirty);
+  int persistChildren (const std::vector<uint64_t>& children);
+  int removeFile (uint64_t ino);
+  int removeDir (uint64_t ino);
+  uint64_t storedSize (uint64_t ino);
+
+  void run ();
+
+  diamondCache& mCache;
+  std::unique_ptr<diamond::common::kv> mStore;
+  Stripe mStripes[kStripes];
+  std::atomic<uint64_t> mPending;
+  std::atomic<uint64_t> mSeq;
+  std::atomic<uint64_t> mFlushed;
+
+  std::mutex mFlushMutex;          //< one flush at a time
+  std::unordered_set<uint64_t> mWritten;   //< inode records written by the running flush
+  uint64_t mHighest;               //< highest inode number in the store
+  std::mutex mWakeMutex;
+  std::condition_variable mWake;
+  bool mStop;
+  unsigned mInterval;
+  std::thread mFlusher;
+};
+
+DIAMONDRIONAMESPACE_END
+
+#endif	/* DIAMONDWRITEBACK_HH */
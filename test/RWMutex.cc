@@ -0,0 +1,187 @@
+// ----------------------------------------------------------------------
+// File: RWMutex.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   RWMutex.cc
+ *
+ * @brief  Google Test and contention benchmark for the RWMutex class
+ *
+ *
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+#include "common/RWMutex.hh"
+
+using namespace diamond::common;
+
+static void
+exclusion (RWMutex::Kind kind)
+{
+  RWMutex mutex(kind);
+  mutex.SetBlocking(true);
+  long shared[2] = {0, 0};
+  std::atomic<bool> broken(false);
+  std::vector<std::thread> threads;
+
+  for (size_t t = 0; t < 8; t++) {
+    threads.push_back(std::thread([&, t] () {
+      for (size_t i = 0; i < 20000; i++) {
+        if ((i % 8) == t) {
+          RWMutexWriteLock lock(mutex);
+          shared[0]++;
+          shared[1]++;
+        } else {
+          RWMutexReadLock lock(mutex);
+          if (shared[0] != shared[1])
+            broken = true;
+        }
+      }
+    }));
+  }
+
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+  EXPECT_FALSE(broken.load());
+  EXPECT_EQ(8 * 2500, shared[0]);
+  EXPECT_EQ(shared[0], shared[1]);
+}
+
+TEST (RWMutex, Exclusion)
+{
+  exclusion(RWMutex::kPthread);
+}
+
+TEST (RWMutex, ReaderBiasedExclusion)
+{
+  exclusion(RWMutex::kReaderBiased);
+}
+
+TEST (RWMutex, ReaderBiasedTimeout)
+{
+  RWMutex mutex(RWMutex::kReaderBiased);
+  mutex.SetWLockTime(10000);
+  mutex.LockRead();
+
+  // a reader held by another thread lets the timed write lock give up
+  std::thread writer([&mutex] () {
+    EXPECT_EQ(ETIMEDOUT, mutex.TimeoutLockWrite());
+  });
+  writer.join();
+
+  // and readers are not blocked by the abandoned attempt
+  mutex.LockRead();
+  mutex.UnLockRead();
+  mutex.UnLockRead();
+  EXPECT_EQ(0, mutex.TimeoutLockWrite());
+  mutex.UnLockWrite();
+}
+
+TEST (RWMutex, Profile)
+{
+  RWMutex::Kind kinds[] = {RWMutex::kPthread, RWMutex::kReaderBiased};
+  const char* names[] = {"test::pthread", "test::readerbiased"};
+
+  LockStats::SetEnabled(true);
+  for (size_t k = 0; k < 2; k++) {
+    RWMutex mutex(names[k], kinds[k]);
+    mutex.SetBlocking(true);
+    {
+      RWMutexReadLock lock(mutex);
+    }
+    mutex.LockWrite();
+    std::thread reader([&mutex] () {
+      RWMutexReadLock lock(mutex);
+    });
+    usleep(20000);
+    mutex.UnLockWrite();
+    reader.join();
+  }
+
+  // unnamed mutexes are not profiled
+  RWMutex unnamed;
+  unnamed.LockWrite();
+  unnamed.UnLockWrite();
+  LockStats::SetEnabled(false);
+
+  std::stringstream out;
+  LockStats::Dump(out);
+  for (size_t k = 0; k < 2; k++) {
+    std::string prefix = std::string("lock.") + names[k];
+    EXPECT_NE(std::string::npos, out.str().find(prefix + " mode=read acquired=2 contended=1 "));
+    EXPECT_NE(std::string::npos, out.str().find(prefix + " mode=write acquired=1 contended=0 "));
+  }
+
+  // the blocked reader waited for the writer
+  size_t pos = out.str().find("lock.test::pthread mode=read");
+  double wait = atof(out.str().c_str() + out.str().find("wait_ms=", pos) + 8);
+  EXPECT_LE(10.0, wait);
+
+  LockStats::Reset();
+  out.str("");
+  LockStats::Dump(out);
+  EXPECT_EQ(std::string::npos, out.str().find("lock.test::"));
+}
+
+//------------------------------------------------------------------------------
+//! Read lock throughput with 1 to 64 threads - the reader biased lock should
+//! scale with the cores while the pthread lock bounces its counter line
+//------------------------------------------------------------------------------
+TEST (RWMutex, ReadScaling)
+{
+  const size_t ops = 200000;
+  RWMutex::Kind kinds[] = {RWMutex::kPthread, RWMutex::kReaderBiased};
+  const char* names[] = {"pthread", "reader-biased"};
+
+  for (size_t k = 0; k < 2; k++) {
+    for (size_t nthreads = 1; nthreads <= 64; nthreads *= 4) {
+      RWMutex mutex(kinds[k]);
+      std::atomic<bool> go(false);
+      std::vector<std::thread> threads;
+      for (size_t t = 0; t < nthreads; t++) {
+        threads.push_back(std::thread([&] () {
+          while (!go.load())
+            std::this_thread::yield();
+          for (size_t i = 0; i < ops / nthreads; i++) {
+            RWMutexReadLock lock(mutex);
+          }
+        }));
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      go = true;
+      for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      fprintf(stderr, "# %-14s threads=%-3zu %8.2f Mops/s\n", names[k], nthreads, ops / ns * 1000.0);
+    }
+  }
+}
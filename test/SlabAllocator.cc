@@ -0,0 +1,142 @@
+// ----------------------------------------------------------------------
+// File: SlabAllocator.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   SlabAllocator.cc
+ * 
+ * @brief  Google Test for the SlabPool and SlabAllocator classes
+ * 
+ * 
+ */
+
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "common/SlabAllocator.hh"
+
+using namespace diamond::common;
+
+DIAMOND_SLAB_TAG(testObjectSlab, "test::object");
+DIAMOND_SLAB_TAG(testListSlab, "test::list");
+DIAMOND_SLAB_TAG(testMapSlab, "test::map");
+
+static bool
+getStats (const char* name, SlabPool::Stats& stats)
+{
+  std::vector<SlabPool::Stats> all;
+  SlabPool::GetAllStats(all);
+  for (size_t i = 0; i < all.size(); i++) {
+    if (all[i].name == name) {
+      stats = all[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+struct TestObject {
+  uint64_t a;
+  uint64_t b;
+  TestObject (uint64_t x) : a(x), b(~x) { }
+};
+
+TEST (SlabPool, AllocateRelease) {
+  SlabPool* pool = SlabPool::Create("test::raw", 40);
+  std::set<void*> objects;
+
+  for (size_t i = 0; i < 10000; i++) {
+    void* p = pool->allocate();
+    EXPECT_EQ(0, ((uintptr_t) p) % 16);
+    EXPECT_TRUE(objects.insert(p).second);
+  }
+
+  SlabPool::Stats stats;
+  pool->GetStats(stats);
+  EXPECT_EQ(48, stats.objsize);
+  EXPECT_LE(10000, stats.inuse);
+  EXPECT_EQ(stats.slabs * (SlabPool::kSlabBytes / 48) * 48, stats.bytes);
+
+  for (auto it = objects.begin(); it != objects.end(); ++it)
+    pool->deallocate(*it);
+
+  // released objects are reused before new slabs are carved
+  size_t slabs = stats.slabs;
+  for (size_t i = 0; i < 10000; i++)
+    objects.insert(pool->allocate());
+  pool->GetStats(stats);
+  EXPECT_EQ(slabs, stats.slabs);
+}
+
+TEST (SlabAllocator, Containers) {
+  const size_t nthreads = 8;
+  std::vector<std::thread> threads;
+
+  for (size_t t = 0; t < nthreads; t++) {
+    threads.push_back(std::thread([t]() {
+      std::list<uint64_t, SlabAllocator<uint64_t, testListSlab> > list;
+      std::map<uint64_t, uint64_t, std::less<uint64_t>,
+               SlabAllocator<std::pair<const uint64_t, uint64_t>, testMapSlab> > map;
+      std::vector< std::shared_ptr<TestObject> > objects;
+
+      for (uint64_t i = 0; i < 20000; i++) {
+        list.push_back(i);
+        map[i] = i;
+        objects.push_back(std::allocate_shared<TestObject>(SlabAllocator<TestObject, testObjectSlab>(), i));
+      }
+      for (uint64_t i = 0; i < 20000; i++) {
+        EXPECT_EQ(i, objects[i]->a);
+        EXPECT_EQ(~i, objects[i]->b);
+        EXPECT_EQ(i, map[i]);
+      }
+      // drop half and re-create them
+      for (uint64_t i = 0; i < 20000; i += 2) {
+        objects[i].reset();
+        map.erase(i);
+      }
+      for (uint64_t i = 0; i < 20000; i += 2)
+        objects[i] = std::allocate_shared<TestObject>(SlabAllocator<TestObject, testObjectSlab>(), i + t);
+    }));
+  }
+
+  for (auto it = threads.begin(); it != threads.end(); ++it)
+    it->join();
+
+  // exiting threads hand their cached objects back
+  SlabPool::Stats stats;
+  ASSERT_TRUE(getStats("test::object", stats));
+  EXPECT_EQ(0, stats.inuse);
+  EXPECT_LT(0, stats.slabs);
+  ASSERT_TRUE(getStats("test::list", stats));
+  EXPECT_EQ(0, stats.inuse);
+  ASSERT_TRUE(getStats("test::map", stats));
+  EXPECT_EQ(0, stats.inuse);
+
+  std::stringstream out;
+  SlabPool::DumpStats(out);
+  EXPECT_NE(std::string::npos, out.str().find("slab=test::object"));
+}
@@ -0,0 +1,306 @@
+// ----------------------------------------------------------------------
+// File: kv.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   kv.cc
+ *
+ * @brief  Google Test for the kv store
+ *
+ *
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gtest/gtest.h"
+#include "common/Logging.hh"
+#include "common/kv/kv.hh"
+
+using namespace diamond::common;
+
+class kvTest : public ::testing::Test {
+protected:
+
+  virtual void
+  SetUp () {
+    Logging::Init();
+    char tmpl[] = "/tmp/diamond.kv.XXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpl) != 0);
+    dir = tmpl;
+    device = dir + "/kv.log";
+  }
+
+  virtual void
+  TearDown () {
+    unlink((dir + "/kv.index").c_str());
+    unlink((dir + "/kv.index.meta").c_str());
+    unlink(device.c_str());
+    rmdir(dir.c_str());
+  }
+
+  off_t
+  deviceSize () {
+    struct stat buf;
+    return stat(device.c_str(), &buf) ? -1 : buf.st_size;
+  }
+
+  std::string dir;
+  std::string device;
+};
+
+TEST_F (kvTest, SetGetDel) {
+  kv store(device, "", 1024);
+  ASSERT_EQ(0, store.Init());
+
+  std::string value;
+  EXPECT_EQ(ENOENT, store.Get("a", value));
+  EXPECT_EQ(0, store.Set("a", "alpha"));
+  EXPECT_EQ(0, store.Set("b", std::string(100000, 'b')));
+  EXPECT_TRUE(store.Has("a"));
+  EXPECT_EQ(0, store.Get("a", value));
+  EXPECT_EQ("alpha", value);
+  EXPECT_EQ(0, store.Set("a", "beta"));
+  EXPECT_EQ(0, store.Get("a", value));
+  EXPECT_EQ("beta", value);
+  EXPECT_EQ(0, store.Get("b", value));
+  EXPECT_EQ(std::string(100000, 'b'), value);
+
+  EXPECT_EQ(0, store.Del("a"));
+  EXPECT_EQ(ENOENT, store.Del("a"));
+  EXPECT_EQ(ENOENT, store.Get("a", value));
+  EXPECT_FALSE(store.Has("a"));
+  EXPECT_EQ(0, store.Set("", ""));
+  EXPECT_EQ(0, store.Get("", value));
+  EXPECT_EQ("", value);
+
+  EXPECT_EQ(0, store.Sync());
+  EXPECT_EQ(deviceSize(), (off_t) store.m_stat.total_size.load());
+  EXPECT_GT(store.m_stat.total_size.load(), store.m_stat.used_size.load());
+}
+
+TEST_F (kvTest, Recover) {
+  {
+    kv store(device, "", 1024);
+    ASSERT_EQ(0, store.Init());
+    for (size_t i = 0; i < 1000; i++)
+      EXPECT_EQ(0, store.Set(std::to_string(i), "value-" + std::to_string(i)));
+    for (size_t i = 0; i < 1000; i += 2)
+      EXPECT_EQ(0, store.Del(std::to_string(i)));
+  }
+
+  off_t size = deviceSize();
+  // tear the last record - it is a deletion of key 998
+  ASSERT_EQ(0, truncate(device.c_str(), size - 3));
+
+  kv store(device, "", 1024);
+  ASSERT_EQ(0, store.Init());
+  EXPECT_GT(size, deviceSize());
+
+  std::string value;
+  for (size_t i = 0; i < 998; i++) {
+    if (i % 2) {
+      EXPECT_EQ(0, store.Get(std::to_string(i), value));
+      EXPECT_EQ("value-" + std::to_string(i), value);
+    } else {
+      EXPECT_EQ(ENOENT, store.Get(std::to_string(i), value));
+    }
+  }
+  EXPECT_EQ(0, store.Get("998", value));
+
+  // records appended after recovery follow the cut
+  EXPECT_EQ(0, store.Set("new", "value"));
+  EXPECT_EQ(0, store.Get("new", value));
+  EXPECT_EQ("value", value);
+}
+
+TEST_F (kvTest, Snapshot) {
+  {
+    kv store(device, dir, 1024);
+    ASSERT_EQ(0, store.Init());
+    for (size_t i = 0; i < 100; i++)
+      EXPECT_EQ(0, store.Set(std::to_string(i), std::to_string(i * i)));
+  }
+  EXPECT_EQ(0, access((dir + "/kv.index.meta").c_str(), R_OK));
+
+  {
+    kv store(device, dir, 1024);
+    ASSERT_EQ(0, store.Init());
+    // the snapshot is consumed
+    EXPECT_NE(0, access((dir + "/kv.index.meta").c_str(), R_OK));
+    std::string value;
+    for (size_t i = 0; i < 100; i++) {
+      EXPECT_EQ(0, store.Get(std::to_string(i), value));
+      EXPECT_EQ(std::to_string(i * i), value);
+    }
+    EXPECT_EQ(0, store.Set("100", "x"));
+  }
+
+  // a snapshot not matching the log is ignored
+  int fd = open(device.c_str(), O_WRONLY | O_APPEND);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ(4, write(fd, "junk", 4));
+  close(fd);
+
+  kv store(device, dir, 1024);
+  ASSERT_EQ(0, store.Init());
+  std::string value;
+  EXPECT_EQ(0, store.Get("100", value));
+  EXPECT_EQ("x", value);
+}
+
+TEST_F (kvTest, Compact) {
+  std::string big(1024 * 1024, 'x');
+  {
+    kv store(device, "", 1024);
+    ASSERT_EQ(0, store.Init());
+    for (size_t i = 0; i < 20; i++)
+      EXPECT_EQ(0, store.Set(std::to_string(i), big + std::to_string(i)));
+    // 60% garbage - left alone while in use, compacted by the next Init
+    for (size_t i = 0; i < 12; i++)
+      EXPECT_EQ(0, store.Del(std::to_string(i)));
+    EXPECT_EQ(0, store.Set("small", "value"));
+  }
+  EXPECT_LT(20 * 1024 * 1024, deviceSize());
+
+  kv store(device, "", 1024);
+  ASSERT_EQ(0, store.Init());
+  EXPECT_GT(9 * 1024 * 1024, deviceSize());
+
+  std::string value;
+  EXPECT_EQ(ENOENT, store.Get("0", value));
+  EXPECT_EQ(0, store.Get("19", value));
+  EXPECT_EQ(big + "19", value);
+  EXPECT_EQ(0, store.Get("small", value));
+  EXPECT_EQ("value", value);
+}
+
+TEST_F (kvTest, CompactOnline) {
+  std::string big(1024 * 1024, 'x');
+  kv store(device, "", 1024);
+  ASSERT_EQ(0, store.Init());
+  EXPECT_EQ(0, store.Set("small", "value"));
+
+  // rewriting one key keeps the log bounded
+  std::string value;
+  for (size_t i = 0; i < 100; i++) {
+    ASSERT_EQ(0, store.Set("big", big + std::to_string(i)));
+    ASSERT_EQ(0, store.Get("big", value));
+    ASSERT_EQ(big + std::to_string(i), value);
+  }
+  EXPECT_GT(20 * 1024 * 1024, deviceSize());
+  EXPECT_EQ(deviceSize(), (off_t) store.m_stat.total_size.load());
+  EXPECT_EQ(0, store.Get("small", value));
+  EXPECT_EQ("value", value);
+
+  // records appended after a compaction survive a replay of the new log
+  EXPECT_EQ(0, store.Set("after", "compaction"));
+  kv replay(device, "", 1024);
+  ASSERT_EQ(0, replay.Init());
+  EXPECT_EQ(0, replay.Get("after", value));
+  EXPECT_EQ("compaction", value);
+  EXPECT_EQ(0, replay.Get("big", value));
+  EXPECT_EQ(big + "99", value);
+}
+
+TEST_F (kvTest, Churn) {
+  {
+    kv store(device, "", 1024);
+    ASSERT_EQ(0, store.Init());
+    EXPECT_EQ(0, store.Set("keep", "value"));
+
+    // deleted keys free their slots - churn far beyond the index size
+    for (size_t i = 0; i < 20000; i++) {
+      std::string key = "churn:" + std::to_string(i);
+      ASSERT_EQ(0, store.Set(key, key));
+      ASSERT_EQ(0, store.Del(key));
+    }
+    EXPECT_FALSE(store.Has("churn:19999"));
+    EXPECT_TRUE(store.Has("keep"));
+  }
+
+  // replaying the log churns the index the same way
+  kv store(device, "", 1024);
+  ASSERT_EQ(0, store.Init());
+  std::string value;
+  EXPECT_EQ(0, store.Get("keep", value));
+  EXPECT_EQ("value", value);
+  EXPECT_EQ(ENOENT, store.Get("churn:0", value));
+}
+
+TEST_F (kvTest, Resurrect) {
+  kv store(device, "", 64);
+  ASSERT_EQ(0, store.Init());
+
+  std::string value;
+  for (size_t round = 0; round < 4; round++) {
+    for (size_t i = 0; i < 200; i++)
+      ASSERT_EQ(0, store.Set("k" + std::to_string(i), "v1"));
+    for (size_t i = 0; i < 200; i += 2)
+      ASSERT_EQ(0, store.Del("k" + std::to_string(i)));
+    // overwrites probe past the slots just freed
+    for (size_t i = 1; i < 200; i += 2)
+      ASSERT_EQ(0, store.Set("k" + std::to_string(i), "v2"));
+    for (size_t i = 1; i < 200; i += 2)
+      ASSERT_EQ(0, store.Del("k" + std::to_string(i)));
+    for (size_t i = 0; i < 200; i++)
+      ASSERT_EQ(ENOENT, store.Get("k" + std::to_string(i), value)) << "k" << i << " resurrected value=" << value;
+  }
+  EXPECT_EQ(0u, store.m_stat.used_size.load());
+}
+
+TEST_F (kvTest, Concurrent) {
+  kv store(device, "", 64 * 1024);
+  ASSERT_EQ(0, store.Init());
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 8; t++) {
+    threads.push_back(std::thread([&store, t]() {
+      for (size_t i = 0; i < 2000; i++) {
+        std::string key = std::to_string(t) + ":" + std::to_string(i);
+        EXPECT_EQ(0, store.Set(key, key + key));
+      }
+    }));
+  }
+  for (auto it = threads.begin(); it != threads.end(); ++it)
+    it->join();
+
+  std::string value;
+  for (size_t t = 0; t < 8; t++) {
+    for (size_t i = 0; i < 2000; i++) {
+      std::string key = std::to_string(t) + ":" + std::to_string(i);
+      ASSERT_EQ(0, store.Get(key, value));
+      EXPECT_EQ(key + key, value);
+    }
+  }
+  EXPECT_EQ(deviceSize(), (off_t) store.m_stat.total_size.load());
+  EXPECT_EQ(store.m_stat.total_size.load(), store.m_stat.used_size.load());
+}
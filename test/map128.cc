@@ -37,6 +37,7 @@
 #include "common/Logging.hh"
 #include "common/Timing.hh"
 #include "common/hash/map128.hh"
+#include "common/hash/map64.hh"
 
 using namespace diamond::common;
 
@@ -106,6 +107,88 @@ TEST (map128, mapoverflow)
   EXPECT_EQ(1024, lkmap.GetItemCount(false));
 }
 
+TEST (map128, mapresize)
+{
+  map128 lkmap(1024, 0, true);
+  lkmap.SetProbeLimit(16);
+
+  // a full table fails inserts and misses after probe limit slots
+  size_t stored = 0;
+  for (__int128 key = 1; key <= 1024; key++)
+  {
+    if (lkmap.SetItem(key, key + 1))
+      stored++;
+  }
+  EXPECT_GT(1024u, stored);
+  EXPECT_EQ(stored, lkmap.GetItemCount(true));
+  EXPECT_EQ(0, lkmap.GetItem(4711));
+
+  // resizing keeps the items and makes room for the rest
+  lkmap.Resize(4096);
+  EXPECT_EQ(4096u, lkmap.GetArraySize());
+  EXPECT_EQ(stored, lkmap.GetItemCount(true));
+  for (__int128 key = 1; key <= 1024; key++)
+  {
+    EXPECT_TRUE(lkmap.SetItem(key, key + 1));
+  }
+  EXPECT_EQ(1024u, lkmap.GetItemCount(true));
+  for (__int128 key = 1; key <= 1024; key++)
+  {
+    EXPECT_EQ(key + 1, lkmap.GetItem(key));
+  }
+}
+
+TEST (map128, overwriteafterdelete)
+{
+  map128 lkmap(64, 0, true);
+
+  // fill densely so most keys sit behind others in their probe chain
+  for (__int128 key = 1; key <= 48; key++)
+  {
+    EXPECT_TRUE(lkmap.SetItem(key, 100));
+  }
+  for (__int128 key = 1; key <= 48; key += 2)
+  {
+    lkmap.DeleteItem(key);
+  }
+
+  // overwriting past a deleted slot must not leave a second copy behind
+  for (__int128 key = 2; key <= 48; key += 2)
+  {
+    EXPECT_TRUE(lkmap.SetItem(key, 200));
+  }
+  EXPECT_EQ(24u, lkmap.GetItemCount(true));
+  for (__int128 key = 2; key <= 48; key += 2)
+  {
+    EXPECT_EQ(200, lkmap.GetItem(key));
+    lkmap.DeleteItem(key);
+  }
+  for (__int128 key = 1; key <= 48; key++)
+  {
+    EXPECT_EQ(0, lkmap.GetItem(key));
+  }
+  EXPECT_EQ(0u, lkmap.GetItemCount(true));
+}
+
+TEST (map128, resizegrows)
+{
+  map128 lkmap(1024, 0, true);
+  for (__int128 key = 1; key <= 900; key++)
+  {
+    EXPECT_TRUE(lkmap.SetItem(key, key + 1));
+  }
+
+  // a resize that cannot place every item keeps growing instead of dropping
+  lkmap.SetProbeLimit(4);
+  EXPECT_TRUE(lkmap.Resize(1024));
+  EXPECT_LT(1024u, lkmap.GetArraySize());
+  EXPECT_EQ(900u, lkmap.GetItemCount(true));
+  for (__int128 key = 1; key <= 900; key++)
+  {
+    EXPECT_EQ(key + 1, lkmap.GetItem(key));
+  }
+}
+
 TEST (map128, mapdelete)
 {
   map128 lkmap(1024 * 1024, 0, true);
@@ -181,3 +264,29 @@ TEST (map128, largemap)
 
   tm1.Print();
 }
+
+TEST (map64, mapsetdelete)
+{
+  map64 lkmap(1024 * 1024, 0, true);
+  EXPECT_EQ(16, sizeof (map64::Entry));
+  EXPECT_EQ(32, sizeof (map128::Entry));
+
+  bool result = true;
+  for (uint64_t i = 1; i <= 512 * 1024; i++)
+  {
+    result &= lkmap.SetItem(i, i << 12);
+  }
+  EXPECT_EQ(true, result);
+  EXPECT_EQ(512 * 1024, lkmap.GetItemCount(true));
+  EXPECT_EQ((uint64_t) 4711 << 12, lkmap.GetItem(4711));
+  EXPECT_EQ(0, lkmap.GetItem(512 * 1024 + 1));
+
+  for (uint64_t i = 1; i <= 512 * 1024; i += 2)
+  {
+    lkmap.DeleteItem(i);
+  }
+  EXPECT_EQ(256 * 1024, lkmap.GetItemCount(true));
+  EXPECT_EQ(0, lkmap.GetItem(4711));
+  EXPECT_EQ((uint64_t) 4712 << 12, lkmap.GetItem(4712));
+  EXPECT_EQ(0, lkmap.Snapshot("/tmp/map64.async.lkmap", MS_ASYNC));
+}
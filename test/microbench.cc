@@ -0,0 +1,718 @@
+// ----------------------------------------------------------------------
+// File: microbench.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * DIAMOND - the CERN Disk Storage System                                   *
+ * Copyright (C) 2011 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+/**
+ * @file   microbench.cc
+ *
+ * @brief  Microbenchmarks of the common data structures
+ *
+ * Every case runs a fixed number of operations per thread for each of the
+ * configured thread counts and reports ns/op, the aggregate throughput, the
+ * cache misses and instructions per op counted with perf_event_open when
+ * the kernel allows it, and the memory held by the case as seen by the
+ * memory accounting and the resident set. Results are written as JSON to
+ * compare builds, a summary table goes to stderr.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/BufferPtr.hh"
+#include "common/BufferPtrLockFree.hh"
+#include "common/Clock.hh"
+#include "common/Logging.hh"
+#include "common/MemoryAccounting.hh"
+#include "common/RWMutex.hh"
+#include "common/hash/map128.hh"
+#include "common/hash/spooky.hh"
+
+using namespace diamond::common;
+
+//------------------------------------------------------------------------------
+//! Hardware counters of the calling thread - all reads return 0 if the
+//! kernel refuses perf events
+//------------------------------------------------------------------------------
+class PerfCounters {
+public:
+  enum Counter {
+    kCacheMisses = 0,
+    kCacheReferences,
+    kInstructions,
+    kCounters
+  };
+
+  PerfCounters ()
+  {
+    static const uint64_t config[kCounters] = {
+#ifdef __linux__
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_INSTRUCTIONS
+#endif
+    };
+    for (int c = 0; c < kCounters; c++) {
+      mFd[c] = -1;
+#ifdef __linux__
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof (attr));
+      attr.size = sizeof (attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[c];
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      mFd[c] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+  }
+
+  ~PerfCounters ()
+  {
+    for (int c = 0; c < kCounters; c++)
+      if (mFd[c] >= 0)
+        close(mFd[c]);
+  }
+
+  bool
+  Available () const
+  {
+    return mFd[kCacheMisses] >= 0;
+  }
+
+  void
+  Start ()
+  {
+#ifdef __linux__
+    for (int c = 0; c < kCounters; c++) {
+      if (mFd[c] >= 0) {
+        ioctl(mFd[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(mFd[c], PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  void
+  Stop (uint64_t* values)
+  {
+    for (int c = 0; c < kCounters; c++) {
+      values[c] = 0;
+#ifdef __linux__
+      if (mFd[c] >= 0) {
+        ioctl(mFd[c], PERF_EVENT_IOC_DISABLE, 0);
+        if (::read(mFd[c], &values[c], sizeof (values[c])) != sizeof (values[c]))
+          values[c] = 0;
+      }
+#endif
+    }
+  }
+
+private:
+  int mFd[kCounters];
+};
+
+//------------------------------------------------------------------------------
+//! Objects under test - created by the setup of a case and shared by all
+//! threads of a run
+//------------------------------------------------------------------------------
+struct State {
+  uint64_t ops;       //< per thread
+  unsigned threads;
+  std::unique_ptr<map128> map;
+  uint64_t keys;
+  BufferPtr buffer;
+  BufferPtrLockFree lfbuffer;
+  uint64_t blocks;    //< 4k blocks of the buffers
+  std::unique_ptr<RWMutex> mutex;
+  std::vector<char> message;
+};
+
+typedef void (*Setup) (State& s);
+typedef void (*Run) (State& s, unsigned t);
+
+struct Case {
+  const char* name;
+  size_t bytes;     //< processed per op for the throughput in MB/s
+  Setup setup;
+  Run run;
+};
+
+//! results of the loops end here so that they are not optimized away
+static volatile uint64_t sSink;
+
+static inline uint64_t
+nextRandom (uint64_t& seed)
+{
+  // xorshift64*
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return seed * 2685821657736338717ull;
+}
+
+static inline __int128
+key128 (uint64_t k)
+{
+  // non zero and spread over both words
+  return ((__int128) (k * 0x9e3779b97f4a7c15ull) << 64) + k + 1;
+}
+
+//------------------------------------------------------------------------------
+// map128
+//------------------------------------------------------------------------------
+static void
+mapNew (State& s)
+{
+  // half filled at most
+  uint64_t size = 1024;
+  while (size < 2 * s.ops * s.threads)
+    size <<= 1;
+  s.map.reset(new map128(size));
+  s.keys = s.ops * s.threads;
+}
+
+static void
+mapFilled (State& s)
+{
+  mapNew(s);
+  for (uint64_t k = 0; k < s.keys; k++)
+    s.map->SetItem(key128(k), key128(k));
+}
+
+static void
+mapSet (State& s, unsigned t)
+{
+  for (uint64_t i = 0; i < s.ops; i++) {
+    uint64_t k = t * s.ops + i;
+    s.map->SetItem(key128(k), key128(k));
+  }
+}
+
+static void
+mapGet (State& s, unsigned t)
+{
+  uint64_t seed = 0x9e3779b97f4a7c15ull * (t + 1);
+  __int128 sum = 0;
+  for (uint64_t i = 0; i < s.ops; i++)
+    sum += s.map->GetItem(key128(nextRandom(seed) % s.keys));
+  sSink = (uint64_t) sum;
+}
+
+static void
+mapDelete (State& s, unsigned t)
+{
+  for (uint64_t i = 0; i < s.ops; i++)
+    s.map->DeleteItem(key128(t * s.ops + i));
+}
+
+//------------------------------------------------------------------------------
+// Bufferll and Bufferll_lf - sized up front, the ops never resize
+//------------------------------------------------------------------------------
+static const size_t kBlock = 4096;
+
+static void
+bufferNew (State& s)
+{
+  s.blocks = 16384;
+  s.buffer = BufferPtr(s.blocks * kBlock);
+}
+
+static void
+lfBufferNew (State& s)
+{
+  s.blocks = 16384;
+  s.lfbuffer = BufferPtrLockFree(s.blocks * kBlock);
+}
+
+static void
+bufferWrite (State& s, unsigned t)
+{
+  char block[kBlock];
+  memset(block, t, sizeof (block));
+  std::shared_ptr<Bufferll> buffer = *s.buffer;
+  uint64_t seed = 0x9e3779b97f4a7c15ull * (t + 1);
+  for (uint64_t i = 0; i < s.ops; i++)
+    buffer->writeData(block, (nextRandom(seed) % s.blocks) * kBlock, kBlock);
+}
+
+static void
+bufferRead (State& s, unsigned t)
+{
+  char block[kBlock];
+  std::shared_ptr<Bufferll> buffer = *s.buffer;
+  uint64_t seed = 0x9e3779b97f4a7c15ull * (t + 1);
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < s.ops; i++) {
+    buffer->readData(block, (nextRandom(seed) % s.blocks) * kBlock, kBlock);
+    sum += block[i % kBlock];
+  }
+  sSink = sum;
+}
+
+static void
+bufferPeek (State& s, unsigned t)
+{
+  std::shared_ptr<Bufferll> buffer = *s.buffer;
+  uint64_t seed = 0x9e3779b97f4a7c15ull * (t + 1);
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < s.ops; i++) {
+    char* ptr;
+    if (buffer->peekData(ptr, (nextRandom(seed) % s.blocks) * kBlock, kBlock))
+      sum += ptr[0];
+    buffer->releasePeek();
+  }
+  sSink = sum;
+}
+
+static void
+lfBufferWrite (State& s, unsigned t)
+{
+  char block[kBlock];
+  memset(block, t, sizeof (block));
+  std::shared_ptr<Bufferll_lf> buffer = *s.lfbuffer;
+  uint64_t seed = 0x9e3779b97f4a7c15ull * (t + 1);
+  for (uint64_t i = 0; i < s.ops; i++)
+    buffer->writeData(block, (nextRandom(seed) % s.blocks) * kBlock, kBlock);
+}
+
+static void
+lfBufferRead (State& s, unsigned t)
+{
+  char block[kBlock];
+  std::shared_ptr<Bufferll_lf> buffer = *s.lfbuffer;
+  uint64_t seed = 0x9e3779b97f4a7c15ull * (t + 1);
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < s.ops; i++) {
+    buffer->readData(block, (nextRandom(seed) % s.blocks) * kBlock, kBlock);
+    sum += block[i % kBlock];
+  }
+  sSink = sum;
+}
+
+//------------------------------------------------------------------------------
+// RWMutex - one shared mutex, every op is a lock and an unlock
+//------------------------------------------------------------------------------
+static void
+mutexPthread (State& s)
+{
+  s.mutex.reset(new RWMutex(RWMutex::kPthread));
+  s.mutex->SetBlocking(true);
+}
+
+static void
+mutexBiased (State& s)
+{
+  s.mutex.reset(new RWMutex(RWMutex::kReaderBiased));
+}
+
+static void
+mutexRead (State& s, unsigned t)
+{
+  for (uint64_t i = 0; i < s.ops; i++) {
+    s.mutex->LockRead();
+    s.mutex->UnLockRead();
+  }
+}
+
+static void
+mutexWrite (State& s, unsigned t)
+{
+  for (uint64_t i = 0; i < s.ops; i++) {
+    s.mutex->LockWrite();
+    s.mutex->UnLockWrite();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Logging - messages below the log priority are dropped by the macro, the
+// others are queued for the writer thread
+//------------------------------------------------------------------------------
+static void
+logNone (State& s)
+{
+}
+
+static void
+logQueued (State& s, unsigned t)
+{
+  for (uint64_t i = 0; i < s.ops; i++)
+    Logging::log(__FUNCTION__, __FILE__, __LINE__, "", "", LOG_NOTICE, "thread=%u op=%llu", t, (unsigned long long) i);
+}
+
+static void
+logFiltered (State& s, unsigned t)
+{
+  for (uint64_t i = 0; i < s.ops; i++)
+    diamond_static_info("thread=%u op=%llu", t, (unsigned long long) i);
+}
+
+//------------------------------------------------------------------------------
+// SpookyHash
+//------------------------------------------------------------------------------
+template <size_t N>
+static void
+hashMessage (State& s)
+{
+  s.message.assign(N, 0);
+  for (size_t i = 0; i < N; i++)
+    s.message[i] = (char) (i * 131);
+}
+
+template <size_t N>
+static void
+hash (State& s, unsigned t)
+{
+  uint64_t h = t;
+  for (uint64_t i = 0; i < s.ops; i++)
+    h = SpookyHash::Hash64(&s.message[0], N, h);
+  sSink = h;
+}
+
+static const Case kCases[] = {
+  {"map128.set", 0, mapNew, mapSet},
+  {"map128.get", 0, mapFilled, mapGet},
+  {"map128.delete", 0, mapFilled, mapDelete},
+  {"bufferll.write", kBlock, bufferNew, bufferWrite},
+  {"bufferll.read", kBlock, bufferNew, bufferRead},
+  {"bufferll.peek", 0, bufferNew, bufferPeek},
+  {"bufferlf.write", kBlock, lfBufferNew, lfBufferWrite},
+  {"bufferlf.read", kBlock, lfBufferNew, lfBufferRead},
+  {"rwmutex.read", 0, mutexPthread, mutexRead},
+  {"rwmutex.write", 0, mutexPthread, mutexWrite},
+  {"rwmutex.biased.read", 0, mutexBiased, mutexRead},
+  {"rwmutex.biased.write", 0, mutexBiased, mutexWrite},
+  {"log.queued", 0, logNone, logQueued},
+  {"log.filtered", 0, logNone, logFiltered},
+  {"spooky.16", 16, hashMessage<16>, hash<16>},
+  {"spooky.64", 64, hashMessage<64>, hash<64>},
+  {"spooky.256", 256, hashMessage<256>, hash<256>},
+  {"spooky.4096", 4096, hashMessage<4096>, hash<4096>},
+  {0, 0, 0, 0}
+};
+
+struct Result {
+  std::string name;
+  unsigned threads;
+  uint64_t ops;
+  uint64_t bytes;
+  double seconds;       //< wall time of the run
+  double threadns;      //< summed time of all threads
+  bool perf;
+  uint64_t counters[PerfCounters::kCounters];
+  int64_t memory;       //< accounted bytes held by the case
+  int64_t rss;          //< resident set growth
+};
+
+static int64_t
+residentBytes ()
+{
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return (int64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+//------------------------------------------------------------------------------
+//! Run a case with all threads started together - the memory is measured
+//! after the run while the objects still exist
+//------------------------------------------------------------------------------
+static Result
+runCase (const Case& c, unsigned threads, uint64_t ops)
+{
+  Result r;
+  r.name = c.name;
+  r.threads = threads;
+  r.ops = ops * threads;
+  r.bytes = c.bytes * r.ops;
+  r.perf = true;
+  memset(r.counters, 0, sizeof (r.counters));
+
+  int64_t memory = MemoryAccounting::Total();
+  int64_t rss = residentBytes();
+
+  State s;
+  s.ops = ops;
+  s.threads = threads;
+  s.keys = 0;
+  s.blocks = 0;
+  c.setup(s);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned ready = 0;
+  bool go = false;
+  std::vector<uint64_t> elapsed(threads, 0);
+  std::vector<std::vector<uint64_t> > counters(threads, std::vector<uint64_t>(PerfCounters::kCounters, 0));
+  std::vector<char> perf(threads, 0);
+  std::vector<std::thread> workers;
+
+  for (unsigned t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&, t] () {
+      PerfCounters pc;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready++;
+        cv.notify_all();
+        cv.wait(lock, [&] () { return go; });
+      }
+      pc.Start();
+      uint64_t start = Clock::Now();
+      c.run(s, t);
+      elapsed[t] = Clock::Ns(Clock::Now() - start);
+      pc.Stop(&counters[t][0]);
+      perf[t] = pc.Available();
+    }));
+  }
+
+  uint64_t start;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] () { return ready == threads; });
+    start = Clock::Monotonic();
+    go = true;
+  }
+  cv.notify_all();
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+  r.seconds = (Clock::Monotonic() - start) / 1000000000.0;
+
+  r.threadns = 0;
+  for (unsigned t = 0; t < threads; t++) {
+    r.threadns += elapsed[t];
+    r.perf = r.perf && perf[t];
+    for (int k = 0; k < PerfCounters::kCounters; k++)
+      r.counters[k] += counters[t][k];
+  }
+
+  r.memory = MemoryAccounting::Total() - memory;
+  r.rss = residentBytes() - rss;
+  return r;
+}
+
+static void
+usage ()
+{
+  fprintf(stderr, "usage: microbench [-t <threads>] [-c <cases>] [-n <ops>] [-o <json file>] [-l]\n"
+          "       -t : comma separated thread counts to run every case with (default 1,2,4,... up to the cores)\n"
+          "       -c : comma separated cases or case prefixes, e.g. 'map128,spooky.64' (default all)\n"
+          "       -n : operations per thread (default 1000000)\n"
+          "       -o : write the JSON results to a file instead of stdout\n"
+          "       -l : list the cases\n");
+}
+
+static bool
+selected (const std::vector<std::string>& filters, const char* name)
+{
+  if (filters.empty())
+    return true;
+  for (size_t i = 0; i < filters.size(); i++) {
+    const std::string& f = filters[i];
+    if (!strncmp(name, f.c_str(), f.size()) && ((name[f.size()] == 0) || (name[f.size()] == '.')))
+      return true;
+  }
+  return false;
+}
+
+static std::vector<std::string>
+split (const char* arg)
+{
+  std::vector<std::string> out;
+  std::string list = arg;
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    if (end > pos)
+      out.push_back(list.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  return out;
+}
+
+static void
+writeJson (FILE* out, uint64_t ops, const std::vector<Result>& results)
+{
+  char host[256] = "";
+  gethostname(host, sizeof (host) - 1);
+#ifdef __OPTIMIZE__
+  const char* optimized = "true";
+#else
+  const char* optimized = "false";
+#endif
+
+  fprintf(out, "{\n  \"benchmark\": \"microbench\",\n  \"host\": \"%s\",\n  \"cores\": %u,\n"
+          "  \"compiler\": \"%s\",\n  \"optimized\": %s,\n  \"clock\": \"%s\",\n  \"ops\": %llu,\n  \"results\": [",
+          host, std::thread::hardware_concurrency(), __VERSION__, optimized,
+          Clock::IsTsc() ? "tsc" : "monotonic", (unsigned long long) ops);
+
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& r = results[i];
+    double secs = (r.seconds > 0) ? r.seconds : 1e-9;
+    fprintf(out, "%s\n    {\"case\": \"%s\", \"threads\": %u, \"ops\": %llu, \"seconds\": %.6f, "
+            "\"ns_per_op\": %.3f, \"ops_per_s\": %.1f, \"mb_per_s\": %.1f, ",
+            i ? "," : "", r.name.c_str(), r.threads, (unsigned long long) r.ops, r.seconds,
+            r.threadns / r.ops, r.ops / secs, r.bytes / secs / (1024 * 1024));
+    if (r.perf)
+      fprintf(out, "\"cache_misses\": %llu, \"cache_misses_per_op\": %.4f, \"cache_references_per_op\": %.4f, "
+              "\"instructions_per_op\": %.1f, ",
+              (unsigned long long) r.counters[PerfCounters::kCacheMisses],
+              (double) r.counters[PerfCounters::kCacheMisses] / r.ops,
+              (double) r.counters[PerfCounters::kCacheReferences] / r.ops,
+              (double) r.counters[PerfCounters::kInstructions] / r.ops);
+    else
+      fprintf(out, "\"cache_misses\": null, \"cache_misses_per_op\": null, \"cache_references_per_op\": null, "
+              "\"instructions_per_op\": null, ");
+    fprintf(out, "\"memory_bytes\": %lld, \"rss_bytes\": %lld}", (long long) r.memory, (long long) r.rss);
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+int
+main (int argc, char* argv[])
+{
+  std::vector<unsigned> threads;
+  std::vector<std::string> filters;
+  uint64_t ops = 1000000;
+  std::string output;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:c:n:o:lh")) != -1) {
+    switch (opt) {
+    case 't':
+    {
+      std::vector<std::string> list = split(optarg);
+      for (size_t i = 0; i < list.size(); i++) {
+        int n = atoi(list[i].c_str());
+        if (n <= 0) {
+          usage();
+          return EINVAL;
+        }
+        threads.push_back(n);
+      }
+      break;
+    }
+    case 'c':
+      filters = split(optarg);
+      break;
+    case 'n':
+      ops = strtoull(optarg, 0, 10);
+      if (!ops) {
+        usage();
+        return EINVAL;
+      }
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'l':
+      for (const Case* c = kCases; c->name; c++)
+        printf("%s\n", c->name);
+      return 0;
+    default:
+      usage();
+      return EINVAL;
+    }
+  }
+
+  if (threads.empty()) {
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned t = 1; t < cores; t *= 2)
+      threads.push_back(t);
+    threads.push_back(cores);
+  }
+
+  FILE* out = stdout;
+  if (!output.empty() && !(out = fopen(output.c_str(), "w"))) {
+    fprintf(stderr, "error: cannot open %s errno=%d\n", output.c_str(), errno);
+    return errno;
+  }
+
+  // the queued messages are written to /dev/null - the summary goes to the
+  // real stderr
+  int err = dup(fileno(stderr));
+  FILE* table = fdopen(err, "w");
+  int devnull = open("/dev/null", O_WRONLY);
+  if (!table || (devnull < 0)) {
+    fprintf(stderr, "error: cannot redirect the log output errno=%d\n", errno);
+    return errno;
+  }
+  dup2(devnull, fileno(stderr));
+  close(devnull);
+
+  Logging::Init();
+  Logging::SetUnit("microbench");
+  Logging::SetLogPriority(LOG_NOTICE);
+  Clock::Calibrate();
+
+  std::vector<Result> results;
+  fprintf(table, "%-22s %7s %10s %12s %10s %12s %12s\n", "case", "threads", "ns/op", "ops/s", "MB/s",
+          "misses/op", "memory");
+  for (const Case* c = kCases; c->name; c++) {
+    if (!selected(filters, c->name))
+      continue;
+
+    for (size_t t = 0; t < threads.size(); t++) {
+      results.push_back(runCase(*c, threads[t], ops));
+      Logging::Flush();
+      const Result& r = results.back();
+      double secs = (r.seconds > 0) ? r.seconds : 1e-9;
+      char misses[32] = "-";
+      if (r.perf)
+        snprintf(misses, sizeof (misses), "%.3f", (double) r.counters[PerfCounters::kCacheMisses] / r.ops);
+      fprintf(table, "%-22s %7u %10.2f %12.0f %10.1f %12s %12lld\n", r.name.c_str(), r.threads,
+              r.threadns / r.ops, r.ops / secs, r.bytes / secs / (1024 * 1024), misses,
+              (long long) std::max(r.memory, r.rss));
+      fflush(table);
+    }
+  }
+
+  if (results.empty()) {
+    fprintf(table, "error: no case selected\n");
+    return EINVAL;
+  }
+
+  writeJson(out, ops, results);
+  if (out != stdout)
+    fclose(out);
+  fclose(table);
+  return 0;
+}
@@ -32,10 +32,23 @@
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
 
 #include "gtest/gtest.h"
 #include "common/Logging.hh"
+#include "common/MemoryAccounting.hh"
+#include "common/OpStats.hh"
+#include "common/Timing.hh"
+#include "common/hash/map128.hh"
 #include "rio/diamondCache.hh"
+#include "rio/diamondCapacity.hh"
+#include "rio/diamondSnapshot.hh"
 
 using namespace diamond::common;
 using namespace diamond::rio;
@@ -74,3 +87,915 @@ TEST (diamondCache, CacheLRU) {
   EXPECT_EQ(3890, sout.str().length());
 }
 
+
+TEST (diamondCache, NameIndex) {
+  diamondCache icache("/", 1024);
+
+  diamond_ino_t ino;
+  EXPECT_FALSE(icache.findName("1", "a", ino));
+
+  icache.addName("1", "a", "2");
+  icache.addName("1", "b", "3");
+  icache.addName("2", "a", "4");
+
+  EXPECT_TRUE(icache.findName("1", "a", ino));
+  EXPECT_EQ("2", ino);
+  EXPECT_TRUE(icache.findName("2", "a", ino));
+  EXPECT_EQ("4", ino);
+  EXPECT_NE(diamondCache::nameKey("1", "a"), diamondCache::nameKey("2", "a"));
+
+  icache.rmName("1", "a");
+  EXPECT_FALSE(icache.findName("1", "a", ino));
+  EXPECT_TRUE(icache.findName("1", "b", ino));
+  EXPECT_EQ("3", ino);
+
+  // churn until tombstones force a rebuild, which keeps the live names
+  for (size_t i = 0; i < 1024; i++) {
+    icache.addName("5", std::to_string(i).c_str(), "6");
+    icache.rmName("5", std::to_string(i).c_str());
+  }
+  EXPECT_FALSE(icache.findName("5", "1023", ino));
+  EXPECT_TRUE(icache.findName("1", "b", ino));
+  EXPECT_EQ("3", ino);
+  EXPECT_TRUE(icache.findName("2", "a", ino));
+  EXPECT_EQ("4", ino);
+
+  // the index doubles at 3/4 load up to its limit and keeps every name
+  icache.sizeNameIndex(1024, 4096);
+  for (size_t i = 0; i < 1536; i++)
+    icache.addName("7", std::to_string(i).c_str(), "8");
+  EXPECT_EQ(4096, icache.nameIndexSize());
+  EXPECT_TRUE(icache.findName("7", "0", ino));
+  EXPECT_TRUE(icache.findName("7", "1535", ino));
+  EXPECT_TRUE(icache.findName("1", "b", ino));
+
+  // beyond the limit names are left to their directory
+  for (size_t i = 1536; i < 8192; i++)
+    icache.addName("7", std::to_string(i).c_str(), "8");
+  EXPECT_EQ(4096, icache.nameIndexSize());
+  EXPECT_FALSE(icache.findName("9", "missing", ino));
+}
+
+TEST (diamondDir, Entries) {
+  diamondDir dir("1", "/");
+
+  for (size_t i = 0; i < 10000; i++) {
+    EXPECT_TRUE(dir.addName(std::to_string(i).c_str(), std::to_string(i + 2)));
+  }
+  EXPECT_FALSE(dir.addName("4711", "99"));
+  EXPECT_EQ(10000, dir.nEntries());
+
+  diamond_ino_t ino;
+  EXPECT_TRUE(dir.findName("4711", ino));
+  EXPECT_EQ("4713", ino);
+  EXPECT_FALSE(dir.findName("10000", ino));
+
+  // read the first half, then unlink every odd entry forcing a compaction
+  uint64_t cursor = 0;
+  std::string name;
+  for (size_t i = 0; i < 5000; i++) {
+    EXPECT_TRUE(dir.nextEntry(cursor, name, ino));
+    EXPECT_EQ(std::to_string(i), name);
+  }
+
+  for (size_t i = 1; i < 10000; i += 2) {
+    EXPECT_TRUE(dir.rmName(std::to_string(i).c_str()));
+  }
+  EXPECT_FALSE(dir.rmName("1"));
+  EXPECT_EQ(5000, dir.nEntries());
+  EXPECT_TRUE(dir.addName("new", "10002"));
+
+  // the cursor stays valid and continues behind the last returned entry
+  size_t n = 0;
+  while (dir.nextEntry(cursor, name, ino)) {
+    if (name != "new") {
+      EXPECT_EQ(0, atoi(name.c_str()) % 2);
+      EXPECT_LE(5000, atoi(name.c_str()));
+    }
+    n++;
+  }
+  EXPECT_EQ(2501, n);
+  EXPECT_TRUE(dir.findName("new", ino));
+  EXPECT_EQ("10002", ino);
+  EXPECT_TRUE(dir.findName("4712", ino));
+  EXPECT_EQ("4714", ino);
+}
+
+TEST (diamondInodeAllocator, Allocate) {
+  const size_t nthreads = 8;
+  const size_t ninodes = 10000;
+  std::vector< std::vector<uint64_t> > inodes(nthreads);
+
+  {
+    diamondInodeAllocator alloc;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; t++) {
+      threads.push_back(std::thread([&alloc, &inodes, t]() {
+        uint64_t gen;
+        for (size_t i = 0; i < ninodes; i++)
+          inodes[t].push_back(alloc.allocate(gen));
+      }));
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+  }
+
+  std::set<uint64_t> unique;
+  for (size_t t = 0; t < nthreads; t++)
+    unique.insert(inodes[t].begin(), inodes[t].end());
+  EXPECT_EQ(nthreads * ninodes, unique.size());
+  EXPECT_LE(diamondInodeAllocator::kFirstInode, *unique.begin());
+
+  // freed numbers come back with a new generation once reuse is enabled
+  diamondInodeAllocator alloc;
+  uint64_t gen;
+  uint64_t ino = alloc.allocate(gen);
+  EXPECT_EQ(0, gen);
+  alloc.release(ino, gen);
+  EXPECT_NE(ino, alloc.allocate(gen));
+  alloc.setReuse(true);
+  alloc.release(ino, 3);
+  EXPECT_EQ(ino, alloc.allocate(gen));
+  EXPECT_EQ(4, gen);
+
+  // a raised floor also drops the range this thread reserved already
+  alloc.raiseFloor(ino + 100000);
+  EXPECT_LE(ino + 100000, alloc.allocate(gen));
+  alloc.raiseFloor(10);
+  EXPECT_LT(ino + 100000, alloc.allocate(gen));
+}
+
+TEST (diamondInodeAllocator, Persist) {
+  char path[] = "/tmp/diamond-inode-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  close(fd);
+
+  uint64_t last = 0;
+  uint64_t gen;
+  {
+    diamondInodeAllocator alloc;
+    EXPECT_EQ(0, alloc.setStateFile(path));
+    for (size_t i = 0; i < 3 * diamondInodeAllocator::kRange; i++)
+      last = alloc.allocate(gen);
+  }
+
+  // a restarted allocator never hands out a number below the previous ones
+  {
+    diamondInodeAllocator alloc;
+    EXPECT_EQ(0, alloc.setStateFile(path));
+    EXPECT_LT(last, alloc.allocate(gen));
+  }
+  unlink(path);
+}
+
+TEST (diamondDirWriteLock, Order) {
+  diamondDir a("2", "a");
+  diamondDir b("10", "b");
+  size_t n = 0;
+
+  // opposite argument orders must not deadlock
+  std::thread t1([&]() {
+    for (size_t i = 0; i < 100000; i++) {
+      diamondDirWriteLock lock(&a, &b);
+      n++;
+    }
+  });
+  std::thread t2([&]() {
+    for (size_t i = 0; i < 100000; i++) {
+      diamondDirWriteLock lock(&b, &a);
+      n++;
+    }
+  });
+  t1.join();
+  t2.join();
+  EXPECT_EQ(200000, n);
+
+  // a rename replacing a directory locks three in any argument order
+  diamondDir c("5", "c");
+  std::thread t3([&]() {
+    for (size_t i = 0; i < 100000; i++) {
+      diamondDirWriteLock lock(&b, &a, &c);
+      n++;
+    }
+  });
+  std::thread t4([&]() {
+    for (size_t i = 0; i < 100000; i++) {
+      diamondDirWriteLock lock(&c, &b, &a);
+      n++;
+    }
+  });
+  t3.join();
+  t4.join();
+  EXPECT_EQ(400000, n);
+
+  // the same directory twice is locked once
+  diamondDirWriteLock lock(&a, &a);
+  diamondDirWriteLock other(&b, &c, &b);
+}
+
+TEST (diamondMeta, StatSeqlock) {
+  diamondFile file("2", "f");
+  file.makeStat(0, 0, S_IFREG | 0644, 0);
+  {
+    // start from a state satisfying the reader invariant
+    diamondMeta::StatWriter st(file);
+    st->st_mtim.tv_nsec = 0;
+  }
+
+  std::atomic<bool> done(false);
+  std::atomic<size_t> torn(0);
+  std::atomic<size_t> reads(0);
+
+  // readers must never observe a half written stat
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < 4; t++) {
+    readers.push_back(std::thread([&]() {
+      struct stat st;
+      while (!done) {
+        file.copyStat(st);
+        if ((st.st_size != (off_t) st.st_uid) || (st.st_size != st.st_mtim.tv_nsec))
+          torn++;
+        reads++;
+      }
+    }));
+  }
+
+  for (size_t i = 1; i <= 200000; i++) {
+    diamondMeta::StatWriter st(file);
+    st->st_size = i;
+    st->st_uid = i;
+    st->st_mtim.tv_nsec = i;
+  }
+  done = true;
+  for (auto it = readers.begin(); it != readers.end(); ++it)
+    it->join();
+
+  EXPECT_EQ(0, torn);
+  EXPECT_LT(0, reads);
+
+  // writes only ever extend the size
+  EXPECT_EQ(200000, file.write("data", 0, 4));
+  struct stat st;
+  file.copyStat(st);
+  EXPECT_EQ(200000, st.st_size);
+}
+
+TEST (diamondMeta, RenameWhileEncoding) {
+  const std::string names[2] = {"a-name-longer-than-the-inline-storage", "short"};
+  diamondFile file("5", names[1]);
+
+  std::atomic<bool> done(false);
+  std::atomic<size_t> bad(0);
+
+  // the write-back flusher encodes while rename swaps heap and inline names
+  std::thread encoder([&]() {
+    std::string record;
+    while (!done) {
+      file.encode(record);
+      diamondFile copy("5", "");
+      if (copy.decode(record) ||
+          ((copy.getName() != names[0]) && (copy.getName() != names[1])))
+        bad++;
+    }
+  });
+
+  for (size_t i = 0; i < 100000; i++)
+    file.setName(names[i % 2]);
+  done = true;
+  encoder.join();
+
+  EXPECT_EQ(0, bad);
+}
+
+TEST (diamondMeta, CompactRecord) {
+  EXPECT_GE(128, sizeof (diamondMeta));
+  EXPECT_GE(128, sizeof (diamondFile));
+
+  diamondFile file("4711", "short");
+  EXPECT_EQ("short", file.getName());
+  EXPECT_EQ("4711", file.getIno());
+  EXPECT_EQ(4711, file.getInode());
+  file.setName("a-name-longer-than-the-inline-storage");
+  EXPECT_EQ("a-name-longer-than-the-inline-storage", file.getName());
+  file.setName("again-short");
+  EXPECT_EQ("again-short", file.getName());
+
+  // the stat is rebuilt from the packed attributes
+  struct stat in;
+  memset(&in, 0, sizeof (in));
+  in.st_mode = S_IFREG | 0640;
+  in.st_uid = 1001;
+  in.st_gid = 1002;
+  in.st_nlink = 1;
+  in.st_size = 5000;
+  in.st_atim.tv_sec = 1413380940;
+  in.st_atim.tv_nsec = 123456789;
+  in.st_mtim.tv_sec = 1413380941;
+  in.st_ctim.tv_nsec = 999999999;
+  file.setStat(in);
+
+  struct stat out;
+  file.copyStat(out);
+  EXPECT_EQ(4711, out.st_ino);
+  EXPECT_EQ(in.st_mode, out.st_mode);
+  EXPECT_EQ(in.st_uid, out.st_uid);
+  EXPECT_EQ(in.st_gid, out.st_gid);
+  EXPECT_EQ(in.st_size, out.st_size);
+  EXPECT_EQ(10, out.st_blocks);
+  EXPECT_EQ(in.st_atim.tv_sec, out.st_atim.tv_sec);
+  EXPECT_EQ(in.st_atim.tv_nsec, out.st_atim.tv_nsec);
+  EXPECT_EQ(in.st_mtim.tv_sec, out.st_mtim.tv_sec);
+  EXPECT_EQ(in.st_ctim.tv_nsec, out.st_ctim.tv_nsec);
+
+  // the journal packs the same way - times before the epoch keep a positive
+  // nanosecond part
+  diamondMeta::Attr attr;
+  in.st_mtim.tv_sec = -2;
+  in.st_mtim.tv_nsec = 250000000;
+  diamondMeta::packStat(in, attr);
+  diamondMeta::unpackAttr(attr, out);
+  EXPECT_EQ(-2, out.st_mtim.tv_sec);
+  EXPECT_EQ(250000000, out.st_mtim.tv_nsec);
+  EXPECT_EQ(in.st_size, out.st_size);
+
+  // extended attributes
+  std::string value;
+  EXPECT_EQ(ENODATA, file.getXattr("user.a", value));
+  EXPECT_EQ(ENODATA, file.setXattr("user.a", "1", 1, XATTR_REPLACE));
+  EXPECT_EQ(0, file.setXattr("user.a", "1", 1));
+  EXPECT_EQ(EEXIST, file.setXattr("user.a", "2", 1, XATTR_CREATE));
+  EXPECT_EQ(0, file.setXattr("user.a", "22", 2, XATTR_REPLACE));
+  EXPECT_EQ(0, file.setXattr("user.b", "", 0));
+  EXPECT_EQ(0, file.getXattr("user.a", value));
+  EXPECT_EQ("22", value);
+  file.listXattr(value);
+  EXPECT_EQ(std::string("user.a\0user.b\0", 14), value);
+  EXPECT_EQ(0, file.rmXattr("user.a"));
+  EXPECT_EQ(ENODATA, file.rmXattr("user.a"));
+  EXPECT_EQ(0, file.rmXattr("user.b"));
+  file.listXattr(value);
+  EXPECT_EQ("", value);
+}
+
+TEST (diamondCache, Slabs) {
+  diamondCache icache("/", 1024);
+
+  for (size_t i = 0; i < 1000; i++) {
+    icache.getFile(std::to_string(i));
+    icache.getDir(std::to_string(i));
+  }
+
+  std::stringstream out;
+  SlabPool::DumpStats(out);
+  EXPECT_NE(std::string::npos, out.str().find("slab=diamondFile"));
+  EXPECT_NE(std::string::npos, out.str().find("slab=diamondDir"));
+  EXPECT_NE(std::string::npos, out.str().find("slab=diamondCache::lru"));
+  EXPECT_NE(std::string::npos, out.str().find("slab=diamondCache::files"));
+
+  for (size_t i = 0; i < 1000; i++) {
+    EXPECT_EQ(0, icache.rmFile(std::to_string(i)));
+    EXPECT_EQ(0, icache.rmDir(std::to_string(i)));
+  }
+  EXPECT_EQ(0, icache.fsize());
+  EXPECT_EQ(0, icache.dsize());
+}
+
+TEST (MemoryAccounting, Subsystems) {
+  int64_t data = MemoryAccounting::Get(MemoryAccounting::kData);
+  int64_t dirents = MemoryAccounting::Get(MemoryAccounting::kDirents);
+  int64_t xattrs = MemoryAccounting::Get(MemoryAccounting::kXattrs);
+  int64_t maps = MemoryAccounting::Get(MemoryAccounting::kMaps);
+
+  {
+    diamondFile file("100", "file");
+    std::string chunk(100000, 'x');
+    file.write(chunk.c_str(), 0, chunk.size());
+    EXPECT_LE(data + 100000, MemoryAccounting::Get(MemoryAccounting::kData));
+
+    EXPECT_EQ(0, file.setXattr("user.a", "value", 5));
+    EXPECT_LT(xattrs, MemoryAccounting::Get(MemoryAccounting::kXattrs));
+    EXPECT_EQ(0, file.setXattr("user.b", "value", 5));
+    EXPECT_EQ(0, file.rmXattr("user.a"));
+
+    diamondDir dir("101", "dir");
+    for (size_t i = 0; i < 1000; i++)
+      EXPECT_TRUE(dir.addName(std::to_string(i).c_str(), std::to_string(1000 + i)));
+    EXPECT_LE(dirents + (int64_t) (1000 * sizeof (diamondDir::Entry)), MemoryAccounting::Get(MemoryAccounting::kDirents));
+    for (size_t i = 0; i < 900; i++)
+      EXPECT_TRUE(dir.rmName(std::to_string(i).c_str()));
+
+    map128 table(1024);
+    EXPECT_EQ(maps + (int64_t) (1024 * 2 * sizeof (__int128)), MemoryAccounting::Get(MemoryAccounting::kMaps));
+  }
+
+  // everything is returned on destruction
+  EXPECT_EQ(data, MemoryAccounting::Get(MemoryAccounting::kData));
+  EXPECT_EQ(dirents, MemoryAccounting::Get(MemoryAccounting::kDirents));
+  EXPECT_EQ(xattrs, MemoryAccounting::Get(MemoryAccounting::kXattrs));
+  EXPECT_EQ(maps, MemoryAccounting::Get(MemoryAccounting::kMaps));
+
+  std::stringstream out;
+  MemoryAccounting::Dump(out);
+  EXPECT_NE(std::string::npos, out.str().find("memory.dirents="));
+  EXPECT_NE(std::string::npos, out.str().find("memory.total="));
+}
+
+TEST (OpStats, Histogram) {
+  // every value lies within its bucket and the buckets are contiguous
+  for (uint64_t v = 0; v < 100000; v += 7) {
+    size_t b = Histogram::Bucket(v);
+    EXPECT_LE(v, Histogram::BucketMax(b));
+    if (b) {
+      EXPECT_LT(Histogram::BucketMax(b - 1), v);
+    }
+  }
+  EXPECT_EQ(Histogram::kBuckets - 1, Histogram::Bucket(1ull << 40));
+
+  Histogram h;
+  for (uint64_t v = 1; v <= 1000; v++) {
+    h.buckets[Histogram::Bucket(v * 1000)]++;
+    h.count++;
+    h.max = v * 1000;
+  }
+  // relative error below 1/16
+  EXPECT_NEAR(500000, h.Percentile(0.5), 500000 / 16);
+  EXPECT_NEAR(990000, h.Percentile(0.99), 990000 / 16);
+  EXPECT_EQ(1000000u, h.Percentile(1.0));
+}
+
+TEST (OpStats, Threads) {
+  static const char* const names[] = {"a", "b", 0};
+  int64_t stats = MemoryAccounting::Get(MemoryAccounting::kStats);
+  {
+    OpStats ops(names);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++) {
+      threads.push_back(std::thread([&ops, t] () {
+        for (uint64_t i = 0; i < 10000; i++)
+          ops.Add(i % 2, 1000 * (t + 1));
+      }));
+    }
+    ops.Add(0, 100);
+
+    std::vector<Histogram> h;
+    ops.Collect(h);
+    EXPECT_LE(1u, h[0].count);
+
+    // exited threads are retired into the totals
+    for (size_t t = 0; t < threads.size(); t++)
+      threads[t].join();
+    ops.Collect(h);
+    ASSERT_EQ(2u, h.size());
+    EXPECT_EQ(20001u, h[0].count);
+    EXPECT_EQ(20000u, h[1].count);
+    EXPECT_EQ(4000u, h[1].max);
+    EXPECT_EQ(100u + 5000 * 10000u, h[0].sum);
+    EXPECT_LT(stats, MemoryAccounting::Get(MemoryAccounting::kStats));
+
+    std::vector<Histogram> before = h;
+    ops.Add(1, 2000);
+    ops.Collect(h);
+    EXPECT_EQ(" b=1/2.0/2.0/2.0", ops.Summary(h, before));
+
+    std::stringstream out;
+    ops.Dump(out, "ops.");
+    EXPECT_NE(std::string::npos, out.str().find("ops.b count=20001 "));
+  }
+  EXPECT_EQ(stats, MemoryAccounting::Get(MemoryAccounting::kStats));
+
+  diamondCache cache;
+  std::vector<Histogram> before;
+  diamondCache::stats().Collect(before);
+  cache.getFile("1000");
+  cache.getFile("1000");
+  std::vector<Histogram> after;
+  diamondCache::stats().Collect(after);
+  EXPECT_EQ(1u, after[diamondCache::kFileMiss].count - before[diamondCache::kFileMiss].count);
+  EXPECT_EQ(1u, after[diamondCache::kFileHit].count - before[diamondCache::kFileHit].count);
+}
+
+TEST (Timing, TagsAndStats) {
+  Timing tm("test");
+  EXPECT_EQ(0, tm.RealTime());
+  COMMONTIMING("start", &tm);
+  usleep(2000);
+  COMMONTIMING("middle", &tm);
+  usleep(1000);
+  COMMONTIMING("stop", &tm);
+  EXPECT_EQ(3u, tm.Tags());
+  EXPECT_LE(1.9, tm.GetTagTimelapse("start", "middle"));
+  EXPECT_LE(2.9, tm.RealTime());
+  EXPECT_NEAR(tm.RealTime(), tm.GetTagTimelapse("start", "stop"), 0.001);
+  EXPECT_EQ(0, tm.GetTagTimelapse("start", "missing"));
+
+  // samples beyond the capacity replace the last one
+  for (size_t i = 0; i < 2 * Timing::kMaxTags; i++)
+    COMMONTIMING("loop", &tm);
+  EXPECT_EQ(Timing::kMaxTags, tm.Tags());
+
+  for (size_t i = 0; i < 100; i++) {
+    DIAMOND_TIMING_SCOPE("test.timing.scope");
+    usleep(10);
+  }
+  std::stringstream out;
+  TimingStat::Dump(out, "timing.");
+  EXPECT_NE(std::string::npos, out.str().find("timing.test.timing.scope count=100 "));
+}
+
+TEST (diamondCapacity, Limits) {
+  EXPECT_EQ(4096ull, diamondCapacity::parseSize("4K"));
+  EXPECT_EQ(3ull << 30, diamondCapacity::parseSize("3G"));
+  EXPECT_EQ(0ull, diamondCapacity::parseSize("3X"));
+  EXPECT_EQ(0ull, diamondCapacity::parseSize("abc"));
+
+  uint64_t bytes = diamondCapacity::bytes();
+  uint64_t inodes = diamondCapacity::inodes();
+  diamondCapacity::setLimits(bytes + 1000000, inodes + 2);
+
+  {
+    diamondFile file("100", "file");
+    std::string chunk(400000, 'x');
+    EXPECT_EQ(400000, file.write(chunk.c_str(), 0, chunk.size()));
+    EXPECT_EQ(800000, file.write(chunk.c_str(), 400000, chunk.size()));
+    // overwriting does not need new space
+    EXPECT_EQ(800000, file.write(chunk.c_str(), 0, chunk.size()));
+    EXPECT_EQ(-ENOSPC, file.write(chunk.c_str(), 800000, chunk.size()));
+    EXPECT_EQ(bytes + 800000, diamondCapacity::bytes());
+
+    EXPECT_EQ(ENOSPC, file.truncate(2000000));
+    EXPECT_EQ(0, file.truncate(100000));
+    EXPECT_EQ(bytes + 100000, diamondCapacity::bytes());
+    EXPECT_EQ(900000, file.write(chunk.c_str(), 500000, chunk.size()));
+
+    struct statvfs sfs;
+    diamondCapacity::fillStatfs(sfs);
+    EXPECT_EQ(diamondCapacity::byteLimit() / 4096, sfs.f_blocks);
+    EXPECT_EQ(sfs.f_blocks - ((diamondCapacity::bytes() + 4095) / 4096), sfs.f_bfree);
+  }
+  // deleting a file releases its space
+  EXPECT_EQ(bytes, diamondCapacity::bytes());
+
+  {
+    diamondCache icache("/", 1024);
+    EXPECT_TRUE(diamondCapacity::haveInode());
+    icache.getFile("100");
+    icache.getDir("101");
+    EXPECT_EQ(inodes + 2, diamondCapacity::inodes());
+    EXPECT_FALSE(diamondCapacity::haveInode());
+    EXPECT_EQ(0, icache.rmFile("100"));
+    EXPECT_TRUE(diamondCapacity::haveInode());
+    EXPECT_EQ(0, icache.rmDir("101"));
+  }
+  EXPECT_EQ(inodes, diamondCapacity::inodes());
+
+  diamondCapacity::setLimits(0, 0);
+}
+
+TEST (diamondWriteBack, Persist) {
+  Logging::Init();
+  char tmpl[] = "/tmp/diamond.wb.XXXXXX";
+  ASSERT_TRUE(mkdtemp(tmpl) != 0);
+  std::string dir = tmpl;
+  std::string store = dir + "/namespace.kv";
+
+  // spans two chunks
+  std::string data(diamondWriteBack::kChunkSize + 4096, 'd');
+  for (size_t i = 0; i < data.size(); i += 997)
+    data[i] = 'a' + (i % 26);
+
+  {
+    diamondCache icache("/", 1024);
+    ASSERT_EQ(0, icache.enableWriteBack(store, dir, 1024, 3600 * 1000));
+
+    diamondCache::diamondDirPtr root = icache.getDir("1", true, true, "/");
+    root->makeStat(0, 0, S_IFDIR | 0777, 1);
+    diamondCache::diamondDirPtr sub = icache.getDir("100", true, true, "sub");
+    sub->makeStat(1, 2, S_IFDIR | 0755, 0);
+    root->addName("sub", "100");
+    icache.addName("1", "sub", "100");
+
+    diamondCache::diamondFilePtr file = icache.getFile("101", true, true, "file");
+    file->makeStat(1, 2, S_IFREG | 0644, 0);
+    EXPECT_EQ((off_t) data.size(), file->write(data.c_str(), 0, data.size()));
+    EXPECT_EQ(0, file->setXattr("user.key", "value", 5));
+    sub->addName("file", "101");
+    icache.addName("100", "file", "101");
+
+    icache.dirtyDir("1", diamondWriteBack::kInode | diamondWriteBack::kEntries);
+    icache.dirtyDir("100", diamondWriteBack::kInode | diamondWriteBack::kEntries);
+    icache.dirtyFile("101", diamondWriteBack::kInode | diamondWriteBack::kData, 0, data.size());
+    EXPECT_EQ(3u, icache.getWriteBack()->pending());
+    EXPECT_EQ(0, icache.getWriteBack()->flush());
+    EXPECT_EQ(0u, icache.getWriteBack()->pending());
+  }
+
+  {
+    // a new cache loads inodes lazily on the first access
+    diamondCache icache("/", 1024);
+    ASSERT_EQ(0, icache.enableWriteBack(store, dir, 1024, 3600 * 1000));
+    uint64_t gen;
+    EXPECT_LT(101u, icache.getInodeAllocator().allocate(gen));
+
+    diamond_ino_t ino;
+    EXPECT_FALSE(icache.findName("1", "sub", ino));
+    diamondCache::diamondDirPtr root = icache.getDir("1", true, false);
+    ASSERT_TRUE(root);
+    EXPECT_TRUE(icache.findName("1", "sub", ino));
+    EXPECT_EQ("100", ino);
+
+    diamondCache::diamondDirPtr sub = icache.getDir("100", true, false);
+    ASSERT_TRUE(sub);
+    EXPECT_EQ("sub", sub->getName());
+    EXPECT_FALSE(icache.getFile("100", true, false));
+
+    diamondCache::diamondFilePtr file = icache.getFile("101", true, false);
+    ASSERT_TRUE(file);
+    struct stat st;
+    file->copyStat(st);
+    EXPECT_EQ((off_t) data.size(), st.st_size);
+    EXPECT_EQ((mode_t) (S_IFREG | 0644), st.st_mode);
+    std::string value;
+    EXPECT_EQ(0, file->getXattr("user.key", value));
+    EXPECT_EQ("value", value);
+
+    char* buffer = 0;
+    int n = file->peek(buffer, 0, data.size());
+    EXPECT_EQ((int) data.size(), n);
+    EXPECT_TRUE(buffer && !memcmp(buffer, data.c_str(), data.size()));
+    file->release();
+
+    // removal reaches the store with the next flush
+    EXPECT_EQ(0, icache.rmFile("101"));
+    sub->rmName("file");
+    icache.dirtyDir("100", diamondWriteBack::kEntries);
+    EXPECT_FALSE(icache.getFile("101", true, false));
+    EXPECT_EQ(0, icache.getWriteBack()->flush());
+  }
+
+  {
+    diamondCache icache("/", 1024);
+    ASSERT_EQ(0, icache.enableWriteBack(store, dir, 1024, 3600 * 1000));
+    EXPECT_FALSE(icache.getFile("101", true, false));
+    diamondCache::diamondDirPtr sub = icache.getDir("100", true, false);
+    ASSERT_TRUE(sub);
+    EXPECT_EQ(0u, sub->nEntries());
+
+    // inodes which were never loaded are removed from the store directly
+    EXPECT_EQ(0, icache.rmDir("1"));
+    EXPECT_EQ(ENOENT, icache.rmDir("1"));
+  }
+
+  unlink(store.c_str());
+  unlink((dir + "/kv.index").c_str());
+  unlink((dir + "/kv.index.meta").c_str());
+  EXPECT_EQ(0, rmdir(dir.c_str()));
+}
+
+TEST (diamondJournal, Recover) {
+  Logging::Init();
+  char tmpl[] = "/tmp/diamond.journal.XXXXXX";
+  ASSERT_TRUE(mkdtemp(tmpl) != 0);
+  std::string dir = tmpl;
+  std::string crash = dir + "/crash";
+  ASSERT_EQ(0, ::mkdir(crash.c_str(), S_IRWXU));
+  const char* files[] = {"journal.0", "journal.1", "namespace.checkpoint", 0};
+
+  {
+    diamondCache icache("/", 1024);
+    diamondCache::diamondDirPtr root = icache.getDir("1", true, true, "/");
+    root->makeStat(0, 0, S_IFDIR | 0777, 1);
+    ASSERT_EQ(0, icache.enableJournal(dir, 10, 3600));
+    diamondJournal* journal = icache.getJournal();
+    struct stat st;
+
+    // mkdir /a, create /a/f with an attribute change and an xattr
+    diamondCache::diamondDirPtr a = icache.getDir("100", true, true, "a");
+    a->makeStat(1, 2, S_IFDIR | 0755, 0);
+    a->setLinkKey(diamondCache::linkKey("1", "a"));
+    root->addName("a", "100");
+    icache.addName("1", "a", "100");
+    a->copyStat(st);
+    EXPECT_EQ(0, journal->logMkdir("1", "a", "100", 0, st));
+
+    diamondCache::diamondFilePtr f = icache.getFile("101", true, true, "f");
+    f->makeStat(1, 2, S_IFREG | 0644, 0);
+    f->setLinkKey(diamondCache::linkKey("100", "f"));
+    a->addName("f", "101");
+    icache.addName("100", "f", "101");
+    f->copyStat(st);
+    EXPECT_EQ(0, journal->logCreate("100", "f", "101", 0, st));
+
+    EXPECT_EQ(0, f->truncate(10));
+    {
+      diamondMeta::StatWriter w(*f);
+      w->st_size = 10;
+      w->st_mode = S_IFREG | 0600;
+      st = *w;
+    }
+    EXPECT_EQ(0, journal->logSetattr("101", st));
+    EXPECT_EQ(0, f->setXattr("user.key", "value", 5));
+    EXPECT_EQ(0, journal->logSetxattr("101", "user.key", "value", 5));
+
+    // appends are timed per thread and reported with the journal status
+    std::stringstream status;
+    journal->Status(status);
+    EXPECT_NE(std::string::npos, status.str().find("journal.append count="));
+
+    // a create racing the checkpoint - its entry is saved but not its inode
+    root->addName("c", "104");
+    icache.addName("1", "c", "104");
+
+    // everything so far goes into the checkpoint, the rest into the journal
+    EXPECT_EQ(0, journal->checkpoint());
+
+    diamondCache::diamondFilePtr c = icache.getFile("104", true, true, "c");
+    c->makeStat(0, 0, S_IFREG | 0644, 0);
+    c->setLinkKey(diamondCache::linkKey("1", "c"));
+    c->copyStat(st);
+    EXPECT_EQ(0, journal->logCreate("1", "c", "104", 0, st));
+
+    // rename /a/f to /g
+    a->rmName("f");
+    icache.rmName("100", "f");
+    root->addName("g", "101");
+    icache.addName("1", "g", "101");
+    f->setName("g");
+    f->setLinkKey(diamondCache::linkKey("1", "g"));
+    EXPECT_EQ(0, journal->logRename("100", "f", "1", "g", "101"));
+
+    // mkdir /b and rmdir /b, create /h and unlink /h
+    diamondCache::diamondDirPtr b = icache.getDir("102", true, true, "b");
+    b->makeStat(0, 0, S_IFDIR | 0755, 0);
+    root->addName("b", "102");
+    icache.addName("1", "b", "102");
+    b->copyStat(st);
+    EXPECT_EQ(0, journal->logMkdir("1", "b", "102", 0, st));
+    root->rmName("b");
+    icache.rmName("1", "b");
+    EXPECT_EQ(0, icache.rmDir("102"));
+    EXPECT_EQ(0, journal->logRmdir("1", "b", "102"));
+
+    diamondCache::diamondFilePtr h = icache.getFile("103", true, true, "h");
+    h->makeStat(0, 0, S_IFREG | 0644, 0);
+    root->addName("h", "103");
+    icache.addName("1", "h", "103");
+    h->copyStat(st);
+    EXPECT_EQ(0, journal->logCreate("1", "h", "103", 0, st));
+    root->rmName("h");
+    icache.rmName("1", "h");
+    EXPECT_EQ(0, icache.rmFile("103"));
+    EXPECT_EQ(0, journal->logUnlink("1", "h", "103"));
+
+    EXPECT_EQ(0, f->rmXattr("user.key"));
+    EXPECT_EQ(0, journal->logRemovexattr("101", "user.key"));
+    EXPECT_EQ(0, f->setXattr("user.other", "1", 1));
+    EXPECT_EQ(0, journal->logSetxattr("101", "user.other", "1", 1));
+
+    // keep the state of a crash - checkpoint plus journal with a torn tail
+    EXPECT_EQ(0, journal->sync());
+    for (size_t i = 0; files[i]; i++) {
+      std::string cmd = "cp " + dir + "/" + files[i] + " " + crash + "/";
+      EXPECT_EQ(0, system(cmd.c_str()));
+      std::string torn = "printf 'DREC....' >> " + crash + "/" + files[i];
+      if (std::string(files[i]) != "namespace.checkpoint") {
+        EXPECT_EQ(0, system(torn.c_str()));
+      }
+    }
+  }
+
+  // recover the crashed state and the cleanly shut down one
+  std::string dirs[] = {crash, dir};
+  for (size_t d = 0; d < 2; d++) {
+    diamondCache icache("/", 1024);
+    diamondCache::diamondDirPtr root = icache.getDir("1", true, true, "/");
+    root->makeStat(0, 0, S_IFDIR | 0777, 1);
+    ASSERT_EQ(0, icache.enableJournal(dirs[d], 10, 3600));
+    uint64_t gen;
+    EXPECT_LT(104u, icache.getInodeAllocator().allocate(gen));
+
+    EXPECT_EQ(3u, root->nEntries());
+    diamond_ino_t ino;
+    EXPECT_TRUE(icache.findName("1", "a", ino));
+    EXPECT_EQ("100", ino);
+    EXPECT_TRUE(icache.findName("1", "g", ino));
+    EXPECT_EQ("101", ino);
+    EXPECT_FALSE(root->findName("b", ino));
+    EXPECT_FALSE(root->findName("h", ino));
+    EXPECT_FALSE(icache.getDir("102", false, false));
+    EXPECT_FALSE(icache.getFile("103", false, false));
+    EXPECT_TRUE(icache.findName("1", "c", ino));
+    EXPECT_EQ("104", ino);
+    diamondCache::diamondFilePtr c = icache.getFile("104", false, false);
+    ASSERT_TRUE(c);
+    EXPECT_EQ("c", c->getName());
+
+    diamondCache::diamondDirPtr a = icache.getDir("100", false, false);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(0u, a->nEntries());
+
+    diamondCache::diamondFilePtr f = icache.getFile("101", false, false);
+    ASSERT_TRUE(f);
+    EXPECT_EQ("g", f->getName());
+    EXPECT_EQ(diamondCache::linkKey("1", "g"), f->getLinkKey());
+    struct stat st;
+    f->copyStat(st);
+    EXPECT_EQ(10, st.st_size);
+    EXPECT_EQ((mode_t) (S_IFREG | 0600), st.st_mode);
+    EXPECT_EQ(1u, st.st_uid);
+    std::string value;
+    EXPECT_EQ(ENODATA, f->getXattr("user.key", value));
+    EXPECT_EQ(0, f->getXattr("user.other", value));
+    EXPECT_EQ("1", value);
+  }
+
+  for (size_t i = 0; files[i]; i++) {
+    unlink((dir + "/" + files[i]).c_str());
+    unlink((crash + "/" + files[i]).c_str());
+  }
+  EXPECT_EQ(0, rmdir(crash.c_str()));
+  EXPECT_EQ(0, rmdir(dir.c_str()));
+}
+
+TEST (diamondSnapshot, DumpLoad) {
+  Logging::Init();
+  char tmpl[] = "/tmp/diamond.snapshot.XXXXXX";
+  ASSERT_TRUE(mkdtemp(tmpl) != 0);
+  std::string path = std::string(tmpl) + "/namespace.snapshot";
+  const size_t ndirs = 64;
+  const size_t nfiles = 2000;
+
+  {
+    diamondCache icache("/", 64 * 1024);
+    uint64_t epoch;
+    EXPECT_EQ(ENOENT, diamondSnapshot::load(icache, path, epoch));
+
+    diamondCache::diamondDirPtr root = icache.getDir("1", true, true, "/");
+    root->makeStat(0, 0, S_IFDIR | 0777, 1);
+
+    // /d<i>/f<j> with the files spread over the directories - the xattrs
+    // make the dump span several blocks
+    for (size_t i = 0; i < ndirs; i++) {
+      diamond_ino_t dino = DIAMOND_INODE(100 + i);
+      std::string dname = "d" + std::to_string(i);
+      diamondCache::diamondDirPtr d = icache.getDir(dino, true, true, dname.c_str());
+      d->makeStat(i, 0, S_IFDIR | 0755, 0);
+      d->setLinkKey(diamondCache::linkKey("1", dname.c_str()));
+      root->addName(dname.c_str(), dino);
+      icache.addName("1", dname.c_str(), dino);
+    }
+    for (size_t j = 0; j < nfiles; j++) {
+      diamond_ino_t pino = DIAMOND_INODE(100 + (j % ndirs));
+      diamond_ino_t fino = DIAMOND_INODE(1000 + j);
+      std::string fname = "f" + std::to_string(j);
+      diamondCache::diamondFilePtr f = icache.getFile(fino, true, true, fname.c_str());
+      f->makeStat(0, j, S_IFREG | 0644, 0);
+      f->setLinkKey(diamondCache::linkKey(pino, fname.c_str()));
+      std::string value = fname + std::string(1024, 'x');
+      EXPECT_EQ(0, f->setXattr("user.j", value.c_str(), value.size()));
+      icache.getDir(pino, false, false)->addName(fname.c_str(), fino);
+      icache.addName(pino, fname.c_str(), fino);
+    }
+    EXPECT_EQ(0, diamondSnapshot::dump(icache, path, 7));
+  }
+
+  // load with one and with several threads - the root exists already
+  unsigned threads[] = {1, 8};
+  for (size_t t = 0; t < 2; t++) {
+    diamondCache icache("/", 64 * 1024);
+    diamondCache::diamondDirPtr root = icache.getDir("1", true, true, "/");
+    root->makeStat(0, 0, S_IFDIR | 0777, 1);
+    uint64_t epoch = 0;
+    ASSERT_EQ(0, diamondSnapshot::load(icache, path, epoch, threads[t]));
+    EXPECT_EQ(7u, epoch);
+    uint64_t gen;
+    EXPECT_LE(1000 + nfiles, icache.getInodeAllocator().allocate(gen));
+
+    EXPECT_EQ(nfiles, icache.fsize());
+    EXPECT_EQ(ndirs + 1, icache.dsize());
+    EXPECT_EQ(root.get(), icache.getDir("1", false, false).get());
+    EXPECT_EQ(ndirs, root->nEntries());
+
+    for (size_t j = 0; j < nfiles; j += 7) {
+      diamond_ino_t pino = DIAMOND_INODE(100 + (j % ndirs));
+      std::string fname = "f" + std::to_string(j);
+      diamond_ino_t ino;
+      EXPECT_TRUE(icache.findName(pino, fname.c_str(), ino));
+      EXPECT_EQ(DIAMOND_INODE(1000 + j), ino);
+      diamondCache::diamondFilePtr f = icache.getFile(ino, true, false);
+      ASSERT_TRUE(f);
+      struct stat st;
+      f->copyStat(st);
+      EXPECT_EQ((gid_t) j, st.st_gid);
+      std::string value;
+      EXPECT_EQ(0, f->getXattr("user.j", value));
+      EXPECT_EQ(fname + std::string(1024, 'x'), value);
+    }
+    diamond_ino_t ino;
+    EXPECT_TRUE(icache.findName("1", "d3", ino));
+    EXPECT_EQ(DIAMOND_INODE(103), ino);
+  }
+
+  unlink(path.c_str());
+  EXPECT_EQ(0, rmdir(tmpl));
+}